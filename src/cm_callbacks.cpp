@@ -14,6 +14,7 @@
 //===----------------------------------------------------------------------===//
 #include "cm_callbacks.hpp"
 
+#include "cm_coro.hpp"
 #include "null_attrs.h" // IWYU pragma: keep
 #include "os.h"
 #include "state.hpp"
@@ -21,10 +22,12 @@
 #include <algorithm>
 #include <atomic>
 #include <charconv>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <iostream>
 #include <iterator>
 #include <libwebsockets.h>
@@ -47,7 +50,44 @@ namespace tek::s3 {
 
 namespace {
 
-//===-- Private type ------------------------------------------------------===//
+//===-- Private types -----------------------------------------------------===//
+
+/// Maximum number of packages or applications in a single PICS request.
+constexpr std::size_t pics_chunk_size{256};
+/// Maximum number of concurrent PICS requests per account.
+constexpr std::size_t max_pics_requests{4};
+/// Maximum number of concurrent depot decryption key requests per account.
+///    Too many requests at once result in server refusing to process some of
+///    them, and timeouts. This will still happen even with such limit, but
+///    nevertheless it's the faster way to get them.
+constexpr std::size_t max_depot_key_requests{5};
+
+/// State of an account's application list refresh, shared between its
+///    coroutines.
+struct refresh_ctx {
+  /// Pointer to the CM client instance associated with @ref acc.
+  tek_sc_cm_client *_Nonnull client;
+  /// Account whose applications are being refreshed.
+  account &acc;
+  /// Cancellation token of the refresh.
+  std::shared_ptr<const cancel_token> cancel;
+  /// IDs of depots owned by the account. Must be accessed with
+  ///    @ref ts3_state::manifest_mtx locked.
+  std::set<std::uint32_t> depot_ids;
+  /// IDs of applications owned by the account. Must be accessed with
+  ///    @ref ts3_state::manifest_mtx locked.
+  std::set<std::uint32_t> app_ids;
+  /// Value indicating whether any of the requests has failed.
+  std::atomic_bool failed;
+
+  /// Check whether the refresh should be abandoned, which is the case when
+  ///    it has been cancelled or the server is stopping.
+  bool cancelled() const noexcept {
+    return cancel->is_cancelled() ||
+           state.cur_status.load(std::memory_order::relaxed) ==
+               status::stopping;
+  }
+};
 
 /// Binary VDF node structure.
 struct [[gnu::visibility("internal")]] bin_vdf_node {
@@ -167,23 +207,7 @@ static bool check_token_err(const tek_sc_err &err, account &acc) {
                        std::memory_order::relaxed);
   state.state_dirty = true;
   if (state.cur_status.load(std::memory_order::relaxed) == status::running) {
-    for (auto &app : state.apps | std::views::values) {
-      for (auto &depot : app.depots | std::views::values) {
-        if (std::erase(depot.accs, &acc)) {
-          depot.next_acc = depot.accs.cbegin();
-        }
-      }
-      if (std::erase_if(app.depots, [](const auto &pair) {
-            return pair.second.accs.empty();
-          })) {
-        state.manifest_dirty = true;
-      }
-    }
-    if (std::erase_if(state.apps, [](const auto &app) {
-          return app.second.depots.empty();
-        })) {
-      state.manifest_dirty = true;
-    }
+    unlink_acc_depots(acc, true);
     update_manifest();
   }
   lock.unlock();
@@ -194,13 +218,13 @@ static bool check_token_err(const tek_sc_err &err, account &acc) {
 static void sync_manifest() {
   const std::scoped_lock lock{state.manifest_mtx};
   for (auto &app : state.apps | std::views::values) {
-    if (std::erase_if(app.depots, [](const auto &pair) {
-          return pair.second.accs.empty();
+    if (erase_if(app.depots, [](const auto &pair) {
+          return pair.second.accs.empty() && !pair.second.peers;
         })) {
       state.manifest_dirty = true;
     }
   }
-  if (std::erase_if(state.apps, [](const auto &app) {
+  if (erase_if(state.apps, [](const auto &app) {
         return app.second.depots.empty();
       })) {
     state.manifest_dirty = true;
@@ -208,89 +232,165 @@ static void sync_manifest() {
   update_manifest();
 }
 
-/// The callback for CM client depot decryption key received event.
+/// Check whether cached PICS info is still fresh.
 ///
-/// @param [in, out] client
-///    Pointer to the CM client instance that emitted the callback.
-/// @param [in, out] data
-///    Pointer to `tek_sc_cm_data_depot_key` associated with request.
-/// @param [in, out] user_data
-///    Pointer to the @ref account object associated with @p client.
-[[using gnu: nonnull(1, 2, 3), access(read_write, 1), access(read_write, 2),
-  access(read_write, 3)]]
-static void cb_depot_key(tek_sc_cm_client *_Nonnull client, void *_Nonnull data,
-                         void *_Nonnull user_data) {
-  if (state.cur_status.load(std::memory_order::relaxed) == status::stopping) {
+/// @param [in] timestamp
+///    Time (seconds since Epoch) when the info has been received.
+/// @param [in] now
+///    Current time, in seconds since Epoch.
+/// @return Value indicating whether the info doesn't need to be requested
+///    again.
+static bool pics_fresh(std::time_t timestamp, std::time_t now) noexcept {
+  return now - timestamp < state.pics_cache_ttl;
+}
+
+/// Split a vector into chunks of at most @ref pics_chunk_size elements.
+///
+/// @param [in] items
+///    The vector to split.
+/// @return Spans of consecutive elements of @p items.
+template <typename T>
+static std::vector<std::span<const T>>
+make_chunks(const std::vector<T> &items) {
+  std::vector<std::span<const T>> chunks;
+  chunks.reserve((items.size() + pics_chunk_size - 1) / pics_chunk_size);
+  for (std::span<const T> rem{items}; !rem.empty();) {
+    const auto size{std::min(pics_chunk_size, rem.size())};
+    chunks.emplace_back(rem.first(size));
+    rem = rem.subspan(size);
+  }
+  return chunks;
+}
+
+/// Add depots and applications included in a package to the sets of the ones
+///    owned by the account. Must be called with @ref ts3_state::manifest_mtx
+///    locked.
+///
+/// @param [in, out] ctx
+///    Refresh context of the account that owns the package.
+/// @param [in] package
+///    PICS info of the package.
+static void add_package(refresh_ctx &ctx, const pics_package &package) {
+  ctx.depot_ids.insert(package.depot_ids.begin(), package.depot_ids.end());
+  ctx.app_ids.insert(package.app_ids.begin(), package.app_ids.end());
+  ctx.depot_ids.insert(package.app_ids.begin(), package.app_ids.end());
+}
+
+/// Process PICS package info response, caching the info and adding its
+///    contents to the refresh context.
+///
+/// @param [in, out] ctx
+///    Refresh context of the account that has sent the request.
+/// @param [in] data_pics
+///    Response data.
+static void store_packages(refresh_ctx &ctx,
+                           const tek_sc_cm_data_pics &data_pics) {
+  auto &acc{ctx.acc};
+  if (!tek_sc_err_success(&data_pics.result)) {
+    std::println(std::cerr,
+                 "Failed to get PICS info for account {}'s packages:",
+                 acc.token_info.steam_id);
+    print_err(data_pics.result);
+    ctx.failed.store(true, std::memory_order::relaxed);
     return;
   }
-  auto &data_dk{*reinterpret_cast<tek_sc_cm_data_depot_key *>(data)};
-  auto &acc{*reinterpret_cast<account *>(user_data)};
-  // TEK_SC_CM_ERESULT_blocked is returned for pre-download depots, ignore it
-  if (!tek_sc_err_success(&data_dk.result) &&
-      data_dk.result.type != TEK_SC_ERR_TYPE_steam_cm &&
-      data_dk.result.auxiliary != TEK_SC_CM_ERESULT_blocked) {
-    if (data_dk.result.type == TEK_SC_ERR_TYPE_sub &&
-        data_dk.result.auxiliary == TEK_SC_ERRC_cm_timeout) {
-      // Timeouts are common for depot key requests, just re-send it
-      tek_sc_cm_get_depot_key(client, &data_dk, cb_depot_key, 3000);
-      return;
+  const std::span packages{
+      data_pics.package_entries,
+      static_cast<std::size_t>(data_pics.num_package_entries)};
+  for (const auto &package : packages) {
+    if (tek_sc_err_success(&package.result)) {
+      continue;
     }
-    std::println(std::cerr, "Failed to get decryption key for depot {}:",
-                 data_dk.depot_id);
-    print_err(data_dk.result);
-    tek_sc_cm_disconnect(client);
+    std::println(std::cerr,
+                 "Failed to get PICS info for package {} owned by account {}:",
+                 package.id, acc.token_info.steam_id);
+    print_err(package.result);
+    ctx.failed.store(true, std::memory_order::relaxed);
     return;
   }
-  if (tek_sc_err_success(&data_dk.result)) {
-    const std::scoped_lock lock{state.manifest_mtx};
-    state.manifest_dirty = true;
-    std::ranges::move(data_dk.key, state.depot_keys[data_dk.depot_id]);
-  }
-  if (!--acc.rem_dk_burst) {
-    if (acc.rem_dk_total) {
-      // Schedule the next burst
-      const int burst_size{std::min(5, acc.rem_dk_total)};
-      acc.rem_dk_burst = burst_size;
-      for (int i = 0; i < burst_size; ++i) {
-        tek_sc_cm_get_depot_key(client,
-                                &acc.depot_key_requests[--acc.rem_dk_total],
-                                cb_depot_key, 3000);
+  const auto now{
+      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now())};
+  const std::scoped_lock lock{state.manifest_mtx};
+  for (const auto &package : packages) {
+    pics_package info{.timestamp = now, .depot_ids = {}, .app_ids = {}};
+    auto cur{reinterpret_cast<const char *>(package.data)};
+    bin_vdf_node bvdf{cur, &cur[package.data_size]};
+    if (const auto depot_ids{bvdf.children.find("depotids")};
+        depot_ids != bvdf.children.end()) {
+      for (int depot_id : depot_ids->second->int_attrs | std::views::values) {
+        info.depot_ids.emplace_back(static_cast<std::uint32_t>(depot_id));
       }
-    } else {
-      acc.depot_key_requests.reset();
-      if (state.cur_status.load(std::memory_order::relaxed) ==
-          status::running) {
-        sync_manifest();
+    }
+    if (const auto app_ids{bvdf.children.find("appids")};
+        app_ids != bvdf.children.end()) {
+      for (int app_id : app_ids->second->int_attrs | std::views::values) {
+        info.app_ids.emplace_back(static_cast<std::uint32_t>(app_id));
       }
     }
+    add_package(ctx, info);
+    state.pics_packages[package.id] = std::move(info);
   }
+  state.state_dirty = true;
 }
 
-/// The callback for CM client PICS app info received event.
+/// Process PICS access tokens response.
 ///
-/// @param [in, out] client
-///    Pointer to the CM client instance that emitted the callback.
-/// @param [in, out] data
-///    Pointer to `tek_sc_cm_data_pics` associated with the request.
-/// @param [in, out] user_data
-///    Pointer to the @ref account object associated with @p client.
-[[using gnu: nonnull(1, 2, 3), access(read_write, 1), access(read_write, 2),
-  access(read_write, 3)]]
-static void cb_app_info(tek_sc_cm_client *_Nonnull client, void *_Nonnull data,
-                        void *_Nonnull user_data) {
-  auto &data_pics{*reinterpret_cast<tek_sc_cm_data_pics *>(data)};
-  auto &acc{*reinterpret_cast<account *>(user_data)};
+/// @param [in, out] ctx
+///    Refresh context of the account that has sent the request.
+/// @param [in, out] data_pics
+///    Response data.
+/// @return Value indicating whether app info may be requested with the
+///    tokens.
+static bool check_access_tokens(refresh_ctx &ctx,
+                                tek_sc_cm_data_pics &data_pics) {
+  const auto &acc{ctx.acc};
+  if (!tek_sc_err_success(&data_pics.result)) {
+    std::println(std::cerr,
+                 "Failed to get PICS access tokens for account {}'s apps:",
+                 acc.token_info.steam_id);
+    print_err(data_pics.result);
+    ctx.failed.store(true, std::memory_order::relaxed);
+    return false;
+  }
+  for (auto &app :
+       std::span{data_pics.app_entries,
+                 static_cast<std::size_t>(data_pics.num_app_entries)}) {
+    if (tek_sc_err_success(&app.result)) {
+      continue;
+    }
+    // Some apps are just weird and don't provide an access token.
+    if (app.result.type == TEK_SC_ERR_TYPE_sub &&
+        app.result.auxiliary == TEK_SC_ERRC_cm_access_token_denied) {
+      app.access_token = 0;
+      continue;
+    }
+    std::println(
+        std::cerr,
+        "Failed to get PICS access token for app {} owned by account {}:",
+        app.id, acc.token_info.steam_id);
+    print_err(app.result);
+    ctx.failed.store(true, std::memory_order::relaxed);
+    return false;
+  }
+  return true;
+}
+
+/// Process PICS app info response, extracting depot IDs and names of the
+///    apps and caching them.
+///
+/// @param [in, out] ctx
+///    Refresh context of the account that has sent the request.
+/// @param [in] data_pics
+///    Response data.
+static void store_apps(refresh_ctx &ctx, const tek_sc_cm_data_pics &data_pics) {
+  const auto &acc{ctx.acc};
   if (!tek_sc_err_success(&data_pics.result)) {
     std::println(std::cerr, "Failed to get PICS info for account {}'s apps:",
                  acc.token_info.steam_id);
     print_err(data_pics.result);
-    delete[] data_pics.app_entries;
-    delete &data_pics;
-    tek_sc_cm_disconnect(client);
+    ctx.failed.store(true, std::memory_order::relaxed);
     return;
   }
-  // App/depot IDs which don't have their decryption keys cached yet.
-  std::vector<std::pair<std::uint32_t, std::uint32_t>> missing_keys;
   const std::span apps{data_pics.app_entries,
                        static_cast<std::size_t>(data_pics.num_app_entries)};
   for (const auto &app : apps) {
@@ -306,93 +406,123 @@ static void cb_app_info(tek_sc_cm_client *_Nonnull client, void *_Nonnull data,
                  "Could not get PICS info for app {} owned by account {}:",
                  app.id, acc.token_info.steam_id);
     print_err(app.result);
-    goto app_err;
+    ctx.failed.store(true, std::memory_order::relaxed);
+    return;
   }
-  // Extract depot IDs and name from the app info
-  for (const std::scoped_lock lock{state.manifest_mtx};
-       const auto &app : apps) {
-    if (!tek_sc_err_success(&app.result)) {
-      continue;
-    }
-    std::string_view view{reinterpret_cast<const char *>(app.data),
-                          static_cast<std::size_t>(app.data_size)};
-    std::error_code ec;
-    const auto vdf{tyti::vdf::read(view.begin(), view.end(), ec)};
-    if (ec != std::error_code{}) {
-      std::println(
-          std::cerr,
-          "Failed to parse VDF app info for app {} owned by account {}:",
-          app.id, acc.token_info.steam_id);
-      goto app_err;
-    }
-    const auto depots{vdf.childs.find("depots")};
-    if (depots != vdf.childs.cend()) {
-      // Collect IDs of depots present in the app
-      std::vector<std::uint32_t> depot_ids;
-      if (const auto workshopdepot{
-              depots->second->attribs.find("workshopdepot")};
-          workshopdepot != depots->second->attribs.cend()) {
-        view = workshopdepot->second;
-        if (std::uint32_t depot_id;
-            std::from_chars(view.begin(), view.end(), depot_id).ec ==
-            std::errc{}) {
-          depot_ids.emplace_back(depot_id);
-        }
-      }
-      for (const auto &[id, depot] : depots->second->childs) {
-        if (!depot->childs.contains("manifests")) {
-          continue;
-        }
-        view = id;
-        std::uint32_t depot_id;
-        if (std::from_chars(view.begin(), view.end(), depot_id).ec !=
-            std::errc{}) {
-          continue;
-        }
-        const auto it{acc.depot_ids.find(depot_id)};
-        if (it != acc.depot_ids.end()) {
-          acc.depot_ids.erase(it);
-          depot_ids.emplace_back(depot_id);
-        }
+  const auto now{
+      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now())};
+  const std::scoped_lock lock{state.manifest_mtx};
+  for (const auto &app : apps) {
+    pics_app info{.timestamp = now,
+                  .access_token = app.access_token,
+                  .name = {},
+                  .workshop_depot = 0,
+                  .depot_ids = {}};
+    // Apps without info are cached as well, so they're not requested again
+    if (tek_sc_err_success(&app.result)) {
+      std::string_view view{reinterpret_cast<const char *>(app.data),
+                            static_cast<std::size_t>(app.data_size)};
+      std::error_code ec;
+      const auto vdf{tyti::vdf::read(view.begin(), view.end(), ec)};
+      if (ec != std::error_code{}) {
+        std::println(
+            std::cerr,
+            "Failed to parse VDF app info for app {} owned by account {}:",
+            app.id, acc.token_info.steam_id);
+        ctx.failed.store(true, std::memory_order::relaxed);
+        break;
       }
-      if (!depot_ids.empty()) {
-        const auto [it, emplaced]{state.apps.try_emplace(app.id)};
-        if (emplaced) {
-          state.manifest_dirty = true;
-        }
-        auto &app_ent{it->second};
-        const auto common{vdf.childs.find("common")};
-        if (common != vdf.childs.cend()) {
-          const auto name{common->second->attribs.find("name")};
-          if (name != common->second->attribs.cend()) {
-            app_ent.name = std::move(name->second);
-          }
-        }
-        if (app.access_token != app_ent.pics_access_token) {
-          state.manifest_dirty = true;
-          app_ent.pics_access_token = app.access_token;
+      if (const auto depots{vdf.childs.find("depots")};
+          depots != vdf.childs.cend()) {
+        if (const auto workshopdepot{
+                depots->second->attribs.find("workshopdepot")};
+            workshopdepot != depots->second->attribs.cend()) {
+          view = workshopdepot->second;
+          std::from_chars(view.begin(), view.end(), info.workshop_depot);
         }
-        for (auto depot_id : depot_ids) {
-          const auto [it, emplaced]{app_ent.depots.try_emplace(depot_id)};
-          if (emplaced) {
-            state.manifest_dirty = true;
+        for (const auto &[id, depot] : depots->second->childs) {
+          if (!depot->childs.contains("manifests")) {
+            continue;
           }
-          auto &depot_ent{it->second};
-          if (emplaced || !std::ranges::contains(depot_ent.accs, &acc)) {
-            depot_ent.accs.emplace_back(&acc);
-            depot_ent.next_acc = depot_ent.accs.cbegin();
-          }
-          if (!state.depot_keys.contains(depot_id)) {
-            missing_keys.emplace_back(app.id, depot_id);
+          view = id;
+          if (std::uint32_t depot_id;
+              std::from_chars(view.begin(), view.end(), depot_id).ec ==
+              std::errc{}) {
+            info.depot_ids.emplace_back(depot_id);
           }
         }
-      } // if (!depot_ids.empty())
-    } // if (depots != vdf.childs.cend())
-    std::free(app.data);
+      }
+      if (const auto common{vdf.childs.find("common")};
+          common != vdf.childs.cend()) {
+        const auto name{common->second->attribs.find("name")};
+        if (name != common->second->attribs.cend()) {
+          info.name = name->second;
+        }
+      }
+    } // if (tek_sc_err_success(&app.result))
+    state.pics_apps[app.id] = std::move(info);
   } // for (const auto &app : apps)
-  delete[] data_pics.app_entries;
-  delete &data_pics;
-  acc.depot_ids = {};
+  state.state_dirty = true;
+}
+
+/// Add applications owned by the account to the manifest using cached PICS
+///    info, and mark the account ready.
+///
+/// @param [in] ctx
+///    Refresh context of the account.
+/// @return App/depot ID pairs of depots which don't have their decryption
+///    keys cached yet, sorted.
+static std::vector<std::pair<std::uint32_t, std::uint32_t>>
+apply_apps(refresh_ctx &ctx) {
+  auto &acc{ctx.acc};
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> missing_keys;
+  for (const std::scoped_lock lock{state.manifest_mtx};
+       const auto app_id : ctx.app_ids) {
+    const auto info{state.pics_apps.find(app_id)};
+    if (info == state.pics_apps.end()) {
+      continue;
+    }
+    // Collect IDs of app's depots that are owned by the account
+    std::vector<std::uint32_t> depot_ids;
+    if (info->second.workshop_depot) {
+      depot_ids.emplace_back(info->second.workshop_depot);
+    }
+    for (const auto depot_id : info->second.depot_ids) {
+      const auto it{ctx.depot_ids.find(depot_id)};
+      if (it != ctx.depot_ids.end()) {
+        ctx.depot_ids.erase(it);
+        depot_ids.emplace_back(depot_id);
+      }
+    }
+    if (depot_ids.empty()) {
+      continue;
+    }
+    const auto [it, emplaced]{state.apps.try_emplace(app_id)};
+    if (emplaced) {
+      state.manifest_dirty = true;
+    }
+    auto &app_ent{it->second};
+    if (!info->second.name.empty()) {
+      app_ent.name = info->second.name;
+    }
+    if (info->second.access_token != app_ent.pics_access_token) {
+      state.manifest_dirty = true;
+      app_ent.pics_access_token = info->second.access_token;
+    }
+    for (auto depot_id : depot_ids) {
+      const auto [it, emplaced]{app_ent.depots.try_emplace(depot_id)};
+      if (emplaced) {
+        state.manifest_dirty = true;
+      }
+      if (!it->second.accs.test(acc.index)) {
+        it->second.accs.set(acc.index);
+        acc.depots.emplace_back(app_id, depot_id);
+      }
+      if (!state.depot_keys.contains(depot_id)) {
+        missing_keys.emplace_back(app_id, depot_id);
+      }
+    }
+  } // for (const auto app_id : ctx.app_ids)
   if (state.cur_status.load(std::memory_order::relaxed) == status::running) {
     sync_manifest();
   } else if (!acc.ready) {
@@ -403,159 +533,219 @@ static void cb_app_info(tek_sc_cm_client *_Nonnull client, void *_Nonnull data,
       state.cur_status.store(status::running, std::memory_order::relaxed);
     }
   }
-  if (missing_keys.empty()) {
-    return;
-  }
   std::ranges::sort(missing_keys);
-  // Schedule depot decryption key requests
-  acc.rem_dk_total = missing_keys.size();
-  acc.depot_key_requests.reset(new tek_sc_cm_data_depot_key[acc.rem_dk_total]);
-  for (int i = 0; i < acc.rem_dk_total; ++i) {
-    auto &data_dk{acc.depot_key_requests[i]};
-    const auto &item{missing_keys[i]};
-    data_dk.app_id = item.first;
-    data_dk.depot_id = item.second;
-  }
-  // Send requests in bursts of 5, too many requests at once result in server
-  //    refusing to process some of them, and timeouts. This will still happen
-  //    even with such bursts, but nevertheless it's the faster way to get them
-  {
-    const int burst_size{std::min(5, acc.rem_dk_total)};
-    acc.rem_dk_burst = burst_size;
-    for (int i = 0; i < burst_size; ++i) {
-      tek_sc_cm_get_depot_key(client,
-                              &acc.depot_key_requests[--acc.rem_dk_total],
-                              cb_depot_key, 3000);
-    }
-  }
-  return;
-app_err:
-  std::ranges::for_each(apps, std::free, &tek_sc_cm_pics_entry::data);
-  delete[] data_pics.app_entries;
-  delete &data_pics;
-  tek_sc_cm_disconnect(client);
+  return missing_keys;
 }
 
-/// The callback for CM client PICS access tokens received event.
+/// Request PICS info for a chunk of packages.
 ///
-/// @param [in, out] client
-///    Pointer to the CM client instance that emitted the callback.
-/// @param [in, out] data
-///    Pointer to `tek_sc_cm_data_pics` associated with the request.
-/// @param [in, out] user_data
-///    Pointer to the @ref account object associated with @p client.
-[[using gnu: nonnull(1, 2, 3), access(read_write, 1), access(read_write, 2),
-  access(read_write, 3)]]
-static void cb_access_tokens(tek_sc_cm_client *_Nonnull client,
-                             void *_Nonnull data, void *_Nonnull user_data) {
-  auto &data_pics{*reinterpret_cast<tek_sc_cm_data_pics *>(data)};
-  auto &acc{*reinterpret_cast<account *>(user_data)};
-  if (!tek_sc_err_success(&data_pics.result)) {
-    std::println(std::cerr,
-                 "Failed to get PICS access tokens for account {}'s apps:",
-                 acc.token_info.steam_id);
-    print_err(data_pics.result);
-    delete[] data_pics.app_entries;
-    delete &data_pics;
-    tek_sc_cm_disconnect(client);
-    return;
+/// @param [in, out] ctx
+///    Refresh context of the account that owns the packages.
+/// @param chunk
+///    IDs and access tokens of the packages.
+static task request_packages(
+    refresh_ctx &ctx,
+    std::span<const std::pair<std::uint32_t, std::uint64_t>> chunk) {
+  if (ctx.failed.load(std::memory_order::relaxed) || ctx.cancelled()) {
+    co_return;
+  }
+  std::vector<tek_sc_cm_pics_entry> entries(chunk.size());
+  for (auto &&[package, entry] : std::views::zip(chunk, entries)) {
+    entry.id = package.first;
+    entry.access_token = package.second;
+  }
+  tek_sc_cm_data_pics data_pics{.app_entries = nullptr,
+                                .package_entries = entries.data(),
+                                .num_app_entries = 0,
+                                .num_package_entries = 0,
+                                .timeout_ms = 10000,
+                                .result = {}};
+  data_pics.num_package_entries = entries.size();
+  data_pics = co_await cm_product_info{ctx.client, data_pics, 10000};
+  if (!ctx.cancelled()) {
+    store_packages(ctx, data_pics);
+  }
+  std::ranges::for_each(entries, std::free, &tek_sc_cm_pics_entry::data);
+}
+
+/// Request PICS access tokens and then info for a chunk of applications.
+///
+/// @param [in, out] ctx
+///    Refresh context of the account that owns the applications.
+/// @param chunk
+///    IDs of the applications.
+static task request_apps(refresh_ctx &ctx,
+                         std::span<const std::uint32_t> chunk) {
+  if (ctx.failed.load(std::memory_order::relaxed) || ctx.cancelled()) {
+    co_return;
+  }
+  std::vector<tek_sc_cm_pics_entry> entries(chunk.size());
+  for (auto &&[id, entry] : std::views::zip(chunk, entries)) {
+    entry.id = id;
   }
-  for (auto &app :
-       std::span{data_pics.app_entries,
-                 static_cast<std::size_t>(data_pics.num_app_entries)}) {
-    if (tek_sc_err_success(&app.result)) {
-      continue;
+  tek_sc_cm_data_pics data_pics{.app_entries = entries.data(),
+                                .package_entries = nullptr,
+                                .num_app_entries = 0,
+                                .num_package_entries = 0,
+                                .timeout_ms = 10000,
+                                .result = {}};
+  data_pics.num_app_entries = entries.size();
+  data_pics = co_await cm_access_tokens{ctx.client, data_pics, 10000};
+  if (ctx.cancelled() || !check_access_tokens(ctx, data_pics)) {
+    co_return;
+  }
+  data_pics = co_await cm_product_info{ctx.client, data_pics, 10000};
+  if (!ctx.cancelled()) {
+    store_apps(ctx, data_pics);
+  }
+  std::ranges::for_each(entries, std::free, &tek_sc_cm_pics_entry::data);
+}
+
+/// Request decryption key for a depot and add it to the manifest.
+///
+/// @param [in, out] ctx
+///    Refresh context of the account that owns the depot.
+/// @param [in] item
+///    App/depot ID pair of the depot.
+static task
+request_depot_key(refresh_ctx &ctx,
+                  const std::pair<std::uint32_t, std::uint32_t> &item) {
+  if (ctx.failed.load(std::memory_order::relaxed) || ctx.cancelled()) {
+    co_return;
+  }
+  tek_sc_cm_data_depot_key data_dk{};
+  data_dk.app_id = item.first;
+  data_dk.depot_id = item.second;
+  for (;;) {
+    data_dk = co_await cm_depot_key{ctx.client, data_dk, 3000};
+    // Checked before re-sending as well, the client may be gone by then
+    if (ctx.cancelled()) {
+      co_return;
     }
-    // Some apps are just weird and don't provide an access token.
-    if (app.result.type == TEK_SC_ERR_TYPE_sub &&
-        app.result.auxiliary == TEK_SC_ERRC_cm_access_token_denied) {
-      app.access_token = 0;
-      continue;
+    // Timeouts are common for depot key requests, just re-send it
+    if (data_dk.result.type != TEK_SC_ERR_TYPE_sub ||
+        data_dk.result.auxiliary != TEK_SC_ERRC_cm_timeout) {
+      break;
     }
-    std::println(
-        std::cerr,
-        "Failed to get PICS access token for app {} owned by account {}:",
-        app.id, acc.token_info.steam_id);
-    print_err(app.result);
-    delete[] data_pics.app_entries;
-    delete &data_pics;
-    tek_sc_cm_disconnect(client);
-    return;
   }
-  tek_sc_cm_get_product_info(client, &data_pics, cb_app_info, 10000);
+  // TEK_SC_CM_ERESULT_blocked is returned for pre-download depots, ignore it
+  if (!tek_sc_err_success(&data_dk.result) &&
+      data_dk.result.type != TEK_SC_ERR_TYPE_steam_cm &&
+      data_dk.result.auxiliary != TEK_SC_CM_ERESULT_blocked) {
+    std::println(std::cerr, "Failed to get decryption key for depot {}:",
+                 data_dk.depot_id);
+    print_err(data_dk.result);
+    ctx.failed.store(true, std::memory_order::relaxed);
+    co_return;
+  }
+  if (tek_sc_err_success(&data_dk.result)) {
+    const std::scoped_lock lock{state.manifest_mtx};
+    state.manifest_dirty = true;
+    std::ranges::copy(data_dk.key, state.depot_keys[data_dk.depot_id].begin());
+  }
 }
 
-/// The callback for CM client PICS package info received event.
+/// Refresh the list of applications owned by an account: request PICS info
+///    for its packages and applications that isn't cached or has expired,
+///    add the applications to the manifest, and request missing depot
+///    decryption keys. Requests are split into chunks that are sent
+///    concurrently. If any of them fails, the CM client is disconnected once
+///    the remaining ones complete, and the refresh is retried after
+///    reconnection.
 ///
 /// @param [in, out] client
-///    Pointer to the CM client instance that emitted the callback.
-/// @param [in, out] data
-///    Pointer to `tek_sc_cm_data_pics` associated with the request.
-/// @param [in, out] user_data
-///    Pointer to the @ref account object associated with @p client.
-[[using gnu: nonnull(1, 2, 3), access(read_write, 1), access(read_write, 2),
-  access(read_write, 3)]]
-static void cb_package_info(tek_sc_cm_client *_Nonnull client,
-                            void *_Nonnull data, void *_Nonnull user_data) {
-  auto &data_pics{*reinterpret_cast<tek_sc_cm_data_pics *>(data)};
-  auto &acc{*reinterpret_cast<account *>(user_data)};
-  if (!tek_sc_err_success(&data_pics.result)) {
-    std::println(std::cerr,
-                 "Failed to get PICS info for account {}'s packages:",
-                 acc.token_info.steam_id);
-    print_err(data_pics.result);
-    delete[] data_pics.package_entries;
-    delete &data_pics;
-    tek_sc_cm_disconnect(client);
-    return;
-  }
-  std::set<std::uint32_t> owned_app_ids;
-  const std::span packages{
-      data_pics.package_entries,
-      static_cast<std::size_t>(data_pics.num_package_entries)};
-  for (const auto &package : packages) {
-    if (tek_sc_err_success(&package.result)) {
-      continue;
+///    Pointer to the CM client instance associated with @p acc.
+/// @param [in, out] acc
+///    Account to refresh applications of.
+/// @param lics
+///    IDs and access tokens of packages that the account has licenses for.
+/// @param cancel
+///    Cancellation token of the refresh.
+static task
+refresh_apps(tek_sc_cm_client *_Nonnull client, account &acc,
+             std::vector<std::pair<std::uint32_t, std::uint64_t>> lics,
+             std::shared_ptr<const cancel_token> cancel) {
+  refresh_ctx ctx{.client = client,
+                  .acc = acc,
+                  .cancel = std::move(cancel),
+                  .depot_ids = {},
+                  .app_ids = {},
+                  .failed = {}};
+  // IDs and access tokens of packages which info has to be requested
+  std::vector<std::pair<std::uint32_t, std::uint64_t>> packages;
+  {
+    const auto now{
+        std::chrono::system_clock::to_time_t(std::chrono::system_clock::now())};
+    const std::scoped_lock lock{state.manifest_mtx};
+    for (const auto &lic : lics) {
+      if (const auto info{state.pics_packages.find(lic.first)};
+          info != state.pics_packages.end() &&
+          pics_fresh(info->second.timestamp, now)) {
+        add_package(ctx, info->second);
+      } else {
+        packages.emplace_back(lic);
+      }
     }
-    std::println(std::cerr,
-                 "Failed to get PICS info for package {} owned by account {}:",
-                 package.id, acc.token_info.steam_id);
-    print_err(package.result);
-    std::ranges::for_each(packages, std::free, &tek_sc_cm_pics_entry::data);
-    delete[] data_pics.package_entries;
-    delete &data_pics;
-    tek_sc_cm_disconnect(client);
-    return;
   }
-  for (const auto &package : packages) {
-    auto cur{reinterpret_cast<const char *>(package.data)};
-    bin_vdf_node bvdf{cur, &cur[package.data_size]};
-    if (const auto depot_ids{bvdf.children.find("depotids")};
-        depot_ids != bvdf.children.end()) {
-      for (int depot_id : depot_ids->second->int_attrs | std::views::values) {
-        acc.depot_ids.emplace(static_cast<std::uint32_t>(depot_id));
-      };
+  if (!packages.empty()) {
+    const auto chunks{make_chunks(packages)};
+    co_await for_each_bounded(
+        std::span{chunks}, max_pics_requests,
+        [&ctx](const auto &chunk) { return request_packages(ctx, chunk); },
+        [&ctx] { return ctx.cancelled(); });
+    if (ctx.cancelled()) {
+      co_return;
     }
-    if (const auto app_ids{bvdf.children.find("appids")};
-        app_ids != bvdf.children.end()) {
-      for (int app_id : app_ids->second->int_attrs | std::views::values) {
-        owned_app_ids.emplace(static_cast<std::uint32_t>(app_id));
-        acc.depot_ids.emplace(static_cast<std::uint32_t>(app_id));
+    if (ctx.failed.load(std::memory_order::relaxed)) {
+      tek_sc_cm_disconnect(client);
+      co_return;
+    }
+  }
+  // IDs of applications which info has to be requested
+  std::vector<std::uint32_t> app_ids;
+  {
+    const auto now{
+        std::chrono::system_clock::to_time_t(std::chrono::system_clock::now())};
+    const std::scoped_lock lock{state.manifest_mtx};
+    for (const auto app_id : ctx.app_ids) {
+      if (const auto info{state.pics_apps.find(app_id)};
+          info == state.pics_apps.end() ||
+          !pics_fresh(info->second.timestamp, now)) {
+        app_ids.emplace_back(app_id);
       }
     }
-    std::free(package.data);
-  }
-  delete[] data_pics.package_entries;
-  data_pics.num_package_entries = 0;
-  data_pics.app_entries = new tek_sc_cm_pics_entry[owned_app_ids.size()]();
-  data_pics.num_app_entries = owned_app_ids.size();
-  for (auto &&[id, entry] :
-       std::views::zip(owned_app_ids, std::span{data_pics.app_entries,
-                                                owned_app_ids.size()})) {
-    entry.id = id;
   }
-  tek_sc_cm_get_access_token(client, &data_pics, cb_access_tokens, 10000);
-  return;
+  if (!app_ids.empty()) {
+    const auto chunks{make_chunks(app_ids)};
+    co_await for_each_bounded(
+        std::span{chunks}, max_pics_requests,
+        [&ctx](const auto &chunk) { return request_apps(ctx, chunk); },
+        [&ctx] { return ctx.cancelled(); });
+    if (ctx.cancelled()) {
+      co_return;
+    }
+    if (ctx.failed.load(std::memory_order::relaxed)) {
+      tek_sc_cm_disconnect(client);
+      co_return;
+    }
+  }
+  const auto missing_keys{apply_apps(ctx)};
+  if (missing_keys.empty()) {
+    co_return;
+  }
+  co_await for_each_bounded(
+      std::span{missing_keys}, max_depot_key_requests,
+      [&ctx](const auto &item) { return request_depot_key(ctx, item); },
+      [&ctx] { return ctx.cancelled(); });
+  if (ctx.cancelled()) {
+    co_return;
+  }
+  if (ctx.failed.load(std::memory_order::relaxed)) {
+    tek_sc_cm_disconnect(client);
+  } else if (state.cur_status.load(std::memory_order::relaxed) ==
+             status::running) {
+    sync_manifest();
+  }
 }
 
 /// The callback for CM client got licenses event.
@@ -582,21 +772,17 @@ static void cb_lics(tek_sc_cm_client *_Nonnull client, void *_Nonnull data,
   if (!data_lics.num_entries) {
     return;
   }
-  auto &data_pics{*new tek_sc_cm_data_pics{
-      .app_entries = nullptr,
-      .package_entries = new tek_sc_cm_pics_entry[data_lics.num_entries](),
-      .num_app_entries = 0,
-      .num_package_entries = data_lics.num_entries,
-      .timeout_ms = 10000,
-      .result = {}}};
-  for (auto &&[lics_entry, pics_entry] :
-       std::views::zip(std::span(data_lics.entries, data_lics.num_entries),
-                       std::span(data_pics.package_entries,
-                                 data_pics.num_package_entries))) {
-    pics_entry.id = lics_entry.package_id;
-    pics_entry.access_token = lics_entry.access_token;
-  }
-  tek_sc_cm_get_product_info(client, &data_pics, cb_package_info, 10000);
+  std::vector<std::pair<std::uint32_t, std::uint64_t>> lics;
+  lics.reserve(data_lics.num_entries);
+  for (const auto &lic : std::span(data_lics.entries, data_lics.num_entries)) {
+    lics.emplace_back(lic.package_id, lic.access_token);
+  }
+  // A refresh started before reconnection may still be awaiting responses
+  if (acc.refresh_cancel) {
+    acc.refresh_cancel->cancel();
+  }
+  acc.refresh_cancel = std::make_shared<cancel_token>();
+  spawn(refresh_apps(client, acc, std::move(lics), acc.refresh_cancel));
 }
 
 /// The callback for CM client signed in event.
@@ -671,7 +857,7 @@ static void cb_token_renewed(tek_sc_cm_client *_Nonnull client,
                                             std::chrono::system_clock::now())) *
                                            LWS_USEC_PER_SEC;
         acc.ren_status = renew_status::pending_schedule;
-        lws_cancel_service(state.lws_ctx);
+        post_event({.type = event_type::schedule_renewal, .acc = &acc});
       }
     }
     tek_sc_cm_sign_in(client, acc.token.data(), cb_signed_in, 5000);
@@ -719,7 +905,7 @@ void cb_connected(tek_sc_cm_client *client, void *data, void *user_data) {
     acc.sul.cb = renew;
     acc.sul.us = lws_now_usecs() + (day_bef_exp - now) * LWS_USEC_PER_SEC;
     acc.ren_status = renew_status::pending_schedule;
-    lws_cancel_service(state.lws_ctx);
+    post_event({.type = event_type::schedule_renewal, .acc = &acc});
     tek_sc_cm_sign_in(client, acc.token.data(), cb_signed_in, 5000);
   } else {
     // Less than a day left until token expiration, try renewing it
@@ -739,16 +925,21 @@ void cb_disconnected(tek_sc_cm_client *client, void *data, void *user_data) {
     //    needed
     return;
   }
+  if (acc.refresh_cancel) {
+    acc.refresh_cancel->cancel();
+  }
   if (!tek_sc_err_success(&res)) {
     std::println(std::cerr, "Abnormal disconnection from a Steam CM server:");
     print_err(res);
   }
   if (remove_status cur_status{remove_status::pending_remove};
-      !acc.rem_status.compare_exchange_strong(cur_status, remove_status::remove,
-                                              std::memory_order::relaxed,
-                                              std::memory_order::relaxed) &&
-      cur_status == remove_status::none &&
-      state.cur_status.load(std::memory_order::relaxed) != status::stopping) {
+      acc.rem_status.compare_exchange_strong(cur_status, remove_status::remove,
+                                             std::memory_order::relaxed,
+                                             std::memory_order::relaxed)) {
+    post_event({.type = event_type::remove_account, .acc = &acc});
+  } else if (cur_status == remove_status::none &&
+             state.cur_status.load(std::memory_order::relaxed) !=
+                 status::stopping) {
     tek_sc_cm_connect(client, cb_connected, 5000, cb_disconnected);
   }
 }
@@ -0,0 +1,292 @@
+//===-- cm_coro.hpp - Coroutine wrappers for CM requests ------------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Declaration and implementation of coroutine types for issuing
+///    tek-steamclient CM requests: @ref tek::s3::task, awaitable
+///    @ref tek::s3::cm_request, and structured concurrency helpers. Coroutines
+///    are resumed on the thread that delivers the CM response, so anything
+///    they share with other threads must still be synchronized.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include "null_attrs.h" // IWYU pragma: keep
+
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <span>
+#include <tek-steamclient/cm.h>
+#include <utility>
+#include <vector>
+
+namespace tek::s3 {
+
+/// Cancellation token shared between a coroutine pipeline and its owner.
+///    Coroutines check it after every resumption, and return without
+///    touching any state once it's set.
+class cancel_token {
+  /// Value indicating whether cancellation has been requested.
+  std::atomic_bool cancelled;
+
+public:
+  /// Request cancellation.
+  void cancel() noexcept { cancelled.store(true, std::memory_order::relaxed); }
+  /// Check whether cancellation has been requested.
+  bool is_cancelled() const noexcept {
+    return cancelled.load(std::memory_order::relaxed);
+  }
+};
+
+/// Lazily started coroutine without a result. A task begins running when it's
+///    awaited, resuming the awaiter on completion, or when it's passed to
+///    @ref spawn, in which case it destroys itself on completion.
+class [[nodiscard]] task {
+public:
+  /// Coroutine promise type.
+  struct promise_type {
+    /// Coroutine awaiting the task, empty for spawned tasks.
+    std::coroutine_handle<> continuation;
+
+    task get_return_object() noexcept {
+      return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    auto final_suspend() const noexcept {
+      struct awaiter {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+          if (const auto continuation{handle.promise().continuation};
+              continuation) {
+            return continuation;
+          }
+          handle.destroy();
+          return std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+      };
+      return awaiter{};
+    }
+    void return_void() const noexcept {}
+    [[noreturn]] void unhandled_exception() const noexcept { std::terminate(); }
+  };
+
+private:
+  /// Handle of the coroutine, empty if it has been moved out or spawned.
+  std::coroutine_handle<promise_type> handle;
+
+  explicit task(std::coroutine_handle<promise_type> handle) noexcept
+      : handle{handle} {}
+
+public:
+  task(task &&other) noexcept : handle{std::exchange(other.handle, {})} {}
+  task &operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (handle) {
+        handle.destroy();
+      }
+      handle = std::exchange(other.handle, {});
+    }
+    return *this;
+  }
+  ~task() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  /// Start the task and suspend the awaiting coroutine until it completes.
+  auto operator co_await() && noexcept {
+    struct awaiter {
+      std::coroutine_handle<promise_type> handle;
+
+      bool await_ready() const noexcept { return false; }
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<> continuation) noexcept {
+        handle.promise().continuation = continuation;
+        return handle;
+      }
+      void await_resume() const noexcept {}
+    };
+    return awaiter{handle};
+  }
+
+  /// Start a task without awaiting it. The task owns its coroutine frame
+  ///    from now on, and destroys it on completion.
+  ///
+  /// @param [in] t
+  ///    The task to start.
+  friend void spawn(task t) noexcept { std::exchange(t.handle, {}).resume(); }
+};
+
+/// Awaitable tek-steamclient CM request. The request/response data lives in
+///    the awaiter, which is kept in the awaiting coroutine's frame until the
+///    response callback resumes it, so requests don't need heap allocations.
+///    Timeout handling is done by tek-steamclient, which reports it via the
+///    `result` field of the data.
+///
+/// @tparam Data
+///    Type of the request/response data structure.
+/// @tparam Fn
+///    tek-steamclient function that sends the request.
+template <typename Data, auto Fn> class cm_request {
+  /// Request/response data. It must be the first member, as the response
+  ///    callback gets the awaiter by its address.
+  Data data;
+  /// Handle of the awaiting coroutine.
+  std::coroutine_handle<> handle;
+  /// Pointer to the CM client instance to send the request via.
+  tek_sc_cm_client *_Nonnull client;
+  /// Timeout for the request, in milliseconds.
+  long timeout_ms;
+
+  /// The callback for CM response, resumes the awaiting coroutine.
+  ///
+  /// @param [in] data
+  ///    Pointer to @ref data.
+  [[using gnu: nonnull(2), access(read_only, 2)]]
+  static void cb(tek_sc_cm_client *_Nonnull, void *_Nonnull data,
+                 void *_Nonnull) {
+    reinterpret_cast<cm_request *>(data)->handle.resume();
+  }
+
+public:
+  /// Prepare a request.
+  ///
+  /// @param [in, out] client
+  ///    Pointer to the CM client instance to send the request via.
+  /// @param [in] data
+  ///    Request data.
+  /// @param timeout_ms
+  ///    Timeout for the request, in milliseconds.
+  cm_request(tek_sc_cm_client *_Nonnull client, const Data &data,
+             long timeout_ms) noexcept
+      : data{data}, handle{}, client{client}, timeout_ms{timeout_ms} {}
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> handle) noexcept {
+    this->handle = handle;
+    // The callback may resume the coroutine on another thread before Fn
+    //    returns, so the awaiter must not be accessed after this call
+    Fn(client, &data, cb, timeout_ms);
+  }
+  Data await_resume() const noexcept { return data; }
+};
+
+/// PICS product info request.
+using cm_product_info =
+    cm_request<tek_sc_cm_data_pics, tek_sc_cm_get_product_info>;
+/// PICS access tokens request.
+using cm_access_tokens =
+    cm_request<tek_sc_cm_data_pics, tek_sc_cm_get_access_token>;
+/// Depot decryption key request.
+using cm_depot_key =
+    cm_request<tek_sc_cm_data_depot_key, tek_sc_cm_get_depot_key>;
+
+/// Awaiter that runs tasks concurrently and resumes the awaiting coroutine
+///    once all of them have completed.
+class when_all {
+  /// Tasks to run.
+  std::vector<task> tasks;
+  /// Number of tasks that haven't completed yet, plus one for the awaiting
+  ///    coroutine while it's starting them.
+  std::atomic_size_t remaining;
+  /// Handle of the awaiting coroutine.
+  std::coroutine_handle<> continuation;
+
+  /// Await a task and resume the awaiting coroutine if it's the last one to
+  ///    complete.
+  ///
+  /// @param t
+  ///    The task to await.
+  /// @param [in, out] all
+  ///    The awaiter.
+  static task run(task t, when_all &all) {
+    co_await std::move(t);
+    if (all.remaining.fetch_sub(1, std::memory_order::acq_rel) == 1) {
+      all.continuation.resume();
+    }
+  }
+
+public:
+  /// Prepare running tasks.
+  ///
+  /// @param tasks
+  ///    Tasks to run.
+  explicit when_all(std::vector<task> tasks) noexcept
+      : tasks{std::move(tasks)} {}
+
+  bool await_ready() const noexcept { return tasks.empty(); }
+  bool await_suspend(std::coroutine_handle<> handle) noexcept {
+    continuation = handle;
+    remaining.store(tasks.size() + 1, std::memory_order::relaxed);
+    for (auto &t : tasks) {
+      spawn(run(std::move(t), *this));
+    }
+    return remaining.fetch_sub(1, std::memory_order::acq_rel) != 1;
+  }
+  void await_resume() const noexcept {}
+};
+
+/// Worker of @ref for_each_bounded.
+///
+/// @param items
+///    Elements to process.
+/// @param [in, out] next
+///    Index of the next element to process, shared between workers.
+/// @param [in] fn
+///    Coroutine function to call for each element.
+/// @param [in] cancelled
+///    Function checked before each call, the worker stops once it returns
+///    `true`.
+template <typename T, typename Fn, typename Cancelled>
+task for_each_worker(std::span<T> items, std::atomic_size_t &next, Fn &fn,
+                     Cancelled &cancelled) {
+  for (auto i{next.fetch_add(1, std::memory_order::relaxed)};
+       i < items.size() && !cancelled();
+       i = next.fetch_add(1, std::memory_order::relaxed)) {
+    co_await fn(items[i]);
+  }
+}
+
+/// Call a coroutine function for each element of a range, with at most
+///    @p limit calls running concurrently, and wait for all of them to
+///    complete. Elements are processed in order of their indices. Once
+///    @p cancelled returns `true`, the remaining elements are skipped and
+///    only the calls that are already running are waited for.
+///
+/// @param items
+///    Elements to process.
+/// @param limit
+///    Maximum number of concurrently running calls.
+/// @param fn
+///    Coroutine function taking a reference to an element and returning
+///    @ref task.
+/// @param cancelled
+///    Function without parameters returning `bool`, which indicates whether
+///    processing should be abandoned.
+template <typename T, typename Fn, typename Cancelled>
+task for_each_bounded(std::span<T> items, std::size_t limit, Fn fn,
+                      Cancelled cancelled) {
+  std::atomic_size_t next{};
+  const auto num_workers{std::min(limit, items.size())};
+  std::vector<task> workers;
+  workers.reserve(num_workers);
+  for (std::size_t i{}; i < num_workers; ++i) {
+    workers.emplace_back(for_each_worker(items, next, fn, cancelled));
+  }
+  co_await when_all{std::move(workers)};
+}
+
+} // namespace tek::s3
@@ -0,0 +1,353 @@
+//===-- comp_tune.cpp - Compression level tuner implementation ------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Implementation of the compression level tuner. Each codec has a short
+///    ladder of candidate levels with prior estimates of their speed and
+///    ratio. Measurements replace the priors of the levels they are taken at,
+///    and scale the priors of other levels of the same codec, so that levels
+///    that haven't been tried yet are estimated for this machine and this
+///    manifest as well. Selection is an exhaustive search over all
+///    combinations of candidate levels, which is cheap since there are only a
+///    few of them.
+///
+//===----------------------------------------------------------------------===//
+#include "comp_tune.hpp"
+
+#include "null_attrs.h" // IWYU pragma: keep
+#include "state.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <vector>
+#ifdef TEK_S3B_ZNG
+#include <zlib-ng.h>
+#else // def TEK_S3B_ZNG
+#include <zlib.h>
+#endif // def TEK_S3B_ZNG else
+#ifdef TEK_S3B_BROTLI
+#include <brotli/encode.h>
+#endif // def TEK_S3B_BROTLI
+#ifdef TEK_S3B_ZSTD
+#include <zstd.h>
+#endif // def TEK_S3B_ZSTD
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private types -----------------------------------------------------===//
+
+/// Weight of a new measurement in moving averages.
+constexpr double ewma_weight{0.25};
+
+/// Number of encodings being tuned.
+constexpr auto num_encs{precomp_encs.size()};
+
+/// Candidate compression level of a codec.
+struct level_entry {
+  /// Compression level to pass to the codec.
+  int level;
+  /// Prior estimate of compression time, in nanoseconds per byte.
+  double prior_ns_per_byte;
+  /// Prior estimate of compression ratio.
+  double prior_ratio;
+  /// Moving average of measured compression time, in nanoseconds per byte.
+  double ns_per_byte;
+  /// Moving average of measured compression ratio.
+  double ratio;
+  /// Number of compression time measurements taken at this level.
+  std::uint32_t samples;
+  /// Number of compression ratio measurements taken at this level, including
+  ///    ones of restored pre-compressed data, which has no timing.
+  std::uint32_t ratio_samples;
+};
+
+/// Tuning state of a codec.
+struct codec_tuner {
+  /// Candidate levels, from fastest to strongest.
+  std::vector<level_entry> levels;
+  /// Index of the selected level in @ref levels.
+  std::size_t cur;
+  /// Moving average of ratios of measured compression time to prior estimates.
+  double time_scale;
+  /// Moving average of ratios of measured compression ratio to prior
+  ///    estimates.
+  double ratio_scale;
+
+  /// Estimate compression time at a candidate level.
+  ///
+  /// @param index
+  ///    Index of the level in @ref levels.
+  /// @return Estimated compression time, in nanoseconds per byte.
+  double est_time(std::size_t index) const noexcept {
+    const auto &entry{levels[index]};
+    return entry.samples ? entry.ns_per_byte
+                         : entry.prior_ns_per_byte * time_scale;
+  }
+  /// Estimate compression ratio at a candidate level.
+  ///
+  /// @param index
+  ///    Index of the level in @ref levels.
+  /// @return Estimated ratio of compressed size to uncompressed size.
+  double est_ratio(std::size_t index) const noexcept {
+    const auto &entry{levels[index]};
+    return entry.ratio_samples ? entry.ratio
+                               : entry.prior_ratio * ratio_scale;
+  }
+};
+
+/// Compression level tuner state.
+struct comp_tuner {
+  /// Tuning states of codecs, in the same order as @ref precomp_encs.
+  std::array<codec_tuner, num_encs> codecs;
+  /// Weights of Accept-Encoding sets in observed requests, indexed by bit
+  ///    masks of accepted encodings.
+  std::array<double, 1 << num_encs> mix;
+  /// Sum of @ref mix values.
+  double mix_total;
+};
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Create the list of candidate levels for a codec. Priors are typical
+///    values for JSON compression on a modern x86 core.
+///
+/// @param enc
+///    Encoding of the codec, one of @ref precomp_encs.
+/// @return Candidate levels, from fastest to strongest.
+static std::vector<level_entry> make_levels(enc_type enc) {
+  switch (enc) {
+#ifdef TEK_S3B_BROTLI
+  case enc_type::brotli:
+    return {{.level = 1, .prior_ns_per_byte = 6, .prior_ratio = 0.33},
+            {.level = 4, .prior_ns_per_byte = 12, .prior_ratio = 0.26},
+            {.level = 6, .prior_ns_per_byte = 25, .prior_ratio = 0.23},
+            {.level = 9, .prior_ns_per_byte = 60, .prior_ratio = 0.22},
+            {.level = BROTLI_MAX_QUALITY,
+             .prior_ns_per_byte = 900,
+             .prior_ratio = 0.18}};
+#endif // def TEK_S3B_BROTLI
+#ifdef TEK_S3B_ZSTD
+  case enc_type::zstd:
+    return {{.level = 1, .prior_ns_per_byte = 3, .prior_ratio = 0.3},
+            {.level = 3, .prior_ns_per_byte = 5, .prior_ratio = 0.27},
+            {.level = 9, .prior_ns_per_byte = 20, .prior_ratio = 0.23},
+            {.level = 15, .prior_ns_per_byte = 90, .prior_ratio = 0.22},
+            {.level = 19, .prior_ns_per_byte = 500, .prior_ratio = 0.2},
+            {.level = ZSTD_maxCLevel(),
+             .prior_ns_per_byte = 900,
+             .prior_ratio = 0.19}};
+#endif // def TEK_S3B_ZSTD
+  default:
+    return {{.level = 1, .prior_ns_per_byte = 12, .prior_ratio = 0.32},
+            {.level = 3, .prior_ns_per_byte = 16, .prior_ratio = 0.3},
+            {.level = 6, .prior_ns_per_byte = 30, .prior_ratio = 0.27},
+            {.level = Z_BEST_COMPRESSION,
+             .prior_ns_per_byte = 45,
+             .prior_ratio = 0.265}};
+  }
+}
+
+/// Create the initial tuner state, with maximum levels selected and every
+///    encoding assumed to be requested equally often.
+///
+/// @return The tuner state.
+static comp_tuner make_tuner() {
+  comp_tuner tuner{};
+  for (std::size_t i{}; i < num_encs; ++i) {
+    auto &codec{tuner.codecs[i]};
+    codec.levels = make_levels(precomp_encs[i]);
+    codec.cur = codec.levels.size() - 1;
+    codec.time_scale = 1;
+    codec.ratio_scale = 1;
+  }
+  for (std::size_t i{}; i < num_encs; ++i) {
+    tuner.mix[1 << i] = 1;
+  }
+  tuner.mix_total = num_encs;
+  return tuner;
+}
+
+/// Get the index of an encoding in @ref precomp_encs.
+///
+/// @param enc
+///    The encoding, one of @ref precomp_encs.
+/// @return Index of @p enc.
+static std::size_t enc_index(enc_type enc) noexcept {
+  return std::distance(precomp_encs.begin(),
+                       std::ranges::find(precomp_encs, enc));
+}
+
+/// Update a moving average with a new measurement.
+///
+/// @param [in, out] avg
+///    The moving average.
+/// @param value
+///    The measurement.
+static void ewma(double &avg, double value) noexcept {
+  avg += (value - avg) * ewma_weight;
+}
+
+/// Record a measured compression ratio.
+///
+/// @param [in, out] codec
+///    Tuning state of the codec.
+/// @param [in, out] entry
+///    Level that the ratio has been measured at.
+/// @param ratio
+///    Ratio of compressed size to uncompressed size.
+static void record_ratio(codec_tuner &codec, level_entry &entry,
+                         double ratio) noexcept {
+  if (entry.ratio_samples++) {
+    ewma(entry.ratio, ratio);
+  } else {
+    entry.ratio = ratio;
+  }
+  ewma(codec.ratio_scale, ratio / entry.prior_ratio);
+}
+
+//===-- Private variable --------------------------------------------------===//
+
+/// The tuner instance.
+static comp_tuner tuner{make_tuner()};
+
+} // namespace
+
+//===-- Internal functions ------------------------------------------------===//
+
+int comp_tune_level(enc_type enc) noexcept {
+  const auto &codec{tuner.codecs[enc_index(enc)]};
+  return codec.levels[codec.cur].level;
+}
+
+void comp_tune_observe(unsigned accepted) noexcept {
+  if (!accepted) {
+    return;
+  }
+  tuner.mix[accepted] += 1;
+  // Halve old observations from time to time, so the mix follows changes of
+  //    the client population
+  if (++tuner.mix_total > 1 << 20) {
+    for (auto &weight : tuner.mix) {
+      weight /= 2;
+    }
+    tuner.mix_total /= 2;
+  }
+}
+
+void comp_tune_record(enc_type enc, int level, std::size_t size,
+                      std::size_t comp_size, std::int64_t elapsed) noexcept {
+  if (!size) {
+    return;
+  }
+  auto &codec{tuner.codecs[enc_index(enc)]};
+  const auto entry{std::ranges::find(codec.levels, level, &level_entry::level)};
+  if (entry == codec.levels.end()) {
+    return;
+  }
+  const auto ns_per_byte{static_cast<double>(elapsed) / size};
+  if (entry->samples++) {
+    ewma(entry->ns_per_byte, ns_per_byte);
+  } else {
+    entry->ns_per_byte = ns_per_byte;
+  }
+  ewma(codec.time_scale, ns_per_byte / entry->prior_ns_per_byte);
+  record_ratio(codec, *entry, static_cast<double>(comp_size) / size);
+}
+
+void comp_tune_record_ratio(enc_type enc, int level, std::size_t size,
+                            std::size_t comp_size) noexcept {
+  if (!size) {
+    return;
+  }
+  auto &codec{tuner.codecs[enc_index(enc)]};
+  const auto entry{std::ranges::find(codec.levels, level, &level_entry::level)};
+  if (entry != codec.levels.end()) {
+    record_ratio(codec, *entry, static_cast<double>(comp_size) / size);
+  }
+}
+
+void comp_tune_select(std::size_t size) noexcept {
+  auto &codecs{tuner.codecs};
+  if (!state.comp_budget) {
+    for (auto &codec : codecs) {
+      codec.cur = codec.levels.size() - 1;
+    }
+    return;
+  }
+  const auto budget{static_cast<double>(state.comp_budget) * 1000};
+  // Try every combination of candidate levels, counting them in mixed radix.
+  //    If none fits in the budget, the fastest levels are used
+  std::array<std::size_t, num_encs> combo{};
+  std::array<std::size_t, num_encs> best{};
+  auto best_size{std::numeric_limits<double>::infinity()};
+  auto best_cost{std::numeric_limits<double>::infinity()};
+  for (;;) {
+    double cost{};
+    for (std::size_t i{}; i < num_encs; ++i) {
+      cost += codecs[i].est_time(combo[i]) * size;
+    }
+    if (cost <= budget) {
+      // Expected response size relative to uncompressed one, given that each
+      //    client gets the smallest of encodings that it accepts
+      double exp_size{};
+      for (unsigned mask{1}; mask < tuner.mix.size(); ++mask) {
+        if (!tuner.mix[mask]) {
+          continue;
+        }
+        double ratio{1};
+        for (std::size_t i{}; i < num_encs; ++i) {
+          if (mask & (1 << i)) {
+            ratio = std::min(ratio, codecs[i].est_ratio(combo[i]));
+          }
+        }
+        exp_size += tuner.mix[mask] * ratio;
+      }
+      if (exp_size < best_size || (exp_size == best_size && cost < best_cost)) {
+        best = combo;
+        best_size = exp_size;
+        best_cost = cost;
+      }
+    }
+    std::size_t i{};
+    for (; i < num_encs; ++i) {
+      if (++combo[i] < codecs[i].levels.size()) {
+        break;
+      }
+      combo[i] = 0;
+    }
+    if (i == num_encs) {
+      break;
+    }
+  }
+  for (std::size_t i{}; i < num_encs; ++i) {
+    codecs[i].cur = best[i];
+  }
+}
+
+std::array<comp_tune_stats, precomp_encs.size()>
+comp_tune_get_stats() noexcept {
+  std::array<comp_tune_stats, num_encs> stats;
+  for (std::size_t i{}; i < num_encs; ++i) {
+    const auto &codec{tuner.codecs[i]};
+    stats[i] = {.level = codec.levels[codec.cur].level,
+                .ns_per_byte = codec.est_time(codec.cur),
+                .ratio = codec.est_ratio(codec.cur),
+                .samples = codec.levels[codec.cur].samples};
+  }
+  return stats;
+}
+
+} // namespace tek::s3
@@ -0,0 +1,108 @@
+//===-- comp_tune.hpp - Compression level tuner declarations --------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Declarations of functions for selecting compression levels of manifest
+///    encodings. Compression time and ratio are measured for every level that
+///    manifests are compressed with, and before each manifest update the
+///    levels are selected to minimize the expected size of responses, given
+///    the observed mix of Accept-Encoding headers, within the configured CPU
+///    time budget. All functions must be called with
+///    @ref ts3_state::manifest_mtx locked.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include "null_attrs.h" // IWYU pragma: keep
+#include "state.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace tek::s3 {
+
+/// Compression statistics of an encoding at its selected level.
+struct comp_tune_stats {
+  /// Selected compression level.
+  int level;
+  /// Estimated compression time, in nanoseconds per uncompressed byte.
+  double ns_per_byte;
+  /// Estimated ratio of compressed size to uncompressed size.
+  double ratio;
+  /// Number of compressions measured at the selected level.
+  std::uint32_t samples;
+};
+
+/// Get the compression level currently selected for an encoding.
+///
+/// @param enc
+///    The encoding, one of @ref precomp_encs.
+/// @return Compression level to pass to the codec.
+[[gnu::visibility("internal")]]
+int comp_tune_level(enc_type enc) noexcept;
+
+/// Record the set of encodings accepted by a manifest request.
+///
+/// @param accepted
+///    Bit mask of accepted encodings, where bit `i` corresponds to
+///    `precomp_encs[i]`.
+[[gnu::visibility("internal")]]
+void comp_tune_observe(unsigned accepted) noexcept;
+
+/// Record the result of a compression.
+///
+/// @param enc
+///    The encoding, one of @ref precomp_encs.
+/// @param level
+///    Compression level that has been used.
+/// @param size
+///    Size of uncompressed data, in bytes.
+/// @param comp_size
+///    Size of compressed data, in bytes.
+/// @param elapsed
+///    Time that compression has taken, in nanoseconds.
+[[gnu::visibility("internal")]]
+void comp_tune_record(enc_type enc, int level, std::size_t size,
+                      std::size_t comp_size, std::int64_t elapsed) noexcept;
+
+/// Record the compression ratio of pre-compressed data that has been restored
+///    rather than made, so its compression time is unknown. Time estimates of
+///    the level keep relying on priors until data is compressed at it again,
+///    which happens on the next manifest update that selects it.
+///
+/// @param enc
+///    The encoding, one of @ref precomp_encs.
+/// @param level
+///    Compression level that the data has been made with.
+/// @param size
+///    Size of uncompressed data, in bytes.
+/// @param comp_size
+///    Size of compressed data, in bytes.
+[[gnu::visibility("internal")]]
+void comp_tune_record_ratio(enc_type enc, int level, std::size_t size,
+                            std::size_t comp_size) noexcept;
+
+/// Select compression levels for the next manifest update. If
+///    @ref ts3_state::comp_budget is `0`, maximum levels are selected.
+///
+/// @param size
+///    Total size of uncompressed manifest buffers that will be compressed
+///    with each encoding, in bytes.
+[[gnu::visibility("internal")]]
+void comp_tune_select(std::size_t size) noexcept;
+
+/// Get compression statistics of all encodings.
+///
+/// @return Statistics of encodings, in the same order as @ref precomp_encs.
+[[gnu::visibility("internal")]]
+std::array<comp_tune_stats, precomp_encs.size()> comp_tune_get_stats() noexcept;
+
+} // namespace tek::s3
@@ -0,0 +1,485 @@
+//===-- enc_cache.cpp - Pre-compressed manifest cache implementation ------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Implementation of the pre-compressed manifest cache. Each encoding of each
+///    manifest buffer is stored in its own file in `enc_cache` subdirectory of
+///    the state directory, with a header holding SHA-256 hash of the
+///    uncompressed content it has been made from and the compression level.
+///    A periodic job on the libwebsockets service thread collects buffers
+///    that have been built since the last save rather than saving on every
+///    manifest update, so frequent updates during startup are coalesced, and
+///    the worker thread writes them, so neither the service thread nor CM
+///    callback threads ever wait for disk I/O. Restored files are read and
+///    sealed on the worker thread as well, and installed like freshly
+///    compressed buffers. Files are written under
+///    temporary names and renamed over the old ones, so a crash never leaves
+///    a valid-looking file behind.
+///
+//===----------------------------------------------------------------------===//
+#include "enc_cache.hpp"
+
+#include "comp_tune.hpp"
+#include "null_attrs.h" // IWYU pragma: keep
+#include "os.h"
+#include "state.hpp"
+#include "worker.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <libwebsockets.h>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <print>
+#include <string>
+#include <string_view>
+#include <tek-steamclient/os.h>
+#include <utility>
+#include <vector>
+#ifdef TEK_S3B_ZNG
+#include <zlib-ng.h>
+#else // def TEK_S3B_ZNG
+#include <zlib.h>
+#endif // def TEK_S3B_ZNG else
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private types -----------------------------------------------------===//
+
+/// Interval between saves of pre-compressed buffers, in microseconds.
+constexpr lws_usec_t save_interval{30 * LWS_US_PER_SEC};
+
+/// Pre-compressed buffer file header, followed by compressed data.
+struct cache_file_hdr {
+  /// Magic value identifying the file, @ref cache_file_magic.
+  std::uint32_t magic;
+  /// File format version, @ref cache_file_version.
+  std::uint32_t version;
+  /// CRC32 checksum of compressed data.
+  std::uint32_t crc;
+  /// Compression level that the data has been made with. The file is
+  ///    discarded if the tuner has selected a different level since.
+  std::int32_t level;
+  /// SHA-256 hash of uncompressed content.
+  sha256_hash hash;
+  /// Size of uncompressed content, in bytes.
+  std::uint64_t size;
+  /// Size of compressed data, in bytes.
+  std::uint64_t data_size;
+};
+
+/// Value of @ref cache_file_hdr::magic ("TS3C" in little-endian).
+constexpr std::uint32_t cache_file_magic{0x43335354};
+/// Current value of @ref cache_file_hdr::version.
+constexpr std::uint32_t cache_file_version{2};
+
+/// Persistence status of a manifest buffer.
+struct cache_slot {
+  /// Member of @ref ts3_state holding the buffer.
+  http_buf ts3_state::*_Nonnull buf;
+  /// Base name of the buffer's files.
+  std::basic_string_view<tek_sc_os_char> name;
+  /// SHA-256 hash of the buffer snapshot that @ref saved refers to.
+  sha256_hash hash;
+  /// Values indicating whether encodings of the snapshot are up to date on
+  ///    disk, in the same order as @ref precomp_encs.
+  std::array<bool, precomp_encs.size()> saved;
+};
+
+/// Pre-compressed buffer to be written by the worker thread.
+struct save_item {
+  /// Name of the file.
+  std::basic_string<tek_sc_os_char> name;
+  /// Name of the temporary file that is written before replacing the file.
+  std::basic_string<tek_sc_os_char> tmp_name;
+  /// Header of the file, except for @ref cache_file_hdr::crc, which is
+  ///    computed on the worker thread.
+  cache_file_hdr hdr;
+  /// The compressed data, kept alive even if it's evicted in the meantime.
+  std::shared_ptr<const sized_buf> data;
+};
+
+/// Pre-compressed buffers to be written by a single worker job.
+struct save_batch {
+  /// Path to the cache directory.
+  std::basic_string<tek_sc_os_char> dir_path;
+  /// Buffers to write.
+  std::vector<save_item> items;
+  /// Value indicating whether the worker job has written all items.
+  std::atomic_bool done;
+};
+
+/// Pre-compressed manifest cache state.
+struct enc_cache {
+  /// Doubly linked list element for libwebsockets save job scheduling.
+  lws_sorted_usec_list_t sul;
+  /// Path to the cache directory, empty if it couldn't be created.
+  std::basic_string<tek_sc_os_char> dir_path;
+  /// Persistence status of buffers, indexed by @ref cached_buf.
+  std::array<cache_slot, 3> slots;
+  /// The last batch submitted to the worker thread. A new one is submitted
+  ///    only when it's done, so files are never written concurrently.
+  std::shared_ptr<save_batch> batch;
+};
+
+//===-- Private variable --------------------------------------------------===//
+
+/// The cache instance.
+static enc_cache cache{
+    .sul{},
+    .dir_path{},
+    .slots{{{.buf = &ts3_state::manifest,
+             .name = TEK_SC_OS_STR("manifest"),
+             .hash{},
+             .saved{}},
+            {.buf = &ts3_state::manifest_bin,
+             .name = TEK_SC_OS_STR("manifest_bin"),
+             .hash{},
+             .saved{}},
+            {.buf = &ts3_state::manifest_bin_v2,
+             .name = TEK_SC_OS_STR("manifest_bin_v2"),
+             .hash{},
+             .saved{}}}},
+    .batch{}};
+
+//===-- Private functions -------------------------------------------------===//
+
+#ifdef TEK_S3B_ZNG
+static constexpr auto &crc32{::zng_crc32};
+#else  // def TEK_S3B_ZNG
+static constexpr auto &crc32{::crc32};
+#endif // def TEK_S3B_ZNG else
+
+/// Print an OS error message to stderr.
+///
+/// @param errc
+///    OS error code.
+/// @param [in] msg
+///    Program-defined message identifying which operation failed.
+static inline void print_os_err(tek_sc_os_errc errc,
+                                const std::string_view &&msg) {
+  const auto err_msg{ts3_os_get_err_msg(errc)};
+  std::println(std::cerr, "{}: ({}) {}", msg, errc, err_msg);
+  std::free(err_msg);
+}
+
+/// Get the file name extension for an encoding.
+///
+/// @param enc
+///    The encoding, one of @ref precomp_encs.
+/// @return File name extension, including the leading dot.
+static std::basic_string_view<tek_sc_os_char> enc_ext(enc_type enc) noexcept {
+  switch (enc) {
+#ifdef TEK_S3B_BROTLI
+  case enc_type::brotli:
+    return TEK_SC_OS_STR(".br");
+#endif // def TEK_S3B_BROTLI
+#ifdef TEK_S3B_ZSTD
+  case enc_type::zstd:
+    return TEK_SC_OS_STR(".zst");
+#endif // def TEK_S3B_ZSTD
+  default:
+    return TEK_SC_OS_STR(".deflate");
+  }
+}
+
+/// Compute CRC32 checksum of a buffer.
+///
+/// @param [in] buf
+///    The buffer.
+/// @return CRC32 checksum of the buffer's contents.
+static std::uint32_t buf_crc(const sized_buf &buf) noexcept {
+  return crc32(crc32(0, nullptr, 0), buf.buf.get(), buf.size);
+}
+
+/// Load a pre-compressed buffer from its file. Runs on the worker thread.
+///
+/// @param [in] path
+///    Path to the file, as a null-terminated string.
+/// @param [in] job
+///    Job that the buffer is loaded for, which specifies the uncompressed
+///    buffer and the compression level that the file must have been made
+///    from and with.
+/// @return The compressed data, or an empty buffer if the file is missing,
+///    damaged or has been made from different content or at a different
+///    level.
+/// @throws std::bad_alloc if allocation fails.
+static sized_buf load_file(const tek_sc_os_char *_Nonnull path,
+                           const enc_job &job) {
+  os_handle handle{ts3_os_file_open(path)};
+  if (!handle) {
+    return {};
+  }
+  const auto file_size{ts3_os_file_get_size(handle.value)};
+  if (file_size == std::numeric_limits<std::size_t>::max() ||
+      file_size < sizeof(cache_file_hdr)) {
+    return {};
+  }
+  cache_file_hdr hdr;
+  if (!ts3_os_file_read(handle.value, &hdr, sizeof hdr) ||
+      hdr.magic != cache_file_magic || hdr.version != cache_file_version ||
+      hdr.level != job.level || hdr.hash != job.hash ||
+      hdr.size != job.src->size || !hdr.data_size ||
+      hdr.data_size != file_size - sizeof hdr) {
+    return {};
+  }
+  auto data{sized_buf::alloc(hdr.data_size)};
+  if (!ts3_os_file_read(handle.value, data.buf.get(), data.size) ||
+      buf_crc(data) != hdr.crc) {
+    return {};
+  }
+  return data;
+}
+
+/// Save a pre-compressed buffer to its file. The data is written to a
+///    temporary file first, which then replaces the old one.
+///
+/// @param dir_handle
+///    Handle for the cache directory.
+/// @param [in] item
+///    The buffer to save.
+static void save_file(tek_sc_os_handle dir_handle, const save_item &item) {
+  os_handle handle{ts3_os_file_create_at(dir_handle, item.tmp_name.data())};
+  if (!handle) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot save pre-compressed manifest; failed to open file");
+    return;
+  }
+  auto hdr{item.hdr};
+  hdr.crc = buf_crc(*item.data);
+  if (!ts3_os_file_write(handle.value, &hdr, sizeof hdr) ||
+      !ts3_os_file_write(handle.value, item.data->buf.get(),
+                         item.data->size)) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot save pre-compressed manifest; failed to write file");
+    return;
+  }
+  handle.close();
+  if (!ts3_os_file_rename_at(dir_handle, item.tmp_name.data(),
+                             item.name.data())) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot save pre-compressed manifest; failed to rename file");
+  }
+}
+
+/// Write all buffers of a batch and mark it done.
+///
+/// @param [in, out] batch
+///    The batch to write.
+static void save_batch_files(save_batch &batch) noexcept {
+  if (os_handle dir_handle{ts3_os_dir_create(batch.dir_path.data())};
+      dir_handle) {
+    for (const auto &item : batch.items) {
+      save_file(dir_handle.value, item);
+    }
+  } else {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot save pre-compressed manifest; failed to open cache "
+                 "directory");
+  }
+  batch.done.store(true, std::memory_order::release);
+}
+
+/// Collect pre-compressed buffers that have been built since the last save.
+///    Must be called with @ref ts3_state::manifest_mtx locked.
+///
+/// @return Batch with the buffers, or `nullptr` if there are none.
+/// @throws std::bad_alloc if allocation fails.
+static std::shared_ptr<save_batch> collect_pending() {
+  if (cache.dir_path.empty()) {
+    return nullptr;
+  }
+  std::vector<save_item> items;
+  for (auto &slot : cache.slots) {
+    const auto &buf{state.*slot.buf};
+    if (!buf.buf) {
+      continue;
+    }
+    if (slot.hash != buf.hash) {
+      slot.hash = buf.hash;
+      slot.saved = {};
+    }
+    for (std::size_t i{}; i < precomp_encs.size(); ++i) {
+      if (slot.saved[i]) {
+        continue;
+      }
+      const auto enc{precomp_encs[i]};
+      const auto &ent{buf.get(enc)};
+      if (!ent.data) {
+        // Not built or already evicted, it will be saved if it's built again
+        continue;
+      }
+      if (ent.restored) {
+        slot.saved[i] = true;
+        continue;
+      }
+      // Failures are not retried until the next snapshot, as they are
+      //    unlikely to go away by themselves
+      slot.saved[i] = true;
+      auto name{
+          std::basic_string<tek_sc_os_char>{slot.name}.append(enc_ext(enc))};
+      auto tmp_name{name + TEK_SC_OS_STR(".tmp")};
+      items.emplace_back(
+          std::move(name), std::move(tmp_name),
+          cache_file_hdr{.magic = cache_file_magic,
+                         .version = cache_file_version,
+                         .crc = 0,
+                         .level = ent.level,
+                         .hash = buf.hash,
+                         .size = buf.buf->size,
+                         .data_size = ent.data->size},
+          ent.data);
+    }
+  }
+  if (items.empty()) {
+    return nullptr;
+  }
+  auto batch{std::make_shared<save_batch>()};
+  batch->dir_path = cache.dir_path;
+  batch->items = std::move(items);
+  return batch;
+}
+
+/// libwebsockets scheduled callback that submits pending pre-compressed
+///    buffers for saving on the worker thread.
+///
+/// @param [in, out] sul
+///    Pointer to @ref enc_cache::sul.
+[[using gnu: nonnull(1), access(read_write, 1)]]
+static void save_job(lws_sorted_usec_list_t *_Nonnull sul) {
+  // If the previous batch is still being written, the buffers are collected
+  //    on the next run
+  if (!cache.batch || cache.batch->done.load(std::memory_order::acquire)) {
+    try {
+      const std::scoped_lock lock{state.manifest_mtx};
+      if (auto batch{collect_pending()}; batch) {
+        worker_submit([batch] noexcept { save_batch_files(*batch); });
+        cache.batch = std::move(batch);
+      }
+    } catch (const std::bad_alloc &) {
+      // Buffers marked saved are only missing from the cache until the next
+      //    snapshot
+    }
+  }
+  sul->us = lws_now_usecs() + save_interval;
+  lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED, sul);
+}
+
+} // namespace
+
+//===-- Internal functions ------------------------------------------------===//
+
+void enc_cache_restore(cached_buf id, http_buf &buf) {
+  if (cache.dir_path.empty() || !buf.buf) {
+    return;
+  }
+  auto path{cache.dir_path};
+  path.append(TEK_SC_OS_STR("" TS3_OS_PATH_SEP_CHAR_STR))
+      .append(cache.slots[static_cast<int>(id)].name);
+  const auto name_end{path.length()};
+  for (const auto enc : precomp_encs) {
+    path.resize(name_end);
+    path.append(enc_ext(enc));
+    auto job{std::make_unique<enc_job>(enc_job{.src = buf.buf,
+                                               .hash = buf.hash,
+                                               .binary = buf.binary,
+                                               .enc = enc,
+                                               .level = comp_tune_level(enc),
+                                               .data{},
+                                               .elapsed = 0,
+                                               .dict{},
+                                               .restored = true})};
+    worker_submit([job = std::move(job), path] mutable noexcept {
+      try {
+        job->data = load_file(path.data(), *job);
+      } catch (const std::bad_alloc &) {
+        // The encoding is compressed as usual then
+      }
+      job->data.seal();
+      try {
+        post_event({.type = event_type::enc_built, .job = std::move(job)});
+      } catch (const std::bad_alloc &) {
+        // The encoding stays pending and is never served, which is as good
+        //    as a failure
+      }
+    });
+    buf.get(enc).pending = true;
+  }
+}
+
+void enc_cache_start() {
+  std::unique_ptr<tek_sc_os_char[], decltype(&std::free)> state_dir{
+      ts3_os_get_state_dir(), std::free};
+  if (!state_dir) {
+    std::println(std::cerr, "Cannot persist pre-compressed manifests: state "
+                            "directory not found");
+    return;
+  }
+  os_handle state_dir_handle{ts3_os_dir_create(state_dir.get())};
+  if (!state_dir_handle) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot persist pre-compressed manifests; failed to open "
+                 "state directory");
+    return;
+  }
+  os_handle ts3_dir_handle{
+      ts3_os_dir_create_at(state_dir_handle.value, TEK_SC_OS_STR("tek-s3"))};
+  if (!ts3_dir_handle) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot persist pre-compressed manifests; failed to open "
+                 "tek-s3 subdirectory");
+    return;
+  }
+  state_dir_handle.close();
+  if (!os_handle{ts3_os_dir_create_at(ts3_dir_handle.value,
+                                      TEK_SC_OS_STR("enc_cache"))}) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot persist pre-compressed manifests; failed to open "
+                 "cache directory");
+    return;
+  }
+  cache.dir_path = state_dir.get();
+  cache.dir_path.append(TEK_SC_OS_STR("" TS3_OS_PATH_SEP_CHAR_STR
+                                      "tek-s3" TS3_OS_PATH_SEP_CHAR_STR
+                                      "enc_cache"));
+  cache.sul.cb = save_job;
+  cache.sul.us = lws_now_usecs() + save_interval;
+  lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED, &cache.sul);
+}
+
+void enc_cache_stop() {
+  if (cache.dir_path.empty()) {
+    return;
+  }
+  lws_sul_cancel(&cache.sul);
+  // The worker thread has been stopped, so a batch that it hasn't finished is
+  //    written here, followed by buffers built since
+  if (cache.batch && !cache.batch->done.load(std::memory_order::acquire)) {
+    save_batch_files(*cache.batch);
+  }
+  cache.batch.reset();
+  try {
+    const std::scoped_lock lock{state.manifest_mtx};
+    if (const auto batch{collect_pending()}; batch) {
+      save_batch_files(*batch);
+    }
+  } catch (const std::bad_alloc &) {
+    // Nothing to do about it at this point
+  }
+}
+
+} // namespace tek::s3
@@ -0,0 +1,66 @@
+//===-- enc_cache.hpp - Pre-compressed manifest cache declarations --------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Declarations of functions for persisting pre-compressed manifest buffers
+///    in the state directory. Compressing manifests at maximum levels is the
+///    most expensive part of startup, and the manifest loaded from the state
+///    file is usually the same as the one that was served before restart, so
+///    its compressed versions are saved to disk and loaded back when the
+///    content hash matches.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include "null_attrs.h" // IWYU pragma: keep
+#include "state.hpp"
+
+namespace tek::s3 {
+
+/// Manifest buffers whose pre-compressed versions are persisted.
+enum class cached_buf {
+  /// @ref ts3_state::manifest.
+  manifest,
+  /// @ref ts3_state::manifest_bin.
+  manifest_bin,
+  /// @ref ts3_state::manifest_bin_v2.
+  manifest_bin_v2
+};
+
+/// Start loading pre-compressed versions of a manifest buffer saved by a
+///    previous run on the worker thread. Files that have been made from the
+///    same content at currently selected compression levels are installed by
+///    @ref complete_enc_job, and the rest are compressed as usual. Must be
+///    called before @ref http_buf::prebuild, so restored encodings aren't
+///    compressed again.
+///
+/// @param id
+///    Identifier of the buffer.
+/// @param [in, out] buf
+///    New snapshot of the buffer to load pre-compressed versions into.
+/// @throws std::bad_alloc if allocation fails.
+[[gnu::visibility("internal")]]
+void enc_cache_restore(cached_buf id, http_buf &buf);
+
+/// Create the cache directory and schedule periodic saving of pre-compressed
+///    buffers that have been built since the last save, which are written on
+///    the worker thread. Must be called after the libwebsockets context has
+///    been created.
+[[gnu::visibility("internal")]]
+void enc_cache_start();
+
+/// Cancel scheduled saving, and save pending pre-compressed buffers right
+///    away, including the ones that the worker thread hasn't written yet.
+///    Must be called from the libwebsockets service thread after stopping the
+///    worker thread and before destroying the context.
+[[gnu::visibility("internal")]]
+void enc_cache_stop();
+
+} // namespace tek::s3
@@ -0,0 +1,162 @@
+//===-- flat_map.hpp - Sorted vector associative container ----------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Declaration and implementation of @ref tek::s3::flat_map.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace tek::s3 {
+
+/// Associative container storing its elements in a vector sorted by key.
+///    Lookups are binary searches over contiguous memory and iteration is a
+///    linear scan, which is much more cache-friendly than `std::map`'s node
+///    chasing. Insertion and erasure are linear in container size, except for
+///    appending elements in ascending key order, which is amortized constant.
+///    Unlike `std::map`, all iterators and references are invalidated by
+///    insertion and erasure.
+///
+/// @tparam Key
+///    Type of element keys, must be ordered with `<`.
+/// @tparam T
+///    Type of mapped values.
+template <typename Key, typename T> class flat_map {
+public:
+  using key_type = Key;
+  using mapped_type = T;
+  using value_type = std::pair<Key, T>;
+  using container_type = std::vector<value_type>;
+  using size_type = typename container_type::size_type;
+  using iterator = typename container_type::iterator;
+  using const_iterator = typename container_type::const_iterator;
+
+private:
+  /// Elements sorted by key.
+  container_type elems;
+
+public:
+  constexpr iterator begin() noexcept { return elems.begin(); }
+  constexpr const_iterator begin() const noexcept { return elems.begin(); }
+  constexpr const_iterator cbegin() const noexcept { return elems.cbegin(); }
+  constexpr iterator end() noexcept { return elems.end(); }
+  constexpr const_iterator end() const noexcept { return elems.end(); }
+  constexpr const_iterator cend() const noexcept { return elems.cend(); }
+  constexpr bool empty() const noexcept { return elems.empty(); }
+  constexpr size_type size() const noexcept { return elems.size(); }
+  constexpr void clear() noexcept { elems.clear(); }
+  constexpr void reserve(size_type capacity) { elems.reserve(capacity); }
+
+  /// Find the first element whose key is not less than specified one.
+  ///
+  /// @param [in] key
+  ///    Key to search for.
+  /// @return Iterator pointing to the found element, or `end()`.
+  constexpr iterator lower_bound(const Key &key) noexcept {
+    return std::ranges::lower_bound(elems, key, {}, &value_type::first);
+  }
+  /// @copydoc lower_bound(const Key &)
+  constexpr const_iterator lower_bound(const Key &key) const noexcept {
+    return std::ranges::lower_bound(elems, key, {}, &value_type::first);
+  }
+  /// Find the element with specified key.
+  ///
+  /// @param [in] key
+  ///    Key to search for.
+  /// @return Iterator pointing to the found element, or `end()`.
+  constexpr iterator find(const Key &key) noexcept {
+    const auto it{lower_bound(key)};
+    return (it == elems.end() || key < it->first) ? elems.end() : it;
+  }
+  /// @copydoc find(const Key &)
+  constexpr const_iterator find(const Key &key) const noexcept {
+    const auto it{lower_bound(key)};
+    return (it == elems.end() || key < it->first) ? elems.end() : it;
+  }
+  /// Check whether there is an element with specified key.
+  ///
+  /// @param [in] key
+  ///    Key to search for.
+  /// @return Value indicating whether the element exists.
+  constexpr bool contains(const Key &key) const noexcept {
+    return find(key) != elems.end();
+  }
+
+  /// Insert an element with specified key and value constructed from
+  ///    specified arguments, unless there already is one with that key.
+  ///
+  /// @param [in] key
+  ///    Key of the element to insert.
+  /// @param [in] args
+  ///    Arguments to construct the value with.
+  /// @return Iterator pointing to the element with @p key, and value
+  ///    indicating whether it has been inserted.
+  template <typename... Args>
+  constexpr std::pair<iterator, bool> try_emplace(const Key &key,
+                                                  Args &&...args) {
+    auto it{elems.end()};
+    if (!elems.empty() && !(elems.back().first < key)) {
+      it = lower_bound(key);
+      if (!(key < it->first)) {
+        return {it, false};
+      }
+    }
+    it = elems.emplace(it, std::piecewise_construct, std::forward_as_tuple(key),
+                       std::forward_as_tuple(std::forward<Args>(args)...));
+    return {it, true};
+  }
+  /// Get the value of the element with specified key, inserting a
+  ///    value-initialized one if it doesn't exist.
+  ///
+  /// @param [in] key
+  ///    Key of the element.
+  /// @return Reference to the element's value.
+  constexpr T &operator[](const Key &key) {
+    return try_emplace(key).first->second;
+  }
+
+  /// Erase the element pointed to by specified iterator.
+  ///
+  /// @param pos
+  ///    Iterator pointing to the element to erase.
+  /// @return Iterator pointing to the element following the erased one.
+  constexpr iterator erase(const_iterator pos) { return elems.erase(pos); }
+  /// Erase the element with specified key if it exists.
+  ///
+  /// @param [in] key
+  ///    Key of the element to erase.
+  /// @return Number of erased elements.
+  constexpr size_type erase(const Key &key) {
+    const auto it{find(key)};
+    if (it == elems.end()) {
+      return 0;
+    }
+    elems.erase(it);
+    return 1;
+  }
+  /// Erase all elements satisfying specified predicate, in a single pass.
+  ///
+  /// @param [in, out] map
+  ///    Container to erase elements from.
+  /// @param pred
+  ///    Predicate taking a reference to `value_type`.
+  /// @return Number of erased elements.
+  template <typename Pred>
+  friend constexpr size_type erase_if(flat_map &map, Pred pred) {
+    return std::erase_if(map.elems, std::move(pred));
+  }
+};
+
+} // namespace tek::s3
@@ -14,28 +14,32 @@
 //===----------------------------------------------------------------------===//
 #include "state.hpp"
 
+#include "comp_tune.hpp"
 #include "config.h" // IWYU pragma: keep
+#include "enc_cache.hpp"
 #include "os.h"
+#include "peer.hpp"
 #include "utils.h"
 
 #include <algorithm>
 #include <array>
+#include <bit>
 #include <charconv>
 #include <chrono>
+#include <concepts>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <deque>
 #include <iostream>
 #include <memory>
 #include <print>
 #include <ranges>
-#include <rapidjson/stringbuffer.h>
-#include <rapidjson/writer.h>
-#include <span>
+#include <string>
 #include <string_view>
-#include <system_error>
 #include <tek-steamclient/os.h>
 #include <utility>
+#include <vector>
 #ifdef TEK_S3B_ZNG
 #include <zlib-ng.h>
 #else // def TEK_S3B_ZNG
@@ -85,6 +89,94 @@ struct bmanifest_depot_key {
   tek_sc_aes256_key key;
 };
 
+//===-- Binary manifest v2 types ------------------------------------------===//
+//
+// Version 2 of binary manifest is designed to be memory-mapped and queried in
+//    place. All fields are little-endian regardless of the host byte order
+//    (they are converted with @ref to_le on big-endian hosts), naturally
+//    aligned, and every section starts at an 8-byte aligned offset:
+//    bmanifest2_hdr
+//    bmanifest2_section[num_sections]
+//    *sections, in any order*
+// Clients must locate sections via the directory and ignore the ones of
+//    unknown types, so new sections may be added without changing the
+//    version. Application and depot key tables are sorted by ID, so entries
+//    can be found via binary search.
+
+/// Magic number identifying binary manifest v2 ("TS3M" in file order).
+constexpr std::uint32_t bmanifest2_magic{0x4D335354};
+
+/// Types of binary manifest v2 sections.
+enum class bmanifest2_section_type : std::uint32_t {
+  /// Array of @ref bmanifest2_app, sorted by ID.
+  apps = 1,
+  /// Array of `std::uint32_t` depot IDs, grouped by application and sorted
+  ///    within each group.
+  depots,
+  /// Array of @ref bmanifest2_depot_key, sorted by ID.
+  depot_keys,
+  /// UTF-8 application names, each followed by a null terminator.
+  names
+};
+
+/// Binary manifest v2 header.
+struct bmanifest2_hdr {
+  /// Magic number, @ref bmanifest2_magic.
+  std::uint32_t magic;
+  /// Format version, `2`.
+  std::uint32_t version;
+  /// CRC32 checksum for the remainder of serialized data (excluding this and
+  ///    preceding fields).
+  std::uint32_t crc;
+  /// Number of entries in the section directory that follows the header.
+  std::uint32_t num_sections;
+};
+
+/// Binary manifest v2 section directory entry.
+struct bmanifest2_section {
+  /// Type of the section.
+  bmanifest2_section_type type;
+  /// Number of entries in the section, or its size in bytes for
+  ///    @ref bmanifest2_section_type::names.
+  std::uint32_t count;
+  /// Offset of the section from the beginning of the manifest, in bytes.
+  std::uint64_t offset;
+};
+
+/// Binary manifest v2 application entry.
+struct bmanifest2_app {
+  /// PICS access token for the application.
+  std::uint64_t pics_access_token;
+  /// ID of the application.
+  std::uint32_t id;
+  /// Offset of the application's name in the names section, in bytes.
+  std::uint32_t name_offset;
+  /// Length of the application's name, in bytes, excluding the null
+  ///    terminator.
+  std::uint32_t name_len;
+  /// Index of the application's first depot ID in the depots section.
+  std::uint32_t depots_index;
+  /// Number of depot IDs assigned to the application.
+  std::uint32_t num_depots;
+  /// Reserved for future use, always `0`.
+  std::uint32_t reserved;
+};
+
+/// Binary manifest v2 depot decryption key entry.
+struct bmanifest2_depot_key {
+  /// ID of the depot.
+  std::uint32_t id;
+  /// Reserved for future use, always `0`.
+  std::uint32_t reserved;
+  /// Decryption key for the depot.
+  tek_sc_aes256_key key;
+};
+
+static_assert(sizeof(bmanifest2_hdr) % 8 == 0 &&
+              sizeof(bmanifest2_section) % 8 == 0 &&
+              sizeof(bmanifest2_app) % 8 == 0 &&
+              sizeof(bmanifest2_depot_key) % 8 == 0);
+
 //===-- Private functions -------------------------------------------------===//
 
 #ifdef TEK_S3B_ZNG
@@ -106,218 +198,781 @@ static inline void print_os_err(tek_sc_os_errc errc,
   std::free(err_msg);
 }
 
-} // namespace
+/// Convert an integer from host byte order to little-endian, as used by binary
+///    manifest v2.
+///
+/// @param value
+///    The value to convert.
+/// @return @p value in little-endian byte order.
+template <std::integral T> static constexpr T to_le(T value) noexcept {
+  if constexpr (std::endian::native == std::endian::big) {
+    return std::byteswap(value);
+  } else {
+    return value;
+  }
+}
 
-void update_manifest() {
-  rapidjson::StringBuffer buf;
-  if (state.manifest_dirty || !state.manifest.buf.size) {
-    if (state.manifest_dirty) {
-      state.state_dirty = true;
-      state.manifest_dirty = false;
-      state.timestamp = std::chrono::system_clock::to_time_t(
-          std::chrono::system_clock::now());
-    }
-    // Serialize JSON manifest
-    rapidjson::Writer writer{buf};
-    writer.StartObject();
-    std::string_view str{"apps"};
-    writer.Key(str.data(), str.length());
-    writer.StartObject();
-    for (const auto &[app_id, app] : state.apps) {
-      std::array<char, 10> id_buf;
-      const auto res{std::to_chars(id_buf.begin(), id_buf.end(), app_id)};
-      if (res.ec != std::errc{}) {
-        continue;
-      }
-      str = {id_buf.data(), res.ptr};
-      writer.Key(str.data(), str.length());
-      writer.StartObject();
-      str = "name";
-      writer.Key(str.data(), str.length());
-      writer.String(app.name.data(), app.name.length());
-      if (app.pics_access_token) {
-        str = "pics_at";
-        writer.Key(str.data(), str.length());
-        writer.Uint64(app.pics_access_token);
-      }
-      str = "depots";
-      writer.Key(str.data(), str.length());
-      writer.StartArray();
-      for (auto depot_id : app.depots | std::views::keys) {
-        writer.Uint(depot_id);
+/// @copydoc to_le(T)
+static constexpr bmanifest2_section_type
+to_le(bmanifest2_section_type value) noexcept {
+  return static_cast<bmanifest2_section_type>(to_le(std::to_underlying(value)));
+}
+
+/// Round a size up to the alignment of binary manifest v2 sections.
+///
+/// @param size
+///    The size to round up, in bytes.
+/// @return @p size rounded up to a multiple of 8.
+static constexpr std::size_t bmanifest2_align(std::size_t size) noexcept {
+  return (size + 7) & ~static_cast<std::size_t>(7);
+}
+
+/// Get number of decimal digits in a number.
+///
+/// @param value
+///    The number.
+/// @return Number of characters that `std::to_chars` produces for @p value.
+static constexpr std::size_t num_digits(std::uint64_t value) noexcept {
+  std::size_t digits{1};
+  for (; value >= 10; value /= 10) {
+    ++digits;
+  }
+  return digits;
+}
+
+/// Get the character that follows the backslash in escape sequence for a
+///    byte in a JSON string. The same characters are escaped as by rapidjson.
+///
+/// @param c
+///    The byte to check.
+/// @return The escape character, `u` for bytes that are written as `\u00XX`,
+///    or `0` if the byte is written as is.
+static constexpr char json_escape(unsigned char c) noexcept {
+  switch (c) {
+  case '\b':
+    return 'b';
+  case '\t':
+    return 't';
+  case '\n':
+    return 'n';
+  case '\f':
+    return 'f';
+  case '\r':
+    return 'r';
+  case '"':
+  case '\\':
+    return static_cast<char>(c);
+  default:
+    return c < 0x20 ? 'u' : '\0';
+  }
+}
+
+/// Base64-encode all known depot decryption keys at once.
+///
+/// @return Buffer with 44 characters per each @ref ts3_state::depot_keys
+///    entry, in the same order.
+/// @throws std::bad_alloc if allocation fails.
+static std::unique_ptr<char[]> encode_depot_keys() {
+  const auto &keys{state.depot_keys};
+  auto b64_keys{std::make_unique_for_overwrite<char[]>(44 * keys.size())};
+  if (!keys.empty()) {
+    ts3_u_base64_encode_keys(keys.begin()->second.data(), sizeof *keys.begin(),
+                             keys.size(), b64_keys.get());
+  }
+  return b64_keys;
+}
+
+#ifdef TEK_S3B_ZSTD
+/// Move raw data of the current generation of a manifest into the list of
+///    retained dictionaries, and drop the oldest one if the limit is exceeded.
+///
+/// @param [in, out] buf
+///    Manifest buffer that is about to be replaced.
+/// @param [in, out] dicts
+///    List of retained previous generations of the manifest.
+static void retain_dict(http_buf &buf, std::deque<manifest_dict> &dicts) {
+  if (!buf.buf) {
+    return;
+  }
+  std::erase_if(dicts, [&buf](const auto &dict) noexcept {
+    return dict.hash == buf.hash;
+  });
+  dicts.emplace_front(buf.hash, std::move(buf.buf));
+  if (dicts.size() > max_manifest_dicts) {
+    dicts.pop_back();
+  }
+}
+#endif // def TEK_S3B_ZSTD
+
+//===-- Serialization -----------------------------------------------------===//
+//
+// All outputs are produced by the same two traversals of the state: the first
+//    one only measures the exact size of each output, and the second one
+//    writes them into buffers of that size. Every output format implements
+//    the same set of member function templates, which take the `Measure`
+//    template argument selecting the traversal, so both of them are
+//    specialized at compile time for each combination of formats. JSON
+//    formats describe their layout once in a schema that is driven by either
+//    @ref json_size or @ref json_cursor.
+
+/// JSON output that counts its size instead of writing anything.
+struct json_size {
+  /// Number of bytes output so far.
+  std::size_t size;
+
+  void raw(char) noexcept { ++size; }
+  void raw(std::string_view str) noexcept { size += str.length(); }
+  void uint(std::uint64_t value) noexcept { size += num_digits(value); }
+  void string(std::string_view str) noexcept {
+    size += str.length() + 2;
+    for (const auto c : str) {
+      switch (json_escape(c)) {
+      case '\0':
+        break;
+      case 'u':
+        size += 5;
+        break;
+      default:
+        ++size;
       }
-      writer.EndArray();
-      writer.EndObject();
     }
-    writer.EndObject();
-    str = "depot_keys";
-    writer.Key(str.data(), str.length());
-    writer.StartObject();
-    for (const auto &[depot_id, key] : state.depot_keys) {
-      std::array<char, 10> id_buf;
-      const auto res = std::to_chars(id_buf.begin(), id_buf.end(), depot_id);
-      if (res.ec != std::errc{}) {
-        continue;
+  }
+};
+
+/// JSON output into a buffer that is large enough to hold it.
+struct json_cursor {
+  /// Pointer to the position in the buffer to write next byte at.
+  char *_Nullable cur;
+
+  void raw(char c) noexcept { *cur++ = c; }
+  void raw(std::string_view str) noexcept {
+    cur = std::ranges::copy(str, cur).out;
+  }
+  void uint(std::uint64_t value) noexcept {
+    cur = std::to_chars(cur, cur + 20, value).ptr;
+  }
+  void string(std::string_view str) noexcept {
+    static constexpr std::string_view hex_digits{"0123456789ABCDEF"};
+    *cur++ = '"';
+    for (const auto c : str) {
+      switch (const auto esc{json_escape(c)}) {
+      case '\0':
+        *cur++ = c;
+        break;
+      case 'u':
+        cur = std::ranges::copy(std::string_view{"\\u00"}, cur).out;
+        *cur++ = hex_digits[static_cast<unsigned char>(c) >> 4];
+        *cur++ = hex_digits[c & 0xF];
+        break;
+      default:
+        *cur++ = '\\';
+        *cur++ = esc;
       }
-      str = {id_buf.data(), res.ptr};
-      writer.Key(str.data(), str.length());
-      std::array<char, 44> b64_key;
-      ts3_u_base64_encode(key, sizeof key, b64_key.data());
-      writer.String(b64_key.data(), b64_key.size());
     }
-    writer.EndObject();
-    writer.EndObject();
-    // Copy serialized JSON into a buffer
-    sized_buf json_buf{
-        .buf = std::make_unique_for_overwrite<unsigned char[]>(buf.GetSize()),
-        .size = buf.GetSize()};
-    std::ranges::copy_n(buf.GetString(), json_buf.size, json_buf.buf.get());
-    state.manifest = {std::move(json_buf), false};
-    buf.Clear();
-    // Serialize binary manifest
-    for (auto &a : state.apps) {
-      a.second.depots.size();
+    *cur++ = '"';
+  }
+};
+
+/// Write depot IDs of an application as JSON array elements.
+///
+/// @param [in, out] out
+///    Output to write to.
+/// @param [in] app
+///    The application.
+template <typename Out>
+static void json_depots(Out &out, const struct app &app) noexcept {
+  for (bool first{true}; const auto depot_id : app.depots | std::views::keys) {
+    if (!first) {
+      out.raw(',');
     }
-    std::size_t num_depots = 0;
-    std::size_t names_len = 0;
-    for (const auto &app : state.apps | std::views::values) {
-      num_depots += app.depots.size();
-      names_len += app.name.length();
+    first = false;
+    out.uint(depot_id);
+  }
+}
+
+/// Write a depot decryption key as JSON object member.
+///
+/// @param [in, out] out
+///    Output to write to.
+/// @param id
+///    ID of the depot.
+/// @param [in] b64_key
+///    Base64-encoded key, 44 characters.
+/// @param first
+///    Value indicating whether this is the first member of the object.
+template <typename Out>
+static void json_depot_key(Out &out, std::uint32_t id,
+                           const char *_Nonnull b64_key, bool first) noexcept {
+  if (!first) {
+    out.raw(',');
+  }
+  out.raw('"');
+  out.uint(id);
+  out.raw(R"(":")");
+  out.raw(std::string_view{b64_key, 44});
+  out.raw('"');
+}
+
+/// Schema of the JSON manifest.
+struct manifest_schema {
+  template <typename Out> void begin(Out &out) const noexcept {
+    out.raw(R"({"apps":{)");
+  }
+  template <typename Out>
+  void add_app(Out &out, std::uint32_t id, const struct app &app,
+               bool first) const noexcept {
+    if (!first) {
+      out.raw(',');
     }
-    const auto bmanifest_size{
-        sizeof(bmanifest_hdr) + sizeof(bmanifest_app) * state.apps.size() +
-        sizeof(std::uint32_t) * num_depots +
-        sizeof(bmanifest_depot_key) * state.depot_keys.size() + names_len};
-    auto bmanifest{
-        std::make_unique_for_overwrite<unsigned char[]>(bmanifest_size)};
-    auto &hdr{*reinterpret_cast<bmanifest_hdr *>(bmanifest.get())};
-    hdr.num_apps = state.apps.size();
-    hdr.num_depots = num_depots;
-    hdr.num_depot_keys = state.depot_keys.size();
-    std::span<bmanifest_app> bapps{reinterpret_cast<bmanifest_app *>(&hdr + 1),
-                                   state.apps.size()};
-    std::span<std::uint32_t> depots{
-        reinterpret_cast<std::uint32_t *>(std::to_address(bapps.end())),
-        num_depots};
-    std::span<bmanifest_depot_key> bdepot_keys{
-        reinterpret_cast<bmanifest_depot_key *>(std::to_address(depots.end())),
-        state.depot_keys.size()};
-    auto names{reinterpret_cast<char *>(std::to_address(bdepot_keys.end()))};
-    auto depot_it{depots.begin()};
-    for (auto &&[bapp, app] :
-         std::views::zip(bapps, state.apps | std::views::values)) {
-      bapp = {.pics_access_token = app.pics_access_token,
-              .name_len = static_cast<std::int32_t>(app.name.length()),
-              .num_depots = static_cast<std::int32_t>(app.depots.size())};
-      names = std::ranges::copy(app.name, names).out;
-      depot_it = std::ranges::copy(app.depots | std::views::keys, depot_it).out;
+    out.raw('"');
+    out.uint(id);
+    out.raw(R"(":{"name":)");
+    out.string(app.name);
+    if (app.pics_access_token) {
+      out.raw(R"(,"pics_at":)");
+      out.uint(app.pics_access_token);
     }
-    for (auto &&[bdk, dk] : std::views::zip(bdepot_keys, state.depot_keys)) {
-      bdk.id = dk.first;
-      std::ranges::copy(dk.second, bdk.key);
+    out.raw(R"(,"depots":[)");
+    json_depots(out, app);
+    out.raw("]}");
+  }
+  template <typename Out> void begin_keys(Out &out) const noexcept {
+    out.raw(R"(},"depot_keys":{)");
+  }
+  template <typename Out>
+  void add_depot_key(Out &out, std::uint32_t id, const char *_Nonnull b64_key,
+                     bool first) const noexcept {
+    json_depot_key(out, id, b64_key, first);
+  }
+  template <typename Out> void end(Out &out) const noexcept { out.raw("}}"); }
+};
+
+/// Schema of the state file. Everything that may change between the
+///    traversals is captured on construction.
+class state_schema {
+  /// Current time, in seconds since Epoch.
+  std::time_t now;
+  /// Pointers to authentication tokens of accounts that are not being
+  ///    removed.
+  std::vector<const std::string *> tokens;
+
+  /// Check whether cached PICS info is still fresh. Expired info would be
+  ///    requested again anyway, so it's not saved.
+  bool fresh(std::time_t timestamp) const noexcept {
+    return now - timestamp < state.pics_cache_ttl;
+  }
+
+  /// Write an array of IDs.
+  template <typename Out>
+  static void ids(Out &out, const std::vector<std::uint32_t> &ids) noexcept {
+    out.raw('[');
+    for (bool first{true}; const auto id : ids) {
+      if (!first) {
+        out.raw(',');
+      }
+      first = false;
+      out.uint(id);
     }
-    hdr.crc = crc32(crc32(0, nullptr, 0), &bmanifest[sizeof hdr.crc],
-                    bmanifest_size - sizeof hdr.crc);
-    state.manifest_bin = {{std::move(bmanifest), bmanifest_size}, true};
-  } // if (state.manifest_dirty || !state.manifest.buf.size)
-  // Update the state file if it's marked dirty
-  if (state.state_dirty) {
-    state.state_dirty = false;
-    // Serialize the state into JSON
-    rapidjson::Writer writer{buf};
-    writer.StartObject();
-    std::string_view str{"timestamp"};
-    writer.Key(str.data(), str.length());
-    writer.Uint64(state.timestamp);
-    str = "accounts";
-    writer.Key(str.data(), str.length());
-    writer.StartArray();
+    out.raw(']');
+  }
+
+public:
+  state_schema()
+      : now{std::chrono::system_clock::to_time_t(
+            std::chrono::system_clock::now())} {
     for (const auto &acc : state.accounts | std::views::values) {
       if (acc.rem_status == remove_status::none) {
-        writer.String(acc.token.data(), acc.token.length());
+        tokens.emplace_back(&acc.token);
       }
     }
-    writer.EndArray();
-    str = "apps";
-    writer.Key(str.data(), str.length());
-    writer.StartObject();
-    for (const auto &[app_id, app] : state.apps) {
-      std::array<char, 10> id_buf;
-      const auto res{std::to_chars(id_buf.begin(), id_buf.end(), app_id)};
-      if (res.ec != std::errc{}) {
-        continue;
+  }
+
+  template <typename Out> void begin(Out &out) const noexcept {
+    out.raw(R"({"timestamp":)");
+    out.uint(state.timestamp);
+    out.raw(R"(,"accounts":[)");
+    for (bool first{true}; const auto token : tokens) {
+      if (!first) {
+        out.raw(',');
       }
-      str = {id_buf.data(), res.ptr};
-      writer.Key(str.data(), str.length());
-      writer.StartObject();
-      if (app.pics_access_token) {
-        str = "pics_at";
-        writer.Key(str.data(), str.length());
-        writer.Uint64(app.pics_access_token);
+      first = false;
+      out.string(*token);
+    }
+    out.raw(R"(],"apps":{)");
+  }
+  template <typename Out>
+  void add_app(Out &out, std::uint32_t id, const struct app &app,
+               bool first) const noexcept {
+    if (!first) {
+      out.raw(',');
+    }
+    out.raw('"');
+    out.uint(id);
+    out.raw(R"(":{)");
+    if (app.pics_access_token) {
+      out.raw(R"("pics_at":)");
+      out.uint(app.pics_access_token);
+      out.raw(',');
+    }
+    out.raw(R"("depots":[)");
+    json_depots(out, app);
+    out.raw("]}");
+  }
+  template <typename Out> void begin_keys(Out &out) const noexcept {
+    out.raw(R"(},"depot_keys":{)");
+  }
+  template <typename Out>
+  void add_depot_key(Out &out, std::uint32_t id, const char *_Nonnull b64_key,
+                     bool first) const noexcept {
+    json_depot_key(out, id, b64_key, first);
+  }
+  template <typename Out> void end(Out &out) const noexcept {
+    out.raw(R"(},"pics_packages":{)");
+    for (bool first{true};
+         const auto &[package_id, package] : state.pics_packages) {
+      if (!fresh(package.timestamp)) {
+        continue;
       }
-      str = "depots";
-      writer.Key(str.data(), str.length());
-      writer.StartArray();
-      for (auto depot_id : app.depots | std::views::keys) {
-        writer.Uint(depot_id);
+      if (!first) {
+        out.raw(',');
       }
-      writer.EndArray();
-      writer.EndObject();
+      first = false;
+      out.raw('"');
+      out.uint(package_id);
+      out.raw(R"(":{"timestamp":)");
+      out.uint(package.timestamp);
+      out.raw(R"(,"depots":)");
+      ids(out, package.depot_ids);
+      out.raw(R"(,"apps":)");
+      ids(out, package.app_ids);
+      out.raw('}');
     }
-    writer.EndObject();
-    str = "depot_keys";
-    writer.Key(str.data(), str.length());
-    writer.StartObject();
-    for (const auto &[depot_id, key] : state.depot_keys) {
-      std::array<char, 10> id_buf;
-      const auto res{std::to_chars(id_buf.begin(), id_buf.end(), depot_id)};
-      if (res.ec != std::errc{}) {
+    out.raw(R"(},"pics_apps":{)");
+    for (bool first{true}; const auto &[app_id, app] : state.pics_apps) {
+      if (!fresh(app.timestamp)) {
         continue;
       }
-      str = {id_buf.data(), res.ptr};
-      writer.Key(str.data(), str.length());
-      std::array<char, 44> b64_key;
-      ts3_u_base64_encode(key, sizeof key, b64_key.data());
-      writer.String(b64_key.data(), b64_key.size());
+      if (!first) {
+        out.raw(',');
+      }
+      first = false;
+      out.raw('"');
+      out.uint(app_id);
+      out.raw(R"(":{"timestamp":)");
+      out.uint(app.timestamp);
+      if (app.access_token) {
+        out.raw(R"(,"pics_at":)");
+        out.uint(app.access_token);
+      }
+      if (!app.name.empty()) {
+        out.raw(R"(,"name":)");
+        out.string(app.name);
+      }
+      if (app.workshop_depot) {
+        out.raw(R"(,"workshopdepot":)");
+        out.uint(app.workshop_depot);
+      }
+      out.raw(R"(,"depots":)");
+      ids(out, app.depot_ids);
+      out.raw('}');
+    }
+    out.raw("}}");
+  }
+};
+
+/// JSON output format.
+///
+/// @tparam Schema
+///    Schema describing the layout of the output.
+template <typename Schema> class json_fmt {
+  /// The schema.
+  Schema schema;
+  /// Output used by the measuring traversal.
+  json_size size_out{};
+  /// Output used by the writing traversal.
+  json_cursor buf_out{};
+  /// Buffer that the output is written to.
+  sized_buf buf;
+
+  /// Get the output for specified traversal.
+  template <bool Measure> auto &out() noexcept {
+    if constexpr (Measure) {
+      return size_out;
+    } else {
+      return buf_out;
+    }
+  }
+
+public:
+  template <bool Measure> void begin() noexcept {
+    schema.begin(out<Measure>());
+  }
+  template <bool Measure>
+  void add_app(std::uint32_t id, const struct app &app, bool first) noexcept {
+    schema.add_app(out<Measure>(), id, app, first);
+  }
+  template <bool Measure> void begin_keys() noexcept {
+    schema.begin_keys(out<Measure>());
+  }
+  template <bool Measure>
+  void add_depot_key(std::uint32_t id, const depot_key &,
+                     const char *_Nonnull b64_key, bool first) noexcept {
+    schema.add_depot_key(out<Measure>(), id, b64_key, first);
+  }
+  template <bool Measure> void end() noexcept { schema.end(out<Measure>()); }
+
+  /// Allocate the buffer for the writing traversal.
+  ///
+  /// @throws std::bad_alloc if allocation fails.
+  void alloc() {
+    buf = sized_buf::alloc(size_out.size);
+    buf_out.cur = reinterpret_cast<char *>(buf.buf.get());
+  }
+  /// Take the buffer with the complete output.
+  sized_buf release() noexcept { return std::move(buf); }
+};
+
+/// Binary manifest output format.
+class bmanifest_fmt {
+  /// Total number of applications.
+  std::size_t num_apps{};
+  /// Total number of depots assigned to applications.
+  std::size_t num_depots{};
+  /// Total number of depot decryption keys.
+  std::size_t num_depot_keys{};
+  /// Total length of application names, in bytes.
+  std::size_t names_len{};
+  /// Buffer that the manifest is written to.
+  sized_buf buf;
+  /// Pointer to the next application entry to write.
+  bmanifest_app *_Nullable app_it;
+  /// Pointer to the next depot ID to write.
+  std::uint32_t *_Nullable depot_it;
+  /// Pointer to the next depot decryption key entry to write.
+  bmanifest_depot_key *_Nullable key_it;
+  /// Pointer to the position to write next application name at.
+  char *_Nullable name_it;
+
+public:
+  template <bool Measure> void begin() const noexcept {}
+  template <bool Measure>
+  void add_app(std::uint32_t, const struct app &app, bool) noexcept {
+    if constexpr (Measure) {
+      ++num_apps;
+      num_depots += app.depots.size();
+      names_len += app.name.length();
+    } else {
+      *app_it++ = {.pics_access_token = app.pics_access_token,
+                   .name_len = static_cast<std::int32_t>(app.name.length()),
+                   .num_depots = static_cast<std::int32_t>(app.depots.size())};
+      name_it = std::ranges::copy(app.name, name_it).out;
+      depot_it =
+          std::ranges::copy(app.depots | std::views::keys, depot_it).out;
     }
-    writer.EndObject();
-    writer.EndObject();
-    // Write serialized JSON into the file
-    std::unique_ptr<tek_sc_os_char[], decltype(&std::free)> state_dir{
-        ts3_os_get_state_dir(), std::free};
-    if (!state_dir) {
-      std::println(std::cerr, "Cannot save state: state directory not found");
-      return;
+  }
+  template <bool Measure> void begin_keys() const noexcept {}
+  template <bool Measure>
+  void add_depot_key(std::uint32_t id, const depot_key &key, const char *,
+                     bool) noexcept {
+    if constexpr (Measure) {
+      ++num_depot_keys;
+    } else {
+      key_it->id = id;
+      std::ranges::copy(key, key_it->key);
+      ++key_it;
     }
-    os_handle state_dir_handle{ts3_os_dir_create(state_dir.get())};
-    if (!state_dir_handle) {
-      print_os_err(ts3_os_get_last_error(),
-                   "Cannot save state; failed to open state directory");
-      return;
+  }
+  template <bool Measure> void end() noexcept {
+    if constexpr (!Measure) {
+      auto &hdr{*reinterpret_cast<bmanifest_hdr *>(buf.buf.get())};
+      hdr.crc = crc32(crc32(0, nullptr, 0), &buf.buf[sizeof hdr.crc],
+                      buf.size - sizeof hdr.crc);
+    }
+  }
+
+  /// Allocate the buffer for the writing traversal and write the header.
+  ///
+  /// @throws std::bad_alloc if allocation fails.
+  void alloc() {
+    buf = sized_buf::alloc(
+        sizeof(bmanifest_hdr) + sizeof(bmanifest_app) * num_apps +
+        sizeof(std::uint32_t) * num_depots +
+        sizeof(bmanifest_depot_key) * num_depot_keys + names_len);
+    auto &hdr{*reinterpret_cast<bmanifest_hdr *>(buf.buf.get())};
+    hdr.num_apps = num_apps;
+    hdr.num_depots = num_depots;
+    hdr.num_depot_keys = num_depot_keys;
+    app_it = reinterpret_cast<bmanifest_app *>(&hdr + 1);
+    depot_it = reinterpret_cast<std::uint32_t *>(app_it + num_apps);
+    key_it = reinterpret_cast<bmanifest_depot_key *>(depot_it + num_depots);
+    name_it = reinterpret_cast<char *>(key_it + num_depot_keys);
+  }
+  /// Take the buffer with the complete manifest.
+  sized_buf release() noexcept { return std::move(buf); }
+};
+
+/// Binary manifest v2 output format.
+class bmanifest2_fmt {
+  /// Number of sections in the manifest.
+  static constexpr std::size_t num_sections{4};
+
+  /// Total number of applications.
+  std::size_t num_apps{};
+  /// Total number of depots assigned to applications.
+  std::size_t num_depots{};
+  /// Total number of depot decryption keys.
+  std::size_t num_depot_keys{};
+  /// Size of the names section, in bytes, excluding padding.
+  std::size_t names_size{};
+  /// Buffer that the manifest is written to.
+  sized_buf buf;
+  /// Pointer to the next application entry to write.
+  bmanifest2_app *_Nullable app_it;
+  /// Pointer to the first entry of depots section.
+  std::uint32_t *_Nullable depots;
+  /// Pointer to the next depot decryption key entry to write.
+  bmanifest2_depot_key *_Nullable key_it;
+  /// Pointer to the beginning of names section.
+  char *_Nullable names;
+  /// Offset of the next application name in names section.
+  std::uint32_t name_offset;
+  /// Index of the next depot ID in depots section.
+  std::uint32_t depots_index;
+
+public:
+  template <bool Measure> void begin() const noexcept {}
+  template <bool Measure>
+  void add_app(std::uint32_t id, const struct app &app, bool) noexcept {
+    if constexpr (Measure) {
+      ++num_apps;
+      num_depots += app.depots.size();
+      names_size += app.name.length() + 1;
+    } else {
+      const auto name_len{static_cast<std::uint32_t>(app.name.length())};
+      const auto num_app_depots{static_cast<std::uint32_t>(app.depots.size())};
+      *app_it++ = {.pics_access_token = to_le(app.pics_access_token),
+                   .id = to_le(id),
+                   .name_offset = to_le(name_offset),
+                   .name_len = to_le(name_len),
+                   .depots_index = to_le(depots_index),
+                   .num_depots = to_le(num_app_depots),
+                   .reserved = 0};
+      // The null terminator is already there
+      std::ranges::copy(app.name, &names[name_offset]);
+      std::ranges::transform(
+          app.depots | std::views::keys, &depots[depots_index],
+          [](std::uint32_t depot_id) { return to_le(depot_id); });
+      name_offset += name_len + 1;
+      depots_index += num_app_depots;
     }
-    state_dir.reset();
-    os_handle ts3_dir_handle{
-        ts3_os_dir_create_at(state_dir_handle.value, TEK_SC_OS_STR("tek-s3"))};
-    if (!ts3_dir_handle) {
-      print_os_err(ts3_os_get_last_error(),
-                   "Cannot save state; failed to open tek-s3 subdirectory");
-      return;
+  }
+  template <bool Measure> void begin_keys() const noexcept {}
+  template <bool Measure>
+  void add_depot_key(std::uint32_t id, const depot_key &key, const char *,
+                     bool) noexcept {
+    if constexpr (Measure) {
+      ++num_depot_keys;
+    } else {
+      key_it->id = to_le(id);
+      std::ranges::copy(key, key_it->key);
+      ++key_it;
+    }
+  }
+  template <bool Measure> void end() noexcept {
+    if constexpr (!Measure) {
+      auto &hdr{*reinterpret_cast<bmanifest2_hdr *>(buf.buf.get())};
+      constexpr auto crc_end{offsetof(bmanifest2_hdr, crc) + sizeof hdr.crc};
+      hdr.crc = to_le(static_cast<std::uint32_t>(crc32(
+          crc32(0, nullptr, 0), &buf.buf[crc_end], buf.size - crc_end)));
+    }
+  }
+
+  /// Allocate the buffer for the writing traversal and write the header and
+  ///    section directory.
+  ///
+  /// @throws std::bad_alloc if allocation fails.
+  void alloc() {
+    const auto apps_offset{sizeof(bmanifest2_hdr) +
+                           sizeof(bmanifest2_section) * num_sections};
+    const auto depots_offset{apps_offset + sizeof(bmanifest2_app) * num_apps};
+    const auto depot_keys_offset{
+        depots_offset + bmanifest2_align(sizeof(std::uint32_t) * num_depots)};
+    const auto names_offset{depot_keys_offset +
+                            sizeof(bmanifest2_depot_key) * num_depot_keys};
+    buf = sized_buf::alloc(names_offset + bmanifest2_align(names_size));
+    // Zero padding and reserved fields, so identical states produce identical
+    //    manifests
+    const auto base{buf.buf.get()};
+    std::ranges::fill_n(base, buf.size, 0);
+    auto &hdr{*reinterpret_cast<bmanifest2_hdr *>(base)};
+    hdr.magic = to_le(bmanifest2_magic);
+    hdr.version = to_le(std::uint32_t{2});
+    hdr.num_sections = to_le(static_cast<std::uint32_t>(num_sections));
+    const std::array<bmanifest2_section, num_sections> sections{
+        {{.type = to_le(bmanifest2_section_type::apps),
+          .count = to_le(static_cast<std::uint32_t>(num_apps)),
+          .offset = to_le(std::uint64_t{apps_offset})},
+         {.type = to_le(bmanifest2_section_type::depots),
+          .count = to_le(static_cast<std::uint32_t>(num_depots)),
+          .offset = to_le(std::uint64_t{depots_offset})},
+         {.type = to_le(bmanifest2_section_type::depot_keys),
+          .count = to_le(static_cast<std::uint32_t>(num_depot_keys)),
+          .offset = to_le(std::uint64_t{depot_keys_offset})},
+         {.type = to_le(bmanifest2_section_type::names),
+          .count = to_le(static_cast<std::uint32_t>(names_size)),
+          .offset = to_le(std::uint64_t{names_offset})}}};
+    std::ranges::copy(sections,
+                      reinterpret_cast<bmanifest2_section *>(&hdr + 1));
+    app_it = reinterpret_cast<bmanifest2_app *>(&base[apps_offset]);
+    depots = reinterpret_cast<std::uint32_t *>(&base[depots_offset]);
+    key_it = reinterpret_cast<bmanifest2_depot_key *>(&base[depot_keys_offset]);
+    names = reinterpret_cast<char *>(&base[names_offset]);
+    name_offset = 0;
+    depots_index = 0;
+  }
+  /// Take the buffer with the complete manifest.
+  sized_buf release() noexcept { return std::move(buf); }
+};
+
+/// Traverse the state, passing its applications and depot decryption keys to
+///    output formats.
+///
+/// @tparam Measure
+///    Value indicating whether this is the measuring traversal.
+/// @param [in] b64_keys
+///    Base64-encoded depot decryption keys, in the same order as
+///    @ref ts3_state::depot_keys.
+/// @param [in, out] fmts
+///    Output formats.
+template <bool Measure, typename... Fmts>
+static void traverse(const char *_Nonnull b64_keys, Fmts &...fmts) noexcept {
+  (fmts.template begin<Measure>(), ...);
+  for (bool first{true}; const auto &[app_id, app] : state.apps) {
+    (fmts.template add_app<Measure>(app_id, app, first), ...);
+    first = false;
+  }
+  (fmts.template begin_keys<Measure>(), ...);
+  for (bool first{true}; const auto &[depot_id, key] : state.depot_keys) {
+    (fmts.template add_depot_key<Measure>(depot_id, key, b64_keys, first),
+     ...);
+    b64_keys += 44;
+    first = false;
+  }
+  (fmts.template end<Measure>(), ...);
+}
+
+/// Serialize current state into specified output formats. Must be called
+///    with @ref ts3_state::manifest_mtx locked.
+///
+/// @param [in, out] fmts
+///    Output formats, their buffers are ready to be released afterwards.
+/// @throws std::bad_alloc if allocation fails.
+template <typename... Fmts> static void serialize(Fmts &...fmts) {
+  const auto b64_keys{encode_depot_keys()};
+  traverse<true>(b64_keys.get(), fmts...);
+  (fmts.alloc(), ...);
+  traverse<false>(b64_keys.get(), fmts...);
+}
+
+} // namespace
+
+void update_manifest() {
+  const bool build_manifest{state.manifest_dirty || !state.manifest.buf};
+  if (state.manifest_dirty) {
+    state.state_dirty = true;
+    state.manifest_dirty = false;
+    state.timestamp =
+        std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  }
+  // Update the state file if it's marked dirty. Replicas leave it intact, as
+  //    it may hold account tokens that they ignore
+  const bool write_state{state.state_dirty && state.replica_of.host.empty()};
+  state.state_dirty = false;
+  json_fmt<manifest_schema> manifest_json;
+  bmanifest_fmt manifest_bin;
+  bmanifest2_fmt manifest_bin_v2;
+  json_fmt<state_schema> state_json;
+  if (build_manifest && write_state) {
+    serialize(manifest_json, manifest_bin, manifest_bin_v2, state_json);
+  } else if (build_manifest) {
+    serialize(manifest_json, manifest_bin, manifest_bin_v2);
+  } else if (write_state) {
+    serialize(state_json);
+  }
+  if (build_manifest) {
+    auto json_buf{manifest_json.release()};
+    auto bin_buf{manifest_bin.release()};
+    auto bin_v2_buf{manifest_bin_v2.release()};
+    comp_tune_select(json_buf.size + bin_buf.size + bin_v2_buf.size);
+    http_buf new_manifest{std::move(json_buf), false};
+    if (!state.manifest.buf) {
+      enc_cache_restore(cached_buf::manifest, new_manifest);
     }
-    state_dir_handle.close();
-    os_handle state_file_handle{ts3_os_file_create_at(
-        ts3_dir_handle.value, TEK_SC_OS_STR("state.json"))};
-    if (!state_file_handle) {
-      print_os_err(ts3_os_get_last_error(),
-                   "Cannot save state; failed to open state file");
-      return;
+    new_manifest.prebuild(state.manifest);
+#ifdef TEK_S3B_ZSTD
+    retain_dict(state.manifest, state.manifest_dicts);
+#endif // def TEK_S3B_ZSTD
+    state.manifest = std::move(new_manifest);
+    http_buf new_manifest_bin{std::move(bin_buf), true};
+    if (!state.manifest_bin.buf) {
+      enc_cache_restore(cached_buf::manifest_bin, new_manifest_bin);
     }
-    ts3_dir_handle.close();
-    if (!ts3_os_file_write(state_file_handle.value, buf.GetString(),
-                           buf.GetSize())) {
-      print_os_err(ts3_os_get_last_error(),
-                   "Cannot save state; failed to write to the state file");
+    new_manifest_bin.prebuild(state.manifest_bin);
+#ifdef TEK_S3B_ZSTD
+    retain_dict(state.manifest_bin, state.manifest_bin_dicts);
+#endif // def TEK_S3B_ZSTD
+    state.manifest_bin = std::move(new_manifest_bin);
+    http_buf new_manifest_bin_v2{std::move(bin_v2_buf), true};
+    if (!state.manifest_bin_v2.buf) {
+      enc_cache_restore(cached_buf::manifest_bin_v2, new_manifest_bin_v2);
     }
-  } // if (state.state_dirty)
+    new_manifest_bin_v2.prebuild(state.manifest_bin_v2);
+#ifdef TEK_S3B_ZSTD
+    retain_dict(state.manifest_bin_v2, state.manifest_bin_v2_dicts);
+#endif // def TEK_S3B_ZSTD
+    state.manifest_bin_v2 = std::move(new_manifest_bin_v2);
+    peer_notify();
+  }
+  if (!write_state) {
+    return;
+  }
+  // Account tokens may have changed, which hot standbys must receive
+  peer_notify();
+  const auto state_buf{state_json.release()};
+  std::unique_ptr<tek_sc_os_char[], decltype(&std::free)> state_dir{
+      ts3_os_get_state_dir(), std::free};
+  if (!state_dir) {
+    std::println(std::cerr, "Cannot save state: state directory not found");
+    return;
+  }
+  os_handle state_dir_handle{ts3_os_dir_create(state_dir.get())};
+  if (!state_dir_handle) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot save state; failed to open state directory");
+    return;
+  }
+  state_dir.reset();
+  os_handle ts3_dir_handle{
+      ts3_os_dir_create_at(state_dir_handle.value, TEK_SC_OS_STR("tek-s3"))};
+  if (!ts3_dir_handle) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot save state; failed to open tek-s3 subdirectory");
+    return;
+  }
+  state_dir_handle.close();
+  os_handle state_file_handle{ts3_os_file_create_at(
+      ts3_dir_handle.value, TEK_SC_OS_STR("state.json"))};
+  if (!state_file_handle) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot save state; failed to open state file");
+    return;
+  }
+  ts3_dir_handle.close();
+  if (!ts3_os_file_write(state_file_handle.value, state_buf.buf.get(),
+                         state_buf.size)) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot save state; failed to write to the state file");
+  }
 }
 
 } // namespace tek::s3
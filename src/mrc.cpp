@@ -0,0 +1,679 @@
+//===-- mrc.cpp - Manifest request code scheduling implementation ---------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Implementation of manifest request code cache and CM request admission
+///    control. Requests are sent to CM only while there are free slots both
+///    globally and for the selected account, otherwise they wait in a bounded
+///    queue, and are rejected with 503 once it's full or their deadline
+///    passes. This keeps request spikes from getting accounts rate-limited by
+///    Steam, which would make all requests fail at once.
+/// The cache is mirrored into a small memory-mapped file, so a restarted
+///    instance can keep serving codes before its CM connections are back.
+///
+//===----------------------------------------------------------------------===//
+#include "mrc.hpp"
+
+#include "null_attrs.h" // IWYU pragma: keep
+#include "os.h"
+#include "replica.hpp"
+#include "shared_mrc.hpp"
+#include "state.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <libwebsockets.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <print>
+#include <string_view>
+#include <tek-steamclient/cm.h>
+#include <tek-steamclient/error.h>
+#include <tek-steamclient/os.h>
+#include <vector>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private types -----------------------------------------------------===//
+
+/// Maximum number of entries in the manifest request code cache.
+constexpr std::size_t max_cached_mrcs{128};
+
+/// Persistent manifest request code cache file entry.
+struct cache_file_entry {
+  /// ID of the manifest, `0` for free entries.
+  std::uint64_t manifest_id;
+  /// Manifest request code value.
+  std::uint64_t mrc;
+  /// Expiration time of the code, in seconds since Epoch.
+  std::int64_t expires;
+};
+
+/// Persistent manifest request code cache file layout.
+struct cache_file {
+  /// Magic value identifying the file, @ref cache_file_magic.
+  std::uint32_t magic;
+  /// File format version, @ref cache_file_version.
+  std::uint32_t version;
+  /// Number of entries in @ref entries.
+  std::uint32_t capacity;
+  /// Reserved for future use.
+  std::uint32_t reserved;
+  /// Cache entries, in no particular order.
+  std::array<cache_file_entry, max_cached_mrcs> entries;
+};
+
+/// Value of @ref cache_file::magic ("TS3M" in little-endian).
+constexpr std::uint32_t cache_file_magic{0x4D335354};
+/// Current value of @ref cache_file::version.
+constexpr std::uint32_t cache_file_version{1};
+
+/// Manifest request code request scheduler state.
+struct mrc_scheduler {
+  /// Requests waiting for a free slot, in submission order.
+  std::deque<mrc_request *> queue;
+  /// Mutex for locking concurrent access to @ref completed.
+  std::mutex completed_mtx;
+  /// Requests completed by CM clients, awaiting processing by the service
+  ///    thread.
+  std::vector<mrc_request *> completed;
+  /// Numbers of requests awaiting CM response per account, by Steam IDs.
+  std::map<std::uint64_t, int> acc_outstanding;
+  /// Scheduling element for queued request expiration.
+  lws_sorted_usec_list_t expire_sul;
+  /// Pointer to the mapped persistent cache file, or `nullptr` if it's not
+  ///    available.
+  cache_file *_Nullable file;
+  /// Number of requests awaiting CM response.
+  int outstanding;
+  /// Number of requests rejected because the queue was full.
+  std::uint64_t shed_full;
+  /// Number of requests rejected because their queue deadline has passed.
+  std::uint64_t shed_expired;
+  /// Number of requests forwarded to peer nodes.
+  std::uint64_t forwarded;
+  /// Number of codes found in the shared table after missing the local cache.
+  std::uint64_t shared_hits;
+};
+
+//===-- Private variable --------------------------------------------------===//
+
+/// The scheduler instance.
+static mrc_scheduler sched;
+
+//===-- Private functions -------------------------------------------------===//
+
+/// The callback for CM client manifest request code received event.
+///
+/// @param [in, out] data
+///    Pointer to the @ref mrc_request associated with the request.
+[[using gnu: nonnull(2), access(read_write, 2)]]
+static void cb_mrc(tek_sc_cm_client *, void *_Nonnull data, void *) {
+  {
+    const std::scoped_lock lock{sched.completed_mtx};
+    sched.completed.emplace_back(reinterpret_cast<mrc_request *>(data));
+  }
+  if (state.cur_status.load(std::memory_order::relaxed) != status::stopping) {
+    lws_cancel_service(state.lws_ctx);
+  }
+}
+
+/// Print an error message with OS error code description to stderr.
+///
+/// @param errc
+///    OS error code.
+/// @param msg
+///    Error message.
+static inline void print_os_err(tek_sc_os_errc errc,
+                                const std::string_view &&msg) {
+  const auto err_msg{ts3_os_get_err_msg(errc)};
+  std::println(std::cerr, "{}: ({}) {}", msg, errc, err_msg);
+  std::free(err_msg);
+}
+
+/// Mirror a manifest request code cache entry into the persistent cache file.
+///
+/// @param manifest_id
+///    ID of the manifest that the code is for.
+/// @param mrc
+///    Manifest request code value.
+/// @param expires
+///    Expiration time of the code, in seconds since Epoch.
+static void persist(std::uint64_t manifest_id, std::uint64_t mrc,
+                    std::int64_t expires) {
+  if (!sched.file) {
+    return;
+  }
+  const auto entry{std::ranges::find(sched.file->entries, std::uint64_t{},
+                                     &cache_file_entry::manifest_id)};
+  if (entry == sched.file->entries.end()) {
+    return;
+  }
+  // Write the ID last, so an interrupted write leaves the entry free
+  entry->mrc = mrc;
+  entry->expires = expires;
+  entry->manifest_id = manifest_id;
+}
+
+/// Remove a manifest request code entry from the persistent cache file.
+///
+/// @param manifest_id
+///    ID of the manifest that the code is for.
+static void unpersist(std::uint64_t manifest_id) {
+  if (!sched.file) {
+    return;
+  }
+  if (const auto entry{std::ranges::find(sched.file->entries, manifest_id,
+                                         &cache_file_entry::manifest_id)};
+      entry != sched.file->entries.end()) {
+    entry->manifest_id = 0;
+  }
+}
+
+/// Remove a manifest request code cache entry.
+///
+/// @param [in, out] sul
+///    Pointer to the scheduling element.
+[[using gnu: nonnull(1), access(read_only, 1)]]
+static void remove_mrc_cache(lws_sorted_usec_list_t *_Nonnull sul) {
+  const auto manifest_id{reinterpret_cast<const mrc_cache *>(sul)->manifest_id};
+  unpersist(manifest_id);
+  state.mrcs.erase(manifest_id);
+}
+
+/// Add an entry to the manifest request code cache and schedule its removal.
+///    There must be no entry for the same manifest, and there must be a free
+///    slot.
+///
+/// @param manifest_id
+///    ID of the manifest that the code is for.
+/// @param mrc
+///    Manifest request code value.
+/// @param rem_time
+///    Number of seconds until the code expires.
+/// @return Reference to the added entry.
+static const mrc_cache &add_entry(std::uint64_t manifest_id, std::uint64_t mrc,
+                                  std::int64_t rem_time) {
+  auto &entry{state.mrcs.emplace(manifest_id, mrc_cache{}).first->second};
+  entry.sul.us = lws_now_usecs() + rem_time * LWS_US_PER_SEC;
+  entry.sul.cb = remove_mrc_cache;
+  entry.manifest_id = manifest_id;
+  entry.mrc = mrc;
+  lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED, &entry.sul);
+  return entry;
+}
+
+/// Add an entry to the manifest request code cache, evicting the oldest one
+///    if the cache is full, and mirror it into the persistent cache file.
+///
+/// @param manifest_id
+///    ID of the manifest that the code is for.
+/// @param mrc
+///    Manifest request code value.
+/// @param now
+///    Current time, in seconds since Epoch.
+/// @param expires
+///    Expiration time of the code, in seconds since Epoch.
+/// @return Reference to the added entry.
+static const mrc_cache &cache_add(std::uint64_t manifest_id, std::uint64_t mrc,
+                                  std::int64_t now, std::int64_t expires) {
+  if (state.mrcs.size() >= max_cached_mrcs) {
+    // Don't keep more than 128 entries in the cache at any given time, to
+    //    avoid memory overflows
+    const auto first_it{state.mrcs.begin()};
+    lws_sul_cancel(&first_it->second.sul);
+    unpersist(first_it->first);
+    state.mrcs.erase(first_it);
+  }
+  persist(manifest_id, mrc, expires);
+  return add_entry(manifest_id, mrc, expires - now);
+}
+
+/// Insert a manifest request code into the cache, unless it's already there,
+///    and publish it to the shared table.
+///
+/// @param manifest_id
+///    ID of the manifest that the code is for.
+/// @param mrc
+///    Manifest request code value.
+/// @return Reference to the cache entry.
+static const mrc_cache &cache_insert(std::uint64_t manifest_id,
+                                     std::uint64_t mrc) {
+  if (const auto it{state.mrcs.find(manifest_id)}; it != state.mrcs.end()) {
+    // Another request for the same manifest has completed first
+    return it->second;
+  }
+  // Steam refreshes MRCs on every *4 and *9 minute, that is every 5 minutes
+  //    with offset of 240 seconds from 5-minute boundary, use that info to
+  //    schedule cache entry removal on next refresh
+  const auto now{std::chrono::system_clock::to_time_t(
+      std::chrono::system_clock::now())};
+  const auto expires{(now + 60) / 300 * 300 + 240};
+  shared_mrc_publish(manifest_id, mrc, expires);
+  peer_mrc_cached(manifest_id, mrc, expires);
+  return cache_add(manifest_id, mrc, now, expires);
+}
+
+/// Notify the connection or the peer node that its request has been
+///    completed, or free the request if the connection has already been
+///    closed.
+///
+/// @param [in, out] req
+///    The completed request.
+static void complete(mrc_request &req) {
+  if (req.wsi) {
+    lws_callback_on_writable(req.wsi);
+  } else if (req.peer) {
+    peer_mrc_done(req);
+  } else {
+    delete &req;
+  }
+}
+
+/// Try sending a request to Steam CM with the next account owning the depot
+///    that has a free slot, to a peer node if the depot is owned only by
+///    peers, or to the primary in replica mode. @ref state.manifest_mtx must
+///    be locked, and there must be a free global slot.
+///
+/// @param [in, out] req
+///    The request to send.
+/// @return `true` if the request has been sent or completed with an error,
+///    `false` if all accounts owning the depot are at their limit, or all
+///    slots for forwarding to the primary are taken.
+static bool dispatch(mrc_request &req) {
+  const auto app{state.apps.find(req.data.app_id)};
+  if (app == state.apps.end()) {
+    req.status = HTTP_STATUS_UNAUTHORIZED;
+    return true;
+  }
+  const auto depot{app->second.depots.find(req.data.depot_id)};
+  if (depot == app->second.depots.end()) {
+    req.status = HTTP_STATUS_UNAUTHORIZED;
+    return true;
+  }
+  auto &depot_ent{depot->second};
+  if (!state.replica_of.host.empty()) {
+    // Replicas have no accounts, the primary handles all requests
+    if (!replica_can_forward()) {
+      // Wait in the queue until a forwarded request completes
+      return false;
+    }
+    if (replica_forward(req)) {
+      ++sched.forwarded;
+    } else {
+      req.status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+    }
+    return true;
+  }
+  if (depot_ent.accs.empty()) {
+    // Requests from peers are not forwarded again, as that could make them
+    //    loop between nodes with diverged views of ownership
+    if (!depot_ent.peers || req.peer) {
+      req.status = HTTP_STATUS_UNAUTHORIZED;
+    } else if (peer_forward(req, depot_ent.peers)) {
+      ++sched.forwarded;
+    } else {
+      req.status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+    }
+    return true;
+  }
+  const auto first{depot_ent.accs.next(depot_ent.next_acc)};
+  auto acc_index{first};
+  do {
+    const auto &acc{*state.acc_slots[acc_index]};
+    if (auto &num_reqs{sched.acc_outstanding[acc.token_info.steam_id]};
+        num_reqs < state.mrc_limits.max_outstanding_per_acc) {
+      ++num_reqs;
+      ++sched.outstanding;
+      depot_ent.next_acc = acc_index + 1;
+      req.steam_id = acc.token_info.steam_id;
+      tek_sc_cm_get_mrc(acc.cm_client, &req.data, cb_mrc, 2000);
+      return true;
+    }
+    acc_index = depot_ent.accs.next(acc_index + 1);
+  } while (acc_index != first);
+  return false;
+}
+
+/// Send queued requests while there are free slots for them.
+static void dispatch_queued() {
+  const std::scoped_lock lock{state.manifest_mtx};
+  std::erase_if(sched.queue, [](auto req) {
+    if (sched.outstanding >= state.mrc_limits.max_outstanding ||
+        !dispatch(*req)) {
+      return false;
+    }
+    if (req->status) {
+      complete(*req);
+    }
+    return true;
+  });
+}
+
+/// Reject queued requests whose deadline has passed, and reschedule itself
+///    for the next deadline.
+///
+/// @param [in, out] sul
+///    Pointer to @ref mrc_scheduler::expire_sul.
+[[using gnu: nonnull(1), access(read_write, 1)]]
+static void expire_queued(lws_sorted_usec_list_t *_Nonnull sul) {
+  const auto now{lws_now_usecs()};
+  while (!sched.queue.empty() && sched.queue.front()->deadline <= now) {
+    auto &req{*sched.queue.front()};
+    sched.queue.pop_front();
+    req.status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+    ++sched.shed_expired;
+    complete(req);
+  }
+  if (!sched.queue.empty()) {
+    sul->us = sched.queue.front()->deadline;
+    lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED, sul);
+  }
+}
+
+/// Create a new pending request.
+///
+/// @param app_id
+///    ID of the application that the manifest belongs to.
+/// @param depot_id
+///    ID of the depot that the manifest belongs to.
+/// @param manifest_id
+///    ID of the manifest to get request code for.
+/// @return Reference to the created request.
+static mrc_request &create(std::uint32_t app_id, std::uint32_t depot_id,
+                           std::uint64_t manifest_id) {
+  return *new mrc_request{
+      .data = {.app_id = app_id,
+               .depot_id = depot_id,
+               .manifest_id = manifest_id,
+               .request_code = 0,
+               .result = {.type = TEK_SC_ERR_TYPE_basic,
+                          .primary = TEK_SC_ERRC_cm_timeout,
+                          .auxiliary = 0,
+                          .extra = 0,
+                          .uri = nullptr}},
+      .wsi = nullptr,
+      .peer = nullptr,
+      .peer_req_id = 0,
+      .steam_id = 0,
+      .fwd_id = 0,
+      .deadline = 0,
+      .mrc = 0,
+      .rem_time = 0,
+      .status = 0};
+}
+
+/// Send a new request right away if there is a free slot, queue it otherwise,
+///    or complete it immediately with an error status.
+///
+/// @param [in, out] req
+///    The request to submit.
+static void submit(mrc_request &req) {
+  const auto &limits{state.mrc_limits};
+  // Earlier requests have priority over the new one
+  if (sched.queue.empty() && sched.outstanding < limits.max_outstanding) {
+    const std::scoped_lock lock{state.manifest_mtx};
+    if (dispatch(req)) {
+      if (req.status) {
+        complete(req);
+      }
+      return;
+    }
+  }
+  if (sched.queue.size() >= limits.max_queued) {
+    req.status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+    ++sched.shed_full;
+    complete(req);
+    return;
+  }
+  req.deadline = lws_now_usecs() + limits.queue_timeout;
+  sched.queue.emplace_back(&req);
+  if (sched.queue.size() == 1) {
+    sched.expire_sul.us = req.deadline;
+    sched.expire_sul.cb = expire_queued;
+    lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED,
+                      &sched.expire_sul);
+  }
+}
+
+} // namespace
+
+//===-- Internal functions ------------------------------------------------===//
+
+bool mrc_cache_find(std::uint64_t manifest_id, std::uint64_t &mrc,
+                    int &rem_time) {
+  if (const auto it{state.mrcs.find(manifest_id)}; it != state.mrcs.end()) {
+    mrc = it->second.mrc;
+    rem_time = (it->second.sul.us - lws_now_usecs()) / LWS_US_PER_SEC;
+    return true;
+  }
+  std::int64_t expires;
+  if (!shared_mrc_find(manifest_id, mrc, expires)) {
+    return false;
+  }
+  // Another process has got the code, keep it locally for the rest of its
+  //    rotation epoch
+  ++sched.shared_hits;
+  const auto now{std::chrono::system_clock::to_time_t(
+      std::chrono::system_clock::now())};
+  cache_add(manifest_id, mrc, now, expires);
+  rem_time = expires - now;
+  return true;
+}
+
+void mrc_cache_put(std::uint64_t manifest_id, std::uint64_t mrc,
+                   std::int64_t expires) {
+  if (state.mrcs.contains(manifest_id)) {
+    return;
+  }
+  if (const auto now{std::chrono::system_clock::to_time_t(
+          std::chrono::system_clock::now())};
+      expires > now) {
+    cache_add(manifest_id, mrc, now, expires);
+  }
+}
+
+mrc_request *mrc_submit(lws *wsi, std::uint32_t app_id, std::uint32_t depot_id,
+                        std::uint64_t manifest_id) {
+  auto &req{create(app_id, depot_id, manifest_id)};
+  req.wsi = wsi;
+  submit(req);
+  return &req;
+}
+
+void mrc_submit_peer(peer_ctx &ctx, std::uint64_t req_id, std::uint32_t app_id,
+                     std::uint32_t depot_id, std::uint64_t manifest_id) {
+  auto &req{create(app_id, depot_id, manifest_id)};
+  req.peer = &ctx;
+  req.peer_req_id = req_id;
+  submit(req);
+}
+
+void mrc_forward_done(mrc_request &req) {
+  if (req.status == HTTP_STATUS_OK) {
+    const auto &entry{cache_insert(req.data.manifest_id, req.mrc)};
+    req.mrc = entry.mrc;
+    req.rem_time = (entry.sul.us - lws_now_usecs()) / LWS_US_PER_SEC;
+  }
+  complete(req);
+  if (!sched.queue.empty()) {
+    // Requests forwarded to the primary may be waiting for the freed slot
+    dispatch_queued();
+  }
+}
+
+void mrc_release(mrc_request &req) {
+  if (req.status) {
+    delete &req;
+  } else if (!req.steam_id && !req.fwd_id) {
+    // Still queued, no need to keep it
+    std::erase(sched.queue, &req);
+    delete &req;
+  } else {
+    // Awaiting CM or peer response, the request will be freed once it
+    //    arrives
+    req.wsi = nullptr;
+    req.peer = nullptr;
+  }
+}
+
+void mrc_process() {
+  std::vector<mrc_request *> reqs;
+  {
+    const std::scoped_lock lock{sched.completed_mtx};
+    reqs.swap(sched.completed);
+  }
+  if (reqs.empty()) {
+    return;
+  }
+  for (auto req : reqs) {
+    --sched.outstanding;
+    if (const auto it{sched.acc_outstanding.find(req->steam_id)};
+        it != sched.acc_outstanding.end() && !--it->second) {
+      sched.acc_outstanding.erase(it);
+    }
+    const auto &result{req->data.result};
+    if (tek_sc_err_success(&result)) {
+      const auto &entry{cache_insert(req->data.manifest_id,
+                                     req->data.request_code)};
+      req->mrc = entry.mrc;
+      req->rem_time = (entry.sul.us - lws_now_usecs()) / LWS_US_PER_SEC;
+      req->status = HTTP_STATUS_OK;
+    } else if (result.type == TEK_SC_ERR_TYPE_sub &&
+               result.auxiliary == TEK_SC_ERRC_cm_timeout) {
+      req->status = HTTP_STATUS_GATEWAY_TIMEOUT;
+    } else {
+      req->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    complete(*req);
+  }
+  if (!sched.queue.empty()) {
+    dispatch_queued();
+  }
+}
+
+mrc_stats mrc_get_stats() noexcept {
+  return {.outstanding = sched.outstanding,
+          .queued = sched.queue.size(),
+          .cached = state.mrcs.size(),
+          .shed_full = sched.shed_full,
+          .shed_expired = sched.shed_expired,
+          .forwarded = sched.forwarded,
+          .shared_hits = sched.shared_hits};
+}
+
+void mrc_cache_load() {
+  if (!state.shared_mrc_cache.empty()) {
+    shared_mrc_open(state.shared_mrc_cache);
+  }
+  std::unique_ptr<tek_sc_os_char[], decltype(&std::free)> state_dir{
+      ts3_os_get_state_dir(), std::free};
+  if (!state_dir) {
+    std::println(std::cerr, "Cannot persist manifest request code cache: "
+                            "state directory not found");
+    return;
+  }
+  os_handle state_dir_handle{ts3_os_dir_create(state_dir.get())};
+  if (!state_dir_handle) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot persist manifest request code cache; failed to open "
+                 "state directory");
+    return;
+  }
+  state_dir.reset();
+  os_handle ts3_dir_handle{
+      ts3_os_dir_create_at(state_dir_handle.value, TEK_SC_OS_STR("tek-s3"))};
+  if (!ts3_dir_handle) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot persist manifest request code cache; failed to open "
+                 "tek-s3 subdirectory");
+    return;
+  }
+  state_dir_handle.close();
+  os_handle file_handle{ts3_os_file_open_rw_at(
+      ts3_dir_handle.value, TEK_SC_OS_STR("mrc_cache.bin"))};
+  if (!file_handle) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot persist manifest request code cache; failed to open "
+                 "cache file");
+    return;
+  }
+  ts3_dir_handle.close();
+  const auto file_size{ts3_os_file_get_size(file_handle.value)};
+  if (file_size != sizeof(cache_file) &&
+      !ts3_os_file_set_size(file_handle.value, sizeof(cache_file))) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot persist manifest request code cache; failed to "
+                 "resize cache file");
+    return;
+  }
+  const auto file{reinterpret_cast<cache_file *>(
+      ts3_os_file_map(file_handle.value, sizeof(cache_file)))};
+  if (!file) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot persist manifest request code cache; failed to map "
+                 "cache file");
+    return;
+  }
+  file_handle.close();
+  sched.file = file;
+  if (file_size != sizeof(cache_file) || file->magic != cache_file_magic ||
+      file->version != cache_file_version ||
+      file->capacity != max_cached_mrcs) {
+    // New or incompatible file, start from scratch
+    *file = {.magic = cache_file_magic,
+             .version = cache_file_version,
+             .capacity = max_cached_mrcs,
+             .reserved = 0,
+             .entries = {}};
+    return;
+  }
+  // Reload entries that haven't passed their rotation boundary yet
+  const auto now{std::chrono::system_clock::to_time_t(
+      std::chrono::system_clock::now())};
+  for (auto &entry : file->entries) {
+    if (!entry.manifest_id) {
+      continue;
+    }
+    if (entry.expires <= now || state.mrcs.contains(entry.manifest_id)) {
+      entry.manifest_id = 0;
+      continue;
+    }
+    add_entry(entry.manifest_id, entry.mrc, entry.expires - now);
+  }
+}
+
+void mrc_cleanup() {
+  shared_mrc_close();
+  if (sched.file) {
+    ts3_os_file_unmap(sched.file, sizeof(cache_file));
+    sched.file = nullptr;
+  }
+  for (auto req : sched.queue) {
+    delete req;
+  }
+  sched.queue.clear();
+  for (auto req : sched.completed) {
+    delete req;
+  }
+  sched.completed.clear();
+}
+
+} // namespace tek::s3
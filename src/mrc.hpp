@@ -0,0 +1,197 @@
+//===-- mrc.hpp - Manifest request code scheduling declarations -----------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Declarations of manifest request code cache and CM request admission
+///    control functions. All of them must be called from the libwebsockets
+///    service thread.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include "null_attrs.h" // IWYU pragma: keep
+#include "peer.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <libwebsockets.h>
+#include <tek-steamclient/cm.h>
+
+namespace tek::s3 {
+
+/// Admission control limits for manifest request code requests to Steam CM.
+struct mrc_admission_limits {
+  /// Maximum number of requests awaiting CM response, across all accounts.
+  int max_outstanding{32};
+  /// Maximum number of requests awaiting CM response per account.
+  int max_outstanding_per_acc{4};
+  /// Maximum number of requests waiting for a free slot.
+  std::size_t max_queued{256};
+  /// Maximum time that a request may spend waiting for a free slot, in
+  ///    microseconds.
+  lws_usec_t queue_timeout{5 * LWS_US_PER_SEC};
+};
+
+/// Manifest request code request submitted by an HTTP client.
+struct mrc_request {
+  /// Request/response data for tek-steamclient.
+  tek_sc_cm_data_mrc data;
+  /// Pointer to the HTTP connection awaiting the response, or `nullptr` if it
+  ///    has been closed or the request came from a peer node.
+  lws *_Nullable wsi;
+  /// Pointer to the context of the peer session that the request came from,
+  ///    or `nullptr` if it came from an HTTP client.
+  peer_ctx *_Nullable peer;
+  /// ID assigned to the request by the peer node that it came from.
+  std::uint64_t peer_req_id;
+  /// Steam ID of the account that the request has been sent with, `0` if it
+  ///    hasn't been sent yet.
+  std::uint64_t steam_id;
+  /// ID of the request sent to a peer node owning the depot or to the
+  ///    primary, `0` if it hasn't been forwarded.
+  std::uint64_t fwd_id;
+  /// Time after which the request is shed if it's still queued, in
+  ///    libwebsockets microseconds.
+  lws_usec_t deadline;
+  /// On success, the manifest request code.
+  std::uint64_t mrc;
+  /// On success, number of seconds until the manifest request code expires.
+  int rem_time;
+  /// HTTP status code to respond with, or `0` if the request is still pending.
+  int status;
+};
+
+/// Manifest request code scheduling statistics.
+struct mrc_stats {
+  /// Number of requests awaiting CM response.
+  int outstanding;
+  /// Number of requests waiting for a free slot.
+  std::size_t queued;
+  /// Number of cached manifest request codes.
+  std::size_t cached;
+  /// Number of requests rejected because the queue was full.
+  std::uint64_t shed_full;
+  /// Number of requests rejected because their queue deadline has passed.
+  std::uint64_t shed_expired;
+  /// Number of requests forwarded to peer nodes owning their depots.
+  std::uint64_t forwarded;
+  /// Number of codes found in the shared table after missing the local cache.
+  std::uint64_t shared_hits;
+};
+
+/// Get a manifest request code from the cache, or from the shared table if
+///    it's enabled, in which case the code is added to the cache.
+///
+/// @param manifest_id
+///    ID of the manifest to get request code for.
+/// @param [out] mrc
+///    Variable that receives the manifest request code.
+/// @param [out] rem_time
+///    Variable that receives number of seconds until the code expires.
+/// @return Value indicating whether the code has been found in the cache.
+[[gnu::visibility("internal")]]
+bool mrc_cache_find(std::uint64_t manifest_id, std::uint64_t &mrc,
+                    int &rem_time);
+
+/// Add a manifest request code received from the primary to the cache, unless
+///    it's already there or has expired.
+///
+/// @param manifest_id
+///    ID of the manifest that the code is for.
+/// @param mrc
+///    Manifest request code value.
+/// @param expires
+///    Expiration time of the code, in seconds since Epoch.
+[[gnu::visibility("internal")]]
+void mrc_cache_put(std::uint64_t manifest_id, std::uint64_t mrc,
+                   std::int64_t expires);
+
+/// Submit a request for a manifest request code that is not in the cache. The
+///    request is sent to Steam CM right away if there is a free slot, queued
+///    otherwise, or completed immediately with an error status. Either way,
+///    `lws_callback_on_writable` is called for @p wsi once @ref
+///    mrc_request::status is set.
+///
+/// @param [in] wsi
+///    Pointer to the HTTP connection that will receive the response.
+/// @param app_id
+///    ID of the application that the manifest belongs to.
+/// @param depot_id
+///    ID of the depot that the manifest belongs to.
+/// @param manifest_id
+///    ID of the manifest to get request code for.
+/// @return Pointer to the created request, which must be released via
+///    @ref mrc_release.
+[[using gnu: visibility("internal"), nonnull(1), returns_nonnull]]
+mrc_request *_Nonnull mrc_submit(lws *_Nonnull wsi, std::uint32_t app_id,
+                                 std::uint32_t depot_id,
+                                 std::uint64_t manifest_id);
+
+/// Submit a request for a manifest request code on behalf of a peer node.
+///    Such requests are never forwarded further, and @ref peer_mrc_done is
+///    called once they complete.
+///
+/// @param [in, out] ctx
+///    Context of the peer session that the request came from.
+/// @param req_id
+///    ID assigned to the request by the peer node.
+/// @param app_id
+///    ID of the application that the manifest belongs to.
+/// @param depot_id
+///    ID of the depot that the manifest belongs to.
+/// @param manifest_id
+///    ID of the manifest to get request code for.
+[[gnu::visibility("internal")]]
+void mrc_submit_peer(peer_ctx &ctx, std::uint64_t req_id, std::uint32_t app_id,
+                     std::uint32_t depot_id, std::uint64_t manifest_id);
+
+/// Complete a request forwarded to a peer node or to the primary, caching the
+///    received code, and dispatch queued requests that may have been waiting
+///    for its forwarding slot.
+///
+/// @param [in, out] req
+///    The request, with @ref mrc_request::status set, and
+///    @ref mrc_request::mrc set on success.
+[[gnu::visibility("internal")]]
+void mrc_forward_done(mrc_request &req);
+
+/// Release a request after its response has been sent or its connection has
+///    been closed. Pending requests are detached from the connection and freed
+///    when complete, queued ones are dropped right away.
+///
+/// @param [in, out] req
+///    Request to release.
+[[gnu::visibility("internal")]]
+void mrc_release(mrc_request &req);
+
+/// Process requests completed by CM clients, and send queued ones if slots
+///    have been freed.
+[[gnu::visibility("internal")]]
+void mrc_process();
+
+/// Get current manifest request code scheduling statistics.
+///
+/// @return Current statistics.
+[[gnu::visibility("internal")]]
+mrc_stats mrc_get_stats() noexcept;
+
+/// Map the persistent manifest request code cache file, and load entries
+///    that haven't expired yet from it. Must be called after the libwebsockets
+///    context has been created. Failures are reported to stderr, and the cache
+///    keeps working in memory only.
+[[gnu::visibility("internal")]]
+void mrc_cache_load();
+
+/// Free all remaining requests and unmap the persistent cache file. Must be
+///    called after all CM clients have been destroyed.
+[[gnu::visibility("internal")]]
+void mrc_cleanup();
+
+} // namespace tek::s3
@@ -164,6 +164,24 @@ tek_sc_os_handle ts3_os_file_create_at(
     [[clang::use_handle("os")]] tek_sc_os_handle parent_dir_handle,
     const tek_sc_os_char *_Nonnull name);
 
+/// Open a file at specified directory for reading and writing, or create it if
+///    it doesn't exist. Unlike @ref ts3_os_file_create_at, existing contents
+///    are preserved.
+///
+/// @param parent_dir_handle
+///    Handle for the parent directory of the file.
+/// @param [in] name
+///    Name of the file to open/create, as a null-terminated string.
+/// @return Handle for the opened file, or @ref TS3_OS_INVALID_HANDLE if the
+///    function fails. Use @ref ts3_os_get_last_error to get the error code. The
+///    returned handle must be closed with @ref ts3_os_close_handle after use.
+[[gnu::visibility("internal"), gnu::fd_arg(1), gnu::nonnull(2),
+  gnu::access(read_only, 2), gnu::null_terminated_string_arg(2),
+  clang::acquire_handle("os")]]
+tek_sc_os_handle ts3_os_file_open_rw_at(
+    [[clang::use_handle("os")]] tek_sc_os_handle parent_dir_handle,
+    const tek_sc_os_char *_Nonnull name);
+
 /// Open a file for reading.
 ///
 /// @param [in] path
@@ -219,6 +237,143 @@ bool ts3_os_file_write([[clang::use_handle("os")]] tek_sc_os_handle handle,
 size_t
 ts3_os_file_get_size([[clang::use_handle("os")]] tek_sc_os_handle handle);
 
+//===--- File set size ----------------------------------------------------===//
+
+/// Set the size of file, truncating it or extending it with zeros.
+///
+/// @param handle
+///    OS handle for the file, opened for writing.
+/// @param size
+///    New size of the file, in bytes.
+/// @return Value indicating whether the function succeeded. Use
+///    @ref ts3_os_get_last_error to get the error code in case of failure.
+[[gnu::visibility("internal"), gnu::fd_arg_write(1)]]
+bool ts3_os_file_set_size([[clang::use_handle("os")]] tek_sc_os_handle handle,
+                          size_t size);
+
+//===--- File rename ------------------------------------------------------===//
+
+/// Rename a file at specified directory, replacing the file with the new name
+///    if it exists. The replacement is atomic, so readers see either the old
+///    or the new file.
+///
+/// @param parent_dir_handle
+///    Handle for the parent directory of the file.
+/// @param [in] name
+///    Current name of the file, as a null-terminated string.
+/// @param [in] new_name
+///    New name of the file, as a null-terminated string.
+/// @return Value indicating whether the function succeeded. Use
+///    @ref ts3_os_get_last_error to get the error code in case of failure.
+[[gnu::visibility("internal"), gnu::fd_arg(1), gnu::nonnull(2, 3),
+  gnu::access(read_only, 2), gnu::access(read_only, 3),
+  gnu::null_terminated_string_arg(2), gnu::null_terminated_string_arg(3)]]
+bool ts3_os_file_rename_at(
+    [[clang::use_handle("os")]] tek_sc_os_handle parent_dir_handle,
+    const tek_sc_os_char *_Nonnull name,
+    const tek_sc_os_char *_Nonnull new_name);
+
+//===--- File map/unmap ---------------------------------------------------===//
+
+/// Map a file into memory for reading and writing. Changes made to the
+///    mapping are written back to the file by the OS, even if the process
+///    crashes.
+///
+/// @param handle
+///    OS handle for the file, opened for reading and writing. It may be closed
+///    after the function returns.
+/// @param size
+///    Number of bytes to map, must not exceed the file size.
+/// @return Pointer to the mapped memory, or `nullptr` if the function fails.
+///    Use @ref ts3_os_get_last_error to get the error code. The mapping must
+///    be released with @ref ts3_os_file_unmap after use.
+[[gnu::visibility("internal"), gnu::fd_arg(1)]]
+void *_Nullable ts3_os_file_map(
+    [[clang::use_handle("os")]] tek_sc_os_handle handle, size_t size);
+
+/// Map a file into memory for reading only. Unlike @ref ts3_os_file_map, this
+///    works for files created by @ref ts3_os_sealed_file_create.
+///
+/// @param handle
+///    OS handle for the file. It may be closed after the function returns.
+/// @param size
+///    Number of bytes to map, must not exceed the file size.
+/// @return Pointer to the mapped memory, or `nullptr` if the function fails.
+///    Use @ref ts3_os_get_last_error to get the error code. The mapping must
+///    be released with @ref ts3_os_file_unmap after use.
+[[gnu::visibility("internal"), gnu::fd_arg(1)]]
+void *_Nullable ts3_os_file_map_ro(
+    [[clang::use_handle("os")]] tek_sc_os_handle handle, size_t size);
+
+/// Release a file mapping created by @ref ts3_os_file_map or
+///    @ref ts3_os_file_map_ro.
+///
+/// @param [in] addr
+///    Pointer to the mapped memory.
+/// @param size
+///    Number of bytes that were mapped.
+[[gnu::visibility("internal"), gnu::nonnull(1), gnu::access(none, 1)]]
+void ts3_os_file_unmap(void *_Nonnull addr, size_t size);
+
+/// Open a named shared memory segment, creating it if it doesn't exist, and
+///    map it into memory for reading and writing. Newly created segments are
+///    zero-filled.
+///
+/// @param [in] name
+///    Name of the segment, as a null-terminated UTF-8 string. It must not
+///    contain slashes or backslashes.
+/// @param size
+///    Number of bytes to map. Smaller segments are extended to this size.
+/// @return Pointer to the mapped memory, or `nullptr` if the function fails.
+///    Use @ref ts3_os_get_last_error to get the error code. The mapping must
+///    be released with @ref ts3_os_file_unmap after use.
+[[gnu::visibility("internal"), gnu::nonnull(1), gnu::access(read_only, 1),
+  gnu::null_terminated_string_arg(1)]]
+void *_Nullable ts3_os_shm_map(const char *_Nonnull name, size_t size);
+
+//===-- Zero-copy sending functions ---------------------------------------===//
+
+/// Create an anonymous in-memory file with a copy of specified data, and seal
+///    it so that its contents can't be changed anymore.
+///
+/// @param [in] name
+///    Name of the file for debugging purposes, as a null-terminated UTF-8
+///    string.
+/// @param [in] data
+///    Pointer to the data to write into the file.
+/// @param size
+///    Number of bytes to write.
+/// @return OS handle for the created file, or @ref TS3_OS_INVALID_HANDLE if
+///    the function fails or is not supported by the OS. Use
+///    @ref ts3_os_get_last_error to get the error code. The handle must be
+///    closed with @ref ts3_os_close_handle after use.
+[[gnu::visibility("internal"), gnu::nonnull(1, 2), gnu::access(read_only, 1),
+  gnu::access(read_only, 2, 3), gnu::null_terminated_string_arg(1)]]
+tek_sc_os_handle ts3_os_sealed_file_create(const char *_Nonnull name,
+                                           const void *_Nonnull data,
+                                           size_t size);
+
+/// Send data from a file directly to a socket, without copying it through
+///    user space.
+///
+/// @param sock
+///    Non-blocking socket to send the data to.
+/// @param handle
+///    OS handle for the file, created by @ref ts3_os_sealed_file_create.
+/// @param [in, out] offset
+///    Pointer to the offset in the file to start reading at, which is
+///    advanced by the number of bytes sent.
+/// @param count
+///    Maximum number of bytes to send.
+/// @return Number of bytes sent, `0` if the socket's send buffer is full, or
+///    `-1` if the function fails. Use @ref ts3_os_get_last_error to get the
+///    error code.
+[[gnu::visibility("internal"), gnu::fd_arg(2), gnu::nonnull(3),
+  gnu::access(read_write, 3)]]
+ptrdiff_t ts3_os_file_send(lws_sockfd_type sock,
+                           [[clang::use_handle("os")]] tek_sc_os_handle handle,
+                           uint64_t *_Nonnull offset, size_t count);
+
 //===-- Futex functions ---------------------------------------------------===//
 
 /// Wait for a value at @p addr to change from @p old.
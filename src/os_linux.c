@@ -23,8 +23,11 @@
 #include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <tek-steamclient/os.h>
@@ -256,6 +259,11 @@ tek_sc_os_handle ts3_os_file_create_at(tek_sc_os_handle parent_dir_handle,
                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
 }
 
+tek_sc_os_handle ts3_os_file_open_rw_at(tek_sc_os_handle parent_dir_handle,
+                                        const tek_sc_os_char *name) {
+  return openat(parent_dir_handle, name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+}
+
 tek_sc_os_handle ts3_os_file_open(const tek_sc_os_char *path) {
   return open(path, O_RDONLY | O_CLOEXEC);
 }
@@ -316,6 +324,108 @@ size_t ts3_os_file_get_size(tek_sc_os_handle handle) {
   return stx.stx_size;
 }
 
+//===--- File set size ----------------------------------------------------===//
+
+bool ts3_os_file_set_size(tek_sc_os_handle handle, size_t size) {
+  return !ftruncate(handle, size);
+}
+
+//===--- File rename ------------------------------------------------------===//
+
+bool ts3_os_file_rename_at(tek_sc_os_handle parent_dir_handle,
+                           const tek_sc_os_char *name,
+                           const tek_sc_os_char *new_name) {
+  return !renameat(parent_dir_handle, name, parent_dir_handle, new_name);
+}
+
+//===--- File map/unmap ---------------------------------------------------===//
+
+void *ts3_os_file_map(tek_sc_os_handle handle, size_t size) {
+  auto const addr =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0);
+  return addr == MAP_FAILED ? nullptr : addr;
+}
+
+void *ts3_os_file_map_ro(tek_sc_os_handle handle, size_t size) {
+  auto const addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, handle, 0);
+  return addr == MAP_FAILED ? nullptr : addr;
+}
+
+void ts3_os_file_unmap(void *addr, size_t size) { munmap(addr, size); }
+
+void *ts3_os_shm_map(const char *name, size_t size) {
+  char path[256];
+  if (snprintf(path, sizeof path, "/%s", name) >= (int)sizeof path) {
+    errno = ENAMETOOLONG;
+    return nullptr;
+  }
+  const int fd = shm_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      ((size_t)st.st_size < size && ftruncate(fd, size) < 0)) {
+    const int errc = errno;
+    close(fd);
+    errno = errc;
+    return nullptr;
+  }
+  auto const addr =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return addr == MAP_FAILED ? nullptr : addr;
+}
+
+//===-- Zero-copy sending functions ---------------------------------------===//
+
+tek_sc_os_handle ts3_os_sealed_file_create(const char *name, const void *data,
+                                           size_t size) {
+  const int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return -1;
+  }
+  for (size_t written = 0; written < size;) {
+    const ssize_t res =
+        write(fd, (const unsigned char *)data + written, size - written);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      goto fail;
+    }
+    written += res;
+  }
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) < 0) {
+    goto fail;
+  }
+  return fd;
+fail:
+  const int errc = errno;
+  close(fd);
+  errno = errc;
+  return -1;
+}
+
+ptrdiff_t ts3_os_file_send(lws_sockfd_type sock, tek_sc_os_handle handle,
+                           uint64_t *offset, size_t count) {
+  off_t off = (off_t)*offset;
+  for (;;) {
+    const ssize_t res = sendfile(sock, handle, &off, count);
+    if (res >= 0) {
+      *offset = (uint64_t)off;
+      return res;
+    }
+    if (errno == EAGAIN) {
+      return 0;
+    }
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
 //===-- Futex functions ---------------------------------------------------===//
 
 bool ts3_os_futex_wait(const _Atomic(uint32_t) *addr, uint32_t old,
@@ -190,6 +190,31 @@ tek_sc_os_handle ts3_os_file_create_at(tek_sc_os_handle parent_dir_handle,
   return INVALID_HANDLE_VALUE;
 }
 
+tek_sc_os_handle ts3_os_file_open_rw_at(tek_sc_os_handle parent_dir_handle,
+                                        const tek_sc_os_char *name) {
+  const USHORT name_size = wcslen(name) * sizeof *name;
+  IO_STATUS_BLOCK isb;
+  HANDLE handle;
+  auto const status = NtCreateFile(
+      &handle, FILE_GENERIC_READ | FILE_GENERIC_WRITE,
+      &(OBJECT_ATTRIBUTES){.Length = sizeof(OBJECT_ATTRIBUTES),
+                           .RootDirectory = parent_dir_handle,
+                           .ObjectName =
+                               &(UNICODE_STRING){.Length = name_size,
+                                                 .MaximumLength = name_size,
+                                                 .Buffer = (PWSTR)name},
+                           .Attributes = OBJ_CASE_INSENSITIVE},
+      &isb, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OPEN_IF,
+      FILE_RANDOM_ACCESS | FILE_SYNCHRONOUS_IO_NONALERT |
+          FILE_NON_DIRECTORY_FILE,
+      nullptr, 0);
+  if (NT_SUCCESS(status)) {
+    return handle;
+  }
+  SetLastError(RtlNtStatusToDosError(status));
+  return INVALID_HANDLE_VALUE;
+}
+
 tek_sc_os_handle ts3_os_file_open(const tek_sc_os_char *path) {
   UNICODE_STRING path_str;
   if (!RtlDosPathNameToNtPathName_U(path, &path_str, nullptr, nullptr)) {
@@ -270,6 +295,129 @@ size_t ts3_os_file_get_size(tek_sc_os_handle handle) {
   return SIZE_MAX;
 }
 
+//===--- File set size ----------------------------------------------------===//
+
+bool ts3_os_file_set_size(tek_sc_os_handle handle, size_t size) {
+  return SetFileInformationByHandle(
+      handle, FileEndOfFileInfo,
+      &(FILE_END_OF_FILE_INFO){.EndOfFile.QuadPart = (LONGLONG)size},
+      sizeof(FILE_END_OF_FILE_INFO));
+}
+
+//===--- File rename ------------------------------------------------------===//
+
+bool ts3_os_file_rename_at(tek_sc_os_handle parent_dir_handle,
+                           const tek_sc_os_char *name,
+                           const tek_sc_os_char *new_name) {
+  const USHORT name_size = wcslen(name) * sizeof *name;
+  IO_STATUS_BLOCK isb;
+  HANDLE handle;
+  auto const status = NtCreateFile(
+      &handle, DELETE | SYNCHRONIZE,
+      &(OBJECT_ATTRIBUTES){.Length = sizeof(OBJECT_ATTRIBUTES),
+                           .RootDirectory = parent_dir_handle,
+                           .ObjectName =
+                               &(UNICODE_STRING){.Length = name_size,
+                                                 .MaximumLength = name_size,
+                                                 .Buffer = (PWSTR)name},
+                           .Attributes = OBJ_CASE_INSENSITIVE},
+      &isb, nullptr, 0, FILE_SHARE_VALID_FLAGS, FILE_OPEN,
+      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+  if (!NT_SUCCESS(status)) {
+    SetLastError(RtlNtStatusToDosError(status));
+    return false;
+  }
+  // A name without root directory renames the file within its current
+  //    directory
+  const DWORD new_name_size = wcslen(new_name) * sizeof *new_name;
+  const DWORD info_size =
+      offsetof(FILE_RENAME_INFO, FileName) + new_name_size + sizeof *new_name;
+  FILE_RENAME_INFO *const info = malloc(info_size);
+  if (!info) {
+    NtClose(handle);
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return false;
+  }
+  info->ReplaceIfExists = TRUE;
+  info->RootDirectory = nullptr;
+  info->FileNameLength = new_name_size;
+  memcpy(info->FileName, new_name, new_name_size + sizeof *new_name);
+  const bool res =
+      SetFileInformationByHandle(handle, FileRenameInfo, info, info_size);
+  free(info);
+  NtClose(handle);
+  return res;
+}
+
+//===--- File map/unmap ---------------------------------------------------===//
+
+void *ts3_os_file_map(tek_sc_os_handle handle, size_t size) {
+  auto const mapping =
+      CreateFileMappingW(handle, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+  if (!mapping) {
+    return nullptr;
+  }
+  // The view keeps the mapping object alive
+  auto const addr = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+  NtClose(mapping);
+  return addr;
+}
+
+void *ts3_os_file_map_ro(tek_sc_os_handle handle, size_t size) {
+  auto const mapping =
+      CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mapping) {
+    return nullptr;
+  }
+  // The view keeps the mapping object alive
+  auto const addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+  NtClose(mapping);
+  return addr;
+}
+
+void ts3_os_file_unmap(void *addr, size_t) { UnmapViewOfFile(addr); }
+
+void *ts3_os_shm_map(const char *name, size_t size) {
+  // Session-local namespace, which doesn't require SeCreateGlobalPrivilege
+  static const wchar_t prefix[] = L"Local\\";
+  constexpr int prefix_len = sizeof prefix / sizeof *prefix - 1;
+  wchar_t path[256];
+  wmemcpy(path, prefix, prefix_len);
+  if (!MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, name, -1,
+                           &path[prefix_len],
+                           sizeof path / sizeof *path - prefix_len)) {
+    return nullptr;
+  }
+  // Pagefile-backed sections are zero-filled on creation
+  auto const mapping = CreateFileMappingW(
+      INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+      (DWORD)((uint64_t)size >> 32), (DWORD)size, path);
+  if (!mapping) {
+    return nullptr;
+  }
+  // The view keeps the mapping object alive
+  auto const addr = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+  NtClose(mapping);
+  return addr;
+}
+
+//===-- Zero-copy sending functions ---------------------------------------===//
+
+// TransmitFile requires overlapped sockets owned by its caller, which doesn't
+//    fit libwebsockets' event loop, so responses are always sent from memory
+
+tek_sc_os_handle ts3_os_sealed_file_create(const char *, const void *,
+                                           size_t) {
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return INVALID_HANDLE_VALUE;
+}
+
+ptrdiff_t ts3_os_file_send(lws_sockfd_type, tek_sc_os_handle, uint64_t *,
+                           size_t) {
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return -1;
+}
+
 //===-- Futex functions ---------------------------------------------------===//
 
 bool ts3_os_futex_wait(const _Atomic(uint32_t) *addr, uint32_t old,
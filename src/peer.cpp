@@ -0,0 +1,1785 @@
+//===-- peer.cpp - Peer replication implementation ------------------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Implementation of peer replication. The shared secret is never sent over
+///    the wire, nodes prove that they know it by challenge-response instead:
+///    the accepting node sends a challenge message with a random nonce, the
+///    connecting node answers with a hello message carrying its ID, its own
+///    nonce and an HMAC-SHA256 of both nonces and its ID keyed with the
+///    secret, and only if that is valid does the accepting node send its own
+///    hello with an HMAC of the connecting node's nonce and its ID. Each node
+///    sends a sync message with all known depot keys and the apps/depots
+///    owned by its own accounts once the hello of the other side is accepted.
+///    After that, sync messages are broadcast whenever the manifest changes,
+///    carrying only depot keys that haven't been broadcast yet, and the owned
+///    apps/depots only if they differ from the last broadcast ones. Received
+///    keys are merged into @ref ts3_state::depot_keys, and received ownership
+///    replaces previous ownership of the sending node in @ref ts3_state::apps,
+///    so depots owned only by peers stay in the manifest until their last
+///    owner disconnects.
+/// `/mrc` requests for depots owned only by peers are forwarded to one of the
+///    owners over the same sessions, with any number of requests in flight
+///    per session, matched to responses by IDs. With account sharding
+///    enabled, each account is handed over to the node with the highest
+///    rendezvous hash score for its Steam ID among sharding nodes, so an
+///    account is only connected to CM by one node. Since a node only hands an
+///    account over to a node with a higher score, accounts can't bounce
+///    between nodes whose views of the cluster differ.
+/// A hot standby marks its hello to the primary, and if its ID is listed in
+///    @ref ts3_state::standbys, the primary sends it state messages with the
+///    tokens of all its accounts and the manifest request codes that it
+///    caches. The standby mirrors the accounts without connecting them to CM,
+///    and keeps the primary's depots in the manifest while the primary is
+///    away. If the primary doesn't reconnect within
+///    @ref ts3_state::failover_timeout, the standby promotes itself: it
+///    keeps serving its manifest while connecting the accounts one by one,
+///    and prunes it like after regular setup once they are all ready.
+///
+//===----------------------------------------------------------------------===//
+#include "peer.hpp"
+
+#include "cm_callbacks.hpp"
+#include "mrc.hpp"
+#include "null_attrs.h" // IWYU pragma: keep
+#include "state.hpp"
+#include "utils.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <iterator>
+#include <libwebsockets.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <print>
+#include <ranges>
+#include <rapidjson/document.h>
+#include <rapidjson/reader.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <set>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tek-steamclient/cm.h>
+#include <utility>
+#include <vector>
+
+namespace tek::s3 {
+
+//===-- Session context ---------------------------------------------------===//
+
+struct peer_ctx {
+  /// Doubly linked list element for libwebsockets reconnection job
+  ///    scheduling.
+  lws_sorted_usec_list_t sul;
+  /// Pointer to the WebSocket connection instance, or `nullptr` if an
+  ///    outbound session is disconnected.
+  lws *_Nullable wsi;
+  /// Pointer to the address of the node for outbound sessions, `nullptr` for
+  ///    inbound ones.
+  const peer_endpoint *_Nullable endpoint;
+  /// Index of the remote node in the node table, `-1` until its hello message
+  ///    has been accepted.
+  int node;
+  /// Buffer accumulating fragments of the incoming message.
+  std::string rx_msg;
+  /// Outgoing messages, each starting at `LWS_PRE` offset.
+  std::deque<std::string> tx_queue;
+  /// Number of bytes of the first message in @ref tx_queue that have already
+  ///    been sent, including `LWS_PRE` headroom.
+  std::size_t tx_offset;
+  /// Number of manifest request code requests from the node that haven't
+  ///    completed yet. Closed inbound session contexts are freed only once it
+  ///    drops to zero.
+  int num_served;
+  /// Random nonce generated by this node for the handshake: the challenge
+  ///    for inbound sessions, and the one sent in the hello message for
+  ///    outbound ones.
+  std::array<unsigned char, 32> nonce;
+  /// For outbound sessions, value indicating whether the hello message has
+  ///    been sent in response to the challenge.
+  bool hello_sent;
+  /// Value indicating whether the remote node is a hot standby of this one.
+  bool standby;
+};
+
+namespace {
+
+//===-- Private types -----------------------------------------------------===//
+
+/// Maximum size of an incoming message before the hello message has been
+///    accepted.
+constexpr std::size_t max_hello_size{4096};
+/// Maximum size of an incoming message.
+constexpr std::size_t max_msg_size{64 * 1024 * 1024};
+/// Delay before reconnecting a disconnected outbound session, in
+///    microseconds.
+constexpr lws_usec_t reconnect_delay{5 * LWS_US_PER_SEC};
+/// Delay between connecting accounts of a promoted standby to CM, so they
+///    don't all sign in at once, in microseconds.
+constexpr lws_usec_t promote_connect_interval{250 * LWS_US_PER_MS};
+
+/// Peer node table entry.
+struct peer_node {
+  /// ID of the node.
+  std::string id;
+  /// Number of authenticated sessions with the node.
+  int num_sessions;
+  /// Value indicating whether the node takes part in account sharding.
+  bool shards;
+};
+
+/// Manifest request code request forwarded to a peer node.
+struct fwd_entry {
+  /// The request.
+  mrc_request *_Nonnull req;
+  /// Context of the session that the request has been sent in.
+  peer_ctx *_Nonnull ctx;
+};
+
+/// Account handed over to a peer node.
+struct handover {
+  /// Context of the session that the account has been sent in.
+  peer_ctx *_Nonnull ctx;
+  /// Value indicating whether the node has rejected the account. It's not
+  ///    offered to the node again until the session is closed.
+  bool rejected;
+};
+
+/// Manifest request code entry sent to hot standbys.
+struct standby_mrc {
+  /// ID of the manifest that the code is for.
+  std::uint64_t manifest_id;
+  /// Manifest request code value.
+  std::uint64_t mrc;
+  /// Expiration time of the code, in seconds since Epoch.
+  std::int64_t expires;
+};
+
+/// Peer replication state.
+struct peer_replicator {
+  /// Known peer nodes, indexed by bit positions in @ref depot::peers.
+  std::vector<peer_node> nodes;
+  /// Contexts of outbound sessions, one per @ref ts3_state::peers entry.
+  std::vector<std::unique_ptr<peer_ctx>> outbound;
+  /// Contexts of all established sessions.
+  std::vector<peer_ctx *> sessions;
+  /// IDs of depots whose keys have been broadcast, in ascending order.
+  std::vector<std::uint32_t> sent_keys;
+  /// Serialized apps/depots owned by local accounts, as of the last
+  ///    broadcast.
+  std::string sent_owned;
+  /// Serialized tokens of local accounts, as of the last state message sent
+  ///    to hot standbys.
+  std::string sent_accounts;
+  /// Requests forwarded to peer nodes awaiting response, by their IDs.
+  std::map<std::uint64_t, fwd_entry> forwarded;
+  /// ID of the last forwarded request.
+  std::uint64_t last_fwd_id;
+  /// Accounts handed over to peer nodes, by their Steam IDs. Accounts stay
+  ///    connected until the node accepts them.
+  std::map<std::uint64_t, handover> handovers;
+  /// Scheduling element for retrying manifest update when it's blocked by
+  ///    active downloads.
+  lws_sorted_usec_list_t update_sul;
+  /// Scheduling element for promoting a hot standby whose primary is away.
+  lws_sorted_usec_list_t failover_sul;
+  /// Scheduling element for connecting accounts of a promoted standby.
+  lws_sorted_usec_list_t connect_sul;
+  /// Index of the primary in the node table for a hot standby, `-1` if it
+  ///    hasn't connected yet. Ownership of the primary is kept while it's
+  ///    away.
+  int primary_node{-1};
+  /// Steam ID of the last account connected after promotion.
+  std::uint64_t last_connected;
+  /// Value indicating whether there may be changes to broadcast.
+  std::atomic_bool notified;
+};
+
+//===-- Private variable --------------------------------------------------===//
+
+/// The replicator instance.
+static peer_replicator repl;
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Write an ID as a JSON object key.
+///
+/// @param [in, out] writer
+///    JSON writer to write the key with.
+/// @param id
+///    ID to write.
+template <typename Writer>
+static void write_id_key(Writer &writer, std::uint32_t id) {
+  std::array<char, 10> id_buf;
+  const auto res{std::to_chars(id_buf.begin(), id_buf.end(), id)};
+  writer.Key(id_buf.data(), res.ptr - id_buf.data());
+}
+
+/// Compute FNV-1a hash of a string.
+///
+/// @param str
+///    String to hash.
+/// @return Hash value.
+static constexpr std::uint64_t fnv1a(std::string_view str) noexcept {
+  std::uint64_t hash{0xcbf29ce484222325};
+  for (const auto c : str) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+  }
+  return hash;
+}
+
+/// Scramble a 64-bit value with splitmix64 finalizer.
+///
+/// @param value
+///    Value to scramble.
+/// @return Scrambled value.
+static constexpr std::uint64_t mix(std::uint64_t value) noexcept {
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111eb;
+  return value ^ (value >> 31);
+}
+
+/// Compute rendezvous hashing score of a node for a key. Every node computes
+///    the same scores, so they agree on the owner of a key as long as they
+///    see the same set of nodes.
+///
+/// @param node_id
+///    ID of the node.
+/// @param key
+///    The key, such as a Steam ID or a manifest ID.
+/// @return The score.
+static constexpr std::uint64_t hrw_score(std::string_view node_id,
+                                         std::uint64_t key) noexcept {
+  return mix(fnv1a(node_id) ^ mix(key));
+}
+
+/// Parse an ID from a JSON object key.
+///
+/// @param [in] key
+///    The key to parse.
+/// @param [out] id
+///    Variable that receives the ID.
+/// @return Value indicating whether the key is a valid ID.
+static bool parse_id_key(const rapidjson::Value &key, std::uint32_t &id) {
+  const std::string_view view{key.GetString(), key.GetStringLength()};
+  return std::from_chars(view.begin(), view.end(), id).ec == std::errc{};
+}
+
+/// Encode binary data as a lowercase hexadecimal string.
+///
+/// @param data
+///    The data to encode.
+/// @return The encoded string.
+static std::string to_hex(std::span<const unsigned char> data) {
+  static constexpr std::string_view digits{"0123456789abcdef"};
+  std::string str;
+  str.reserve(data.size() * 2);
+  for (const auto byte : data) {
+    str.push_back(digits[byte >> 4]);
+    str.push_back(digits[byte & 0xF]);
+  }
+  return str;
+}
+
+/// Decode a hexadecimal string of known length.
+///
+/// @param [in] value
+///    JSON value that should contain the string.
+/// @param [out] data
+///    Buffer that receives the decoded data, its size determines the expected
+///    length of the string.
+/// @return Value indicating whether @p value is a string of the expected
+///    length that consists of hexadecimal digits only.
+static bool from_hex(const rapidjson::Value &value,
+                     std::span<unsigned char> data) {
+  if (!value.IsString() || value.GetStringLength() != data.size() * 2) {
+    return false;
+  }
+  const std::string_view str{value.GetString(), value.GetStringLength()};
+  for (std::size_t i{}; i < data.size(); ++i) {
+    if (std::from_chars(&str[i * 2], &str[i * 2 + 2], data[i], 16).ptr !=
+        &str[i * 2 + 2]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Compute the handshake proof of a node, which is HMAC-SHA256 keyed with
+///    @ref ts3_state::peer_secret of the role label, both nonces and the ID of
+///    the node. Including the role prevents reflecting a node's own proof
+///    back to it, and including the other node's nonce prevents replaying
+///    proofs from previous sessions.
+///
+/// @param role
+///    Role of the node in the session, `connect` or `accept`.
+/// @param challenge
+///    Nonce generated by the other node.
+/// @param nonce
+///    Nonce generated by the node, empty for the accepting node.
+/// @param node_id
+///    ID of the node.
+/// @return The proof.
+static std::array<unsigned char, 32>
+make_proof(std::string_view role, std::span<const unsigned char> challenge,
+           std::span<const unsigned char> nonce, std::string_view node_id) {
+  // HMAC as per RFC 2104, with SHA-256 block size
+  constexpr std::size_t block_size{64};
+  std::array<unsigned char, block_size> key{};
+  if (state.peer_secret.length() > block_size) {
+    ts3_u_sha256(state.peer_secret.data(), state.peer_secret.length(),
+                 key.data());
+  } else {
+    std::ranges::copy(state.peer_secret, key.begin());
+  }
+  std::vector<unsigned char> msg;
+  msg.reserve(block_size + role.length() + challenge.size() + nonce.size() +
+              node_id.length());
+  std::ranges::transform(key, std::back_inserter(msg),
+                         [](auto byte) { return byte ^ 0x36; });
+  msg.insert(msg.end(), role.begin(), role.end());
+  msg.insert(msg.end(), challenge.begin(), challenge.end());
+  msg.insert(msg.end(), nonce.begin(), nonce.end());
+  msg.insert(msg.end(), node_id.begin(), node_id.end());
+  std::array<unsigned char, block_size + 32> outer;
+  ts3_u_sha256(msg.data(), msg.size(), &outer[block_size]);
+  std::ranges::transform(key, outer.begin(),
+                         [](auto byte) { return byte ^ 0x5C; });
+  std::array<unsigned char, 32> proof;
+  ts3_u_sha256(outer.data(), outer.size(), proof.data());
+  return proof;
+}
+
+/// Check the handshake proof received from a peer, in constant time.
+///
+/// @param [in] value
+///    JSON value that should contain the hex-encoded proof.
+/// @param expected
+///    The expected proof, computed by @ref make_proof.
+/// @return Value indicating whether the proof is valid.
+static bool proof_matches(const rapidjson::Value &value,
+                          std::span<const unsigned char, 32> expected) {
+  std::array<unsigned char, 32> proof;
+  if (!from_hex(value, proof)) {
+    return false;
+  }
+  unsigned char diff{};
+  for (std::size_t i{}; i < proof.size(); ++i) {
+    diff |= proof[i] ^ expected[i];
+  }
+  return !diff;
+}
+
+/// Wrap a serialized message into a string with `LWS_PRE` headroom.
+///
+/// @param [in] buf
+///    Buffer containing the serialized message.
+/// @return The wrapped message.
+static std::string wrap_msg(const rapidjson::StringBuffer &buf) {
+  std::string msg(LWS_PRE, '\0');
+  msg.append(buf.GetString(), buf.GetSize());
+  return msg;
+}
+
+/// Queue a message for sending in a session.
+///
+/// @param [in, out] ctx
+///    Context of the session.
+/// @param [in] msg
+///    The message to send, starting at `LWS_PRE` offset.
+static void send_msg(peer_ctx &ctx, std::string msg) {
+  ctx.tx_queue.emplace_back(std::move(msg));
+  lws_callback_on_writable(ctx.wsi);
+}
+
+/// Serialize apps and depots owned by local accounts. Must be called with
+///    @ref ts3_state::manifest_mtx locked.
+///
+/// @return JSON object with app entries in @ref ts3_state::apps format,
+///    listing only depots that have owning accounts.
+static std::string serialize_owned() {
+  rapidjson::StringBuffer buf;
+  rapidjson::Writer writer{buf};
+  writer.StartObject();
+  for (const auto &[app_id, app] : state.apps) {
+    auto owned{app.depots | std::views::filter([](const auto &pair) {
+                 return !pair.second.accs.empty();
+               }) |
+               std::views::keys};
+    if (owned.empty()) {
+      continue;
+    }
+    write_id_key(writer, app_id);
+    writer.StartObject();
+    std::string_view str{"name"};
+    writer.Key(str.data(), str.length());
+    writer.String(app.name.data(), app.name.length());
+    if (app.pics_access_token) {
+      str = "pics_at";
+      writer.Key(str.data(), str.length());
+      writer.Uint64(app.pics_access_token);
+    }
+    str = "depots";
+    writer.Key(str.data(), str.length());
+    writer.StartArray();
+    for (const auto depot_id : owned) {
+      writer.Uint(depot_id);
+    }
+    writer.EndArray();
+    writer.EndObject();
+  }
+  writer.EndObject();
+  return {buf.GetString(), buf.GetSize()};
+}
+
+/// Serialize a sync message.
+///
+/// @param [in] keys
+///    Range of depot ID/key pairs to include.
+/// @param [in] owned
+///    Pointer to the serialized owned apps/depots to include, or `nullptr` if
+///    they haven't changed.
+/// @return The serialized message, starting at `LWS_PRE` offset.
+template <typename Keys>
+static std::string serialize_sync(Keys &&keys,
+                                  const std::string *_Nullable owned) {
+  rapidjson::StringBuffer buf;
+  rapidjson::Writer writer{buf};
+  writer.StartObject();
+  std::string_view str{"type"};
+  writer.Key(str.data(), str.length());
+  str = "sync";
+  writer.String(str.data(), str.length());
+  str = "depot_keys";
+  writer.Key(str.data(), str.length());
+  writer.StartObject();
+  for (const auto &[depot_id, key] : keys) {
+    write_id_key(writer, depot_id);
+    std::array<char, 44> b64_key;
+    ts3_u_base64_encode_keys(key.data(), key.size(), 1, b64_key.data());
+    writer.String(b64_key.data(), b64_key.size());
+  }
+  writer.EndObject();
+  if (owned) {
+    str = "apps";
+    writer.Key(str.data(), str.length());
+    writer.RawValue(owned->data(), owned->length(), rapidjson::kObjectType);
+  }
+  writer.EndObject();
+  return wrap_msg(buf);
+}
+
+/// Remove depots that are owned neither by local accounts nor by peers, and
+///    apps that are left without depots. Must be called with
+///    @ref ts3_state::manifest_mtx locked. During setup, depots loaded from
+///    the state file have no owning accounts yet, so nothing is removed.
+///
+/// @return Value indicating whether anything has been removed.
+static bool prune() {
+  if (state.cur_status.load(std::memory_order::relaxed) != status::running) {
+    return false;
+  }
+  bool pruned{};
+  for (auto &app : state.apps | std::views::values) {
+    if (erase_if(app.depots, [](const auto &pair) {
+          return pair.second.accs.empty() && !pair.second.peers;
+        })) {
+      pruned = true;
+    }
+  }
+  if (erase_if(state.apps,
+               [](const auto &app) { return app.second.depots.empty(); })) {
+    pruned = true;
+  }
+  return pruned;
+}
+
+/// Update the manifest after merging changes from peers, or schedule a retry
+///    if manifest downloads are in progress. Must be called with
+///    @ref ts3_state::manifest_mtx locked. During setup, the update is left to
+///    its completion.
+static void refresh_manifest() {
+  if (state.cur_status.load(std::memory_order::relaxed) != status::running) {
+    return;
+  }
+  peer_update_manifest();
+}
+
+/// libwebsockets scheduled callback that retries a manifest update blocked by
+///    active downloads.
+///
+/// @param [in] sul
+///    Pointer to @ref peer_replicator::update_sul.
+[[using gnu: nonnull(1), access(read_only, 1)]]
+static void retry_update(lws_sorted_usec_list_t *_Nonnull) {
+  const std::scoped_lock lock{state.manifest_mtx};
+  if (state.manifest_dirty || state.state_dirty) {
+    refresh_manifest();
+  }
+}
+
+/// Check whether a session is the one that a hot standby maintains with its
+///    primary.
+///
+/// @param [in] ctx
+///    Context of the session.
+/// @return Value indicating whether the session is with the primary.
+static bool is_primary(const peer_ctx &ctx) noexcept {
+  return state.standby && ctx.endpoint == &state.peers.front();
+}
+
+/// Serialize tokens of local accounts. Must be called with
+///    @ref ts3_state::manifest_mtx locked.
+///
+/// @return JSON array of token strings, excluding accounts being removed.
+static std::string serialize_accounts() {
+  rapidjson::StringBuffer buf;
+  rapidjson::Writer writer{buf};
+  writer.StartArray();
+  for (const auto &acc : state.accounts | std::views::values) {
+    if (acc.rem_status.load(std::memory_order::relaxed) ==
+        remove_status::none) {
+      writer.String(acc.token.data(), acc.token.length());
+    }
+  }
+  writer.EndArray();
+  return {buf.GetString(), buf.GetSize()};
+}
+
+/// Serialize a state message for hot standbys.
+///
+/// @param [in] accounts
+///    Pointer to the serialized account tokens to include, or `nullptr` if
+///    they haven't changed.
+/// @param [in] mrcs
+///    Range of @ref standby_mrc entries to include.
+/// @return The serialized message, starting at `LWS_PRE` offset.
+template <typename Mrcs>
+static std::string serialize_state(const std::string *_Nullable accounts,
+                                   Mrcs &&mrcs) {
+  rapidjson::StringBuffer buf;
+  rapidjson::Writer writer{buf};
+  writer.StartObject();
+  std::string_view str{"type"};
+  writer.Key(str.data(), str.length());
+  str = "state";
+  writer.String(str.data(), str.length());
+  if (accounts) {
+    str = "accounts";
+    writer.Key(str.data(), str.length());
+    writer.RawValue(accounts->data(), accounts->length(),
+                    rapidjson::kArrayType);
+  }
+  str = "mrcs";
+  writer.Key(str.data(), str.length());
+  writer.StartArray();
+  for (const auto &entry : mrcs) {
+    writer.StartArray();
+    writer.Uint64(entry.manifest_id);
+    writer.Uint64(entry.mrc);
+    writer.Int64(entry.expires);
+    writer.EndArray();
+  }
+  writer.EndArray();
+  writer.EndObject();
+  return wrap_msg(buf);
+}
+
+/// Make local accounts match the primary's account tokens, creating CM
+///    clients for new accounts without connecting them. Must be called with
+///    @ref ts3_state::manifest_mtx locked.
+///
+/// @param [in] tokens
+///    JSON array of the primary's account tokens.
+/// @return Value indicating whether any accounts have been changed.
+static bool mirror_accounts(const rapidjson::Value &tokens) {
+  const auto now{std::chrono::system_clock::to_time_t(
+      std::chrono::system_clock::now())};
+  std::set<std::uint64_t> listed;
+  bool changed{};
+  for (const auto &token_val : tokens.GetArray()) {
+    if (!token_val.IsString()) {
+      continue;
+    }
+    std::string token{token_val.GetString(), token_val.GetStringLength()};
+    const auto token_info{tek_sc_cm_parse_auth_token(token.data())};
+    if (!token_info.steam_id || token_info.expires < now) {
+      continue;
+    }
+    listed.emplace(token_info.steam_id);
+    if (const auto it{state.accounts.find(token_info.steam_id)};
+        it != state.accounts.end()) {
+      // The primary may have renewed the token
+      if (it->second.token != token) {
+        it->second.token = std::move(token);
+        it->second.token_info = token_info;
+        changed = true;
+      }
+      continue;
+    }
+    const auto cm_client{tek_sc_cm_client_create(state.tek_sc_ctx, nullptr)};
+    if (!cm_client) {
+      std::println(std::cerr, "tek_sc_cm_client_create failed");
+      continue;
+    }
+    auto &acc{state.accounts
+                  .try_emplace(token_info.steam_id, lws_sorted_usec_list_t{},
+                               cm_client, std::move(token), token_info,
+                               renew_status::not_scheduled,
+                               remove_status::none, false, 0,
+                               std::shared_ptr<cancel_token>{})
+                  .first->second};
+    assign_acc_index(acc);
+    tek_sc_cm_set_user_data(cm_client, &acc);
+    changed = true;
+  }
+  for (auto it{state.accounts.begin()}; it != state.accounts.end();) {
+    if (listed.contains(it->first)) {
+      ++it;
+      continue;
+    }
+    // The client has never been connected, so it can be destroyed right away
+    state.acc_slots[it->second.index] = nullptr;
+    tek_sc_cm_client_destroy(it->second.cm_client);
+    it = state.accounts.erase(it);
+    changed = true;
+  }
+  return changed;
+}
+
+/// libwebsockets scheduled callback that connects the next account of a
+///    promoted standby to CM.
+///
+/// @param [in, out] sul
+///    Pointer to @ref peer_replicator::connect_sul.
+[[using gnu: nonnull(1), access(read_write, 1)]]
+static void connect_next(lws_sorted_usec_list_t *_Nonnull sul) {
+  if (state.cur_status.load(std::memory_order::relaxed) == status::stopping) {
+    return;
+  }
+  std::unique_lock lock{state.manifest_mtx};
+  const auto it{state.accounts.upper_bound(repl.last_connected)};
+  if (it == state.accounts.end()) {
+    return;
+  }
+  repl.last_connected = it->first;
+  const auto cm_client{it->second.cm_client};
+  lock.unlock();
+  tek_sc_cm_connect(cm_client, cb_connected, 5000, cb_disconnected);
+  sul->us = lws_now_usecs() + promote_connect_interval;
+  lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED, sul);
+}
+
+/// libwebsockets scheduled callback that promotes a hot standby whose primary
+///    hasn't reconnected within @ref ts3_state::failover_timeout.
+///
+/// @param [in] sul
+///    Pointer to @ref peer_replicator::failover_sul.
+[[using gnu: nonnull(1), access(read_only, 1)]]
+static void promote(lws_sorted_usec_list_t *_Nonnull) {
+  if (!state.standby ||
+      state.cur_status.load(std::memory_order::relaxed) == status::stopping) {
+    return;
+  }
+  std::println("Primary is unreachable; promoting this node to primary");
+  state.standby = false;
+  std::unique_lock lock{state.manifest_mtx};
+  if (repl.primary_node >= 0) {
+    // Depots owned only by the primary stay in the manifest, since setup
+    //    doesn't prune them until all accounts are ready
+    const auto mask{~(std::uint64_t{1} << repl.primary_node)};
+    for (auto &app : state.apps | std::views::values) {
+      for (auto &depot : app.depots | std::views::values) {
+        depot.peers &= mask;
+      }
+    }
+    repl.primary_node = -1;
+  }
+  if (state.accounts.empty()) {
+    if (prune()) {
+      state.manifest_dirty = true;
+      refresh_manifest();
+    }
+    return;
+  }
+  state.num_ready_accs = 0;
+  state.hot_manifest = true;
+  state.cur_status.store(status::setup, std::memory_order::relaxed);
+  lock.unlock();
+  repl.last_connected = 0;
+  connect_next(&repl.connect_sul);
+}
+
+/// Schedule promotion of a hot standby after @ref ts3_state::failover_timeout.
+static void schedule_failover() {
+  repl.failover_sul.us = lws_now_usecs() + state.failover_timeout;
+  lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED,
+                    &repl.failover_sul);
+}
+
+/// Drop ownership of all depots by a node that has no sessions left.
+///
+/// @param node
+///    Index of the node in the node table.
+static void drop_node(int node) {
+  const std::scoped_lock lock{state.manifest_mtx};
+  const auto mask{~(std::uint64_t{1} << node)};
+  for (auto &app : state.apps | std::views::values) {
+    for (auto &depot : app.depots | std::views::values) {
+      depot.peers &= mask;
+    }
+  }
+  if (prune()) {
+    state.manifest_dirty = true;
+    refresh_manifest();
+  }
+}
+
+/// Start an outbound session.
+///
+/// @param [in, out] ctx
+///    Context of the session.
+static void connect(peer_ctx &ctx) {
+  lws_client_connect_info info{};
+  info.context = state.lws_ctx;
+  info.address = ctx.endpoint->host.data();
+  info.port = ctx.endpoint->port;
+  info.path = "/peer";
+  info.host = info.address;
+  info.origin = info.address;
+  info.protocol = protocol.name;
+  info.local_protocol_name = protocol.name;
+  if (ctx.endpoint->tls) {
+    info.ssl_connection = LCCSCF_USE_SSL;
+  }
+  info.userdata = &ctx;
+  info.pwsi = &ctx.wsi;
+  // On failure, the connection error callback schedules the next attempt
+  lws_client_connect_via_info(&info);
+}
+
+/// libwebsockets scheduled callback that reconnects an outbound session.
+///
+/// @param [in] sul
+///    Pointer to @ref peer_ctx::sul of the session.
+[[using gnu: nonnull(1), access(read_only, 1)]]
+static void reconnect(lws_sorted_usec_list_t *_Nonnull sul) {
+  connect(*reinterpret_cast<peer_ctx *>(sul));
+}
+
+/// Queue the challenge message in an inbound session.
+///
+/// @param [in, out] ctx
+///    Context of the session, with @ref peer_ctx::nonce generated.
+static void send_challenge(peer_ctx &ctx) {
+  rapidjson::StringBuffer buf;
+  rapidjson::Writer writer{buf};
+  writer.StartObject();
+  std::string_view str{"type"};
+  writer.Key(str.data(), str.length());
+  str = "challenge";
+  writer.String(str.data(), str.length());
+  str = "nonce";
+  writer.Key(str.data(), str.length());
+  const auto nonce{to_hex(ctx.nonce)};
+  writer.String(nonce.data(), nonce.length());
+  writer.EndObject();
+  send_msg(ctx, wrap_msg(buf));
+}
+
+/// Queue the hello message in a session.
+///
+/// @param [in, out] ctx
+///    Context of the session. For outbound sessions, @ref peer_ctx::nonce
+///    must be generated.
+/// @param challenge
+///    Nonce generated by the other node.
+static void send_hello(peer_ctx &ctx,
+                       std::span<const unsigned char> challenge) {
+  rapidjson::StringBuffer buf;
+  rapidjson::Writer writer{buf};
+  writer.StartObject();
+  std::string_view str{"type"};
+  writer.Key(str.data(), str.length());
+  str = "hello";
+  writer.String(str.data(), str.length());
+  str = "node_id";
+  writer.Key(str.data(), str.length());
+  writer.String(state.node_id.data(), state.node_id.length());
+  std::array<unsigned char, 32> proof;
+  if (ctx.endpoint) {
+    str = "nonce";
+    writer.Key(str.data(), str.length());
+    const auto nonce{to_hex(ctx.nonce)};
+    writer.String(nonce.data(), nonce.length());
+    proof = make_proof("connect", challenge, ctx.nonce, state.node_id);
+  } else {
+    proof = make_proof("accept", challenge, {}, state.node_id);
+  }
+  str = "proof";
+  writer.Key(str.data(), str.length());
+  const auto proof_hex{to_hex(proof)};
+  writer.String(proof_hex.data(), proof_hex.length());
+  str = "shard_accounts";
+  writer.Key(str.data(), str.length());
+  writer.Bool(state.shard_accounts);
+  if (is_primary(ctx)) {
+    str = "standby";
+    writer.Key(str.data(), str.length());
+    writer.Bool(true);
+  }
+  writer.EndObject();
+  send_msg(ctx, wrap_msg(buf));
+}
+
+/// Process the challenge message in an outbound session, and answer it with
+///    the hello message.
+///
+/// @param [in, out] ctx
+///    Context of the session that received the message.
+/// @param [in] doc
+///    The parsed message.
+/// @return `0` on success, or a non-zero value to close the connection.
+static int process_challenge(peer_ctx &ctx, const rapidjson::Document &doc) {
+  const auto type{doc.FindMember("type")};
+  if (type == doc.MemberEnd() || !type->value.IsString() ||
+      std::string_view{type->value.GetString(),
+                       type->value.GetStringLength()} != "challenge") {
+    return 1;
+  }
+  const auto nonce{doc.FindMember("nonce")};
+  std::array<unsigned char, 32> challenge;
+  if (nonce == doc.MemberEnd() || !from_hex(nonce->value, challenge)) {
+    return 1;
+  }
+  if (lws_get_random(state.lws_ctx, ctx.nonce.data(), ctx.nonce.size()) !=
+      ctx.nonce.size()) {
+    return 1;
+  }
+  send_hello(ctx, challenge);
+  ctx.hello_sent = true;
+  return 0;
+}
+
+/// Process a hello message, and send the initial sync message if it's
+///    accepted, followed by the initial state message if the node is a hot
+///    standby. In inbound sessions, this node's hello message is sent first.
+///
+/// @param [in, out] ctx
+///    Context of the session that received the message.
+/// @param [in] doc
+///    The parsed message.
+/// @return `0` on success, or a non-zero value to close the connection.
+static int process_hello(peer_ctx &ctx, const rapidjson::Document &doc) {
+  const auto type{doc.FindMember("type")};
+  if (type == doc.MemberEnd() || !type->value.IsString() ||
+      std::string_view{type->value.GetString(),
+                       type->value.GetStringLength()} != "hello") {
+    return 1;
+  }
+  const auto node_id{doc.FindMember("node_id")};
+  if (node_id == doc.MemberEnd() || !node_id->value.IsString() ||
+      !node_id->value.GetStringLength()) {
+    return 1;
+  }
+  const std::string_view id{node_id->value.GetString(),
+                            node_id->value.GetStringLength()};
+  if (id == state.node_id) {
+    // The node has connected to itself
+    return 1;
+  }
+  // The connecting node proves knowledge of the secret first, so the
+  //    accepting one doesn't answer anything but challenges to unauthenticated
+  //    clients
+  std::array<unsigned char, 32> peer_nonce;
+  std::array<unsigned char, 32> expected;
+  if (ctx.endpoint) {
+    expected = make_proof("accept", ctx.nonce, {}, id);
+  } else {
+    const auto nonce{doc.FindMember("nonce")};
+    if (nonce == doc.MemberEnd() || !from_hex(nonce->value, peer_nonce)) {
+      return 1;
+    }
+    expected = make_proof("connect", ctx.nonce, peer_nonce, id);
+  }
+  if (const auto proof{doc.FindMember("proof")};
+      proof == doc.MemberEnd() || !proof_matches(proof->value, expected)) {
+    std::println(std::cerr,
+                 "Peer failed to prove knowledge of the secret; closing the "
+                 "session");
+    return 1;
+  }
+  if (!ctx.endpoint) {
+    send_hello(ctx, peer_nonce);
+  }
+  auto node{std::ranges::find(repl.nodes, id, &peer_node::id)};
+  if (node == repl.nodes.end()) {
+    // Reuse the slot of a node without sessions, its ownership has already
+    //    been dropped unless it's the primary of a hot standby
+    node = std::ranges::find_if(
+        repl.nodes, [first = repl.nodes.data()](const auto &entry) {
+          return !entry.num_sessions && &entry - first != repl.primary_node;
+        });
+    if (node != repl.nodes.end()) {
+      node->id = id;
+    } else if (repl.nodes.size() < max_peer_nodes) {
+      node = repl.nodes.emplace(repl.nodes.end(), std::string{id}, 0);
+    } else {
+      std::println(std::cerr,
+                   "Peer node limit reached; rejecting session with node {}",
+                   id);
+      return 1;
+    }
+  }
+  if (!node->num_sessions++) {
+    std::println("Peer node {} connected", id);
+  }
+  const auto shard_accounts{doc.FindMember("shard_accounts")};
+  node->shards = shard_accounts != doc.MemberEnd() &&
+                 shard_accounts->value.IsBool() &&
+                 shard_accounts->value.GetBool();
+  ctx.node = static_cast<int>(node - repl.nodes.begin());
+  if (is_primary(ctx)) {
+    lws_sul_cancel(&repl.failover_sul);
+    if (repl.primary_node >= 0 && repl.primary_node != ctx.node &&
+        !repl.nodes[repl.primary_node].num_sessions) {
+      // The primary has restarted with a different ID
+      drop_node(repl.primary_node);
+    }
+    repl.primary_node = ctx.node;
+  }
+  const auto standby{doc.FindMember("standby")};
+  ctx.standby = standby != doc.MemberEnd() && standby->value.IsBool() &&
+                standby->value.GetBool();
+  if (ctx.standby &&
+      std::ranges::find(state.standbys, id) == state.standbys.end()) {
+    // Account tokens are only sent to explicitly configured standbys, rather
+    //    than to any node that asks for them
+    std::println(std::cerr,
+                 "Peer node {} requested to be a hot standby, but it's not "
+                 "listed in standbys; treating it as a regular peer",
+                 id);
+    ctx.standby = false;
+  }
+  // The set of nodes has changed, which may change account owners
+  peer_notify();
+  const std::scoped_lock lock{state.manifest_mtx};
+  const auto owned{serialize_owned()};
+  send_msg(ctx, serialize_sync(state.depot_keys, &owned));
+  if (ctx.standby) {
+    std::println("Peer node {} is a hot standby of this node", id);
+    const auto now{std::chrono::system_clock::to_time_t(
+        std::chrono::system_clock::now())};
+    const auto now_us{lws_now_usecs()};
+    std::vector<standby_mrc> mrcs;
+    mrcs.reserve(state.mrcs.size());
+    for (const auto &[manifest_id, entry] : state.mrcs) {
+      mrcs.emplace_back(manifest_id, entry.mrc,
+                        now + (entry.sul.us - now_us) / LWS_US_PER_SEC);
+    }
+    const auto accounts{serialize_accounts()};
+    send_msg(ctx, serialize_state(&accounts, mrcs));
+  }
+  return 0;
+}
+
+/// Merge a sync message into the manifest.
+///
+/// @param [in] ctx
+///    Context of the session that received the message.
+/// @param [in] doc
+///    The parsed message.
+/// @return `0` on success, or a non-zero value to close the connection.
+static int process_sync(const peer_ctx &ctx, const rapidjson::Document &doc) {
+  const std::scoped_lock lock{state.manifest_mtx};
+  bool changed{};
+  if (const auto depot_keys{doc.FindMember("depot_keys")};
+      depot_keys != doc.MemberEnd() && depot_keys->value.IsObject()) {
+    for (const auto &[id, b64_key] : depot_keys->value.GetObject()) {
+      std::uint32_t depot_id;
+      if (!parse_id_key(id, depot_id) || !b64_key.IsString() ||
+          b64_key.GetStringLength() != 44) {
+        continue;
+      }
+      depot_key key;
+      if (!ts3_u_base64_decode_keys(b64_key.GetString(), 1, key.data(),
+                                    key.size())) {
+        continue;
+      }
+      if (state.depot_keys.try_emplace(depot_id, key).second) {
+        changed = true;
+      }
+    }
+  }
+  if (const auto apps{doc.FindMember("apps")};
+      apps != doc.MemberEnd() && apps->value.IsObject()) {
+    // The message lists all depots owned by the node, replacing previous
+    //    ownership
+    const auto bit{std::uint64_t{1} << ctx.node};
+    for (auto &app : state.apps | std::views::values) {
+      for (auto &depot : app.depots | std::views::values) {
+        depot.peers &= ~bit;
+      }
+    }
+    for (const auto &[id, app_ent] : apps->value.GetObject()) {
+      std::uint32_t app_id;
+      if (!parse_id_key(id, app_id) || !app_ent.IsObject()) {
+        continue;
+      }
+      const auto depots{app_ent.FindMember("depots")};
+      if (depots == app_ent.MemberEnd() || !depots->value.IsArray() ||
+          depots->value.Empty()) {
+        continue;
+      }
+      auto &app{state.apps.try_emplace(app_id).first->second};
+      if (const auto name{app_ent.FindMember("name")};
+          app.name.empty() && name != app_ent.MemberEnd() &&
+          name->value.IsString()) {
+        app.name = {name->value.GetString(), name->value.GetStringLength()};
+      }
+      if (const auto pics_at{app_ent.FindMember("pics_at")};
+          !app.pics_access_token && pics_at != app_ent.MemberEnd() &&
+          pics_at->value.IsUint64()) {
+        app.pics_access_token = pics_at->value.GetUint64();
+      }
+      for (const auto &depot_id : depots->value.GetArray()) {
+        if (!depot_id.IsUint()) {
+          continue;
+        }
+        const auto [it, emplaced]{app.depots.try_emplace(
+            static_cast<std::uint32_t>(depot_id.GetUint()))};
+        if (emplaced) {
+          changed = true;
+        }
+        it->second.peers |= bit;
+      }
+    }
+    // Apps without valid depots may have been created above
+    if (prune()) {
+      changed = true;
+    }
+  }
+  if (changed) {
+    state.manifest_dirty = true;
+    refresh_manifest();
+  }
+  return 0;
+}
+
+/// Serialize a manifest request code response message.
+///
+/// @param [in] req
+///    The completed request.
+/// @param id
+///    ID assigned to the request by the node that sent it.
+/// @return The serialized message, starting at `LWS_PRE` offset.
+static std::string serialize_mrc_res(const mrc_request &req,
+                                     std::uint64_t id) {
+  rapidjson::StringBuffer buf;
+  rapidjson::Writer writer{buf};
+  writer.StartObject();
+  std::string_view str{"type"};
+  writer.Key(str.data(), str.length());
+  str = "mrc_res";
+  writer.String(str.data(), str.length());
+  str = "id";
+  writer.Key(str.data(), str.length());
+  writer.Uint64(id);
+  str = "status";
+  writer.Key(str.data(), str.length());
+  writer.Int(req.status);
+  if (req.status == HTTP_STATUS_OK) {
+    str = "mrc";
+    writer.Key(str.data(), str.length());
+    writer.Uint64(req.mrc);
+  }
+  writer.EndObject();
+  return wrap_msg(buf);
+}
+
+/// Process a manifest request code request forwarded by a peer node.
+///
+/// @param [in, out] ctx
+///    Context of the session that received the message.
+/// @param [in] doc
+///    The parsed message.
+/// @return `0` on success, or a non-zero value to close the connection.
+static int process_mrc(peer_ctx &ctx, const rapidjson::Document &doc) {
+  const auto id{doc.FindMember("id")};
+  const auto app_id{doc.FindMember("app_id")};
+  const auto depot_id{doc.FindMember("depot_id")};
+  const auto manifest_id{doc.FindMember("manifest_id")};
+  if (id == doc.MemberEnd() || !id->value.IsUint64() ||
+      app_id == doc.MemberEnd() || !app_id->value.IsUint() ||
+      depot_id == doc.MemberEnd() || !depot_id->value.IsUint() ||
+      manifest_id == doc.MemberEnd() || !manifest_id->value.IsUint64()) {
+    return 1;
+  }
+  if (mrc_request req{}; mrc_cache_find(manifest_id->value.GetUint64(),
+                                        req.mrc, req.rem_time)) {
+    req.status = HTTP_STATUS_OK;
+    send_msg(ctx, serialize_mrc_res(req, id->value.GetUint64()));
+    return 0;
+  }
+  if (state.cur_status.load(std::memory_order::relaxed) != status::running) {
+    mrc_request req{};
+    req.status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+    send_msg(ctx, serialize_mrc_res(req, id->value.GetUint64()));
+    return 0;
+  }
+  // The request may complete right away, so count it beforehand
+  ++ctx.num_served;
+  mrc_submit_peer(ctx, id->value.GetUint64(), app_id->value.GetUint(),
+                  depot_id->value.GetUint(), manifest_id->value.GetUint64());
+  return 0;
+}
+
+/// Process a response to a forwarded manifest request code request.
+///
+/// @param [in] ctx
+///    Context of the session that received the message.
+/// @param [in] doc
+///    The parsed message.
+/// @return `0` on success, or a non-zero value to close the connection.
+static int process_mrc_res(const peer_ctx &ctx,
+                           const rapidjson::Document &doc) {
+  const auto id{doc.FindMember("id")};
+  const auto status{doc.FindMember("status")};
+  if (id == doc.MemberEnd() || !id->value.IsUint64() ||
+      status == doc.MemberEnd() || !status->value.IsInt()) {
+    return 1;
+  }
+  const auto it{repl.forwarded.find(id->value.GetUint64())};
+  if (it == repl.forwarded.end() || it->second.ctx != &ctx) {
+    // The request has been sent in a previous session
+    return 0;
+  }
+  auto &req{*it->second.req};
+  repl.forwarded.erase(it);
+  req.status = status->value.GetInt();
+  if (req.status == HTTP_STATUS_OK) {
+    const auto mrc{doc.FindMember("mrc")};
+    if (mrc == doc.MemberEnd() || !mrc->value.IsUint64()) {
+      req.status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    } else {
+      req.mrc = mrc->value.GetUint64();
+    }
+  } else if (req.status < 300 || req.status > 599) {
+    req.status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  }
+  mrc_forward_done(req);
+  return 0;
+}
+
+/// Queue the response to an account handover message.
+///
+/// @param [in, out] ctx
+///    Context of the session that the account has been received in.
+/// @param steam_id
+///    Steam ID of the account.
+/// @param accepted
+///    Value indicating whether the account has been taken over.
+static void send_account_res(peer_ctx &ctx, std::uint64_t steam_id,
+                             bool accepted) {
+  rapidjson::StringBuffer buf;
+  rapidjson::Writer writer{buf};
+  writer.StartObject();
+  std::string_view str{"type"};
+  writer.Key(str.data(), str.length());
+  str = "account_res";
+  writer.String(str.data(), str.length());
+  str = "steam_id";
+  writer.Key(str.data(), str.length());
+  writer.Uint64(steam_id);
+  str = "accepted";
+  writer.Key(str.data(), str.length());
+  writer.Bool(accepted);
+  writer.EndObject();
+  send_msg(ctx, wrap_msg(buf));
+}
+
+/// Take over an account handed over by a peer node if this node shares
+///    accounts, and respond whether it has been accepted.
+///
+/// @param [in, out] ctx
+///    Context of the session that received the message.
+/// @param [in] doc
+///    The parsed message.
+/// @return `0` on success, or a non-zero value to close the connection.
+static int process_account(peer_ctx &ctx, const rapidjson::Document &doc) {
+  const auto steam_id{doc.FindMember("steam_id")};
+  if (steam_id == doc.MemberEnd() || !steam_id->value.IsUint64()) {
+    return 1;
+  }
+  const auto token_member{doc.FindMember("token")};
+  if (token_member == doc.MemberEnd() || !token_member->value.IsString()) {
+    return 1;
+  }
+  const auto id{steam_id->value.GetUint64()};
+  // Only sharding nodes own handed over accounts. Hot standbys keep accounts
+  //    disconnected until promotion, and replicas have none
+  if (state.cur_status.load(std::memory_order::relaxed) == status::stopping ||
+      !state.shard_accounts || state.standby ||
+      !state.replica_of.host.empty()) {
+    send_account_res(ctx, id, false);
+    return 0;
+  }
+  std::string token{token_member->value.GetString(),
+                    token_member->value.GetStringLength()};
+  const auto token_info{tek_sc_cm_parse_auth_token(token.data())};
+  if (token_info.steam_id != id ||
+      token_info.expires < std::chrono::system_clock::to_time_t(
+                               std::chrono::system_clock::now())) {
+    std::println(std::cerr,
+                 "Peer node {} handed over account {} with invalid token",
+                 repl.nodes[ctx.node].id, id);
+    send_account_res(ctx, id, false);
+    return 0;
+  }
+  std::unique_lock lock{state.manifest_mtx};
+  if (state.accounts.contains(id)) {
+    // Already taken over, so the node may drop it
+    send_account_res(ctx, id, true);
+    return 0;
+  }
+  const auto cm_client{tek_sc_cm_client_create(state.tek_sc_ctx, nullptr)};
+  if (!cm_client) {
+    std::println(std::cerr, "tek_sc_cm_client_create failed");
+    send_account_res(ctx, id, false);
+    return 0;
+  }
+  auto &acc{state.accounts
+                .try_emplace(id, lws_sorted_usec_list_t{}, cm_client,
+                             std::move(token), token_info,
+                             renew_status::not_scheduled,
+                             remove_status::none, false, 0,
+                             std::shared_ptr<cancel_token>{})
+                .first->second};
+  assign_acc_index(acc);
+  tek_sc_cm_set_user_data(cm_client, &acc);
+  state.state_dirty = true;
+  refresh_manifest();
+  lock.unlock();
+  send_account_res(ctx, id, true);
+  std::println("Took over account {} from a peer node", id);
+  tek_sc_cm_connect(cm_client, cb_connected, 5000, cb_disconnected);
+  return 0;
+}
+
+/// Process the response to an account handover message, and remove the
+///    account if it has been accepted.
+///
+/// @param [in] ctx
+///    Context of the session that received the message.
+/// @param [in] doc
+///    The parsed message.
+/// @return `0` on success, or a non-zero value to close the connection.
+static int process_account_res(const peer_ctx &ctx,
+                               const rapidjson::Document &doc) {
+  const auto steam_id{doc.FindMember("steam_id")};
+  if (steam_id == doc.MemberEnd() || !steam_id->value.IsUint64()) {
+    return 1;
+  }
+  const auto accepted{doc.FindMember("accepted")};
+  if (accepted == doc.MemberEnd() || !accepted->value.IsBool()) {
+    return 1;
+  }
+  const auto id{steam_id->value.GetUint64()};
+  const auto it{repl.handovers.find(id)};
+  if (it == repl.handovers.end() || it->second.ctx != &ctx ||
+      it->second.rejected) {
+    return 0;
+  }
+  if (!accepted->value.GetBool()) {
+    std::println(std::cerr, "Peer node {} rejected account {}, keeping it",
+                 repl.nodes[ctx.node].id, id);
+    it->second.rejected = true;
+    return 0;
+  }
+  repl.handovers.erase(it);
+  std::unique_lock lock{state.manifest_mtx};
+  const auto acc_it{state.accounts.find(id)};
+  if (acc_it == state.accounts.end()) {
+    return 0;
+  }
+  auto &acc{acc_it->second};
+  if (acc.rem_status.load(std::memory_order::relaxed) !=
+      remove_status::none) {
+    return 0;
+  }
+  std::println("Handed account {} over to peer node {}", id,
+               repl.nodes[ctx.node].id);
+  // Remove the account the same way as one with a revoked token
+  acc.rem_status.store(remove_status::pending_remove,
+                       std::memory_order::relaxed);
+  unlink_acc_depots(acc, false);
+  state.state_dirty = true;
+  if (prune()) {
+    state.manifest_dirty = true;
+  }
+  refresh_manifest();
+  const auto cm_client{acc.cm_client};
+  lock.unlock();
+  tek_sc_cm_disconnect(cm_client);
+  return 0;
+}
+
+/// Mirror a state message received from the primary.
+///
+/// @param [in] ctx
+///    Context of the session that received the message.
+/// @param [in] doc
+///    The parsed message.
+/// @return `0` on success, or a non-zero value to close the connection.
+static int process_state(const peer_ctx &ctx, const rapidjson::Document &doc) {
+  if (!is_primary(ctx)) {
+    // Only the primary's state is mirrored, a promoted standby may still
+    //    receive messages sent before its promotion
+    return 0;
+  }
+  if (const auto mrcs{doc.FindMember("mrcs")};
+      mrcs != doc.MemberEnd() && mrcs->value.IsArray()) {
+    for (const auto &entry : mrcs->value.GetArray()) {
+      if (!entry.IsArray() || entry.Size() != 3 || !entry[0].IsUint64() ||
+          !entry[1].IsUint64() || !entry[2].IsInt64()) {
+        continue;
+      }
+      mrc_cache_put(entry[0].GetUint64(), entry[1].GetUint64(),
+                    entry[2].GetInt64());
+    }
+  }
+  if (const auto accounts{doc.FindMember("accounts")};
+      accounts != doc.MemberEnd() && accounts->value.IsArray()) {
+    const std::scoped_lock lock{state.manifest_mtx};
+    if (mirror_accounts(accounts->value)) {
+      state.state_dirty = true;
+      refresh_manifest();
+    }
+  }
+  return 0;
+}
+
+/// Process a message received after the hello message.
+///
+/// @param [in, out] ctx
+///    Context of the session that received the message.
+/// @param [in] doc
+///    The parsed message.
+/// @return `0` on success, or a non-zero value to close the connection.
+static int process_msg(peer_ctx &ctx, const rapidjson::Document &doc) {
+  const auto type{doc.FindMember("type")};
+  if (type == doc.MemberEnd() || !type->value.IsString()) {
+    return 1;
+  }
+  const std::string_view type_view{type->value.GetString(),
+                                   type->value.GetStringLength()};
+  if (type_view == "sync") {
+    return process_sync(ctx, doc);
+  }
+  if (type_view == "mrc") {
+    return process_mrc(ctx, doc);
+  }
+  if (type_view == "mrc_res") {
+    return process_mrc_res(ctx, doc);
+  }
+  if (type_view == "account") {
+    return process_account(ctx, doc);
+  }
+  if (type_view == "account_res") {
+    return process_account_res(ctx, doc);
+  }
+  if (type_view == "state") {
+    return process_state(ctx, doc);
+  }
+  return 1;
+}
+
+/// Hand accounts over to peer nodes that have higher rendezvous hash scores
+///    for them among sharding nodes. Accounts are kept until the nodes accept
+///    them.
+static void rebalance() {
+  if (!state.shard_accounts ||
+      state.cur_status.load(std::memory_order::relaxed) != status::running) {
+    return;
+  }
+  const std::scoped_lock lock{state.manifest_mtx};
+  for (const auto &[steam_id, acc] : state.accounts) {
+    if (acc.rem_status.load(std::memory_order::relaxed) !=
+        remove_status::none) {
+      continue;
+    }
+    peer_ctx *target{};
+    auto best_score{hrw_score(state.node_id, steam_id)};
+    for (const auto ctx : repl.sessions) {
+      if (ctx->node < 0 || !repl.nodes[ctx->node].shards) {
+        continue;
+      }
+      if (const auto score{hrw_score(repl.nodes[ctx->node].id, steam_id)};
+          score > best_score) {
+        best_score = score;
+        target = ctx;
+      }
+    }
+    if (!target) {
+      continue;
+    }
+    if (const auto it{repl.handovers.find(steam_id)};
+        it != repl.handovers.end() &&
+        (!it->second.rejected || it->second.ctx == target)) {
+      // Either awaiting response, or already rejected by the same node
+      continue;
+    }
+    rapidjson::StringBuffer buf;
+    rapidjson::Writer writer{buf};
+    writer.StartObject();
+    std::string_view str{"type"};
+    writer.Key(str.data(), str.length());
+    str = "account";
+    writer.String(str.data(), str.length());
+    str = "steam_id";
+    writer.Key(str.data(), str.length());
+    writer.Uint64(steam_id);
+    str = "token";
+    writer.Key(str.data(), str.length());
+    writer.String(acc.token.data(), acc.token.length());
+    writer.EndObject();
+    send_msg(*target, wrap_msg(buf));
+    std::println("Handing account {} over to peer node {}", steam_id,
+                 repl.nodes[target->node].id);
+    repl.handovers.insert_or_assign(steam_id,
+                                    handover{.ctx = target, .rejected = false});
+  }
+}
+
+} // namespace
+
+//===-- Internal functions ------------------------------------------------===//
+
+void peer_update_manifest() {
+  if (state.download_lock.locked()) {
+    // Streams are sending current manifest buffers, which can't be replaced
+    //    under them
+    repl.update_sul.us = lws_now_usecs() + LWS_US_PER_SEC;
+    lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED,
+                      &repl.update_sul);
+    return;
+  }
+  update_manifest();
+}
+
+void peer_connect() {
+  repl.update_sul.cb = retry_update;
+  repl.failover_sul.cb = promote;
+  repl.connect_sul.cb = connect_next;
+  if (state.standby) {
+    // The primary may be down already
+    schedule_failover();
+  }
+  for (const auto &endpoint : state.peers) {
+    auto &ctx{*repl.outbound.emplace_back(std::make_unique<peer_ctx>())};
+    ctx.sul.cb = reconnect;
+    ctx.endpoint = &endpoint;
+    ctx.node = -1;
+    connect(ctx);
+  }
+}
+
+peer_ctx *peer_accept(lws *wsi) {
+  if (state.peer_secret.empty()) {
+    return nullptr;
+  }
+  auto ctx{std::make_unique<peer_ctx>()};
+  if (lws_get_random(state.lws_ctx, ctx->nonce.data(), ctx->nonce.size()) !=
+      ctx->nonce.size()) {
+    return nullptr;
+  }
+  ctx->wsi = wsi;
+  ctx->node = -1;
+  repl.sessions.emplace_back(ctx.get());
+  send_challenge(*ctx);
+  return ctx.release();
+}
+
+void peer_established(peer_ctx &ctx) {
+  repl.sessions.emplace_back(&ctx);
+  // The hello message is sent in response to the challenge
+  ctx.hello_sent = false;
+}
+
+int peer_receive(peer_ctx &ctx, const void *data, std::size_t size) {
+  if (lws_frame_is_binary(ctx.wsi)) {
+    return 1;
+  }
+  if (ctx.rx_msg.size() + size >
+      (ctx.node < 0 ? max_hello_size : max_msg_size)) {
+    return 1;
+  }
+  ctx.rx_msg.append(reinterpret_cast<const char *>(data), size);
+  if (lws_remaining_packet_payload(ctx.wsi) ||
+      !lws_is_final_fragment(ctx.wsi)) {
+    return 0;
+  }
+  rapidjson::Document doc;
+  doc.ParseInsitu<rapidjson::kParseStopWhenDoneFlag>(ctx.rx_msg.data());
+  int res{1};
+  if (!doc.HasParseError() && doc.IsObject()) {
+    if (ctx.node >= 0) {
+      res = process_msg(ctx, doc);
+    } else if (ctx.endpoint && !ctx.hello_sent) {
+      res = process_challenge(ctx, doc);
+    } else {
+      res = process_hello(ctx, doc);
+    }
+  }
+  ctx.rx_msg.clear();
+  return res;
+}
+
+int peer_write(peer_ctx &ctx) {
+  if (ctx.tx_queue.empty()) {
+    return 0;
+  }
+  auto &msg{ctx.tx_queue.front()};
+  const bool first{ctx.tx_offset == 0};
+  if (first) {
+    ctx.tx_offset = LWS_PRE;
+  }
+  const auto chunk_size{std::min(msg.size() - ctx.tx_offset, tx_size)};
+  const bool last{ctx.tx_offset + chunk_size == msg.size()};
+  // Bytes preceding the chunk have already been sent, so they serve as
+  //    LWS_PRE headroom for continuation frames
+  if (lws_write(ctx.wsi,
+                reinterpret_cast<unsigned char *>(&msg[ctx.tx_offset]),
+                chunk_size,
+                static_cast<lws_write_protocol>(
+                    lws_write_ws_flags(LWS_WRITE_TEXT, first, last))) <
+      static_cast<int>(chunk_size)) {
+    return 1;
+  }
+  if (last) {
+    ctx.tx_queue.pop_front();
+    ctx.tx_offset = 0;
+  } else {
+    ctx.tx_offset += chunk_size;
+  }
+  if (!ctx.tx_queue.empty()) {
+    lws_callback_on_writable(ctx.wsi);
+  }
+  return 0;
+}
+
+void peer_closed(peer_ctx &ctx) {
+  std::erase(repl.sessions, &ctx);
+  // Requests forwarded in this session won't get responses anymore
+  for (auto it{repl.forwarded.begin()}; it != repl.forwarded.end();) {
+    if (it->second.ctx != &ctx) {
+      ++it;
+      continue;
+    }
+    auto &req{*it->second.req};
+    it = repl.forwarded.erase(it);
+    req.status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+    mrc_forward_done(req);
+  }
+  // Accounts handed over in this session that haven't been accepted yet stay
+  //    with this node
+  erase_if(repl.handovers,
+           [&ctx](const auto &pair) { return pair.second.ctx == &ctx; });
+  if (ctx.node >= 0) {
+    auto &node{repl.nodes[ctx.node]};
+    if (!--node.num_sessions) {
+      std::println("Peer node {} disconnected", node.id);
+      if (state.standby && ctx.node == repl.primary_node) {
+        // Keep serving the primary's depots, they are taken over if it
+        //    doesn't come back
+        if (state.cur_status.load(std::memory_order::relaxed) !=
+            status::stopping) {
+          schedule_failover();
+        }
+      } else {
+        drop_node(ctx.node);
+      }
+      peer_notify();
+    }
+    ctx.node = -1;
+  }
+  ctx.wsi = nullptr;
+  if (!ctx.endpoint) {
+    // Requests from the node that are still being processed refer to the
+    //    context
+    if (!ctx.num_served) {
+      delete &ctx;
+    }
+    return;
+  }
+  ctx.rx_msg.clear();
+  ctx.tx_queue.clear();
+  ctx.tx_offset = 0;
+  if (state.cur_status.load(std::memory_order::relaxed) != status::stopping) {
+    ctx.sul.us = lws_now_usecs() + reconnect_delay;
+    lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED, &ctx.sul);
+  }
+}
+
+void peer_connect_failed(peer_ctx &ctx, const char *reason) {
+  std::println(std::cerr, "Failed to connect to peer {}:{}: {}",
+               ctx.endpoint->host, ctx.endpoint->port, reason);
+  peer_closed(ctx);
+}
+
+bool peer_forward(mrc_request &req, std::uint64_t nodes) {
+  peer_ctx *target{};
+  std::uint64_t best_score{};
+  for (const auto ctx : repl.sessions) {
+    if (ctx->node < 0 || !((nodes >> ctx->node) & 1)) {
+      continue;
+    }
+    if (const auto score{
+            hrw_score(repl.nodes[ctx->node].id, req.data.manifest_id)};
+        !target || score > best_score) {
+      best_score = score;
+      target = ctx;
+    }
+  }
+  if (!target) {
+    return false;
+  }
+  req.fwd_id = ++repl.last_fwd_id;
+  repl.forwarded.emplace(req.fwd_id, fwd_entry{.req = &req, .ctx = target});
+  rapidjson::StringBuffer buf;
+  rapidjson::Writer writer{buf};
+  writer.StartObject();
+  std::string_view str{"type"};
+  writer.Key(str.data(), str.length());
+  str = "mrc";
+  writer.String(str.data(), str.length());
+  str = "id";
+  writer.Key(str.data(), str.length());
+  writer.Uint64(req.fwd_id);
+  str = "app_id";
+  writer.Key(str.data(), str.length());
+  writer.Uint(req.data.app_id);
+  str = "depot_id";
+  writer.Key(str.data(), str.length());
+  writer.Uint(req.data.depot_id);
+  str = "manifest_id";
+  writer.Key(str.data(), str.length());
+  writer.Uint64(req.data.manifest_id);
+  writer.EndObject();
+  send_msg(*target, wrap_msg(buf));
+  return true;
+}
+
+void peer_mrc_done(mrc_request &req) {
+  auto &ctx{*req.peer};
+  if (ctx.node >= 0) {
+    send_msg(ctx, serialize_mrc_res(req, req.peer_req_id));
+  }
+  req.peer = nullptr;
+  mrc_release(req);
+  if (!--ctx.num_served && !ctx.wsi && !ctx.endpoint) {
+    delete &ctx;
+  }
+}
+
+void peer_mrc_cached(std::uint64_t manifest_id, std::uint64_t mrc,
+                     std::int64_t expires) {
+  std::string msg;
+  for (const auto ctx : repl.sessions) {
+    if (ctx->node < 0 || !ctx->standby) {
+      continue;
+    }
+    if (msg.empty()) {
+      msg = serialize_state(
+          nullptr, std::array{standby_mrc{.manifest_id = manifest_id,
+                                          .mrc = mrc,
+                                          .expires = expires}});
+    }
+    send_msg(*ctx, msg);
+  }
+}
+
+void peer_notify() {
+  if (state.peer_secret.empty()) {
+    return;
+  }
+  repl.notified.store(true, std::memory_order::relaxed);
+  if (state.cur_status.load(std::memory_order::relaxed) != status::stopping) {
+    lws_cancel_service(state.lws_ctx);
+  }
+}
+
+void peer_process() {
+  if (!repl.notified.exchange(false, std::memory_order::relaxed)) {
+    return;
+  }
+  rebalance();
+  const std::scoped_lock lock{state.manifest_mtx};
+  auto new_keys{state.depot_keys | std::views::filter([](const auto &pair) {
+                  return !std::ranges::binary_search(repl.sent_keys,
+                                                     pair.first);
+                })};
+  auto owned{serialize_owned()};
+  const bool owned_changed{owned != repl.sent_owned};
+  if (!new_keys.empty() || owned_changed) {
+    bool msg_built{};
+    std::string msg;
+    for (auto ctx : repl.sessions) {
+      if (ctx->node < 0) {
+        // The initial sync message will include current state
+        continue;
+      }
+      if (!msg_built) {
+        msg = serialize_sync(new_keys, owned_changed ? &owned : nullptr);
+        msg_built = true;
+      }
+      send_msg(*ctx, msg);
+    }
+    repl.sent_keys.clear();
+    std::ranges::copy(state.depot_keys | std::views::keys,
+                      std::back_inserter(repl.sent_keys));
+    repl.sent_owned = std::move(owned);
+  }
+  if (auto accounts{serialize_accounts()}; accounts != repl.sent_accounts) {
+    std::string msg;
+    for (auto ctx : repl.sessions) {
+      if (ctx->node < 0 || !ctx->standby) {
+        continue;
+      }
+      if (msg.empty()) {
+        msg = serialize_state(&accounts, std::array<standby_mrc, 0>{});
+      }
+      send_msg(*ctx, msg);
+    }
+    repl.sent_accounts = std::move(accounts);
+  }
+}
+
+void peer_stop() {
+  lws_sul_cancel(&repl.update_sul);
+  lws_sul_cancel(&repl.failover_sul);
+  lws_sul_cancel(&repl.connect_sul);
+  for (auto &ctx : repl.outbound) {
+    lws_sul_cancel(&ctx->sul);
+  }
+}
+
+} // namespace tek::s3
@@ -0,0 +1,168 @@
+//===-- peer.hpp - Peer replication declarations --------------------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Declarations of peer replication functions, which exchange depot keys and
+///    app ownership between tek-s3 instances over `/peer` WebSocket sessions.
+///    Unless stated otherwise, they must be called from the libwebsockets
+///    service thread.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include "null_attrs.h" // IWYU pragma: keep
+
+#include <cstddef>
+#include <cstdint>
+#include <libwebsockets.h>
+#include <string>
+
+namespace tek::s3 {
+
+/// Maximum number of distinct peer nodes that may be connected at once.
+constexpr std::size_t max_peer_nodes{64};
+
+/// Address of a peer node to connect to.
+struct peer_endpoint {
+  /// Host name or IP address of the node.
+  std::string host;
+  /// Port number that the node listens on.
+  int port;
+  /// Value indicating whether the node must be connected to via TLS.
+  bool tls;
+};
+
+/// Peer replication session context, opaque outside of peer.cpp.
+struct peer_ctx;
+struct mrc_request;
+
+/// Update the manifest, or schedule a retry if manifest downloads are in
+///    progress, since streams are sending current manifest buffers. The retry
+///    updates the manifest only if it's still dirty by then, and only once the
+///    server is running. Must be called with @ref ts3_state::manifest_mtx
+///    locked.
+[[gnu::visibility("internal")]]
+void peer_update_manifest();
+
+/// Start outbound sessions to all nodes listed in @ref ts3_state::peers. Must
+///    be called after the libwebsockets context has been created.
+[[gnu::visibility("internal")]]
+void peer_connect();
+
+/// Create a context for an inbound `/peer` session and send the challenge
+///    message. The hello message is sent only after the connecting node has
+///    proven that it knows the secret.
+///
+/// @param [in] wsi
+///    Pointer to the WebSocket instance of the session.
+/// @return Pointer to the created context, or `nullptr` if peer replication
+///    is disabled or a nonce can't be generated, in which case the connection
+///    should be closed.
+[[using gnu: visibility("internal"), nonnull(1)]]
+peer_ctx *_Nullable peer_accept(lws *_Nonnull wsi);
+
+/// Register an outbound session that has just been established. Its hello
+///    message is sent in response to the challenge from the other node.
+///
+/// @param [in, out] ctx
+///    Context of the session.
+[[gnu::visibility("internal")]]
+void peer_established(peer_ctx &ctx);
+
+/// Process a chunk of data received in a session. Messages may span multiple
+///    chunks, and are processed once complete.
+///
+/// @param [in, out] ctx
+///    Context of the session.
+/// @param [in] data
+///    Pointer to the received data.
+/// @param size
+///    Size of the data pointed to by @p data, in bytes.
+/// @return `0` on success, or a non-zero value to close the connection.
+[[using gnu: visibility("internal"), nonnull(2), access(read_only, 2, 3)]]
+int peer_receive(peer_ctx &ctx, const void *_Nonnull data, std::size_t size);
+
+/// Send the next chunk of pending outgoing messages in a session.
+///
+/// @param [in, out] ctx
+///    Context of the session.
+/// @return `0` on success, or a non-zero value to close the connection.
+[[gnu::visibility("internal")]]
+int peer_write(peer_ctx &ctx);
+
+/// Handle closure of a session. The node's ownership is dropped if it was its
+///    last session, inbound session contexts are freed, and outbound ones are
+///    scheduled for reconnection.
+///
+/// @param [in, out] ctx
+///    Context of the session.
+[[gnu::visibility("internal")]]
+void peer_closed(peer_ctx &ctx);
+
+/// Report a failed connection attempt of an outbound session, and schedule
+///    the next one.
+///
+/// @param [in, out] ctx
+///    Context of the session.
+/// @param [in] reason
+///    Error message provided by libwebsockets.
+[[using gnu: visibility("internal"), nonnull(2), access(read_only, 2)]]
+void peer_connect_failed(peer_ctx &ctx, const char *_Nonnull reason);
+
+/// Forward a manifest request code request to one of peer nodes owning the
+///    depot. The node is selected by rendezvous hashing of the manifest ID, so
+///    requests for the same manifest go to the same node and hit its cache.
+///    On response, @ref mrc_forward_done is called for the request.
+///
+/// @param [in, out] req
+///    The request to forward, its @ref mrc_request::fwd_id is set on success.
+/// @param nodes
+///    Bit mask of peer nodes owning the depot.
+/// @return Value indicating whether the request has been sent.
+[[gnu::visibility("internal")]]
+bool peer_forward(mrc_request &req, std::uint64_t nodes);
+
+/// Send the response to a manifest request code request that came from a peer
+///    node, and release the request.
+///
+/// @param [in, out] req
+///    The completed request.
+[[gnu::visibility("internal")]]
+void peer_mrc_done(mrc_request &req);
+
+/// Send a manifest request code that has just been cached to connected hot
+///    standby nodes.
+///
+/// @param manifest_id
+///    ID of the manifest that the code is for.
+/// @param mrc
+///    Manifest request code value.
+/// @param expires
+///    Expiration time of the code, in seconds since Epoch.
+[[gnu::visibility("internal")]]
+void peer_mrc_cached(std::uint64_t manifest_id, std::uint64_t mrc,
+                     std::int64_t expires);
+
+/// Request broadcasting local changes to connected peers. May be called from
+///    any thread, with @ref ts3_state::manifest_mtx locked.
+[[gnu::visibility("internal")]]
+void peer_notify();
+
+/// Broadcast depot keys and app ownership changes since the previous
+///    broadcast, if @ref peer_notify has been called since then.
+[[gnu::visibility("internal")]]
+void peer_process();
+
+/// Cancel all scheduled peer replication and standby failover jobs. Must be
+///    called before destroying the libwebsockets context.
+[[gnu::visibility("internal")]]
+void peer_stop();
+
+} // namespace tek::s3
@@ -0,0 +1,229 @@
+//===-- ratelimit.cpp - Per-client rate limiting implementation -----------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Implementation of per-client token bucket rate limiting. Instead of a
+///    bucket per client, which would let a spray of addresses grow memory
+///    usage without bound, buckets are stored in a fixed-size count-min
+///    sketch: each client maps to one bucket in every row, all of them are
+///    drained on each request, and the fullest one decides whether the request
+///    is allowed, so a client is only limited prematurely if it shares a bucket
+///    with a heavy client in every row. Since the table is only accessed from
+///    the service thread, no locks or atomics are involved.
+///
+//===----------------------------------------------------------------------===//
+#include "ratelimit.hpp"
+
+#include "null_attrs.h" // IWYU pragma: keep
+#include "state.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <libwebsockets.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private types -----------------------------------------------------===//
+
+/// Number of rows in a bucket sketch.
+constexpr std::size_t sketch_depth{4};
+/// Number of buckets in each row of a bucket sketch, must be a power of two.
+constexpr std::size_t sketch_width{1024};
+
+/// Token bucket.
+struct bucket {
+  /// Time of the last refill, in libwebsockets microseconds.
+  lws_usec_t last_refill;
+  /// Number of tokens in the bucket.
+  double tokens;
+};
+
+/// Count-min sketch of token buckets.
+struct bucket_sketch {
+  /// Bucket rows, each indexed with its own hash of the client key.
+  std::array<std::array<bucket, sketch_width>, sketch_depth> rows;
+};
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Generate random hash seeds for sketch rows, so clients can't pick
+///    addresses that collide with others on purpose.
+///
+/// @return Generated seeds.
+static std::array<std::uint64_t, sketch_depth> gen_seeds() {
+  std::random_device rd;
+  std::array<std::uint64_t, sketch_depth> seeds;
+  for (auto &seed : seeds) {
+    seed = (static_cast<std::uint64_t>(rd()) << 32) | rd();
+  }
+  return seeds;
+}
+
+/// Compute FNV-1a hash of a string.
+///
+/// @param str
+///    String to hash.
+/// @return Hash value.
+static constexpr std::uint64_t fnv1a(std::string_view str) noexcept {
+  std::uint64_t hash{0xcbf29ce484222325};
+  for (const auto c : str) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+  }
+  return hash;
+}
+
+/// Scramble a 64-bit value with splitmix64 finalizer.
+///
+/// @param value
+///    Value to scramble.
+/// @return Scrambled value.
+static constexpr std::uint64_t mix(std::uint64_t value) noexcept {
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111eb;
+  return value ^ (value >> 31);
+}
+
+/// Check whether specified address belongs to a trusted proxy.
+///
+/// @param addr
+///    Address to check.
+/// @return Value indicating whether @p addr is listed in
+///    @ref ts3_state::trusted_proxies.
+static bool is_trusted(std::string_view addr) {
+  return std::ranges::find(state.trusted_proxies, addr) !=
+         state.trusted_proxies.end();
+}
+
+/// Trim leading and trailing whitespace from a string.
+///
+/// @param str
+///    String to trim.
+/// @return Trimmed view of @p str.
+static constexpr std::string_view trim(std::string_view str) noexcept {
+  const auto first{str.find_first_not_of(" \t")};
+  if (first == std::string_view::npos) {
+    return {};
+  }
+  return str.substr(first, str.find_last_not_of(" \t") - first + 1);
+}
+
+/// Get the key identifying the client that sent the request.
+///
+/// @param [in] wsi
+///    Pointer to the WebSocket instance that received the request.
+/// @param [out] peer_buf
+///    Buffer that receives the peer address.
+/// @param [out] xff_buf
+///    Buffer that receives `X-Forwarded-For` header value.
+/// @return View of either @p peer_buf or @p xff_buf containing the key.
+[[using gnu: nonnull(1), access(read_only, 1)]]
+static std::string_view client_key(lws *_Nonnull wsi,
+                                   std::array<char, 64> &peer_buf,
+                                   std::string &xff_buf) {
+  const auto peer{lws_get_peer_simple(wsi, peer_buf.data(), peer_buf.size())};
+  const std::string_view addr{peer ? peer : ""};
+  if (!state.unix_socket && !is_trusted(addr)) {
+    return addr;
+  }
+  const int xff_len{lws_hdr_total_length(wsi, WSI_TOKEN_X_FORWARDED_FOR)};
+  if (xff_len <= 0) {
+    return addr;
+  }
+  xff_buf.resize(xff_len + 1);
+  if (lws_hdr_copy(wsi, xff_buf.data(), xff_len + 1,
+                   WSI_TOKEN_X_FORWARDED_FOR) <= 0) {
+    return addr;
+  }
+  // Entries are appended by each proxy on the way, so walk from the rightmost
+  //    one, skipping entries added by trusted proxies themselves. Anything to
+  //    the left of the first untrusted entry may be forged by the client
+  std::string_view xff{xff_buf.data(), static_cast<std::size_t>(xff_len)};
+  for (;;) {
+    const auto comma{xff.rfind(',')};
+    const auto entry{
+        trim(comma == std::string_view::npos ? xff : xff.substr(comma + 1))};
+    if (comma == std::string_view::npos || !is_trusted(entry)) {
+      return entry.empty() ? addr : entry;
+    }
+    xff = xff.substr(0, comma);
+  }
+}
+
+//===-- Private variables -------------------------------------------------===//
+
+/// Bucket sketches for each request class, allocated on first use.
+static std::array<std::unique_ptr<bucket_sketch>, num_rl_classes> sketches;
+/// Hash seeds for sketch rows.
+static const std::array<std::uint64_t, sketch_depth> seeds{gen_seeds()};
+
+} // namespace
+
+//===-- Internal functions ------------------------------------------------===//
+
+int rl_take(lws *wsi, rl_class cls) {
+  const auto cls_index{static_cast<std::size_t>(cls)};
+  const auto &params{state.rate_limits[cls_index]};
+  if (params.rate <= 0) {
+    return 0;
+  }
+  auto &sketch{sketches[cls_index]};
+  if (!sketch) {
+    sketch = std::make_unique<bucket_sketch>();
+  }
+  std::array<char, 64> peer_buf;
+  std::string xff_buf;
+  const auto key_hash{fnv1a(client_key(wsi, peer_buf, xff_buf))};
+  const auto now{lws_now_usecs()};
+  std::array<bucket *, sketch_depth> buckets;
+  double max_tokens{};
+  for (std::size_t i{}; i < sketch_depth; ++i) {
+    auto &b{sketch->rows[i][mix(key_hash ^ seeds[i]) & (sketch_width - 1)]};
+    // Buckets that have never been used start full
+    b.tokens = b.last_refill
+                   ? std::min(params.burst,
+                              b.tokens +
+                                  static_cast<double>(now - b.last_refill) *
+                                      params.rate / LWS_US_PER_SEC)
+                   : params.burst;
+    b.last_refill = now;
+    max_tokens = std::max(max_tokens, b.tokens);
+    buckets[i] = &b;
+  }
+  if (max_tokens < 1) {
+    const auto wait_time{std::ceil((1 - max_tokens) / params.rate)};
+    return std::max(static_cast<int>(wait_time), 1);
+  }
+  for (auto b : buckets) {
+    b->tokens = std::max(b->tokens - 1, 0.0);
+  }
+  return 0;
+}
+
+bool rl_client_listed(lws *wsi, const std::vector<std::string> &addrs) {
+  if (addrs.empty()) {
+    return false;
+  }
+  std::array<char, 64> peer_buf;
+  std::string xff_buf;
+  const auto key{client_key(wsi, peer_buf, xff_buf)};
+  return !key.empty() && std::ranges::find(addrs, key) != addrs.end();
+}
+
+} // namespace tek::s3
@@ -0,0 +1,75 @@
+//===-- ratelimit.hpp - Per-client rate limiting declarations -------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Declarations of per-client token bucket rate limiting and client lookup
+///    functions. All of them must be called from the libwebsockets service
+///    thread.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include "null_attrs.h" // IWYU pragma: keep
+
+#include <cstddef>
+#include <libwebsockets.h>
+#include <string>
+#include <vector>
+
+namespace tek::s3 {
+
+/// Rate-limited request classes.
+enum class rl_class {
+  /// `/mrc` requests that miss the cache and have to be sent to Steam CM.
+  mrc,
+  /// `/manifest` and `/manifest-bin` downloads.
+  manifest,
+  /// `/signin` WebSocket sessions.
+  signin
+};
+
+/// Number of @ref rl_class values.
+constexpr std::size_t num_rl_classes{3};
+
+/// Token bucket parameters for a request class.
+struct rl_params {
+  /// Number of tokens added to a client's bucket per second, `0` disables
+  ///    rate limiting for the class.
+  double rate{};
+  /// Maximum number of tokens in a bucket, that is the number of requests a
+  ///    client may send in a burst.
+  double burst{};
+};
+
+/// Take a token from the bucket of the client that sent the request. The
+///    client is identified by its IP address, or by the rightmost untrusted
+///    `X-Forwarded-For` entry if the connection comes from a trusted proxy.
+///
+/// @param [in] wsi
+///    Pointer to the WebSocket instance that received the request.
+/// @param cls
+///    Class of the request.
+/// @return `0` if the request is allowed, otherwise number of seconds after
+///    which the client may retry.
+[[using gnu: visibility("internal"), nonnull(1), access(read_only, 1)]]
+int rl_take(lws *_Nonnull wsi, rl_class cls);
+
+/// Check whether the client that sent the request is listed among specified
+///    addresses. The client is identified the same way as by @ref rl_take.
+///
+/// @param [in] wsi
+///    Pointer to the WebSocket instance that received the request.
+/// @param [in] addrs
+///    Addresses to look for the client among.
+/// @return Value indicating whether the client's address is in @p addrs.
+[[using gnu: visibility("internal"), nonnull(1), access(read_only, 1)]]
+bool rl_client_listed(lws *_Nonnull wsi, const std::vector<std::string> &addrs);
+
+} // namespace tek::s3
@@ -0,0 +1,504 @@
+//===-- replica.cpp - Read-only replica mode implementation ---------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Implementation of read-only replica mode. The primary's `/manifest` is
+///    polled with `If-Modified-Since` set to the `Last-Modified` value of the
+///    previous response, so unchanged manifests cost a single 304 response.
+///    A received manifest replaces @ref ts3_state::apps and
+///    @ref ts3_state::depot_keys, and the timestamp of the primary is kept, so
+///    clients may switch between the primary and its replicas without
+///    re-downloading the manifest. The JSON manifest is used rather than the
+///    binary one, as only the former carries application IDs.
+/// Over TLS, requests to the primary share kept-alive connections: they're
+///    made with `LCCSCF_PIPELINE`, so libwebsockets multiplexes them as
+///    HTTP/2 streams of one connection, or queues them on an idle HTTP/1.1
+///    one. Over plain HTTP, where HTTP/2 isn't negotiated and queued requests
+///    would wait for each other, each request uses its own connection, which
+///    is cheap without a TLS handshake.
+///
+//===----------------------------------------------------------------------===//
+#include "replica.hpp"
+
+#include "mrc.hpp"
+#include "null_attrs.h" // IWYU pragma: keep
+#include "state.hpp"
+#include "utils.h"
+
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <format>
+#include <iomanip>
+#include <iostream>
+#include <libwebsockets.h>
+#include <locale>
+#include <mutex>
+#include <print>
+#include <rapidjson/document.h>
+#include <rapidjson/reader.h>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private types -----------------------------------------------------===//
+
+/// Maximum size of a manifest response body, in bytes.
+constexpr std::size_t max_manifest_size{64 * 1024 * 1024};
+/// Maximum size of a manifest request code response body, in bytes.
+constexpr std::size_t max_mrc_size{32};
+
+/// Context of an HTTP request to the primary.
+struct fetch_ctx {
+  /// Pointer to the manifest request code request being forwarded, or
+  ///    `nullptr` for manifest requests.
+  mrc_request *_Nullable req;
+  /// Response body received so far.
+  std::string body;
+  /// HTTP status code of the response, `0` if it hasn't been received yet.
+  int status;
+  /// Value indicating whether @ref lws_client_connect_via_info hasn't
+  ///    returned yet for the request.
+  bool connecting;
+  /// Value indicating whether the connection has failed while
+  ///    @ref connecting was set.
+  bool failed;
+  /// Value indicating whether the request has been finished.
+  bool done;
+};
+
+/// Replica state.
+struct replica_state {
+  /// Scheduling element for manifest polling.
+  lws_sorted_usec_list_t poll_sul;
+  /// Scheduling element for retrying manifest updates blocked by active
+  ///    downloads.
+  lws_sorted_usec_list_t update_sul;
+  /// Value of `Last-Modified` header of the last received manifest, in
+  ///    seconds since Epoch, `0` if none has been received yet.
+  std::time_t last_modified;
+  /// Value of `Last-Modified` header of the manifest response being received.
+  std::time_t pending_modified;
+  /// Number of manifest request code requests in flight.
+  int num_forwarded;
+  /// ID of the last forwarded request.
+  std::uint64_t last_fwd_id;
+};
+
+//===-- Private variable --------------------------------------------------===//
+
+/// The replica state instance.
+static replica_state repl;
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Start an HTTP request to the primary.
+///
+/// @param [in, out] ctx
+///    Context of the request.
+/// @param [in] path
+///    Path of the request relative to the primary's path prefix, including
+///    the query string.
+/// @return Value indicating whether the request has been initiated.
+static bool connect(fetch_ctx &ctx, const std::string_view &path) {
+  const auto &primary{state.replica_of};
+  const auto full_path{std::string{primary.path_prefix}.append(path)};
+  lws_client_connect_info info{};
+  info.context = state.lws_ctx;
+  info.address = primary.host.data();
+  info.port = primary.port;
+  info.ssl_connection = primary.tls ? LCCSCF_USE_SSL | LCCSCF_PIPELINE : 0;
+  info.path = full_path.data();
+  info.host = info.address;
+  info.origin = info.address;
+  info.method = "GET";
+  info.protocol = replica_protocol.name;
+  info.local_protocol_name = replica_protocol.name;
+  info.userdata = &ctx;
+  ctx.connecting = true;
+  const auto wsi{lws_client_connect_via_info(&info)};
+  ctx.connecting = false;
+  return wsi && !ctx.failed;
+}
+
+/// Update the manifest buffers, or schedule a retry if downloads are active.
+///    @ref ts3_state::manifest_mtx must be locked.
+static void refresh_manifest() {
+  if (state.download_lock.locked()) {
+    // Streams are sending current manifest buffers, which can't be replaced
+    //    under them
+    repl.update_sul.us = lws_now_usecs() + LWS_US_PER_SEC;
+    lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED,
+                      &repl.update_sul);
+    return;
+  }
+  update_manifest();
+  if (repl.last_modified) {
+    state.timestamp = repl.last_modified;
+  }
+}
+
+/// libwebsockets scheduled callback that retries a manifest update blocked by
+///    active downloads.
+[[using gnu: nonnull(1), access(read_only, 1)]]
+static void retry_update(lws_sorted_usec_list_t *_Nonnull) {
+  const std::scoped_lock lock{state.manifest_mtx};
+  if (state.manifest_dirty) {
+    refresh_manifest();
+  }
+}
+
+/// Replace applications and depot keys with the ones from a manifest received
+///    from the primary.
+///
+/// @param [in, out] json
+///    The manifest JSON, parsed in situ, so it must be null-terminated.
+/// @return Value indicating whether the manifest has been applied.
+[[using gnu: nonnull(1), access(read_write, 1)]]
+static bool apply_manifest(char *_Nonnull json) {
+  rapidjson::Document doc;
+  doc.ParseInsitu<rapidjson::kParseStopWhenDoneFlag>(json);
+  if (doc.HasParseError() || !doc.IsObject()) {
+    return false;
+  }
+  const auto apps{doc.FindMember("apps")};
+  const auto depot_keys{doc.FindMember("depot_keys")};
+  if (apps == doc.MemberEnd() || !apps->value.IsObject() ||
+      depot_keys == doc.MemberEnd() || !depot_keys->value.IsObject()) {
+    return false;
+  }
+  decltype(state.apps) new_apps;
+  new_apps.reserve(apps->value.MemberCount());
+  for (const auto &[id, app_ent] : apps->value.GetObject()) {
+    std::uint32_t app_id;
+    if (const std::string_view view{id.GetString(), id.GetStringLength()};
+        !app_ent.IsObject() ||
+        std::from_chars(view.begin(), view.end(), app_id).ec != std::errc{}) {
+      continue;
+    }
+    auto &app{new_apps.try_emplace(app_id).first->second};
+    if (const auto name{app_ent.FindMember("name")};
+        name != app_ent.MemberEnd() && name->value.IsString()) {
+      app.name = {name->value.GetString(), name->value.GetStringLength()};
+    }
+    if (const auto pics_at{app_ent.FindMember("pics_at")};
+        pics_at != app_ent.MemberEnd() && pics_at->value.IsUint64()) {
+      app.pics_access_token = pics_at->value.GetUint64();
+    }
+    const auto depots{app_ent.FindMember("depots")};
+    if (depots == app_ent.MemberEnd() || !depots->value.IsArray()) {
+      continue;
+    }
+    for (const auto &depot_id : depots->value.GetArray()) {
+      if (depot_id.IsUint()) {
+        app.depots.try_emplace(depot_id.GetUint());
+      }
+    }
+  }
+  decltype(state.depot_keys) new_keys;
+  new_keys.reserve(depot_keys->value.MemberCount());
+  for (const auto &[id, b64_key] : depot_keys->value.GetObject()) {
+    std::uint32_t depot_id;
+    if (const std::string_view view{id.GetString(), id.GetStringLength()};
+        !b64_key.IsString() || b64_key.GetStringLength() != 44 ||
+        std::from_chars(view.begin(), view.end(), depot_id).ec !=
+            std::errc{}) {
+      continue;
+    }
+    if (depot_key key; ts3_u_base64_decode_keys(b64_key.GetString(), 1,
+                                                key.data(), key.size())) {
+      new_keys.try_emplace(depot_id, key);
+    }
+  }
+  const std::scoped_lock lock{state.manifest_mtx};
+  state.apps = std::move(new_apps);
+  state.depot_keys = std::move(new_keys);
+  state.manifest_dirty = true;
+  refresh_manifest();
+  return true;
+}
+
+/// Schedule the next manifest poll.
+static void schedule_poll();
+
+/// Finish a manifest request, and switch the server to running status if it
+///    was the first one.
+///
+/// @param [in, out] ctx
+///    Context of the request.
+static void finish_manifest(fetch_ctx &ctx) {
+  switch (ctx.status) {
+  case HTTP_STATUS_OK:
+    if (ctx.body.empty() || !apply_manifest(ctx.body.data())) {
+      std::println(std::cerr, "Received an invalid manifest from the primary");
+      break;
+    }
+    repl.last_modified = repl.pending_modified;
+    std::println("Manifest updated from the primary");
+    break;
+  case HTTP_STATUS_NOT_MODIFIED:
+    break;
+  case 0:
+    std::println(std::cerr, "Failed to get manifest from the primary");
+    break;
+  default:
+    std::println(std::cerr,
+                 "Failed to get manifest from the primary: HTTP status {}",
+                 ctx.status);
+  }
+  ctx.body = {};
+  if (state.cur_status.load(std::memory_order::relaxed) == status::setup) {
+    const std::scoped_lock lock{state.manifest_mtx};
+    update_manifest();
+    if (repl.last_modified) {
+      state.timestamp = repl.last_modified;
+    }
+    state.cur_status.store(status::running, std::memory_order::relaxed);
+  }
+  schedule_poll();
+}
+
+/// Finish a forwarded manifest request code request.
+///
+/// @param [in, out] ctx
+///    Context of the request.
+static void finish_mrc(fetch_ctx &ctx) {
+  --repl.num_forwarded;
+  auto &req{*ctx.req};
+  switch (ctx.status) {
+  case HTTP_STATUS_OK:
+    if (std::from_chars(ctx.body.data(), ctx.body.data() + ctx.body.length(),
+                        req.mrc)
+            .ec == std::errc{}) {
+      req.status = HTTP_STATUS_OK;
+    } else {
+      req.status = HTTP_STATUS_BAD_GATEWAY;
+    }
+    break;
+  case 0:
+    req.status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+    break;
+  default:
+    // Errors like 401 or 429 are passed to the client as is
+    req.status = ctx.status;
+  }
+  mrc_forward_done(req);
+}
+
+/// Finish a request to the primary, unless it's already finished.
+///
+/// @param [in, out] ctx
+///    Context of the request.
+static void finish(fetch_ctx &ctx) {
+  if (ctx.done) {
+    return;
+  }
+  ctx.done = true;
+  if (ctx.req) {
+    finish_mrc(ctx);
+  } else {
+    finish_manifest(ctx);
+  }
+}
+
+/// Start a manifest request to the primary.
+static void poll_manifest() {
+  auto &ctx{*new fetch_ctx{}};
+  if (!connect(ctx, "/manifest")) {
+    finish(ctx);
+    delete &ctx;
+  }
+}
+
+/// libwebsockets scheduled callback that polls the primary's manifest.
+[[using gnu: nonnull(1), access(read_only, 1)]]
+static void poll(lws_sorted_usec_list_t *_Nonnull) { poll_manifest(); }
+
+static void schedule_poll() {
+  if (state.cur_status.load(std::memory_order::relaxed) == status::stopping) {
+    return;
+  }
+  repl.poll_sul.us = lws_now_usecs() + state.replica_poll_interval;
+  repl.poll_sul.cb = poll;
+  lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED,
+                    &repl.poll_sul);
+}
+
+/// Process a libwebsockets protocol callback for a connection to the primary.
+///
+/// @param wsi
+///    Pointer to the client connection instance that emitted the callback.
+/// @param reason
+///    Reason for the callback.
+/// @param user
+///    Pointer to the @ref fetch_ctx of the request.
+/// @param [in] in
+///    Pointer to the data associated with the callback.
+/// @param len
+///    Size of the data pointed to by @p in, in bytes.
+/// @return `0` on success, or a non-zero value to close connection.
+[[gnu::access(read_only, 4, 5)]]
+static int replica_lws_cb(lws *_Nullable wsi, lws_callback_reasons reason,
+                          void *_Nullable user, void *_Nullable in,
+                          std::size_t len) {
+  const auto ctx{reinterpret_cast<fetch_ctx *>(user)};
+  switch (reason) {
+  case LWS_CALLBACK_CLIENT_APPEND_HANDSHAKE_HEADER: {
+    if (!ctx || ctx->req || !repl.last_modified) {
+      break;
+    }
+    std::array<char, 64> buf;
+    const auto res{std::format_to_n(
+        buf.data(), buf.size(), std::locale::classic(),
+        "{:%a, %d %b %Y %X} GMT",
+        std::chrono::system_clock::from_time_t(repl.last_modified))};
+    auto &cur{*reinterpret_cast<unsigned char **>(in)};
+    if (lws_add_http_header_by_token(
+            wsi, WSI_TOKEN_HTTP_IF_MODIFIED_SINCE,
+            reinterpret_cast<const unsigned char *>(buf.data()),
+            static_cast<int>(std::distance(buf.data(), res.out)), &cur,
+            cur + len)) {
+      return -1;
+    }
+    break;
+  }
+  case LWS_CALLBACK_ESTABLISHED_CLIENT_HTTP: {
+    if (!ctx) {
+      break;
+    }
+    ctx->status = static_cast<int>(lws_http_client_http_response(wsi));
+    if (ctx->req || ctx->status != HTTP_STATUS_OK) {
+      break;
+    }
+    repl.pending_modified = 0;
+    std::array<char, 64> buf;
+    if (const int hdr_len{lws_hdr_copy(wsi, buf.data(), buf.size(),
+                                       WSI_TOKEN_HTTP_LAST_MODIFIED)};
+        hdr_len > 0) {
+      std::istringstream stream{
+          {buf.data(), static_cast<std::size_t>(hdr_len)}};
+      stream.imbue(std::locale::classic());
+      std::tm tm;
+      stream >> std::get_time(&tm, "%a, %d %b %Y %X GMT");
+      if (!stream.fail()) {
+        tm.tm_isdst = 0;
+        repl.pending_modified = timegm(&tm);
+      }
+    }
+    break;
+  }
+  case LWS_CALLBACK_RECEIVE_CLIENT_HTTP: {
+    std::array<char, LWS_PRE + 4096> buf;
+    auto data{&buf[LWS_PRE]};
+    int data_len{static_cast<int>(buf.size() - LWS_PRE)};
+    return lws_http_client_read(wsi, &data, &data_len) ? -1 : 0;
+  }
+  case LWS_CALLBACK_RECEIVE_CLIENT_HTTP_READ:
+    if (!ctx) {
+      break;
+    }
+    if (ctx->body.length() + len >
+        (ctx->req ? max_mrc_size : max_manifest_size)) {
+      ctx->status = HTTP_STATUS_BAD_GATEWAY;
+      finish(*ctx);
+      return -1;
+    }
+    ctx->body.append(reinterpret_cast<const char *>(in), len);
+    return 0;
+  case LWS_CALLBACK_COMPLETED_CLIENT_HTTP:
+    if (ctx) {
+      finish(*ctx);
+    }
+    // Pipelined connections are kept for further requests, the context is
+    //    freed when the transaction's instance is closed either way
+    return state.replica_of.tls ? 0 : -1;
+  case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+    if (!ctx) {
+      break;
+    }
+    std::println(std::cerr, "Connection to the primary failed: {}",
+                 in ? reinterpret_cast<const char *>(in) : "");
+    if (ctx->connecting) {
+      // The initiator handles the failure once the connect call returns
+      ctx->failed = true;
+      return 0;
+    }
+    ctx->status = 0;
+    finish(*ctx);
+    delete ctx;
+    return 0;
+  case LWS_CALLBACK_CLOSED_CLIENT_HTTP:
+    if (!ctx) {
+      break;
+    }
+    if (!ctx->done && ctx->status == HTTP_STATUS_OK) {
+      // Closed before the whole body has been received
+      ctx->status = 0;
+    }
+    finish(*ctx);
+    delete ctx;
+    return 0;
+  default:
+    break;
+  }
+  return lws_callback_http_dummy(wsi, reason, user, in, len);
+}
+
+} // namespace
+
+//===-- Internal variable -------------------------------------------------===//
+
+constexpr lws_protocols replica_protocol{.name = "tek-s3-replica",
+                                         .callback = replica_lws_cb,
+                                         .per_session_data_size = 0,
+                                         .rx_buffer_size = 0,
+                                         .id = 0,
+                                         .user = nullptr,
+                                         .tx_packet_size = 0};
+
+//===-- Internal functions ------------------------------------------------===//
+
+void replica_start() {
+  repl.update_sul.cb = retry_update;
+  poll_manifest();
+}
+
+bool replica_can_forward() noexcept {
+  return repl.num_forwarded < state.mrc_limits.max_outstanding;
+}
+
+bool replica_forward(mrc_request &req) {
+  auto &ctx{*new fetch_ctx{.req = &req}};
+  if (!connect(ctx, std::format("/mrc?app_id={}&depot_id={}&manifest_id={}",
+                                req.data.app_id, req.data.depot_id,
+                                req.data.manifest_id))) {
+    // The caller completes the request itself
+    delete &ctx;
+    return false;
+  }
+  ++repl.num_forwarded;
+  req.fwd_id = ++repl.last_fwd_id;
+  return true;
+}
+
+void replica_stop() {
+  lws_sul_cancel(&repl.poll_sul);
+  lws_sul_cancel(&repl.update_sul);
+}
+
+} // namespace tek::s3
@@ -0,0 +1,78 @@
+//===-- replica.hpp - Read-only replica mode declarations -----------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Declarations of read-only replica mode functions. A replica has no Steam
+///    accounts: it mirrors the manifest of a primary tek-s3 instance via
+///    conditional `/manifest` requests, and forwards `/mrc` requests that miss
+///    its cache to the primary. All functions must be called from the
+///    libwebsockets service thread.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include "null_attrs.h" // IWYU pragma: keep
+
+#include <libwebsockets.h>
+#include <string>
+
+namespace tek::s3 {
+
+/// Address of the primary instance followed by a replica.
+struct replica_endpoint {
+  /// Host name or IP address of the primary, empty if the server is not a
+  ///    replica.
+  std::string host;
+  /// Path prefix that the primary's endpoints are located under, without the
+  ///    trailing slash. Empty if they are at the root.
+  std::string path_prefix;
+  /// Port number that the primary listens on.
+  int port;
+  /// Value indicating whether the primary must be connected to via TLS.
+  bool tls;
+};
+
+struct mrc_request;
+
+/// libwebsockets protocol for HTTP client connections to the primary.
+[[gnu::visibility("internal")]]
+extern const lws_protocols replica_protocol;
+
+/// Start polling the primary's manifest. The server switches to running status
+///    once the first poll completes, whether it succeeds or not. Must be
+///    called after the libwebsockets context has been created.
+[[gnu::visibility("internal")]]
+void replica_start();
+
+/// Check whether there is a free slot for forwarding a manifest request code
+///    request to the primary.
+///
+/// @return Value indicating whether less than
+///    @ref mrc_admission_limits::max_outstanding requests are in flight.
+[[gnu::visibility("internal")]]
+bool replica_can_forward() noexcept;
+
+/// Forward a manifest request code request to the primary. There must be a
+///    free slot, see @ref replica_can_forward. On response,
+///    @ref mrc_forward_done is called for the request.
+///
+/// @param [in, out] req
+///    The request to forward, its @ref mrc_request::fwd_id is set on success.
+/// @return Value indicating whether the request has been sent. It's not sent
+///    if the connection could not be initiated.
+[[gnu::visibility("internal")]]
+bool replica_forward(mrc_request &req);
+
+/// Cancel all scheduled replica jobs. Must be called before destroying the
+///    libwebsockets context.
+[[gnu::visibility("internal")]]
+void replica_stop();
+
+} // namespace tek::s3
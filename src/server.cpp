@@ -14,11 +14,19 @@
 //===----------------------------------------------------------------------===//
 #include "impl.h"
 
+#include "comp_tune.hpp"
 #include "config.h"     // IWYU pragma: keep
+#include "enc_cache.hpp"
+#include "mrc.hpp"
 #include "null_attrs.h" // IWYU pragma: keep
 #include "os.h"
+#include "peer.hpp"
+#include "ratelimit.hpp"
+#include "replica.hpp"
 #include "signin.hpp"
 #include "state.hpp"
+#include "utils.h"
+#include "worker.hpp"
 
 #include <algorithm>
 #include <array>
@@ -27,22 +35,23 @@
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <ctime>
+#include <deque>
 #include <format>
 #include <iomanip>
 #include <iterator>
 #include <libwebsockets.h>
-#include <limits>
 #include <locale>
-#include <memory>
 #include <mutex>
 #include <ranges>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
 #include <span>
 #include <sstream>
 #include <string_view>
 #include <system_error>
-#include <tek-steamclient/cm.h>
-#include <tek-steamclient/error.h>
+#include <utility>
 
 namespace tek::s3 {
 
@@ -52,99 +61,501 @@ namespace {
 static constexpr auto &timegm{::_mkgmtime};
 #endif // _WIN32
 
-//===-- Private types -----------------------------------------------------===//
+/// HTTP 429 Too Many Requests status code. Not all libwebsockets versions
+///    have it in `http_status`, and since that's an enum, its presence can't be
+///    checked by the preprocessor.
+static constexpr auto http_status_too_many_requests{
+    static_cast<http_status>(429)};
 
-/// Possible encoding types for manifest responses.
-enum class enc_type {
-  none,
-  deflate,
-#ifdef TEK_S3B_BROTLI
-  brotli,
-#endif // def TEK_S3B_BROTLI
-#ifdef TEK_S3B_ZSTD
-  zstd
-#endif // def TEK_S3B_ZSTD
-};
+//===-- Private types -----------------------------------------------------===//
 
-/// Manifest request code await entry.
-struct mrc_await_entry {
-  /// Request/response data for tek-steamclient.
-  tek_sc_cm_data_mrc data;
-  /// Value that is set to `1` and signaled when the callback is received.
-  std::atomic_uint32_t finished;
-};
+/// Maximum number of bytes that manifest streams may send per service loop
+///    iteration, across all connections. Each connection sends at most
+///    @ref tx_size bytes per writable callback.
+constexpr std::size_t stream_budget{8 * tx_size};
 
 /// Per-session context for HTTP sessions.
 struct http_ctx {
   /// Next chunk of data to send.
   std::span<unsigned char> data;
-  /// Send buffer.
-  std::array<unsigned char, tx_size> tx_buf;
+  /// Pointer to the pending manifest request code request, if any.
+  mrc_request *_Nullable mrc_req;
+  /// Value indicating whether the session is streaming a manifest and holds a
+  ///    reference to @ref ts3_state::download_lock.
+  bool streaming;
+  /// Value indicating whether the rest of the stream is sent from @ref file
+  ///    without copying it through user space.
+  bool zero_copy;
+  /// Sealed file with the data being streamed, valid if @ref zero_copy is
+  ///    set. Owned by the buffer that the stream holds a reference to.
+  tek_sc_os_handle file;
+  /// Offset of the next chunk to send in @ref file.
+  std::uint64_t file_offset;
+  /// Buffer allocated with `std::malloc` that @ref data points into, for
+  ///    responses made for this request that don't fit in a single write.
+  unsigned char *_Nullable body;
+  /// Send buffer, with `LWS_PRE` headroom for HTTP/2 frame headers.
+  std::array<unsigned char, LWS_PRE + tx_size> tx_buf;
 };
 
 /// Per-session context for WebSocket sessions.
 struct ws_ctx {
-  /// Sign-in context.
-  std::unique_ptr<signin_ctx> s_ctx;
-  /// Send buffer.
-  std::array<unsigned char, tx_size> tx_buf;
+  /// Pointer to the sign-in context, which may outlive the session.
+  signin_ctx *_Nullable s_ctx;
+  /// Pointer to the peer replication context for `/peer` sessions.
+  peer_ctx *_Nullable p_ctx;
 };
 
+/// Bulk stream scheduler state. Manifest streams may send only a limited
+///    number of bytes before yielding to the next service loop iteration, so
+///    that small latency-sensitive responses such as `/mrc` ones, which are
+///    always written as soon as their connections become writable, don't
+///    queue behind them.
+struct stream_scheduler {
+  /// Number of bytes that streams may still send in the current service loop
+  ///    iteration. Refilled by @ref ts3_run before each iteration.
+  std::size_t budget{stream_budget};
+  /// Streams waiting for the budget to be refilled, in FIFO order.
+  std::deque<lws *> deferred;
+  /// Scheduling element for resuming deferred streams on the next service
+  ///    loop iteration.
+  lws_sorted_usec_list_t sul;
+};
+
+//===-- Private variable --------------------------------------------------===//
+
+/// The bulk stream scheduler instance.
+static stream_scheduler streams;
+
 //===-- Private functions -------------------------------------------------===//
 
-/// The callback for CM client manifest request code received event.
+#ifdef TEK_S3B_ZSTD
+/// Find the dictionary advertised by the client via Available-Dictionary
+///    header among retained previous manifest generations, and get the
+///    manifest encoded with dcz against it. Until it's built on the worker
+///    thread, other encodings are served.
+///
+/// @param [in] wsi
+///    Pointer to the WebSocket instance that sent the request.
+/// @param [in, out] buf
+///    Buffer that will be sent back to the client.
+/// @param [in] dicts
+///    Retained previous generations of @p buf.
+/// @return Pointer to the dcz-encoded buffer, or `nullptr` if the client
+///    didn't advertise a known dictionary, or the buffer isn't built yet or
+///    its compression has failed.
+/// @throws std::bad_alloc if allocation fails.
+[[using gnu: nonnull(1), access(read_only, 1)]]
+static const sized_buf *_Nullable negotiate_dcz(
+    lws *_Nonnull wsi, http_buf &buf, const std::deque<manifest_dict> &dicts) {
+  if (dicts.empty()) {
+    return nullptr;
+  }
+  // The value is a structured field byte sequence, that is the Base64-encoded
+  //    hash enclosed in colons
+  std::array<char, 64> hdr_buf;
+  constexpr std::string_view name{"available-dictionary:"};
+  if (lws_hdr_custom_copy(wsi, hdr_buf.data(), hdr_buf.size(), name.data(),
+                          name.length()) != 46 ||
+      hdr_buf[0] != ':' || hdr_buf[45] != ':') {
+    return nullptr;
+  }
+  sha256_hash hash;
+  if (!ts3_u_base64_decode_keys(&hdr_buf[1], 1, hash.data(), hash.size())) {
+    return nullptr;
+  }
+  const auto dict{std::ranges::find(dicts, hash, &manifest_dict::hash)};
+  return dict == dicts.end() ? nullptr : buf.build_dcz(*dict);
+}
+#endif // def TEK_S3B_ZSTD
+
+/// Get the Content-Encoding token for specified encoding.
 ///
-/// @param [in, out] data
-///    Pointer to `mrc_await_entry` associated with the request.
-[[using gnu: nonnull(2), access(read_write, 2)]]
-static void cb_mrc(tek_sc_cm_client *, void *_Nonnull data, void *) {
-  auto &entry{*reinterpret_cast<mrc_await_entry *>(data)};
-  entry.finished.store(1, std::memory_order::relaxed);
-  ts3_os_futex_wake(&entry.finished);
+/// @param enc
+///    Encoding to get the token for, must not be `enc_type::none`.
+/// @return Content-Encoding token for @p enc.
+static constexpr std::string_view enc_name(enc_type enc) noexcept {
+  switch (enc) {
+#ifdef TEK_S3B_BROTLI
+  case enc_type::brotli:
+    return "br";
+#endif // def TEK_S3B_BROTLI
+#ifdef TEK_S3B_ZSTD
+  case enc_type::zstd:
+    return "zstd";
+  case enc_type::dcz:
+    return "dcz";
+#endif // def TEK_S3B_ZSTD
+  default:
+    return "deflate";
+  }
 }
 
 /// Select response encoding based on which encodings are supported by the
-///    client, and sizes of manifest data in each supported one.
+///    client, and sizes of manifest data in each supported one. Only resident
+///    encodings are served. If an encoding that is not resident is estimated
+///    from its last compression ratio to be smaller, it's built on the worker
+///    thread for future requests.
 ///
 /// @param [in] accept
 ///    Value of the Accept-Encoding header sent by the client.
-/// @param [in] buf
+/// @param [in, out] buf
 ///    Buffer that will be sent back to the client.
+/// @param [in] dcz
+///    Pointer to the dcz-encoded buffer if the client has advertised a known
+///    dictionary, `nullptr` otherwise.
 /// @return Value indicating which encoding shall be used.
-static constexpr enc_type negotiate_enc(const std::string_view &&accept,
-                                        const http_buf &buf) noexcept {
+static enc_type negotiate_enc(const std::string_view &&accept, http_buf &buf,
+                              [[maybe_unused]] const sized_buf
+                                  *_Nullable dcz) {
   if (accept.empty()) {
     return enc_type::none;
   }
-  auto enc{enc_type::none};
-  auto size{buf.buf.size};
-  if (buf.deflate.buf && accept.contains("deflate") &&
-      buf.deflate.size < size) {
-    enc = enc_type::deflate;
-    size = buf.deflate.size;
+  unsigned accepted{};
+  for (std::size_t i{}; i < precomp_encs.size(); ++i) {
+    if (accept.contains(enc_name(precomp_encs[i]))) {
+      accepted |= 1 << i;
+    }
   }
-#ifdef TEK_S3B_BROTLI
-  if (buf.brotli.buf && accept.contains("br") && buf.brotli.size < size) {
-    enc = enc_type::brotli;
-    size = buf.brotli.size;
+  comp_tune_observe(accepted);
+  auto enc{enc_type::none};
+  auto size{static_cast<double>(buf.buf->size)};
+  auto best{enc_type::none};
+  auto best_size{size};
+  for (std::size_t i{}; i < precomp_encs.size(); ++i) {
+    const auto cand{precomp_encs[i]};
+    const auto &ent{buf.get(cand)};
+    if (ent.failed || !(accepted & (1 << i))) {
+      continue;
+    }
+    if (ent.data && ent.data->size < size) {
+      enc = cand;
+      size = ent.data->size;
+    }
+    const auto cand_size{ent.data ? static_cast<double>(ent.data->size)
+                                  : buf.buf->size * ent.ratio};
+    if (cand_size < best_size) {
+      best = cand;
+      best_size = cand_size;
+    }
   }
-#endif // def TEK_S3B_BROTLI
 #ifdef TEK_S3B_ZSTD
-  if (buf.zstd.buf && accept.contains("zstd") && buf.zstd.size < size) {
-    enc = enc_type::zstd;
-    size = buf.zstd.size;
+  // Caller ensures that dcz is supported by the client
+  if (dcz && dcz->size < size) {
+    enc = enc_type::dcz;
+    size = dcz->size;
   }
 #endif // def TEK_S3B_ZSTD
+  const auto now{lws_now_usecs()};
+  if (best != enc_type::none && best_size < size) {
+    // Count the request as a use, so the encoding isn't evicted right after
+    //    it's built
+    auto &ent{buf.get(best)};
+    ent.last_use = now;
+    buf.build(best);
+  }
+  switch (enc) {
+  case enc_type::none:
+#ifdef TEK_S3B_ZSTD
+  case enc_type::dcz:
+#endif // def TEK_S3B_ZSTD
+    break;
+  default: {
+    auto &ent{buf.get(enc)};
+    ++ent.num_uses;
+    ent.last_use = now;
+  }
+  }
   return enc;
 }
 
-/// Remove a manifest request code cache entry.
+/// Write statistics of a manifest buffer as JSON object members.
+///
+/// @param [in, out] writer
+///    JSON writer to write the members into.
+/// @param [in] buf
+///    Manifest buffer to write statistics for.
+template <typename Writer>
+static void write_buf_stats(Writer &writer, const http_buf &buf) {
+  std::string_view str{"size"};
+  writer.Key(str.data(), str.length());
+  writer.Uint64(buf.buf ? buf.buf->size : 0);
+  str = "resident";
+  writer.Key(str.data(), str.length());
+  writer.Uint64(buf.mem_size());
+  str = "encodings";
+  writer.Key(str.data(), str.length());
+  writer.StartObject();
+  for (const auto enc : precomp_encs) {
+    const auto &ent{buf.get(enc)};
+    str = enc_name(enc);
+    writer.Key(str.data(), str.length());
+    writer.StartObject();
+    str = "size";
+    writer.Key(str.data(), str.length());
+    writer.Uint64(ent.data ? ent.data->size : 0);
+    str = "uses";
+    writer.Key(str.data(), str.length());
+    writer.Uint64(ent.num_uses);
+    writer.EndObject();
+  }
+  writer.EndObject();
+}
+
+#ifdef TEK_S3B_ZSTD
+/// Write statistics of retained manifest dictionaries as JSON object members.
+///
+/// @param [in, out] writer
+///    JSON writer to write the members into.
+/// @param [in] dicts
+///    Retained previous generations of a manifest.
+template <typename Writer>
+static void write_dict_stats(Writer &writer,
+                             const std::deque<manifest_dict> &dicts) {
+  std::size_t size{};
+  for (const auto &dict : dicts) {
+    size += dict.buf->size;
+  }
+  std::string_view str{"dicts"};
+  writer.Key(str.data(), str.length());
+  writer.Uint64(dicts.size());
+  str = "dicts_size";
+  writer.Key(str.data(), str.length());
+  writer.Uint64(size);
+}
+#endif // def TEK_S3B_ZSTD
+
+/// Resume deferred streams that fit in the bulk stream budget, which has been
+///    refilled at the start of the service loop iteration.
 ///
 /// @param [in, out] sul
-///    Pointer to the scheduling element.
+///    Pointer to @ref stream_scheduler::sul.
+[[using gnu: nonnull(1), access(read_write, 1)]]
+static void resume_streams(lws_sorted_usec_list_t *_Nonnull sul) {
+  for (auto n{stream_budget / tx_size}; n && !streams.deferred.empty(); --n) {
+    lws_callback_on_writable(streams.deferred.front());
+    streams.deferred.pop_front();
+  }
+  if (!streams.deferred.empty()) {
+    sul->us = lws_now_usecs();
+    lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED, sul);
+  }
+}
+
+/// Account for bytes sent by a bulk stream, and request a writable callback
+///    for it if the budget allows, or defer it until the next service loop
+///    iteration otherwise.
+///
+/// @param [in] wsi
+///    Pointer to the WebSocket instance of the stream.
+/// @param sent
+///    Number of bytes that the stream has just sent.
 [[using gnu: nonnull(1), access(read_only, 1)]]
-static void remove_mrc_cache(lws_sorted_usec_list_t *_Nonnull sul) {
-  state.mrcs.erase(reinterpret_cast<const mrc_cache *>(sul)->manifest_id);
+static void schedule_stream(lws *_Nonnull wsi, std::size_t sent) {
+  streams.budget -= std::min(sent, streams.budget);
+  if (streams.budget && streams.deferred.empty()) {
+    lws_callback_on_writable(wsi);
+    return;
+  }
+  if (streams.deferred.empty()) {
+    streams.sul.us = lws_now_usecs();
+    streams.sul.cb = resume_streams;
+    lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED,
+                      &streams.sul);
+  }
+  streams.deferred.emplace_back(wsi);
+}
+
+/// Stop streaming a response, releasing the session's reference to
+///    @ref ts3_state::download_lock or freeing its own body.
+///
+/// @param [in] wsi
+///    Pointer to the WebSocket instance of the stream.
+/// @param [in, out] session
+///    Session context.
+[[using gnu: nonnull(1), access(none, 1)]]
+static void end_stream(lws *_Nonnull wsi, http_ctx &session) {
+  if (session.streaming) {
+    session.streaming = false;
+    session.zero_copy = false;
+    std::erase(streams.deferred, wsi);
+    state.download_lock.unlock();
+  }
+  std::free(std::exchange(session.body, nullptr));
+}
+
+/// Complete the HTTP transaction after its final write. HTTP/1.1 connections
+///    are kept alive for further requests, and HTTP/2 streams are closed
+///    without affecting other streams of the connection.
+///
+/// @param [in] wsi
+///    Pointer to the WebSocket instance that has completed the response.
+/// @return `0` if the connection may be reused, or `-1` if it must be
+///    closed.
+[[using gnu: nonnull(1), access(read_only, 1)]]
+static int complete_transaction(lws *_Nonnull wsi) {
+  return lws_http_transaction_completed(wsi) ? -1 : 0;
+}
+
+/// Add status, Content-Type and Content-Length headers of a 200 response
+///    whose body is sent with sendfile. libwebsockets counts body bytes
+///    written through it against the length set by
+///    `lws_add_http_header_content_length`, and closes the connection after a
+///    transaction that it considers incomplete. Bytes sent with sendfile
+///    bypass it, so the length is added as a plain header instead, which
+///    leaves the body out of its accounting and lets it keep the connection
+///    alive.
+///
+/// @param [in] wsi
+///    Pointer to the WebSocket instance of the request.
+/// @param [in] content_type
+///    Value of Content-Type header.
+/// @param content_length
+///    Size of the response body, in bytes.
+/// @param [in, out] p
+///    Pointer to the position in the send buffer to write headers at, advanced
+///    past them.
+/// @param [in] end
+///    Pointer to the end of the send buffer.
+/// @return `0` on success, or a non-zero value if the headers don't fit.
+[[using gnu: nonnull(1, 2, 4, 5), access(read_only, 1),
+  access(read_only, 2), access(read_write, 4)]]
+static int add_uncounted_headers(lws *_Nonnull wsi,
+                                 const char *_Nonnull content_type,
+                                 std::size_t content_length,
+                                 unsigned char *_Nonnull *_Nonnull p,
+                                 unsigned char *_Nonnull end) {
+  if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, p, end)) {
+    return 1;
+  }
+  if (const std::string_view type{content_type}; lws_add_http_header_by_token(
+          wsi, WSI_TOKEN_HTTP_CONTENT_TYPE,
+          reinterpret_cast<const unsigned char *>(type.data()), type.length(),
+          p, end)) {
+    return 1;
+  }
+  std::array<char, 21> buf;
+  const auto res{std::to_chars(buf.begin(), buf.end(), content_length)};
+  return lws_add_http_header_by_token(
+      wsi, WSI_TOKEN_HTTP_CONTENT_LENGTH,
+      reinterpret_cast<const unsigned char *>(buf.data()),
+      static_cast<int>(std::distance(buf.begin(), res.ptr)), p, end);
+}
+
+/// Send a response consisting of just the status code and (unless disabled)
+///    its text representation as the body.
+///
+/// @param [in] wsi
+///    Pointer to the WebSocket instance to send the response to.
+/// @param [in, out] session
+///    Session context, which provides the send buffer.
+/// @param status
+///    HTTP status code to send.
+/// @param body
+///    Value indicating whether the status code text should be sent as body.
+/// @param retry_after
+///    Value of Retry-After header, in seconds, `0` to omit it.
+/// @return Value to return from the libwebsockets callback.
+[[using gnu: nonnull(1), access(read_only, 1)]]
+static int write_status(lws *_Nonnull wsi, http_ctx &session,
+                       http_status status, bool body, int retry_after = 0) {
+  auto buf_cur{session.tx_buf.begin() + LWS_PRE};
+  const auto buf_end{session.tx_buf.end()};
+  std::array<char, 10> status_buf;
+  std::string_view status_view;
+  if (body) {
+    const auto res{std::to_chars(status_buf.begin(), status_buf.end(),
+                                 static_cast<unsigned>(status))};
+    if (res.ec != std::errc{}) {
+      return 1;
+    }
+    status_view = {status_buf.data(), res.ptr};
+  }
+  if (lws_add_http_common_headers(
+          wsi, status, body ? "text/plain; charset=utf-8" : nullptr,
+          status_view.length(), &buf_cur, buf_end)) {
+    return 1;
+  }
+  if (retry_after) {
+    std::array<char, 11> retry_after_buf;
+    const auto res{std::to_chars(retry_after_buf.begin(),
+                                 retry_after_buf.end(), retry_after)};
+    if (res.ec != std::errc{}) {
+      return 1;
+    }
+    if (lws_add_http_header_by_token(
+            wsi, WSI_TOKEN_HTTP_RETRY_AFTER,
+            reinterpret_cast<const unsigned char *>(retry_after_buf.data()),
+            std::distance(retry_after_buf.data(), res.ptr), &buf_cur,
+            buf_end)) {
+      return 1;
+    }
+  }
+  if (lws_finalize_http_header(wsi, &buf_cur, buf_end)) {
+    return 1;
+  }
+  buf_cur = std::ranges::copy(status_view, buf_cur).out;
+  if (const int size{static_cast<int>(
+          std::distance(session.tx_buf.begin() + LWS_PRE, buf_cur))};
+      lws_write(wsi, &session.tx_buf[LWS_PRE], size, LWS_WRITE_HTTP_FINAL) <
+      size) {
+    return 1;
+  }
+  return complete_transaction(wsi);
+}
+
+/// Send a manifest request code response.
+///
+/// @param [in] wsi
+///    Pointer to the WebSocket instance to send the response to.
+/// @param [in, out] session
+///    Session context, which provides the send buffer.
+/// @param mrc
+///    Manifest request code value.
+/// @param rem_time
+///    Number of seconds until the code expires.
+/// @return Value to return from the libwebsockets callback.
+[[using gnu: nonnull(1), access(read_only, 1)]]
+static int write_mrc(lws *_Nonnull wsi, http_ctx &session, std::uint64_t mrc,
+                    int rem_time) {
+  std::array<char, 21> buf;
+  const auto res{std::to_chars(buf.begin(), buf.end(), mrc)};
+  if (res.ec != std::errc{}) {
+    return write_status(wsi, session, HTTP_STATUS_INTERNAL_SERVER_ERROR, true);
+  }
+  const std::string_view mrc_view{buf.data(), res.ptr};
+  auto buf_cur{session.tx_buf.begin() + LWS_PRE};
+  const auto buf_end{session.tx_buf.end()};
+  // Write headers
+  if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK,
+                                  "text/plain; charset=utf-8",
+                                  mrc_view.length(), &buf_cur, buf_end)) {
+    return 1;
+  }
+  std::array<char, sizeof("max-age=") + 3> cache_control_buf;
+  if (const std::string_view cache_control{
+          cache_control_buf.data(),
+          std::format_to_n(cache_control_buf.data(), cache_control_buf.size(),
+                           std::locale::classic(), "max-age={}", rem_time)
+              .out};
+      lws_add_http_header_by_token(
+          wsi, WSI_TOKEN_HTTP_CACHE_CONTROL,
+          reinterpret_cast<const unsigned char *>(cache_control.data()),
+          cache_control.length(), &buf_cur, buf_end)) {
+    return 1;
+  }
+  if (lws_finalize_http_header(wsi, &buf_cur, buf_end)) {
+    return 1;
+  }
+  // Send the response
+  buf_cur = std::ranges::copy(mrc_view, buf_cur).out;
+  if (const int size{static_cast<int>(
+          std::distance(session.tx_buf.begin() + LWS_PRE, buf_cur))};
+      lws_write(wsi, &session.tx_buf[LWS_PRE], size, LWS_WRITE_HTTP_FINAL) <
+      size) {
+    return 1;
+  }
+  return complete_transaction(wsi);
 }
 
 // Process a libwebsockets protocol callback.
@@ -172,44 +583,46 @@ static int tsc_lws_cb(lws *_Nullable wsi, lws_callback_reasons reason,
     if (uri_len <= 0) {
       return 1;
     }
-    if (std::string_view{uri.data(), static_cast<std::size_t>(uri_len)} !=
-        "/signin") {
+    const std::string_view uri_view{uri.data(),
+                                    static_cast<std::size_t>(uri_len)};
+    if (uri_view == "/peer") {
+      auto &session{*reinterpret_cast<ws_ctx *>(user)};
+      session.p_ctx = peer_accept(wsi);
+      return session.p_ctx ? 0 : 1;
+    }
+    // Replicas don't keep accounts, so there is nothing to sign in to, and
+    //    hot standbys get theirs from the primary
+    if (uri_view != "/signin" || !state.replica_of.host.empty() ||
+        state.standby) {
       return 1;
     }
-    auto &session{*reinterpret_cast<ws_ctx *>(user)};
-    session.s_ctx.reset(
-        new signin_ctx{.cm_client = {nullptr, tek_sc_cm_client_destroy},
-                       .wsi = wsi,
-                       .state = signin_state::awaiting_init,
-                       .type = auth_type::credentials,
-                       .msg_buf = &session.tx_buf[LWS_PRE],
-                       .msg_size = 0,
-                       .mtx = {},
-                       .account_name = {},
-                       .password = {},
-                       .token = {}});
+    if (rl_take(wsi, rl_class::signin)) {
+      return 1;
+    }
+    reinterpret_cast<ws_ctx *>(user)->s_ctx = signin_create(wsi);
     return 0;
   }
   case LWS_CALLBACK_CLOSED: {
     auto &session{*reinterpret_cast<ws_ctx *>(user)};
-    std::erase(state.signin_ctxs, session.s_ctx.get());
-    if (session.s_ctx->cm_client) {
-      tek_sc_cm_disconnect(session.s_ctx->cm_client.get());
-    } else {
-      session.s_ctx->state = signin_state::disonnected;
+    if (session.p_ctx) {
+      peer_closed(*session.p_ctx);
+      session.p_ctx = nullptr;
+      return 0;
     }
-    for (auto cur_state{session.s_ctx->state};
-         cur_state != signin_state::disonnected;
-         cur_state = session.s_ctx->state) {
-      ts3_os_futex_wait(
-          reinterpret_cast<const std::atomic_uint32_t *>(&session.s_ctx->state),
-          static_cast<std::uint32_t>(cur_state),
-          std::numeric_limits<std::uint32_t>::max());
+    if (!session.s_ctx) {
+      break;
     }
-    session.s_ctx.reset();
+    std::erase(state.signin_ctxs, session.s_ctx);
+    // Don't wait for CM client disconnection, the context will be freed once
+    //    it's done
+    signin_close(*session.s_ctx);
+    session.s_ctx = nullptr;
     return 0;
   }
   case LWS_CALLBACK_RECEIVE:
+    if (const auto p_ctx{reinterpret_cast<ws_ctx *>(user)->p_ctx}; p_ctx) {
+      return peer_receive(*p_ctx, in, len);
+    }
     if (lws_frame_is_binary(wsi)) {
       break;
     }
@@ -218,22 +631,44 @@ static int tsc_lws_cb(lws *_Nullable wsi, lws_callback_reasons reason,
       //    likely to be some sort of DDOS attack
       return 1;
     }
-    return signin_process_msg(*reinterpret_cast<ws_ctx *>(user)->s_ctx.get(),
+    return signin_process_msg(*reinterpret_cast<ws_ctx *>(user)->s_ctx,
                               reinterpret_cast<char *>(in), len);
   case LWS_CALLBACK_SERVER_WRITEABLE: {
     auto &session{*reinterpret_cast<ws_ctx *>(user)};
+    if (session.p_ctx) {
+      return peer_write(*session.p_ctx);
+    }
     const std::scoped_lock lock{session.s_ctx->mtx};
     auto &msg_size{session.s_ctx->msg_size};
     if (msg_size <= 0) {
       break;
     }
-    if (lws_write(wsi, &session.tx_buf[LWS_PRE], msg_size, LWS_WRITE_TEXT) <
-        msg_size) {
+    if (lws_write(wsi, &session.s_ctx->tx_buf[LWS_PRE], msg_size,
+                  LWS_WRITE_TEXT) < msg_size) {
       return 1;
     }
     msg_size = 0;
     return (session.s_ctx->state >= signin_state::done) ? 1 : 0;
   }
+  // Outbound peer replication sessions, which get their contexts as user data
+  case LWS_CALLBACK_CLIENT_ESTABLISHED:
+    peer_established(*reinterpret_cast<peer_ctx *>(user));
+    return 0;
+  case LWS_CALLBACK_CLIENT_RECEIVE:
+    return peer_receive(*reinterpret_cast<peer_ctx *>(user), in, len);
+  case LWS_CALLBACK_CLIENT_WRITEABLE:
+    return peer_write(*reinterpret_cast<peer_ctx *>(user));
+  case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+    if (user) {
+      peer_connect_failed(*reinterpret_cast<peer_ctx *>(user),
+                          in ? reinterpret_cast<const char *>(in) : "");
+    }
+    return 0;
+  case LWS_CALLBACK_CLIENT_CLOSED:
+    if (user) {
+      peer_closed(*reinterpret_cast<peer_ctx *>(user));
+    }
+    return 0;
   case LWS_CALLBACK_HTTP: {
     char *uri;
     int uri_len;
@@ -243,15 +678,26 @@ static int tsc_lws_cb(lws *_Nullable wsi, lws_callback_reasons reason,
     }
     const std::string_view uri_view{uri, static_cast<std::size_t>(uri_len)};
     auto &session{*reinterpret_cast<http_ctx *>(user)};
-    auto buf_cur{session.tx_buf.begin()};
+    auto buf_cur{session.tx_buf.begin() + LWS_PRE};
     const auto buf_end{session.tx_buf.end()};
     bool send_status_body{true};
+    int retry_after{};
     auto status{HTTP_STATUS_NOT_FOUND};
-    if (state.cur_status.load(std::memory_order::relaxed) != status::running) {
+    // During setup, manifest request codes restored from the persistent cache
+    //    may still be served, and so may the manifest of a promoted standby
+    if (const auto cur_status{
+            state.cur_status.load(std::memory_order::relaxed)};
+        cur_status != status::running &&
+        (cur_status != status::setup ||
+         (uri_view != "/mrc" &&
+          (!state.hot_manifest ||
+           (uri_view != "/manifest" && uri_view != "/manifest-bin" &&
+            uri_view != "/manifest-bin-v2"))))) {
       status = HTTP_STATUS_SERVICE_UNAVAILABLE;
       goto send_status;
     }
-    if (uri_view == "/manifest" || uri_view == "/manifest-bin") {
+    if (uri_view == "/manifest" || uri_view == "/manifest-bin" ||
+        uri_view == "/manifest-bin-v2") {
       if (method != LWSHUMETH_GET) {
         status = HTTP_STATUS_METHOD_NOT_ALLOWED;
         goto send_status;
@@ -279,6 +725,11 @@ static int tsc_lws_cb(lws *_Nullable wsi, lws_callback_reasons reason,
           }
         }
       }
+      retry_after = rl_take(wsi, rl_class::manifest);
+      if (retry_after) {
+        status = http_status_too_many_requests;
+        goto send_status;
+      }
       // Read Accept-Encoding header
       hdr_len = lws_hdr_copy(wsi, hdr_buf.data(), hdr_buf.size(),
                              WSI_TOKEN_HTTP_ACCEPT_ENCODING);
@@ -287,43 +738,58 @@ static int tsc_lws_cb(lws *_Nullable wsi, lws_callback_reasons reason,
       }
       // Select response encoding
       const bool binary{uri_view != "/manifest"};
-      const auto &buf{binary ? state.manifest_bin : state.manifest};
+      const bool v2{uri_view == "/manifest-bin-v2"};
+      auto &buf{v2       ? state.manifest_bin_v2
+                : binary ? state.manifest_bin
+                         : state.manifest};
+      if (!buf.buf) {
+        // A promoted standby may not have built the manifest yet
+        status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+        goto send_status;
+      }
+      const sized_buf *dcz_buf{};
+#ifdef TEK_S3B_ZSTD
+      if (std::string_view{hdr_buf.data(), static_cast<std::size_t>(hdr_len)}
+              .contains("dcz")) {
+        dcz_buf = negotiate_dcz(wsi, buf,
+                                v2       ? state.manifest_bin_v2_dicts
+                                : binary ? state.manifest_bin_dicts
+                                         : state.manifest_dicts);
+      }
+#endif // def TEK_S3B_ZSTD
       const auto enc{negotiate_enc(
-          {hdr_buf.data(), static_cast<std::size_t>(hdr_len)}, buf)};
-      auto set_enc{[&hdr_buf, &hdr_len](const std::string_view &&name) {
-        std::ranges::copy(name, hdr_buf.data());
-        hdr_len = name.length();
-      }};
+          {hdr_buf.data(), static_cast<std::size_t>(hdr_len)}, buf, dcz_buf)};
+      const sized_buf *body;
       switch (enc) {
       case enc_type::none:
-        session.data = {buf.buf.buf.get(), buf.buf.size};
+        body = buf.buf.get();
         break;
-      case enc_type::deflate: {
-        session.data = {buf.deflate.buf.get(), buf.deflate.size};
-        set_enc("deflate");
-        break;
-      }
-#ifdef TEK_S3B_BROTLI
-      case enc_type::brotli: {
-        session.data = {buf.brotli.buf.get(), buf.brotli.size};
-        set_enc("br");
-        break;
-      }
-#endif // def TEK_S3B_BROTLI
 #ifdef TEK_S3B_ZSTD
-      case enc_type::zstd: {
-        session.data = {buf.zstd.buf.get(), buf.zstd.size};
-        set_enc("zstd");
+      case enc_type::dcz:
+        body = dcz_buf;
         break;
-      }
 #endif // def TEK_S3B_ZSTD
+      default:
+        body = buf.get(enc).data.get();
       }
+      session.data = {body->buf.get(), body->size};
+      // On plain TCP connections, the part of the body that doesn't fit into
+      //    the first packet can be sent by the kernel directly from the sealed
+      //    file's pages. TLS needs to encrypt it in user space, and HTTP/2
+      //    needs to frame it
+      const auto file{!lws_is_ssl(wsi) && lws_get_network_wsi(wsi) == wsi &&
+                              session.data.size() > tx_size
+                          ? body->get_file()
+                          : TS3_OS_INVALID_HANDLE};
       // Write headers
-      if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK,
-                                      binary
-                                          ? "application/octet-stream"
-                                          : "application/json; charset=utf-8",
-                                      session.data.size(), &buf_cur, buf_end)) {
+      if (const auto content_type{binary ? "application/octet-stream"
+                                         : "application/json; charset=utf-8"};
+          file == TS3_OS_INVALID_HANDLE
+              ? lws_add_http_common_headers(wsi, HTTP_STATUS_OK, content_type,
+                                            session.data.size(), &buf_cur,
+                                            buf_end)
+              : add_uncounted_headers(wsi, content_type, session.data.size(),
+                                      &buf_cur, buf_end)) {
         return 1;
       }
       if (constexpr std::string_view cache_control{"no-cache"};
@@ -334,13 +800,37 @@ static int tsc_lws_cb(lws *_Nullable wsi, lws_callback_reasons reason,
         return 1;
       }
       if (enc != enc_type::none) {
-        if (lws_add_http_header_by_token(
+        if (const auto name{enc_name(enc)}; lws_add_http_header_by_token(
                 wsi, WSI_TOKEN_HTTP_CONTENT_ENCODING,
-                reinterpret_cast<const unsigned char *>(hdr_buf.data()),
-                hdr_len, &buf_cur, buf_end)) {
+                reinterpret_cast<const unsigned char *>(name.data()),
+                name.length(), &buf_cur, buf_end)) {
           return 1;
         }
       }
+#ifdef TEK_S3B_ZSTD
+      // Let the client know that it may advertise this response as a
+      //    dictionary for the next request. The match pattern is relative so
+      //    it works behind reverse proxies with path prefixes
+      if (constexpr std::string_view vary{
+              "accept-encoding, available-dictionary"};
+          lws_add_http_header_by_name(
+              wsi, reinterpret_cast<const unsigned char *>("vary:"),
+              reinterpret_cast<const unsigned char *>(vary.data()),
+              vary.length(), &buf_cur, buf_end)) {
+        return 1;
+      }
+      if (const std::string_view use_as_dict{
+              v2       ? R"(match="manifest-bin-v2")"
+              : binary ? R"(match="manifest-bin")"
+                       : R"(match="manifest")"};
+          lws_add_http_header_by_name(
+              wsi,
+              reinterpret_cast<const unsigned char *>("use-as-dictionary:"),
+              reinterpret_cast<const unsigned char *>(use_as_dict.data()),
+              use_as_dict.length(), &buf_cur, buf_end)) {
+        return 1;
+      }
+#endif // def TEK_S3B_ZSTD
       // Set Last-Modified header
       const auto res{std::format_to_n(
           hdr_buf.data(), hdr_buf.size(), std::locale::classic(),
@@ -363,20 +853,25 @@ static int tsc_lws_cb(lws *_Nullable wsi, lws_callback_reasons reason,
       buf_cur =
           std::ranges::copy(session.data.subspan(0, send_size), buf_cur).out;
       // Send the response packet
-      if (const int size{
-              static_cast<int>(std::distance(session.tx_buf.begin(), buf_cur))};
-          lws_write(wsi, session.tx_buf.data(), size,
+      if (const int size{static_cast<int>(
+              std::distance(session.tx_buf.begin() + LWS_PRE, buf_cur))};
+          lws_write(wsi, &session.tx_buf[LWS_PRE], size,
                     done ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) < size) {
         return 1;
       }
       if (done) {
-        // Close connection
-        return 1;
+        return complete_transaction(wsi);
       }
       // More data to come
       session.data = session.data.subspan(send_size);
       state.download_lock.lock();
-      lws_callback_on_writable(wsi);
+      session.streaming = true;
+      if (file != TS3_OS_INVALID_HANDLE) {
+        session.zero_copy = true;
+        session.file = file;
+        session.file_offset = send_size;
+      }
+      schedule_stream(wsi, send_size);
       return 0;
     } else if (uri_view == "/mrc") { // if (uri_view == "/manifest")
       if (method != LWSHUMETH_GET) {
@@ -421,96 +916,132 @@ static int tsc_lws_cb(lws *_Nullable wsi, lws_callback_reasons reason,
         status = HTTP_STATUS_BAD_REQUEST;
         goto send_status;
       }
-      std::uint64_t mrc;
-      int rem_time;
       // Check if the manifest request code is present in the cache
-      const auto it{state.mrcs.find(manifest_id)};
-      mrc = it == state.mrcs.end() ? 0 : it->second.mrc;
-      if (!mrc) {
-        // If not, fetch it from Steam CM
-        std::unique_lock lock{state.manifest_mtx};
-        const auto &app{state.apps.find(app_id)};
-        if (app == state.apps.end()) {
-          status = HTTP_STATUS_UNAUTHORIZED;
-          goto send_status;
-        }
-        const auto depot{app->second.depots.find(depot_id)};
-        if (depot == app->second.depots.end()) {
-          status = HTTP_STATUS_UNAUTHORIZED;
-          goto send_status;
-        }
-        const auto cm_client{(*depot->second.next_acc)->cm_client};
-        if (++depot->second.next_acc == depot->second.accs.cend()) {
-          depot->second.next_acc = depot->second.accs.cbegin();
-        }
-        lock.unlock();
-        mrc_await_entry entry{
-            .data = {.app_id = app_id,
-                     .depot_id = depot_id,
-                     .manifest_id = manifest_id,
-                     .request_code = 0,
-                     .result = {.type = TEK_SC_ERR_TYPE_basic,
-                                .primary = TEK_SC_ERRC_cm_timeout,
-                                .auxiliary = 0,
-                                .extra = 0,
-                                .uri = nullptr}},
-            .finished = 0};
-        tek_sc_cm_get_mrc(cm_client, &entry.data, cb_mrc, 2000);
-        ts3_os_futex_wait(&entry.finished, 0, 2000);
-        if (!tek_sc_err_success(&entry.data.result)) {
-          if (entry.data.result.type == TEK_SC_ERR_TYPE_sub &&
-              entry.data.result.auxiliary == TEK_SC_ERRC_cm_timeout) {
-            status = HTTP_STATUS_GATEWAY_TIMEOUT;
-          } else {
-            status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
-          }
-          goto send_status;
-        }
-        mrc = entry.data.request_code;
-        if (state.mrcs.size() >= 128) {
-          // Don't keep more than 128 entries in the cache at any given time, to
-          //    avoid memory overflows
-          const auto first_it{state.mrcs.begin()};
-          lws_sul_cancel(&first_it->second.sul);
-          state.mrcs.erase(first_it);
-        }
-        auto &cache_entry{
-            state.mrcs.emplace(manifest_id, mrc_cache{}).first->second};
-        // Steam refreshes MRCs on every *4 and *9 minute, that is every 5
-        //    minutes with offset of 240 seconds from 5-minute boundary, use
-        //    that info to schedule cache entry removal on next refresh
-        const auto now{std::chrono::system_clock::to_time_t(
-            std::chrono::system_clock::now())};
-        rem_time = ((now + 60) / 300 * 300 + 240) - now;
-        cache_entry.sul.us = lws_now_usecs() + rem_time * LWS_US_PER_SEC;
-        cache_entry.sul.cb = remove_mrc_cache;
-        cache_entry.manifest_id = manifest_id;
-        cache_entry.mrc = mrc;
-        lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED,
-                          &cache_entry.sul);
-      } else { // if (it == state.mrcs.end())
-        mrc = it->second.mrc;
-        rem_time = (it->second.sul.us - lws_now_usecs()) / LWS_US_PER_SEC;
-      } // if (it == state.mrcs.end()) else
-      const auto res{std::to_chars(buf.begin(), buf.end(), mrc)};
-      if (res.ec != std::errc{}) {
-        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+      std::uint64_t mrc;
+      if (int rem_time; mrc_cache_find(manifest_id, mrc, rem_time)) {
+        return write_mrc(wsi, session, mrc, rem_time);
+      }
+      if (state.cur_status.load(std::memory_order::relaxed) !=
+          status::running) {
+        status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+        goto send_status;
+      }
+      // If not, submit a request to Steam CM, the response will be sent once
+      //    it completes. Only such requests are rate-limited, as they're the
+      //    ones spending accounts' request budget
+      retry_after = rl_take(wsi, rl_class::mrc);
+      if (retry_after) {
+        status = http_status_too_many_requests;
         goto send_status;
       }
-      const std::string_view mrc_view{buf.data(), res.ptr};
+      session.mrc_req = mrc_submit(wsi, app_id, depot_id, manifest_id);
+      return 0;
+    } else if (uri_view == "/stats") { // if (uri_view == "/manifest") else if
+                                       //    (uri_view == "/mrc")
+      if (method != LWSHUMETH_GET) {
+        status = HTTP_STATUS_METHOD_NOT_ALLOWED;
+        goto send_status;
+      }
+      // Statistics reveal memory usage and request patterns, so they're only
+      //    shown to operators
+      if (!rl_client_listed(wsi, state.stats_clients)) {
+        status = HTTP_STATUS_FORBIDDEN;
+        goto send_status;
+      }
+      rapidjson::StringBuffer json;
+      rapidjson::Writer writer{json};
+      writer.StartObject();
+      {
+        const std::scoped_lock lock{state.manifest_mtx};
+        std::string_view str{"manifest"};
+        writer.Key(str.data(), str.length());
+        writer.StartObject();
+        write_buf_stats(writer, state.manifest);
+#ifdef TEK_S3B_ZSTD
+        write_dict_stats(writer, state.manifest_dicts);
+#endif // def TEK_S3B_ZSTD
+        writer.EndObject();
+        str = "manifest_bin";
+        writer.Key(str.data(), str.length());
+        writer.StartObject();
+        write_buf_stats(writer, state.manifest_bin);
+#ifdef TEK_S3B_ZSTD
+        write_dict_stats(writer, state.manifest_bin_dicts);
+#endif // def TEK_S3B_ZSTD
+        writer.EndObject();
+        str = "manifest_bin_v2";
+        writer.Key(str.data(), str.length());
+        writer.StartObject();
+        write_buf_stats(writer, state.manifest_bin_v2);
+#ifdef TEK_S3B_ZSTD
+        write_dict_stats(writer, state.manifest_bin_v2_dicts);
+#endif // def TEK_S3B_ZSTD
+        writer.EndObject();
+        str = "compression";
+        writer.Key(str.data(), str.length());
+        writer.StartObject();
+        str = "budget";
+        writer.Key(str.data(), str.length());
+        writer.Uint64(state.comp_budget / (LWS_US_PER_SEC / 1000));
+        const auto comp_stats{comp_tune_get_stats()};
+        for (auto &&[enc, enc_stats] :
+             std::views::zip(precomp_encs, comp_stats)) {
+          str = enc_name(enc);
+          writer.Key(str.data(), str.length());
+          writer.StartObject();
+          str = "level";
+          writer.Key(str.data(), str.length());
+          writer.Int(enc_stats.level);
+          str = "ns_per_byte";
+          writer.Key(str.data(), str.length());
+          writer.Double(enc_stats.ns_per_byte);
+          str = "ratio";
+          writer.Key(str.data(), str.length());
+          writer.Double(enc_stats.ratio);
+          str = "samples";
+          writer.Key(str.data(), str.length());
+          writer.Uint(enc_stats.samples);
+          writer.EndObject();
+        }
+        writer.EndObject();
+      }
+      {
+        const auto stats{mrc_get_stats()};
+        std::string_view str{"mrc"};
+        writer.Key(str.data(), str.length());
+        writer.StartObject();
+        str = "outstanding";
+        writer.Key(str.data(), str.length());
+        writer.Int(stats.outstanding);
+        str = "queued";
+        writer.Key(str.data(), str.length());
+        writer.Uint64(stats.queued);
+        str = "cached";
+        writer.Key(str.data(), str.length());
+        writer.Uint64(stats.cached);
+        str = "shed_full";
+        writer.Key(str.data(), str.length());
+        writer.Uint64(stats.shed_full);
+        str = "shed_expired";
+        writer.Key(str.data(), str.length());
+        writer.Uint64(stats.shed_expired);
+        str = "forwarded";
+        writer.Key(str.data(), str.length());
+        writer.Uint64(stats.forwarded);
+        str = "shared_hits";
+        writer.Key(str.data(), str.length());
+        writer.Uint64(stats.shared_hits);
+        writer.EndObject();
+      }
+      writer.EndObject();
+      const std::string_view json_view{json.GetString(), json.GetSize()};
       // Write headers
       if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK,
-                                      "text/plain; charset=utf-8",
-                                      mrc_view.length(), &buf_cur, buf_end)) {
+                                      "application/json; charset=utf-8",
+                                      json_view.length(), &buf_cur, buf_end)) {
         return 1;
       }
-      std::array<char, sizeof("max-age=") + 3> cache_control_buf;
-      if (const std::string_view cache_control{
-              cache_control_buf.data(),
-              std::format_to_n(cache_control_buf.data(),
-                               cache_control_buf.size(), std::locale::classic(),
-                               "max-age={}", rem_time)
-                  .out};
+      if (constexpr std::string_view cache_control{"no-store"};
           lws_add_http_header_by_token(
               wsi, WSI_TOKEN_HTTP_CACHE_CONTROL,
               reinterpret_cast<const unsigned char *>(cache_control.data()),
@@ -520,46 +1051,37 @@ static int tsc_lws_cb(lws *_Nullable wsi, lws_callback_reasons reason,
       if (lws_finalize_http_header(wsi, &buf_cur, buf_end)) {
         return 1;
       }
-      // Send the response
-      buf_cur = std::ranges::copy(mrc_view, buf_cur).out;
-      lws_write(wsi, session.tx_buf.data(),
-                std::distance(session.tx_buf.data(), buf_cur),
-                LWS_WRITE_HTTP_FINAL);
-      return 1;
-    } // if (uri_view == "/manifest") else if (uri_view == "/mrc")
-  send_status:
-    // Send just the status code and (unless disabled) its text representation
-    //    as the body
-    if (send_status_body) {
-      std::array<char, 10> status_buf;
-      const auto res{std::to_chars(status_buf.begin(), status_buf.end(),
-                                   static_cast<unsigned>(status))};
-      if (res.ec != std::errc{}) {
-        return 1;
-      }
-      const std::string_view status_view{status_buf.data(), res.ptr};
-      if (lws_add_http_common_headers(wsi, status, "text/plain; charset=utf-8",
-                                      status_view.length(), &buf_cur,
-                                      buf_end)) {
-        return 1;
-      }
-      if (lws_finalize_http_header(wsi, &buf_cur, buf_end)) {
-        return 1;
+      // Send as much as fits along with the headers, the rest is copied into
+      //    the session's own buffer and sent from writable callbacks
+      const auto send_size{std::min<std::size_t>(
+          json_view.length(), std::distance(buf_cur, buf_end))};
+      const bool done{send_size == json_view.length()};
+      buf_cur = std::ranges::copy(json_view.substr(0, send_size), buf_cur).out;
+      if (!done) {
+        const auto rest{json_view.substr(send_size)};
+        session.body = static_cast<unsigned char *>(std::malloc(rest.length()));
+        if (!session.body) {
+          return 1;
+        }
+        std::ranges::copy(rest, session.body);
+        session.data = {session.body, rest.length()};
       }
-      buf_cur = std::ranges::copy(status_view, buf_cur).out;
-    } else {
-      if (lws_add_http_common_headers(wsi, status, nullptr, 0, &buf_cur,
-                                      buf_end)) {
+      if (const int size{static_cast<int>(
+              std::distance(session.tx_buf.begin() + LWS_PRE, buf_cur))};
+          lws_write(wsi, &session.tx_buf[LWS_PRE], size,
+                    done ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) < size) {
+        end_stream(wsi, session);
         return 1;
       }
-      if (lws_finalize_http_header(wsi, &buf_cur, buf_end)) {
-        return 1;
+      if (done) {
+        return complete_transaction(wsi);
       }
-    }
-    lws_write(wsi, session.tx_buf.data(),
-              std::distance(session.tx_buf.begin(), buf_cur),
-              LWS_WRITE_HTTP_FINAL);
-    return 1;
+      lws_callback_on_writable(wsi);
+      return 0;
+    } // if (uri_view == "/manifest") else if (uri_view == "/mrc") else if
+      //    (uri_view == "/stats")
+  send_status:
+    return write_status(wsi, session, status, send_status_body, retry_after);
   } // case LWS_CALLBACK_HTTP
   case LWS_CALLBACK_HTTP_WRITEABLE: {
     if (!user) {
@@ -567,70 +1089,181 @@ static int tsc_lws_cb(lws *_Nullable wsi, lws_callback_reasons reason,
       break;
     }
     auto &session{*reinterpret_cast<http_ctx *>(user)};
+    if (session.mrc_req) {
+      auto &req{*session.mrc_req};
+      if (!req.status) {
+        // Still pending
+        return 0;
+      }
+      session.mrc_req = nullptr;
+      int res;
+      if (req.status == HTTP_STATUS_OK) {
+        res = write_mrc(wsi, session, req.mrc, req.rem_time);
+      } else {
+        // For shed requests, suggest retrying after the queue had a chance to
+        //    drain
+        const int retry_after{
+            req.status == HTTP_STATUS_SERVICE_UNAVAILABLE
+                ? std::max(static_cast<int>(state.mrc_limits.queue_timeout /
+                                            LWS_US_PER_SEC),
+                           1)
+                : 0};
+        res = write_status(wsi, session, static_cast<http_status>(req.status),
+                           true, retry_after);
+      }
+      mrc_release(req);
+      return res;
+    }
+    if (!session.streaming && !session.body) {
+      // Ignore spurious callbacks
+      return 0;
+    }
+    if (session.zero_copy) {
+      if (lws_partial_buffered(wsi)) {
+        // Headers must reach the socket before the body
+        lws_callback_on_writable(wsi);
+        return 0;
+      }
+      const auto sent{ts3_os_file_send(lws_get_socket_fd(wsi), session.file,
+                                       &session.file_offset,
+                                       std::min(session.data.size(), tx_size))};
+      if (sent < 0) {
+        end_stream(wsi, session);
+        return 1;
+      }
+      if (static_cast<std::size_t>(sent) == session.data.size()) {
+        end_stream(wsi, session);
+        return complete_transaction(wsi);
+      }
+      session.data = session.data.subspan(sent);
+      schedule_stream(wsi, sent);
+      return 0;
+    }
     const int send_size{
         static_cast<int>(std::min(session.data.size(), tx_size))};
     const bool done{send_size == static_cast<int>(session.data.size())};
-    if (lws_write(wsi, session.data.data(), send_size,
+    auto send_data{session.data.data()};
+    if (lws_get_network_wsi(wsi) != wsi) {
+      // HTTP/2 streams write frame headers into LWS_PRE bytes preceding the
+      //    data, which can't be done in the shared manifest buffer
+      std::ranges::copy(session.data.subspan(0, send_size),
+                        &session.tx_buf[LWS_PRE]);
+      send_data = &session.tx_buf[LWS_PRE];
+    }
+    if (lws_write(wsi, send_data, send_size,
                   done ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) < send_size) {
-      state.download_lock.unlock();
+      end_stream(wsi, session);
       return 1;
     }
     if (done) {
-      // Close connection
-      state.download_lock.unlock();
-      return 1;
+      end_stream(wsi, session);
+      return complete_transaction(wsi);
     }
     // More data to come
     session.data = session.data.subspan(send_size);
-    lws_callback_on_writable(wsi);
+    if (session.streaming) {
+      schedule_stream(wsi, send_size);
+    } else {
+      lws_callback_on_writable(wsi);
+    }
     return 0;
   }
+  case LWS_CALLBACK_CLOSED_HTTP: {
+    if (!user) {
+      break;
+    }
+    auto &session{*reinterpret_cast<http_ctx *>(user)};
+    if (session.mrc_req) {
+      mrc_release(*session.mrc_req);
+      session.mrc_req = nullptr;
+    }
+    // The connection may be closed by the client in the middle of a stream
+    end_stream(wsi, session);
+    break;
+  }
   case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
     std::unique_lock lock{state.manifest_mtx};
     if (state.cur_status.load(std::memory_order::relaxed) == status::stopping) {
-      state.download_lock.force_unlock();
       // Destroy libwebsockets context
       const auto lws_ctx{state.lws_ctx};
       state.lws_ctx = nullptr;
+      lws_sul_cancel(&state.enc_evict_sul);
+      lws_sul_cancel(&streams.sul);
+      peer_stop();
+      replica_stop();
+      tls_stop();
+      // A compression job that is still running is waited for, its result
+      //    is freed along with other unprocessed events
+      worker_stop();
+      enc_cache_stop();
       for (auto &acc : state.accounts | std::views::values) {
         if (acc.ren_status == renew_status::scheduled) {
           lws_sul_cancel(&acc.sul);
         }
       }
+      // Active streams release their download lock references on close
       lws_context_destroy(lws_ctx);
+      state.download_lock.force_unlock();
       return 1;
     }
-    for (auto &acc : state.accounts | std::views::values) {
-      if (acc.rem_status.load(std::memory_order::relaxed) ==
-              remove_status::remove &&
-          acc.ren_status == renew_status::scheduled) {
-        lws_sul_cancel(&acc.sul);
-      } else if (acc.ren_status == renew_status::pending_schedule) {
-        lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED,
-                          &acc.sul);
-        acc.ren_status = renew_status::scheduled;
-      }
-    }
-    if (std::erase_if(state.accounts,
-                      [](const auto &pair) {
-                        return pair.second.rem_status.load(
-                                   std::memory_order::relaxed) ==
-                               remove_status::remove;
-                      }) &&
+    // Process only the events posted since the last wakeup rather than
+    //    scanning all accounts and sign-in contexts
+    bool acc_removed{};
+    for (std::unique_ptr<event> ev{state.events.take()}; ev;
+         ev.reset(ev->next)) {
+      switch (ev->type) {
+      case event_type::schedule_renewal:
+        if (auto &acc{*ev->acc};
+            acc.ren_status == renew_status::pending_schedule) {
+          lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED,
+                            &acc.sul);
+          acc.ren_status = renew_status::scheduled;
+        }
+        break;
+      case event_type::remove_account: {
+        // No events are posted for the account after this one, since its CM
+        //    client is not connected anymore
+        auto &acc{*ev->acc};
+        // Its index will be reused, so make sure that no depots refer to it
+        //    anymore
+        unlink_acc_depots(acc, false);
+        acc_removed = true;
+        state.acc_slots[acc.index] = nullptr;
+        if (acc.ren_status == renew_status::scheduled) {
+          lws_sul_cancel(&acc.sul);
+        }
+        state.accounts.erase(acc.token_info.steam_id);
+        break;
+      }
+      case event_type::signin_output:
+        // The session may have been closed after the event was posted
+        if (const auto ctx{ev->s_ctx};
+            std::ranges::find(state.signin_ctxs, ctx) !=
+            state.signin_ctxs.end()) {
+          if (ctx->msg_size > 0) {
+            lws_callback_on_writable(ctx->wsi);
+          } else if (ctx->msg_size < 0) {
+            lws_set_timeout(ctx->wsi, static_cast<pending_timeout>(1),
+                            LWS_TO_KILL_ASYNC);
+          }
+        }
+        break;
+      case event_type::enc_built:
+        complete_enc_job(*ev->job);
+      } // switch (ev->type)
+    }
+    if (acc_removed &&
         state.cur_status.load(std::memory_order::relaxed) == status::setup &&
         state.num_ready_accs == static_cast<int>(state.accounts.size())) {
-      update_manifest();
       state.cur_status.store(status::running, std::memory_order::relaxed);
+      // A promoted standby serves its manifest during setup, and downloads of
+      //    it may still be in progress
+      peer_update_manifest();
     }
     lock.unlock();
-    for (auto ctx : state.signin_ctxs) {
-      if (ctx->msg_size > 0) {
-        lws_callback_on_writable(ctx->wsi);
-      } else if (ctx->msg_size < 0) {
-        lws_set_timeout(ctx->wsi, static_cast<pending_timeout>(1),
-                        LWS_TO_KILL_ASYNC);
-      }
-    }
+    mrc_process();
+    peer_process();
+    signin_free_retired();
     break;
   } // case LWS_CALLBACK_EVENT_WAIT_CANCELLED
   default:
@@ -657,6 +1290,9 @@ constexpr lws_protocols protocol{.name = "tek-s3",
 //===-- Internal function -------------------------------------------------===//
 
 extern "C" void ts3_run(void) {
-  while (!lws_service(tek::s3::state.lws_ctx, 0))
-    ;
+  // The bulk stream budget limits the amount of data sent per iteration, so
+  //    it's refilled before each one rather than when it runs out
+  do {
+    tek::s3::streams.budget = tek::s3::stream_budget;
+  } while (!lws_service(tek::s3::state.lws_ctx, 0));
 }
@@ -0,0 +1,333 @@
+//===-- shared_mrc.cpp - Shared manifest request code table ---------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Implementation of the shared manifest request code table. It's a
+///    fixed-size open addressing hash table with linear probing, where each
+///    slot is guarded by its own sequence lock: writers claim a slot by making
+///    its sequence number odd, and readers retry if the number has changed
+///    while they were reading. Writers record the time of the claim, so a slot
+///    left odd by a process that has crashed in the middle of writing is
+///    reclaimed by the next process that finds it after
+///    @ref stale_claim_timeout, instead of staying unreadable until the
+///    segment is removed. Slots are never emptied, instead their codes become
+///    stale once their rotation epoch ends, and they may be reused for other
+///    manifests after that.
+///
+//===----------------------------------------------------------------------===//
+#include "shared_mrc.hpp"
+
+#include "null_attrs.h" // IWYU pragma: keep
+#include "os.h"
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <print>
+#include <string>
+#include <string_view>
+#include <tek-steamclient/os.h>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private types -----------------------------------------------------===//
+
+/// Number of slots in the table, must be a power of 2.
+constexpr std::size_t num_slots{4096};
+/// Maximum number of slots probed for a manifest ID.
+constexpr std::size_t max_probes{16};
+/// Maximum number of attempts to read a slot that is being written to.
+constexpr int max_read_attempts{8};
+/// Time after which a slot that is still being written to is considered
+///    abandoned by a crashed writer, in seconds. Writing takes a few stores,
+///    so it can only be exceeded by a process that has died or has been
+///    stopped.
+constexpr std::uint32_t stale_claim_timeout{10};
+
+/// Shared table slot.
+struct slot {
+  /// Sequence number, odd while the slot is being written to.
+  std::atomic_uint32_t seq;
+  /// Lower 32 bits of the time of the latest attempt to claim the slot, in
+  ///    seconds since Epoch. Set before changing @ref seq, so it's never older
+  ///    than the claim that made @ref seq odd.
+  std::atomic_uint32_t claimed;
+  /// ID of the manifest, `0` if the slot has never been used.
+  std::atomic_uint64_t manifest_id;
+  /// Manifest request code value.
+  std::atomic_uint64_t mrc;
+  /// End of the code's rotation epoch, in seconds since Epoch.
+  std::atomic_int64_t expires;
+};
+
+/// Shared memory segment layout.
+struct table {
+  /// Magic value identifying the segment, @ref table_magic, set after all
+  ///    other header fields.
+  std::atomic_uint32_t magic;
+  /// Segment layout version, @ref table_version.
+  std::atomic_uint32_t version;
+  /// Number of slots in @ref slots.
+  std::atomic_uint32_t capacity;
+  /// Reserved for future use.
+  std::uint32_t reserved;
+  /// Table slots.
+  std::array<slot, num_slots> slots;
+};
+
+/// Contents of a slot read under its sequence lock.
+struct slot_snapshot {
+  /// ID of the manifest, `0` if the slot has never been used.
+  std::uint64_t manifest_id;
+  /// Manifest request code value.
+  std::uint64_t mrc;
+  /// End of the code's rotation epoch, in seconds since Epoch.
+  std::int64_t expires;
+};
+
+// The segment is shared with other processes, so the atomics must not fall
+//    back to process-local locks
+static_assert(std::atomic_uint32_t::is_always_lock_free &&
+              std::atomic_uint64_t::is_always_lock_free &&
+              std::atomic_int64_t::is_always_lock_free);
+
+/// Value of @ref table::magic ("TS3S" in little-endian).
+constexpr std::uint32_t table_magic{0x53335354};
+/// Current value of @ref table::version.
+constexpr std::uint32_t table_version{2};
+
+//===-- Private variable --------------------------------------------------===//
+
+/// Pointer to the mapped table, or `nullptr` if it's not available.
+static table *_Nullable shared_table;
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Print an error message with OS error code description to stderr.
+///
+/// @param errc
+///    OS error code.
+/// @param msg
+///    Error message.
+static inline void print_os_err(tek_sc_os_errc errc,
+                                const std::string_view &&msg) {
+  const auto err_msg{ts3_os_get_err_msg(errc)};
+  std::println(std::cerr, "{}: ({}) {}", msg, errc, err_msg);
+  std::free(err_msg);
+}
+
+/// Get current time in seconds since Epoch.
+///
+/// @return Current time.
+static inline std::int64_t time_now() noexcept {
+  return std::chrono::system_clock::to_time_t(
+      std::chrono::system_clock::now());
+}
+
+/// Get index of the first slot to probe for a manifest ID.
+///
+/// @param manifest_id
+///    ID of the manifest.
+/// @return Index of the slot.
+static constexpr std::size_t home_slot(std::uint64_t manifest_id) noexcept {
+  // Fibonacci hashing, manifest IDs are not uniformly distributed in low bits
+  return (manifest_id * 0x9E3779B97F4A7C15) >>
+         (64 - std::countr_zero(num_slots));
+}
+
+/// Read a consistent snapshot of a slot.
+///
+/// @param [in] s
+///    The slot to read.
+/// @param [out] snapshot
+///    Variable that receives slot contents.
+/// @return Value indicating whether a consistent snapshot has been read, that
+///    is no writer has held the slot for all attempts.
+static bool read_slot(const slot &s, slot_snapshot &snapshot) noexcept {
+  for (int i{}; i < max_read_attempts; ++i) {
+    const auto seq{s.seq.load(std::memory_order::acquire)};
+    if (seq & 1) {
+      continue;
+    }
+    snapshot = {.manifest_id = s.manifest_id.load(std::memory_order::relaxed),
+                .mrc = s.mrc.load(std::memory_order::relaxed),
+                .expires = s.expires.load(std::memory_order::relaxed)};
+    std::atomic_thread_fence(std::memory_order::acquire);
+    if (s.seq.load(std::memory_order::relaxed) == seq) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Claim a slot that has been left odd by a crashed writer.
+///
+/// @param [in, out] s
+///    The slot.
+/// @param [in, out] seq
+///    Odd sequence number of the slot that has been loaded. On success,
+///    receives the sequence number of the new claim, which is odd as well.
+/// @param now
+///    Current time.
+/// @return Value indicating whether the slot has been claimed. Fails if the
+///    claim isn't stale yet, or if another process has changed the slot.
+static bool reclaim_slot(slot &s, std::uint32_t &seq,
+                         std::int64_t now) noexcept {
+  const auto now32{static_cast<std::uint32_t>(now)};
+  if (now32 - s.claimed.load(std::memory_order::relaxed) <=
+      stale_claim_timeout) {
+    return false;
+  }
+  s.claimed.store(now32, std::memory_order::relaxed);
+  if (!s.seq.compare_exchange_strong(seq, seq + 2,
+                                     std::memory_order::acq_rel)) {
+    return false;
+  }
+  std::println(std::cerr,
+               "Reclaiming shared manifest request code table slot abandoned "
+               "by a crashed process");
+  seq += 2;
+  return true;
+}
+
+} // namespace
+
+//===-- Internal functions ------------------------------------------------===//
+
+bool shared_mrc_open(const std::string &name) {
+  const auto tab{
+      reinterpret_cast<table *>(ts3_os_shm_map(name.data(), sizeof(table)))};
+  if (!tab) {
+    print_os_err(ts3_os_get_last_error(),
+                 "Cannot use shared manifest request code table; failed to "
+                 "map shared memory segment");
+    return false;
+  }
+  if (!tab->magic.load(std::memory_order::acquire)) {
+    // Fresh zero-filled segment is already a valid empty table, only the
+    //    header needs to be set. Racing processes write the same values.
+    tab->version.store(table_version, std::memory_order::relaxed);
+    tab->capacity.store(num_slots, std::memory_order::relaxed);
+    auto expected{std::uint32_t{}};
+    tab->magic.compare_exchange_strong(expected, table_magic,
+                                       std::memory_order::release,
+                                       std::memory_order::acquire);
+  }
+  if (tab->magic.load(std::memory_order::acquire) != table_magic ||
+      tab->version.load(std::memory_order::relaxed) != table_version ||
+      tab->capacity.load(std::memory_order::relaxed) != num_slots) {
+    std::println(std::cerr,
+                 "Cannot use shared manifest request code table: segment "
+                 "\"{}\" has incompatible layout",
+                 name);
+    ts3_os_file_unmap(tab, sizeof(table));
+    return false;
+  }
+  shared_table = tab;
+  return true;
+}
+
+bool shared_mrc_find(std::uint64_t manifest_id, std::uint64_t &mrc,
+                     std::int64_t &expires) noexcept {
+  if (!shared_table) {
+    return false;
+  }
+  const auto now{time_now()};
+  const auto home{home_slot(manifest_id)};
+  for (std::size_t i{}; i < max_probes; ++i) {
+    auto &s{shared_table->slots[(home + i) & (num_slots - 1)]};
+    slot_snapshot snapshot;
+    if (!read_slot(s, snapshot)) {
+      // The contents of an abandoned slot may be torn, so it's marked stale
+      //    to be reused
+      if (auto seq{s.seq.load(std::memory_order::acquire)};
+          (seq & 1) && reclaim_slot(s, seq, now)) {
+        s.expires.store(0, std::memory_order::relaxed);
+        if (!s.manifest_id.load(std::memory_order::relaxed)) {
+          // Keep the probe chain going through the slot
+          s.manifest_id.store(manifest_id, std::memory_order::relaxed);
+        }
+        s.seq.store(seq + 1, std::memory_order::release);
+      }
+      continue;
+    }
+    if (!snapshot.manifest_id) {
+      // Slots are never emptied, so the probe chain ends here
+      return false;
+    }
+    if (snapshot.manifest_id == manifest_id && snapshot.expires > now) {
+      mrc = snapshot.mrc;
+      expires = snapshot.expires;
+      return true;
+    }
+  }
+  return false;
+}
+
+void shared_mrc_publish(std::uint64_t manifest_id, std::uint64_t mrc,
+                        std::int64_t expires) noexcept {
+  if (!shared_table) {
+    return;
+  }
+  const auto now{time_now()};
+  const auto home{home_slot(manifest_id)};
+  for (std::size_t i{}; i < max_probes; ++i) {
+    auto &s{shared_table->slots[(home + i) & (num_slots - 1)]};
+    auto seq{s.seq.load(std::memory_order::acquire)};
+    if (seq & 1) {
+      // Another process is writing to the slot, or has crashed while doing so
+      if (!reclaim_slot(s, seq, now)) {
+        continue;
+      }
+    } else {
+      const auto slot_id{s.manifest_id.load(std::memory_order::relaxed)};
+      if (slot_id && slot_id != manifest_id &&
+          s.expires.load(std::memory_order::relaxed) > now) {
+        // Live code for another manifest
+        continue;
+      }
+      // Claiming the slot fails if anyone has written to it since the
+      //    sequence number was loaded, which also validates the checks above
+      s.claimed.store(static_cast<std::uint32_t>(now),
+                      std::memory_order::relaxed);
+      if (!s.seq.compare_exchange_strong(seq, seq + 1,
+                                         std::memory_order::acq_rel)) {
+        continue;
+      }
+      ++seq;
+    }
+    std::atomic_thread_fence(std::memory_order::release);
+    s.mrc.store(mrc, std::memory_order::relaxed);
+    s.expires.store(expires, std::memory_order::relaxed);
+    s.manifest_id.store(manifest_id, std::memory_order::relaxed);
+    // Fails only if this process has been stopped for so long that the slot
+    //    has been reclaimed, then the new owner publishes its own contents
+    s.seq.compare_exchange_strong(seq, seq + 1, std::memory_order::release,
+                                  std::memory_order::relaxed);
+    return;
+  }
+}
+
+void shared_mrc_close() noexcept {
+  if (shared_table) {
+    ts3_os_file_unmap(shared_table, sizeof(table));
+    shared_table = nullptr;
+  }
+}
+
+} // namespace tek::s3
@@ -0,0 +1,67 @@
+//===-- shared_mrc.hpp - Shared manifest request code table declarations --===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Declarations of functions for the manifest request code table shared
+///    between tek-s3 processes on the same host via a named shared memory
+///    segment. The table is lock-free, so it may be accessed by any number of
+///    processes at once, and a crashed process cannot block the others.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace tek::s3 {
+
+/// Open the shared memory segment with the table, creating and initializing it
+///    if it doesn't exist yet. Failures are reported to stderr.
+///
+/// @param [in] name
+///    Name of the segment, the same for all processes that share the table.
+/// @return Value indicating whether the table has been opened.
+[[gnu::visibility("internal")]]
+bool shared_mrc_open(const std::string &name);
+
+/// Find a manifest request code that hasn't expired yet in the table.
+///
+/// @param manifest_id
+///    ID of the manifest to get request code for.
+/// @param [out] mrc
+///    Variable that receives the manifest request code.
+/// @param [out] expires
+///    Variable that receives expiration time of the code, in seconds since
+///    Epoch.
+/// @return Value indicating whether the code has been found.
+[[gnu::visibility("internal")]]
+bool shared_mrc_find(std::uint64_t manifest_id, std::uint64_t &mrc,
+                     std::int64_t &expires) noexcept;
+
+/// Publish a manifest request code to the table, so other processes can use
+///    it. If all slots that the manifest ID may occupy hold live codes for
+///    other manifests, the code is not published.
+///
+/// @param manifest_id
+///    ID of the manifest that the code is for.
+/// @param mrc
+///    Manifest request code value.
+/// @param expires
+///    Expiration time of the code, in seconds since Epoch.
+[[gnu::visibility("internal")]]
+void shared_mrc_publish(std::uint64_t manifest_id, std::uint64_t mrc,
+                        std::int64_t expires) noexcept;
+
+/// Unmap the shared memory segment, if it's mapped. The segment itself is left
+///    in place for other processes.
+[[gnu::visibility("internal")]]
+void shared_mrc_close() noexcept;
+
+} // namespace tek::s3
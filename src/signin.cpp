@@ -34,11 +34,11 @@
 #include <rapidjson/reader.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
-#include <set>
 #include <string_view>
 #include <tek-steamclient/cm.h>
 #include <tek-steamclient/error.h>
 #include <utility>
+#include <vector>
 
 namespace tek::s3 {
 
@@ -46,6 +46,37 @@ namespace {
 
 //===-- Private functions -------------------------------------------------===//
 
+/// Free a sign-in context.
+///
+/// @param [in] ctx
+///    Pointer to the context to free.
+static void free_ctx(signin_ctx *_Nonnull ctx) {
+  delete ctx;
+  state.num_signin_ctxs.fetch_sub(1, std::memory_order::relaxed);
+}
+
+/// Release a reference to a sign-in context from a CM client callback. If it
+///    was the last one, hand the context over to the service thread for
+///    freeing, since the CM client cannot be destroyed from its own callback.
+///    Must not be called with the context's mutex locked.
+///
+/// @param [in, out] ctx
+///    Sign-in context to release.
+static void release_from_cm(signin_ctx &ctx) {
+  if (ctx.ref_count.fetch_sub(1, std::memory_order::acq_rel) != 1) {
+    return;
+  }
+  {
+    const std::scoped_lock lock{state.retired_signin_mtx};
+    state.retired_signin_ctxs.emplace_back(&ctx);
+  }
+  state.signin_retire_seq.fetch_add(1, std::memory_order::release);
+  ts3_os_futex_wake(&state.signin_retire_seq);
+  if (state.cur_status.load(std::memory_order::relaxed) != status::stopping) {
+    lws_cancel_service(state.lws_ctx);
+  }
+}
+
 /// The callback for CM client authentication session events.
 ///
 /// @param [in, out] client
@@ -98,12 +129,12 @@ static void cb_auth(tek_sc_cm_client *_Nonnull client, void *_Nonnull data,
     } // if (tek_sc_err_success(&data_auth.result)) else
     writer.EndObject();
     ctx.msg_size = buf.GetSize();
-    if (LWS_PRE + static_cast<std::size_t>(ctx.msg_size) > tx_size) {
+    if (LWS_PRE + static_cast<std::size_t>(ctx.msg_size) > ctx.tx_buf.size()) {
       ctx.msg_size = -1;
     } else {
-      std::ranges::copy_n(buf.GetString(), ctx.msg_size, ctx.msg_buf);
+      std::ranges::copy_n(buf.GetString(), ctx.msg_size, &ctx.tx_buf[LWS_PRE]);
     }
-    lws_cancel_service(state.lws_ctx);
+    post_event({.type = event_type::signin_output, .s_ctx = &ctx});
     tek_sc_cm_disconnect(client);
     break;
   } // case TEK_SC_CM_AUTH_STATUS_completed
@@ -117,12 +148,12 @@ static void cb_auth(tek_sc_cm_client *_Nonnull client, void *_Nonnull data,
     writer.String(str.data(), str.length());
     writer.EndObject();
     ctx.msg_size = buf.GetSize();
-    if (LWS_PRE + static_cast<std::size_t>(ctx.msg_size) > tx_size) {
+    if (LWS_PRE + static_cast<std::size_t>(ctx.msg_size) > ctx.tx_buf.size()) {
       ctx.msg_size = -1;
     } else {
-      std::ranges::copy_n(buf.GetString(), ctx.msg_size, ctx.msg_buf);
+      std::ranges::copy_n(buf.GetString(), ctx.msg_size, &ctx.tx_buf[LWS_PRE]);
     }
-    lws_cancel_service(state.lws_ctx);
+    post_event({.type = event_type::signin_output, .s_ctx = &ctx});
     break;
   }
   case TEK_SC_CM_AUTH_STATUS_awaiting_confirmation: {
@@ -150,12 +181,12 @@ static void cb_auth(tek_sc_cm_client *_Nonnull client, void *_Nonnull data,
     writer.EndObject();
     ctx.state = signin_state::awaiting_confirmation;
     ctx.msg_size = buf.GetSize();
-    if (LWS_PRE + static_cast<std::size_t>(ctx.msg_size) > tx_size) {
+    if (LWS_PRE + static_cast<std::size_t>(ctx.msg_size) > ctx.tx_buf.size()) {
       ctx.msg_size = -1;
     } else {
-      std::ranges::copy_n(buf.GetString(), ctx.msg_size, ctx.msg_buf);
+      std::ranges::copy_n(buf.GetString(), ctx.msg_size, &ctx.tx_buf[LWS_PRE]);
     }
-    lws_cancel_service(state.lws_ctx);
+    post_event({.type = event_type::signin_output, .s_ctx = &ctx});
   }
   } // switch (data_auth.status)
 }
@@ -175,7 +206,7 @@ static void cb_auth_connected(tek_sc_cm_client *_Nonnull client,
   auto &ctx{*reinterpret_cast<signin_ctx *>(user_data)};
   if (const auto &res{*reinterpret_cast<const tek_sc_err *>(data)};
       !tek_sc_err_success(&res)) {
-    const std::scoped_lock lock{ctx.mtx};
+    std::unique_lock lock{ctx.mtx};
     if (ctx.state != signin_state::done) {
       ctx.state = signin_state::disonnected;
       rapidjson::StringBuffer buf;
@@ -198,12 +229,21 @@ static void cb_auth_connected(tek_sc_cm_client *_Nonnull client,
       writer.EndObject();
       writer.EndObject();
       ctx.msg_size = buf.GetSize();
-      if (LWS_PRE + static_cast<std::size_t>(ctx.msg_size) > tx_size) {
+      if (LWS_PRE + static_cast<std::size_t>(ctx.msg_size) >
+          ctx.tx_buf.size()) {
         ctx.msg_size = -1;
       } else {
-        std::ranges::copy_n(buf.GetString(), ctx.msg_size, ctx.msg_buf);
+        std::ranges::copy_n(buf.GetString(), ctx.msg_size,
+                            &ctx.tx_buf[LWS_PRE]);
       }
-      lws_cancel_service(state.lws_ctx);
+      post_event({.type = event_type::signin_output, .s_ctx = &ctx});
+    }
+    // The disconnection callback is not supposed to be called, so release CM
+    //    client's reference here, unless it has been released already
+    const bool owns_ref{!std::exchange(ctx.cm_ref_released, true)};
+    lock.unlock();
+    if (owns_ref) {
+      release_from_cm(ctx);
     }
     return;
   } // if (!tek_sc_err_success(&res))
@@ -234,7 +274,7 @@ static void cb_auth_connected(tek_sc_cm_client *_Nonnull client,
 static void cb_auth_disconnected(tek_sc_cm_client *, void *,
                                  void *_Nonnull user_data) {
   auto &ctx{*reinterpret_cast<signin_ctx *>(user_data)};
-  const std::scoped_lock lock{ctx.mtx};
+  std::unique_lock lock{ctx.mtx};
   if (ctx.state == signin_state::done) {
     if (!ctx.token.empty()) {
       state.manifest_mtx.lock();
@@ -242,12 +282,12 @@ static void cb_auth_disconnected(tek_sc_cm_client *, void *,
       const auto token_info{tek_sc_cm_parse_auth_token(ctx.token.data())};
       const auto [it, emplaced]{state.accounts.try_emplace(
           token_info.steam_id, lws_sorted_usec_list_t{}, cm_client,
-          std::move(ctx.token), token_info, renew_status::not_scheduled, 0, 0,
-          remove_status::none, std::unique_ptr<tek_sc_cm_data_depot_key[]>{},
-          std::set<std::uint32_t>{}, false)};
+          std::move(ctx.token), token_info, renew_status::not_scheduled,
+          remove_status::none, false, 0, std::shared_ptr<cancel_token>{})};
       auto &acc{it->second};
       if (emplaced) {
         // New account added
+        assign_acc_index(acc);
         tek_sc_cm_set_user_data(cm_client, &acc);
         state.state_dirty = true;
         update_manifest();
@@ -274,15 +314,59 @@ static void cb_auth_disconnected(tek_sc_cm_client *, void *,
   } else if (state.cur_status.load(std::memory_order::relaxed) !=
              status::stopping) {
     ctx.msg_size = -1;
-    lws_cancel_service(state.lws_ctx);
+    post_event({.type = event_type::signin_output, .s_ctx = &ctx});
   }
   ctx.state = signin_state::disonnected;
-  ts3_os_futex_wake(reinterpret_cast<std::atomic_uint32_t *>(&ctx.state));
+  const bool owns_ref{!std::exchange(ctx.cm_ref_released, true)};
+  lock.unlock();
+  if (owns_ref) {
+    release_from_cm(ctx);
+  }
 }
 
 } // namespace
 
-//===-- Internal function -------------------------------------------------===//
+//===-- Internal functions ------------------------------------------------===//
+
+signin_ctx *signin_create(lws *wsi) {
+  const auto ctx{
+      new signin_ctx{.ref_count = 1,
+                     .cm_client = {nullptr, tek_sc_cm_client_destroy},
+                     .wsi = wsi,
+                     .state = signin_state::awaiting_init,
+                     .type = auth_type::credentials,
+                     .tx_buf = {},
+                     .msg_size = 0,
+                     .mtx = {},
+                     .account_name = {},
+                     .password = {},
+                     .token = {},
+                     .cm_ref_released = false}};
+  state.num_signin_ctxs.fetch_add(1, std::memory_order::relaxed);
+  return ctx;
+}
+
+void signin_close(signin_ctx &ctx) {
+  {
+    const std::scoped_lock lock{ctx.mtx};
+    if (ctx.cm_client && ctx.state != signin_state::disonnected) {
+      // CM client's reference will be released by the disconnection callback
+      tek_sc_cm_disconnect(ctx.cm_client.get());
+    }
+  }
+  if (ctx.ref_count.fetch_sub(1, std::memory_order::acq_rel) == 1) {
+    free_ctx(&ctx);
+  }
+}
+
+void signin_free_retired() {
+  std::vector<signin_ctx *> ctxs;
+  {
+    const std::scoped_lock lock{state.retired_signin_mtx};
+    ctxs.swap(state.retired_signin_ctxs);
+  }
+  std::ranges::for_each(ctxs, free_ctx);
+}
 
 int signin_process_msg(signin_ctx &ctx, char *msg, std::size_t msg_size) {
   const std::scoped_lock lock{ctx.mtx};
@@ -329,6 +413,8 @@ int signin_process_msg(signin_ctx &ctx, char *msg, std::size_t msg_size) {
     }
     state.signin_ctxs.emplace_back(&ctx);
     ctx.state = signin_state::awaiting_cm_response;
+    // Reference owned by the CM client
+    ctx.ref_count.fetch_add(1, std::memory_order::relaxed);
     tek_sc_cm_connect(ctx.cm_client.get(), cb_auth_connected, 5000,
                       cb_auth_disconnected);
     return 0;
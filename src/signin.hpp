@@ -16,6 +16,8 @@
 
 #include "null_attrs.h" // IWYU pragma: keep
 
+#include <array>
+#include <atomic>
 #include <cstddef>
 #include <libwebsockets.h>
 #include <memory>
@@ -25,6 +27,9 @@
 
 namespace tek::s3 {
 
+/// Size of the sign-in message send buffer, including `LWS_PRE` headroom.
+constexpr std::size_t signin_tx_size{8192};
+
 /// Steam authentication types.
 enum class auth_type {
   /// Credentials-based authentication.
@@ -48,8 +53,12 @@ enum class signin_state {
   disonnected
 };
 
-/// Steam sign-in context.
+/// Steam sign-in context. It is owned jointly by the WebSocket session and the
+///    CM client performing the sign-in, and freed when both have released it,
+///    so neither has to wait for the other.
 struct signin_ctx {
+  /// Number of active references to the context.
+  std::atomic_uint32_t ref_count;
   /// Pointer to the CM client instance performing the sign-in.
   std::unique_ptr<tek_sc_cm_client, decltype(&tek_sc_cm_client_destroy)>
       cm_client;
@@ -59,8 +68,9 @@ struct signin_ctx {
   signin_state state;
   /// Selected authentication type.
   auth_type type;
-  /// Pointer to the buffer for outgoing messages.
-  unsigned char *_Nonnull msg_buf;
+  /// Buffer for outgoing messages, the message itself starts at `LWS_PRE`
+  ///    offset.
+  std::array<unsigned char, signin_tx_size> tx_buf;
   /// Size of the message to send, in bytes. Value of `0` indicates that there
   ///    is no outgoing message pending, and value of `-1` indicates that
   ///    connection should be closed.
@@ -73,8 +83,37 @@ struct signin_ctx {
   std::string password;
   /// On success, Steam authentication token.
   std::string token;
+  /// Value indicating whether the CM client's reference to the context has
+  ///    been released. Both the failed connection and the disconnection
+  ///    callbacks may attempt it, so the first one to set this owns the
+  ///    release.
+  bool cm_ref_released;
 };
 
+/// Create a new sign-in context for a WebSocket session.
+///
+/// @param [in] wsi
+///    Pointer to the client WebSocket connection instance.
+/// @return Pointer to the created context, with a single reference owned by
+///    the session.
+[[using gnu: visibility("internal"), nonnull(1), returns_nonnull]]
+signin_ctx *_Nonnull signin_create(lws *_Nonnull wsi);
+
+/// Release session's reference to a sign-in context after its WebSocket
+///    connection has been closed, and request CM client disconnection if
+///    it's still connected. Returns without waiting for the disconnection.
+///
+/// @param [in, out] ctx
+///    Sign-in context to close.
+[[gnu::visibility("internal")]]
+void signin_close(signin_ctx &ctx);
+
+/// Free sign-in contexts whose last reference has been released by CM client
+///    callbacks. Must be called from the libwebsockets service thread, or
+///    after it has exited.
+[[gnu::visibility("internal")]]
+void signin_free_retired();
+
 /// Process incoming WebSocket message.
 ///
 /// @param [in, out] ctx
@@ -15,32 +15,42 @@
 #include "state.hpp"
 
 #include "cm_callbacks.hpp"
+#include "comp_tune.hpp"
 #include "config.h"
+#include "enc_cache.hpp"
 #include "impl.h"
 #include "os.h"
 #include "utils.h"
+#include "worker.hpp"
 
+#include <algorithm>
+#include <array>
 #include <charconv>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <ctime>
+#include <format>
 #include <iostream>
+#include <iterator>
 #include <libwebsockets.h>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <print>
+#include <random>
 #include <ranges>
 #include <rapidjson/document.h>
 #include <rapidjson/reader.h>
-#include <set>
 #include <string>
 #include <string_view>
 #include <system_error>
 #include <tek-steamclient/base.h>
 #include <tek-steamclient/os.h>
 #include <utility>
+#include <vector>
 #ifdef TEK_S3B_ZNG
 #include <zlib-ng.h>
 #else // def TEK_S3B_ZNG
@@ -91,6 +101,16 @@ static constexpr lws_http_mount mount{.mount_next = nullptr,
                                       .headers = nullptr,
                                       .keepalive_timeout = 0};
 
+#ifdef TEK_S3B_ZSTD
+/// Base-2 logarithm of the maximum zstd window size for dcz responses. RFC
+///    9842 only requires clients to support windows of up to 8 MiB.
+static constexpr int dcz_max_window_log{23};
+/// Maximum zstd compression level for dcz responses. Each dictionary gets its
+///    own compression on first request, and deltas against a previous
+///    generation gain little from the slowest levels.
+static constexpr int dcz_max_level{12};
+#endif // def TEK_S3B_ZSTD
+
 #ifdef TEK_S3B_ZNG
 
 static constexpr auto &compressBound{::zng_compressBound};
@@ -118,73 +138,460 @@ static inline void print_os_err(tek_sc_os_errc errc,
   std::free(err_msg);
 }
 
+/// Compress the source buffer of a job and seal the result, or make a sealed
+///    copy of it. Runs on the worker thread.
+///
+/// @param [in, out] job
+///    The job to run.
+static void run_enc_job(enc_job &job) noexcept {
+  const auto &src{*job.src};
+  if (job.enc == enc_type::none) {
+    job.data = sized_buf::sealed_copy(src);
+    return;
+  }
+  // Each codec compresses into a worst-case sized buffer, which is then
+  //    shrunk to the actual size
+  const auto start{std::chrono::steady_clock::now()};
+  try {
+    switch (job.enc) {
+    case enc_type::deflate: {
+      auto tmp_buf{sized_buf::alloc(compressBound(src.size))};
+#ifdef TEK_S3B_ZNG
+      std::size_t size{tmp_buf.size};
+#else  // def TEK_S3B_ZNG
+      uLongf size{tmp_buf.size};
+#endif // def TEK_S3B_ZNG else
+      if (compress2(tmp_buf.buf.get(), &size, src.buf.get(), src.size,
+                    job.level) != Z_OK) {
+        return;
+      }
+      tmp_buf.shrink(size);
+      job.data = std::move(tmp_buf);
+      break;
+    }
+#ifdef TEK_S3B_BROTLI
+    case enc_type::brotli: {
+      auto tmp_buf{
+          sized_buf::alloc(BrotliEncoderMaxCompressedSize(src.size))};
+      auto size{tmp_buf.size};
+      if (BrotliEncoderCompress(
+              job.level, BROTLI_MAX_WINDOW_BITS,
+              job.binary ? BROTLI_MODE_GENERIC : BROTLI_MODE_TEXT, src.size,
+              src.buf.get(), &size, tmp_buf.buf.get()) == BROTLI_FALSE) {
+        return;
+      }
+      tmp_buf.shrink(size);
+      job.data = std::move(tmp_buf);
+      break;
+    }
+#endif // def TEK_S3B_BROTLI
+#ifdef TEK_S3B_ZSTD
+    case enc_type::zstd: {
+      auto tmp_buf{sized_buf::alloc(ZSTD_compressBound(src.size))};
+      const auto size{ZSTD_compress(tmp_buf.buf.get(), tmp_buf.size,
+                                    src.buf.get(), src.size, job.level)};
+      if (ZSTD_isError(size)) {
+        return;
+      }
+      tmp_buf.shrink(size);
+      job.data = std::move(tmp_buf);
+      break;
+    }
+    case enc_type::dcz: {
+      // dcz stream starts with a zstd skippable frame header with 32-byte
+      //    payload, which is the SHA-256 hash of the dictionary
+      static constexpr std::array<unsigned char, 8> dcz_magic{
+          0x5E, 0x2A, 0x4D, 0x18, 0x20, 0x00, 0x00, 0x00};
+      constexpr auto hdr_size{dcz_magic.size() + sizeof job.dict.hash};
+      const std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx{
+          ZSTD_createCCtx(), ZSTD_freeCCtx};
+      if (!cctx) {
+        return;
+      }
+      // Using the previous generation as a raw prefix lets zstd match against
+      //    it like zstd --patch-from does, within the window allowed for dcz
+      const auto &dict{*job.dict.buf};
+      if (ZSTD_isError(ZSTD_CCtx_setParameter(
+              cctx.get(), ZSTD_c_compressionLevel, job.level)) ||
+          ZSTD_isError(ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_windowLog,
+                                              dcz_max_window_log)) ||
+          ZSTD_isError(
+              ZSTD_CCtx_refPrefix(cctx.get(), dict.buf.get(), dict.size))) {
+        return;
+      }
+      auto tmp_buf{sized_buf::alloc(hdr_size + ZSTD_compressBound(src.size))};
+      std::ranges::copy(job.dict.hash,
+                        std::ranges::copy(dcz_magic, tmp_buf.buf.get()).out);
+      const auto size{ZSTD_compress2(cctx.get(), &tmp_buf.buf[hdr_size],
+                                     tmp_buf.size - hdr_size, src.buf.get(),
+                                     src.size)};
+      if (ZSTD_isError(size)) {
+        return;
+      }
+      tmp_buf.shrink(hdr_size + size);
+      job.data = std::move(tmp_buf);
+      break;
+    }
+#endif // def TEK_S3B_ZSTD
+    default:
+      return;
+    }
+  } catch (const std::bad_alloc &) {
+    return;
+  }
+  job.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  job.data.seal();
+}
+
+/// Submit a job to the worker thread, which posts it back to the service
+///    thread when done.
+///
+/// @param [in] job
+///    The job to submit.
+/// @throws std::bad_alloc if allocation fails.
+static void submit_enc_job(std::unique_ptr<enc_job> &&job) {
+  worker_submit([job = std::move(job)] mutable noexcept {
+    run_enc_job(*job);
+    try {
+      post_event({.type = event_type::enc_built, .job = std::move(job)});
+    } catch (const std::bad_alloc &) {
+      // The encoding stays pending and is never served, which is as good as
+      //    a failure
+    }
+  });
+}
+
 } // namespace
 
 //===-- Internal functions ------------------------------------------------===//
 
-http_buf::http_buf(sized_buf &&new_buf, bool binary) : buf{std::move(new_buf)} {
-  // Deflate
-  {
-    const auto worst_size{compressBound(buf.size)};
-    auto tmp_buf{std::make_unique_for_overwrite<unsigned char[]>(worst_size)};
-    deflate.size = worst_size;
-#ifdef TEK_S3B_ZNG
-    std::size_t size;
-#else  // def TEK_S3B_ZNG
-    uLongf size;
-#endif // def TEK_S3B_ZNG else
-    const auto res{compress2(tmp_buf.get(), &size, buf.buf.get(), buf.size,
-                             Z_BEST_COMPRESSION)};
-    deflate.size = size;
-    if (res != Z_OK) {
-      deflate.buf.reset();
-      deflate.size = 0;
-    } else if (deflate.size == worst_size) {
-      deflate.buf = std::move(tmp_buf);
-    } else {
-      deflate.buf.reset(new unsigned char[deflate.size]);
-      std::ranges::copy_n(tmp_buf.get(), deflate.size, deflate.buf.get());
+sized_buf sized_buf::alloc(std::size_t size) {
+  const auto buf{static_cast<unsigned char *>(std::malloc(size))};
+  if (!buf) {
+    throw std::bad_alloc{};
+  }
+  return {.buf{buf, {.map_size = 0}}, .size = size};
+}
+
+void sized_buf::deleter::operator()(unsigned char *buf) const noexcept {
+  if (map_size) {
+    ts3_os_file_unmap(buf, map_size);
+  } else {
+    std::free(buf);
+  }
+}
+
+void sized_buf::shrink(std::size_t new_size) noexcept {
+  if (new_size >= size) {
+    return;
+  }
+  if (const auto new_buf{
+          static_cast<unsigned char *>(std::realloc(buf.get(), new_size))}) {
+    static_cast<void>(buf.release());
+    buf.reset(new_buf);
+  }
+  size = new_size;
+}
+
+void sized_buf::seal() noexcept {
+  if (file) {
+    return;
+  }
+  if (auto sealed{sealed_copy(*this)}; sealed.buf) {
+    *this = std::move(sealed);
+  }
+}
+
+sized_buf sized_buf::sealed_copy(const sized_buf &src) noexcept {
+  if (!src.size) {
+    // Empty files can't be mapped
+    return {};
+  }
+  try {
+    auto file{std::make_unique<os_handle>(
+        ts3_os_sealed_file_create("tek-s3-buf", src.buf.get(), src.size))};
+    if (!*file) {
+      return {};
+    }
+    const auto map{static_cast<unsigned char *>(
+        ts3_os_file_map_ro(file->value, src.size))};
+    if (!map) {
+      return {};
     }
+    return {.buf{map, {.map_size = src.size}},
+            .size = src.size,
+            .file = std::move(file)};
+  } catch (const std::bad_alloc &) {
+    return {};
   }
+}
+
+http_buf::http_buf(sized_buf &&new_buf, bool binary)
+    : buf{std::make_shared<const sized_buf>(std::move(new_buf))},
+      binary{binary} {
+  ts3_u_sha256(buf->buf.get(), buf->size, hash.data());
+}
+
+const enc_buf &http_buf::get(enc_type enc) const noexcept {
+  switch (enc) {
 #ifdef TEK_S3B_BROTLI
-  // Brotli
-  {
-    const auto worst_size{BrotliEncoderMaxCompressedSize(buf.size)};
-    auto tmp_buf{std::make_unique_for_overwrite<unsigned char[]>(worst_size)};
-    brotli.size = worst_size;
-    const int res{BrotliEncoderCompress(
-        BROTLI_MAX_QUALITY, BROTLI_MAX_WINDOW_BITS,
-        binary ? BROTLI_MODE_GENERIC : BROTLI_MODE_TEXT, buf.size,
-        buf.buf.get(), &brotli.size, tmp_buf.get())};
-    if (res == BROTLI_FALSE) {
-      brotli.buf.reset();
-      brotli.size = 0;
-    } else if (brotli.size == worst_size) {
-      brotli.buf = std::move(tmp_buf);
+  case enc_type::brotli:
+    return brotli;
+#endif // def TEK_S3B_BROTLI
+#ifdef TEK_S3B_ZSTD
+  case enc_type::zstd:
+    return zstd;
+#endif // def TEK_S3B_ZSTD
+  default:
+    return deflate;
+  }
+}
+
+bool http_buf::build(enc_type enc) {
+  auto &ent{get(enc)};
+  if (ent.data) {
+    return true;
+  }
+  if (ent.pending || ent.failed) {
+    return false;
+  }
+  submit_enc_job(std::make_unique<enc_job>(
+      enc_job{.src = buf,
+              .hash = hash,
+              .binary = binary,
+              .enc = enc,
+              .level = comp_tune_level(enc),
+              .data{},
+              .elapsed = 0,
+              .dict{},
+              .restored = false}));
+  ent.pending = true;
+  return false;
+}
+
+void http_buf::prebuild(const http_buf &prev) {
+  submit_enc_job(std::make_unique<enc_job>(enc_job{.src = buf,
+                                                   .hash = hash,
+                                                   .binary = binary,
+                                                   .enc = enc_type::none,
+                                                   .level = 0,
+                                                   .data{},
+                                                   .elapsed = 0,
+                                                   .dict{},
+                                                   .restored = false}));
+  const auto now{lws_now_usecs()};
+  for (const auto enc : precomp_encs) {
+    auto &ent{get(enc)};
+    if (prev.buf) {
+      const auto &prev_ent{prev.get(enc)};
+      ent.num_uses = prev_ent.num_uses;
+      ent.last_use = prev_ent.last_use;
+      ent.ratio = prev_ent.ratio;
     } else {
-      brotli.buf.reset(new unsigned char[brotli.size]);
-      std::ranges::copy_n(tmp_buf.get(), brotli.size, brotli.buf.get());
+      // Nothing is known about the demand yet, so have every encoding ready
+      //    for the first clients, and let eviction sort it out later
+      ent.last_use = now;
+    }
+    if (now - ent.last_use < enc_idle_timeout) {
+      build(enc);
+    }
+  }
+}
+
+void http_buf::evict(lws_usec_t idle_since) noexcept {
+  for (const auto enc : precomp_encs) {
+    if (auto &ent{get(enc)}; ent.data && ent.last_use < idle_since) {
+      ent.data.reset();
+    }
+  }
+}
+
+void http_buf::install_sealed() noexcept {
+  if (sealed_buf) {
+    // Compression jobs that still read the old buffer keep it alive
+    buf = std::move(sealed_buf);
+  }
+}
+
+std::size_t http_buf::mem_size() const noexcept {
+  auto size{buf ? buf->size : 0};
+  if (sealed_buf) {
+    size += sealed_buf->size;
+  }
+  for (const auto enc : precomp_encs) {
+    if (const auto &data{get(enc).data}; data) {
+      size += data->size;
     }
   }
-#endif // def TEK_S3B_BROTLI
 #ifdef TEK_S3B_ZSTD
-  // Zstandard
-  {
-    const auto worst_size{ZSTD_compressBound(buf.size)};
-    auto tmp_buf{std::make_unique_for_overwrite<unsigned char[]>(worst_size)};
-    zstd.size = ZSTD_compress(tmp_buf.get(), worst_size, buf.buf.get(),
-                              buf.size, ZSTD_maxCLevel());
-    if (ZSTD_isError(zstd.size)) {
-      zstd.buf.reset();
-      zstd.size = 0;
-    } else if (zstd.size == worst_size) {
-      zstd.buf = std::move(tmp_buf);
-    } else {
-      zstd.buf.reset(new unsigned char[zstd.size]);
-      std::ranges::copy_n(tmp_buf.get(), zstd.size, zstd.buf.get());
+  for (const auto &ent : dcz | std::views::values) {
+    if (ent.data) {
+      size += ent.data->size;
     }
   }
 #endif // def TEK_S3B_ZSTD
+  return size;
+}
+
+#ifdef TEK_S3B_ZSTD
+const sized_buf *http_buf::build_dcz(const manifest_dict &dict) {
+  auto &ent{dcz.try_emplace(dict.hash, enc_buf{.ratio = 0}).first->second};
+  if (ent.data) {
+    return ent.data.get();
+  }
+  if (ent.pending || ent.failed) {
+    return nullptr;
+  }
+  submit_enc_job(std::make_unique<enc_job>(enc_job{
+      .src = buf,
+      .hash = hash,
+      .binary = binary,
+      .enc = enc_type::dcz,
+      .level = std::min(comp_tune_level(enc_type::zstd), dcz_max_level),
+      .data{},
+      .elapsed = 0,
+      .dict = dict,
+      .restored = false}));
+  ent.pending = true;
+  return nullptr;
+}
+#endif // def TEK_S3B_ZSTD
+
+void assign_acc_index(account &acc) {
+  const auto it{std::ranges::find(state.acc_slots, nullptr)};
+  acc.index = std::distance(state.acc_slots.begin(), it);
+  if (it == state.acc_slots.end()) {
+    state.acc_slots.emplace_back(&acc);
+  } else {
+    *it = &acc;
+  }
+}
+
+void unlink_acc_depots(account &acc, bool prune) {
+  for (const auto &[app_id, depot_id] : acc.depots) {
+    const auto app{state.apps.find(app_id)};
+    if (app == state.apps.end()) {
+      continue;
+    }
+    auto &depots{app->second.depots};
+    const auto depot{depots.find(depot_id)};
+    if (depot == depots.end()) {
+      continue;
+    }
+    depot->second.accs.reset(acc.index);
+    if (!prune || !depot->second.accs.empty() || depot->second.peers) {
+      continue;
+    }
+    depots.erase(depot);
+    if (depots.empty()) {
+      state.apps.erase(app);
+    }
+    state.manifest_dirty = true;
+  }
+  acc.depots.clear();
+}
+
+void post_event(event &&ev) {
+  if (state.events.push(new event{std::move(ev)}) &&
+      state.cur_status.load(std::memory_order::relaxed) != status::stopping) {
+    lws_cancel_service(state.lws_ctx);
+  }
+}
+
+void complete_enc_job(enc_job &job) {
+  // dcz compressions use zstd levels, but their ratios depend on the
+  //    dictionary and would skew zstd estimates
+  if (job.data.buf && std::ranges::find(precomp_encs, job.enc) !=
+                          precomp_encs.end()) {
+    if (job.restored) {
+      comp_tune_record_ratio(job.enc, job.level, job.src->size, job.data.size);
+    } else {
+      comp_tune_record(job.enc, job.level, job.src->size, job.data.size,
+                       job.elapsed);
+    }
+  }
+  for (auto buf : {&state.manifest, &state.manifest_bin,
+                   &state.manifest_bin_v2}) {
+    // Snapshots are matched by contents rather than by buffer pointers, which
+    //    change when sealed copies are installed
+    if (!buf->buf || buf->hash != job.hash) {
+      continue;
+    }
+    if (job.enc == enc_type::none) {
+      if (!job.data.buf || buf->buf->file) {
+        return;
+      }
+      try {
+        buf->sealed_buf =
+            std::make_shared<const sized_buf>(std::move(job.data));
+      } catch (const std::bad_alloc &) {
+        // The buffer is sent from memory then
+        return;
+      }
+      if (!state.download_lock.locked()) {
+        buf->install_sealed();
+      }
+      return;
+    }
+#ifdef TEK_S3B_ZSTD
+    const auto dcz_ent{job.enc == enc_type::dcz ? buf->dcz.find(job.dict.hash)
+                                                : buf->dcz.end()};
+    if (job.enc == enc_type::dcz && dcz_ent == buf->dcz.end()) {
+      return;
+    }
+    auto &ent{dcz_ent == buf->dcz.end() ? buf->get(job.enc) : dcz_ent->second};
+#else  // def TEK_S3B_ZSTD
+    auto &ent{buf->get(job.enc)};
+#endif // def TEK_S3B_ZSTD else
+    if (!ent.pending) {
+      // A job started for an earlier snapshot with the same contents has
+      //    already completed
+      return;
+    }
+    ent.pending = false;
+    if (!job.data.buf) {
+      if (job.restored) {
+        // The saved file is missing or stale
+        try {
+          buf->build(job.enc);
+        } catch (const std::bad_alloc &) {
+          // Left unbuilt, so it's retried on a later request
+        }
+      } else {
+        ent.failed = true;
+      }
+      return;
+    }
+    try {
+      ent.data = std::make_shared<const sized_buf>(std::move(job.data));
+    } catch (const std::bad_alloc &) {
+      // Left unbuilt, so it's retried on a later request
+      return;
+    }
+    ent.level = job.level;
+    ent.restored = job.restored;
+    if (job.src->size) {
+      ent.ratio = static_cast<double>(ent.data->size) / job.src->size;
+    }
+    return;
+  }
+}
+
+void evict_encs(lws_sorted_usec_list_t *sul) {
+  if (const std::scoped_lock lock{state.manifest_mtx};
+      !state.download_lock.locked()) {
+    // Buffers can be evicted only when no downloads are streaming them
+    const auto idle_since{lws_now_usecs() - enc_idle_timeout};
+    for (auto buf : {&state.manifest, &state.manifest_bin,
+                     &state.manifest_bin_v2}) {
+      buf->evict(idle_since);
+      buf->install_sealed();
+    }
+  }
+  sul->us = lws_now_usecs() + 60 * LWS_US_PER_SEC;
+  lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED, sul);
 }
 
 } // namespace tek::s3
@@ -202,6 +609,13 @@ bool ts3_init(void) {
     std::println(std::cerr, "tek_sc_lib_init failed");
     return false;
   }
+  // Start the thread that compresses manifests in the background
+  try {
+    worker_start();
+  } catch (const std::system_error &e) {
+    std::println(std::cerr, "Failed to start worker thread: {}", e.what());
+    return false;
+  }
   // Load state
   {
     const auto state_dir{ts3_os_get_state_dir()};
@@ -270,11 +684,14 @@ bool ts3_init(void) {
                        token_info.steam_id);
           continue;
         }
-        state.accounts.try_emplace(
-            token_info.steam_id, lws_sorted_usec_list_t{}, nullptr,
-            std::move(token), token_info, renew_status::not_scheduled, 0, 0,
-            remove_status::none, std::unique_ptr<tek_sc_cm_data_depot_key[]>{},
-            std::set<std::uint32_t>{}, false);
+        if (const auto [it, emplaced]{state.accounts.try_emplace(
+                token_info.steam_id, lws_sorted_usec_list_t{}, nullptr,
+                std::move(token), token_info, renew_status::not_scheduled,
+                remove_status::none, false, 0,
+                std::shared_ptr<cancel_token>{})};
+            emplaced) {
+          assign_acc_index(it->second);
+        }
       }
     }
     if (const auto apps{doc.FindMember("apps")};
@@ -302,8 +719,8 @@ bool ts3_init(void) {
           if (!depot_id.IsUint()) {
             continue;
           }
-          app.depots.emplace(static_cast<std::uint32_t>(depot_id.GetUint()),
-                             depot{});
+          app.depots.try_emplace(
+              static_cast<std::uint32_t>(depot_id.GetUint()));
         }
       }
     }
@@ -319,8 +736,82 @@ bool ts3_init(void) {
         if (!b64_key.IsString() || b64_key.GetStringLength() != 44) {
           continue;
         }
-        ts3_u_base64_decode(b64_key.GetString(), 44,
-                            state.depot_keys[depot_id]);
+        if (depot_key key; ts3_u_base64_decode_keys(b64_key.GetString(), 1,
+                                                    key.data(), key.size())) {
+          state.depot_keys[depot_id] = key;
+        }
+      }
+    }
+    // Read an array of IDs from a member of a PICS info entry
+    const auto read_ids{[](const rapidjson::Value &ent, const char *name,
+                           std::vector<std::uint32_t> &ids) {
+      const auto arr{ent.FindMember(name)};
+      if (arr == ent.MemberEnd() || !arr->value.IsArray()) {
+        return;
+      }
+      for (const auto &id : arr->value.GetArray()) {
+        if (id.IsUint()) {
+          ids.emplace_back(static_cast<std::uint32_t>(id.GetUint()));
+        }
+      }
+    }};
+    if (const auto packages{doc.FindMember("pics_packages")};
+        packages != doc.MemberEnd() && packages->value.IsObject()) {
+      for (const auto &[id, package_ent] : packages->value.GetObject()) {
+        if (!package_ent.IsObject()) {
+          continue;
+        }
+        std::uint32_t package_id;
+        if (const std::string_view view{id.GetString(), id.GetStringLength()};
+            std::from_chars(view.begin(), view.end(), package_id).ec !=
+            std::errc{}) {
+          continue;
+        }
+        const auto timestamp{package_ent.FindMember("timestamp")};
+        if (timestamp == package_ent.MemberEnd() ||
+            !timestamp->value.IsUint64()) {
+          continue;
+        }
+        auto &package{state.pics_packages[package_id]};
+        package.timestamp =
+            static_cast<std::time_t>(timestamp->value.GetUint64());
+        read_ids(package_ent, "depots", package.depot_ids);
+        read_ids(package_ent, "apps", package.app_ids);
+      }
+    }
+    if (const auto apps{doc.FindMember("pics_apps")};
+        apps != doc.MemberEnd() && apps->value.IsObject()) {
+      for (const auto &[id, app_ent] : apps->value.GetObject()) {
+        if (!app_ent.IsObject()) {
+          continue;
+        }
+        std::uint32_t app_id;
+        if (const std::string_view view{id.GetString(), id.GetStringLength()};
+            std::from_chars(view.begin(), view.end(), app_id).ec !=
+            std::errc{}) {
+          continue;
+        }
+        const auto timestamp{app_ent.FindMember("timestamp")};
+        if (timestamp == app_ent.MemberEnd() || !timestamp->value.IsUint64()) {
+          continue;
+        }
+        auto &app{state.pics_apps[app_id]};
+        app.timestamp = static_cast<std::time_t>(timestamp->value.GetUint64());
+        if (const auto pics_at{app_ent.FindMember("pics_at")};
+            pics_at != app_ent.MemberEnd() && pics_at->value.IsUint64()) {
+          app.access_token = pics_at->value.GetUint64();
+        }
+        if (const auto name{app_ent.FindMember("name")};
+            name != app_ent.MemberEnd() && name->value.IsString()) {
+          app.name = {name->value.GetString(), name->value.GetStringLength()};
+        }
+        if (const auto workshopdepot{app_ent.FindMember("workshopdepot")};
+            workshopdepot != app_ent.MemberEnd() &&
+            workshopdepot->value.IsUint()) {
+          app.workshop_depot =
+              static_cast<std::uint32_t>(workshopdepot->value.GetUint());
+        }
+        read_ids(app_ent, "depots", app.depot_ids);
       }
     }
   } // State file loading scope
@@ -379,6 +870,351 @@ skip_state_file:
       endpoint = {listen_endpoint->value.GetString(),
                   listen_endpoint->value.GetStringLength()};
     }
+    if (const auto mrc_limits{doc.FindMember("mrc_limits")};
+        mrc_limits != doc.MemberEnd() && mrc_limits->value.IsObject()) {
+      auto &limits{state.mrc_limits};
+      const auto get_limit{[&mrc_limits](const char *_Nonnull name,
+                                         auto &value) {
+        const auto member{mrc_limits->value.FindMember(name)};
+        if (member == mrc_limits->value.MemberEnd()) {
+          return true;
+        }
+        if (!member->value.IsInt() || member->value.GetInt() <= 0) {
+          std::println(std::cerr,
+                       "Invalid mrc_limits.{} value: must be a positive "
+                       "integer",
+                       name);
+          return false;
+        }
+        value = member->value.GetInt();
+        return true;
+      }};
+      if (!get_limit("max_outstanding", limits.max_outstanding) ||
+          !get_limit("max_outstanding_per_account",
+                     limits.max_outstanding_per_acc) ||
+          !get_limit("max_queued", limits.max_queued) ||
+          !get_limit("queue_timeout", limits.queue_timeout)) {
+        return false;
+      }
+      // The setting is in milliseconds
+      limits.queue_timeout *= LWS_US_PER_SEC / 1000;
+    }
+    if (const auto rate_limits{doc.FindMember("rate_limits")};
+        rate_limits != doc.MemberEnd() && rate_limits->value.IsObject()) {
+      constexpr std::array<const char *, num_rl_classes> names{
+          "mrc", "manifest", "signin"};
+      for (auto &&[name, params] :
+           std::views::zip(names, state.rate_limits)) {
+        const auto member{rate_limits->value.FindMember(name)};
+        if (member == rate_limits->value.MemberEnd()) {
+          continue;
+        }
+        const auto &value{member->value};
+        if (!value.IsObject()) {
+          std::println(std::cerr,
+                       "Invalid rate_limits.{} value: must be an object", name);
+          return false;
+        }
+        const auto rate{value.FindMember("rate")};
+        if (rate == value.MemberEnd() || !rate->value.IsNumber() ||
+            rate->value.GetDouble() <= 0) {
+          std::println(std::cerr,
+                       "Invalid rate_limits.{}.rate value: must be a positive "
+                       "number",
+                       name);
+          return false;
+        }
+        params.rate = rate->value.GetDouble();
+        if (const auto burst{value.FindMember("burst")};
+            burst != value.MemberEnd()) {
+          if (!burst->value.IsNumber() || burst->value.GetDouble() < 1) {
+            std::println(std::cerr,
+                         "Invalid rate_limits.{}.burst value: must be a "
+                         "number not less than 1",
+                         name);
+            return false;
+          }
+          params.burst = burst->value.GetDouble();
+        } else {
+          params.burst = std::max(params.rate, 1.0);
+        }
+      }
+    }
+    if (const auto tls{doc.FindMember("tls")}; tls != doc.MemberEnd()) {
+      if (!tls->value.IsObject()) {
+        std::println(std::cerr, "Invalid tls value: must be an object");
+        return false;
+      }
+      for (auto &&[name, path] :
+           {std::pair{"cert", &state.tls.cert_path},
+            std::pair{"key", &state.tls.key_path}}) {
+        const auto member{tls->value.FindMember(name)};
+        if (member == tls->value.MemberEnd() || !member->value.IsString() ||
+            !member->value.GetStringLength()) {
+          std::println(std::cerr,
+                       "Invalid tls.{} value: must be a non-empty string",
+                       name);
+          return false;
+        }
+        *path = {member->value.GetString(), member->value.GetStringLength()};
+      }
+    }
+    if (const auto h2c{doc.FindMember("h2c")};
+        h2c != doc.MemberEnd() && h2c->value.IsBool()) {
+      state.h2c = h2c->value.GetBool();
+#ifndef LWS_SERVER_OPTION_H2_PRIOR_KNOWLEDGE
+      if (state.h2c) {
+        std::println(std::cerr, "h2c is not supported by the libwebsockets "
+                                "build in use");
+        return false;
+      }
+#endif // ndef LWS_SERVER_OPTION_H2_PRIOR_KNOWLEDGE
+      if (state.h2c && !state.tls.cert_path.empty()) {
+        std::println(std::cerr, "h2c can't be used along with tls");
+        return false;
+      }
+    }
+    if (const auto trusted_proxies{doc.FindMember("trusted_proxies")};
+        trusted_proxies != doc.MemberEnd() &&
+        trusted_proxies->value.IsArray()) {
+      for (const auto &proxy : trusted_proxies->value.GetArray()) {
+        if (proxy.IsString()) {
+          state.trusted_proxies.emplace_back(proxy.GetString(),
+                                             proxy.GetStringLength());
+        }
+      }
+    }
+    if (const auto stats_clients{doc.FindMember("stats_clients")};
+        stats_clients != doc.MemberEnd() && stats_clients->value.IsArray()) {
+      for (const auto &client : stats_clients->value.GetArray()) {
+        if (client.IsString()) {
+          state.stats_clients.emplace_back(client.GetString(),
+                                           client.GetStringLength());
+        }
+      }
+    }
+    if (const auto node_id{doc.FindMember("node_id")};
+        node_id != doc.MemberEnd() && node_id->value.IsString()) {
+      state.node_id = {node_id->value.GetString(),
+                       node_id->value.GetStringLength()};
+    }
+    if (const auto peer_secret{doc.FindMember("peer_secret")};
+        peer_secret != doc.MemberEnd() && peer_secret->value.IsString()) {
+      state.peer_secret = {peer_secret->value.GetString(),
+                           peer_secret->value.GetStringLength()};
+    }
+    if (const auto standbys{doc.FindMember("standbys")};
+        standbys != doc.MemberEnd() && standbys->value.IsArray()) {
+      for (const auto &standby : standbys->value.GetArray()) {
+        if (!standby.IsString() || !standby.GetStringLength()) {
+          std::println(std::cerr,
+                       "Invalid standbys entry: must be a non-empty string");
+          return false;
+        }
+        state.standbys.emplace_back(standby.GetString(),
+                                    standby.GetStringLength());
+      }
+      if (!state.standbys.empty() && state.peer_secret.empty()) {
+        std::println(std::cerr, "peer_secret must be set to use standbys");
+        return false;
+      }
+    }
+    if (const auto shared_mrc_cache{doc.FindMember("shared_mrc_cache")};
+        shared_mrc_cache != doc.MemberEnd()) {
+      const auto &value{shared_mrc_cache->value};
+      const std::string_view view{value.IsString() ? value.GetString() : "",
+                                  value.IsString() ? value.GetStringLength()
+                                                   : 0};
+      if (view.empty() || view.length() > 200 ||
+          view.find_first_of("/\\") != std::string_view::npos) {
+        std::println(std::cerr,
+                     "Invalid shared_mrc_cache value: must be a non-empty "
+                     "string of up to 200 characters without slashes");
+        return false;
+      }
+      state.shared_mrc_cache = view;
+    }
+    if (const auto shard_accounts{doc.FindMember("shard_accounts")};
+        shard_accounts != doc.MemberEnd() && shard_accounts->value.IsBool()) {
+      state.shard_accounts = shard_accounts->value.GetBool();
+    }
+    if (const auto peers{doc.FindMember("peers")};
+        peers != doc.MemberEnd() && peers->value.IsArray()) {
+      for (const auto &peer : peers->value.GetArray()) {
+        if (!peer.IsString()) {
+          std::println(std::cerr, "Invalid peers entry: must be a string");
+          return false;
+        }
+        std::string_view view{peer.GetString(), peer.GetStringLength()};
+        const bool tls{view.starts_with("wss://")};
+        if (tls) {
+          view.remove_prefix(6);
+        }
+        const auto colon_pos{view.rfind(':')};
+        int port;
+        if (colon_pos == std::string_view::npos || !colon_pos ||
+            std::from_chars(view.begin() + colon_pos + 1, view.end(), port)
+                    .ec != std::errc{} ||
+            port < 1 || port > 65535) {
+          std::println(std::cerr,
+                       "Invalid peers entry \"{}\": must be in host:port "
+                       "or wss://host:port format",
+                       peer.GetString());
+          return false;
+        }
+        state.peers.emplace_back(std::string{view.substr(0, colon_pos)}, port,
+                                 tls);
+      }
+      if (!state.peers.empty() && state.peer_secret.empty()) {
+        std::println(std::cerr, "peer_secret must be set to use peers");
+        return false;
+      }
+    }
+    if (const auto standby_of{doc.FindMember("standby_of")};
+        standby_of != doc.MemberEnd()) {
+      const auto &value{standby_of->value};
+      std::string_view view{value.IsString() ? value.GetString() : "",
+                            value.IsString() ? value.GetStringLength() : 0};
+      const bool tls{view.starts_with("wss://")};
+      if (tls) {
+        view.remove_prefix(6);
+      }
+      const auto colon_pos{view.rfind(':')};
+      int port;
+      if (colon_pos == std::string_view::npos || !colon_pos ||
+          std::from_chars(view.begin() + colon_pos + 1, view.end(), port)
+                  .ec != std::errc{} ||
+          port < 1 || port > 65535) {
+        std::println(std::cerr, "Invalid standby_of value: must be a string "
+                                "in host:port or wss://host:port format");
+        return false;
+      }
+      if (state.peer_secret.empty()) {
+        std::println(std::cerr, "peer_secret must be set to use standby_of");
+        return false;
+      }
+      if (state.node_id.empty()) {
+        std::println(std::cerr,
+                     "node_id must be set to use standby_of, as the primary "
+                     "only accepts standbys listed in its standbys array");
+        return false;
+      }
+      if (state.shard_accounts) {
+        std::println(std::cerr,
+                     "standby_of can't be used along with shard_accounts");
+        return false;
+      }
+      // The primary is always the first entry, so its session can be told
+      //    apart from sessions with other peers
+      state.peers.emplace(state.peers.begin(),
+                          std::string{view.substr(0, colon_pos)}, port, tls);
+      state.standby = true;
+    }
+    if (const auto failover_timeout{doc.FindMember("failover_timeout")};
+        failover_timeout != doc.MemberEnd()) {
+      if (!failover_timeout->value.IsInt() ||
+          failover_timeout->value.GetInt() <= 0) {
+        std::println(std::cerr, "Invalid failover_timeout value: must be a "
+                                "positive integer");
+        return false;
+      }
+      state.failover_timeout =
+          failover_timeout->value.GetInt() * LWS_US_PER_SEC;
+    }
+    if (const auto replica_of{doc.FindMember("replica_of")};
+        replica_of != doc.MemberEnd()) {
+      if (!replica_of->value.IsString()) {
+        std::println(std::cerr, "Invalid replica_of value: must be a string");
+        return false;
+      }
+      auto &primary{state.replica_of};
+      std::string_view view{replica_of->value.GetString(),
+                            replica_of->value.GetStringLength()};
+      if (view.starts_with("https://")) {
+        view.remove_prefix(8);
+        primary.port = 443;
+        primary.tls = true;
+      } else if (view.starts_with("http://")) {
+        view.remove_prefix(7);
+        primary.port = 80;
+      } else {
+        std::println(std::cerr, "Invalid replica_of value: must start with "
+                                "http:// or https://");
+        return false;
+      }
+      if (const auto slash_pos{view.find('/')};
+          slash_pos != std::string_view::npos) {
+        primary.path_prefix = view.substr(slash_pos);
+        while (primary.path_prefix.ends_with('/')) {
+          primary.path_prefix.pop_back();
+        }
+        view = view.substr(0, slash_pos);
+      }
+      // Colons inside brackets belong to IPv6 addresses
+      if (const auto colon_pos{view.rfind(':')};
+          colon_pos != std::string_view::npos &&
+          (!view.starts_with('[') || colon_pos > view.find(']'))) {
+        if (std::from_chars(view.begin() + colon_pos + 1, view.end(),
+                            primary.port)
+                    .ec != std::errc{} ||
+            primary.port < 1 || primary.port > 65535) {
+          std::println(std::cerr,
+                       "Invalid replica_of value: invalid port number");
+          return false;
+        }
+        view = view.substr(0, colon_pos);
+      }
+      if (view.starts_with('[') && view.ends_with(']')) {
+        view = view.substr(1, view.length() - 2);
+      }
+      if (view.empty()) {
+        std::println(std::cerr, "Invalid replica_of value: host not found");
+        return false;
+      }
+      primary.host = view;
+      if (!state.peer_secret.empty()) {
+        std::println(std::cerr,
+                     "replica_of can't be used along with peer_secret");
+        return false;
+      }
+      if (!state.accounts.empty()) {
+        std::println("Replica mode, ignoring {} accounts from the state file",
+                     state.accounts.size());
+        state.accounts.clear();
+        state.acc_slots.clear();
+      }
+    }
+    if (const auto pics_cache_ttl{doc.FindMember("pics_cache_ttl")};
+        pics_cache_ttl != doc.MemberEnd()) {
+      if (!pics_cache_ttl->value.IsInt() ||
+          pics_cache_ttl->value.GetInt() < 0) {
+        std::println(std::cerr, "Invalid pics_cache_ttl value: must be a "
+                                "non-negative integer");
+        return false;
+      }
+      state.pics_cache_ttl = pics_cache_ttl->value.GetInt();
+    }
+    if (const auto comp_budget{doc.FindMember("compression_budget")};
+        comp_budget != doc.MemberEnd()) {
+      if (!comp_budget->value.IsInt() || comp_budget->value.GetInt() < 0) {
+        std::println(std::cerr, "Invalid compression_budget value: must be a "
+                                "non-negative integer");
+        return false;
+      }
+      // The setting is in milliseconds
+      state.comp_budget = comp_budget->value.GetInt() * (LWS_US_PER_SEC / 1000);
+    }
+    if (const auto poll_interval{doc.FindMember("replica_poll_interval")};
+        poll_interval != doc.MemberEnd()) {
+      if (!poll_interval->value.IsInt() || poll_interval->value.GetInt() <= 0) {
+        std::println(std::cerr,
+                     "Invalid replica_poll_interval value: must be a positive "
+                     "integer");
+        return false;
+      }
+      state.replica_poll_interval =
+          poll_interval->value.GetInt() * LWS_US_PER_SEC;
+    }
   } // Settings file loading scope
 skip_settings_file:
   // Parse listen_endpoint
@@ -396,6 +1232,12 @@ skip_settings_file:
       iface = "/run/tek-s3.sock";
       port = 0;
       uds_perms = &endpoint[5];
+      state.unix_socket = true;
+      if (!state.tls.cert_path.empty()) {
+        std::println(std::cerr,
+                     "tls can't be used when listening on a Unix socket");
+        return false;
+      }
     } else
 #endif // __linux__
     {
@@ -440,7 +1282,17 @@ skip_settings_file:
       info.unix_socket_perms = uds_perms;
     }
 #endif // __linux__
-    const lws_protocols *pprotocols[]{&protocol, nullptr};
+    if (state.replica_of.tls ||
+        std::ranges::any_of(state.peers, &peer_endpoint::tls)) {
+      info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+    }
+    tls_configure(info);
+#ifdef LWS_SERVER_OPTION_H2_PRIOR_KNOWLEDGE
+    if (state.h2c) {
+      info.options |= LWS_SERVER_OPTION_H2_PRIOR_KNOWLEDGE;
+    }
+#endif // def LWS_SERVER_OPTION_H2_PRIOR_KNOWLEDGE
+    const lws_protocols *pprotocols[]{&protocol, &replica_protocol, nullptr};
     info.pprotocols = pprotocols;
     info.mounts = &mount;
     lws_ctx.reset(lws_create_context(&info));
@@ -472,8 +1324,35 @@ skip_settings_file:
   }
   state.lws_ctx = lws_ctx.release();
   state.tek_sc_ctx = tek_sc_ctx.release();
-  // Connect CM clients or update the manifest if there are none
-  if (state.accounts.empty()) {
+  tls_start();
+  // Schedule eviction of unused pre-compressed manifest buffers
+  state.enc_evict_sul.us = lws_now_usecs() + 60 * LWS_US_PER_SEC;
+  state.enc_evict_sul.cb = evict_encs;
+  lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED,
+                    &state.enc_evict_sul);
+  // Pre-compressed manifests saved by the previous run are restored by the
+  //    first manifest update
+  enc_cache_start();
+  // Restore manifest request codes cached by the previous run
+  mrc_cache_load();
+  // Start peer replication
+  if (!state.peer_secret.empty()) {
+    if (state.node_id.empty()) {
+      std::random_device rd;
+      state.node_id = std::format("{:08x}{:08x}", rd(), rd());
+    }
+    std::println("Peer replication node ID: {}", state.node_id);
+    peer_connect();
+  }
+  // Connect CM clients or update the manifest if there are none. Replicas
+  //    have no accounts and get the manifest from the primary instead, hot
+  //    standbys keep their accounts disconnected until promotion
+  if (!state.replica_of.host.empty()) {
+    replica_start();
+  } else if (state.standby) {
+    update_manifest();
+    state.cur_status.store(status::running, std::memory_order::relaxed);
+  } else if (state.accounts.empty()) {
     if (!state.apps.empty()) {
       state.apps.clear();
       state.manifest_dirty = true;
@@ -508,6 +1387,21 @@ int ts3_cleanup(void) {
     ts3_os_futex_wait(&state.num_cm_connections, cur_num_conns,
                       std::numeric_limits<std::uint32_t>::max());
   }
+  // Wait for sign-in CM clients to disconnect, and free their contexts
+  for (;;) {
+    const auto seq{state.signin_retire_seq.load(std::memory_order::acquire)};
+    signin_free_retired();
+    if (!state.num_signin_ctxs.load(std::memory_order::relaxed)) {
+      break;
+    }
+    ts3_os_futex_wait(&state.signin_retire_seq, seq,
+                      std::numeric_limits<std::uint32_t>::max());
+  }
+  // Free events that have been posted after the service thread stopped
+  for (std::unique_ptr<event> ev{state.events.take()}; ev;
+       ev.reset(ev->next)) {
+  }
+  mrc_cleanup();
   tek_sc_lib_cleanup(state.tek_sc_ctx);
   return state.exit_code;
 }
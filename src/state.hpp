@@ -14,23 +14,35 @@
 //===----------------------------------------------------------------------===//
 #pragma once
 
+#include "cm_coro.hpp"
 #include "config.h"     // IWYU pragma: keep
+#include "flat_map.hpp"
+#include "mrc.hpp"
 #include "null_attrs.h" // IWYU pragma: keep
+#include "os.h"
+#include "peer.hpp"
+#include "ratelimit.hpp"
+#include "replica.hpp"
 #include "signin.hpp"
+#include "tls.hpp"
 
+#include <array>
 #include <atomic>
+#include <bit>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <ctime>
+#include <deque>
 #include <libwebsockets.h>
 #include <map>
 #include <memory>
 #include <mutex>
-#include <set>
+#include <ranges>
 #include <string>
 #include <tek-steamclient/base.h>
 #include <tek-steamclient/cm.h>
+#include <utility>
 #include <vector>
 
 namespace tek::s3 {
@@ -38,6 +50,15 @@ namespace tek::s3 {
 /// Maximum size of a response packet.
 constexpr std::size_t tx_size{32768};
 
+/// Maximum number of previous manifest generations to retain for use as
+///    compression dictionaries.
+constexpr std::size_t max_manifest_dicts{3};
+
+/// SHA-256 hash value.
+using sha256_hash = std::array<unsigned char, 32>;
+/// AES-256 depot decryption key.
+using depot_key = std::array<unsigned char, sizeof(tek_sc_aes256_key)>;
+
 /// Global program status values.
 enum class status {
   /// First account sign-ins and initial manifest generation are being
@@ -82,29 +103,102 @@ struct account {
   tek_sc_cm_auth_token_info token_info;
   /// Status of the token renewal job.
   renew_status ren_status;
-  /// Total number of depot decryption keys remaining to be acquired.
-  int rem_dk_total;
-  /// Number of remaining depot decryption key responses in current burst.
-  int rem_dk_burst;
   /// Value indicating whether the account should be removed.
   std::atomic<remove_status> rem_status;
-  /// Pointer to the array of depot decryption key request/response data
-  ///    structures.
-  std::unique_ptr<tek_sc_cm_data_depot_key[]> depot_key_requests;
-  /// IDs of depots owned by the acccount.
-  std::set<std::uint32_t> depot_ids;
   /// Value indicating whether the application list for this account has been
   ///    received at least once.
   bool ready;
+  /// Dense index of the account in @ref ts3_state::acc_slots, used to refer
+  ///    to it in @ref acc_bitset.
+  std::uint32_t index;
+  /// Cancellation token of the latest application list refresh, empty if none
+  ///    has been started yet.
+  std::shared_ptr<cancel_token> refresh_cancel;
+  /// App/depot ID pairs of depots whose @ref depot::accs include the account,
+  ///    so it can be removed from them without scanning all depots.
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> depots;
+};
+
+/// Compact set of account indices.
+class acc_bitset {
+  /// Bit words, the highest one is always non-zero.
+  std::vector<std::uint64_t> words;
+
+  /// Remove trailing zero words.
+  void trim() noexcept {
+    while (!words.empty() && !words.back()) {
+      words.pop_back();
+    }
+  }
+
+public:
+  /// Check whether the set is empty.
+  bool empty() const noexcept { return words.empty(); }
+  /// Check whether specified index is in the set.
+  bool test(std::uint32_t index) const noexcept {
+    const auto word{index / 64};
+    return word < words.size() && ((words[word] >> (index % 64)) & 1);
+  }
+  /// Add specified index to the set.
+  void set(std::uint32_t index) {
+    const auto word{index / 64};
+    if (word >= words.size()) {
+      words.resize(word + 1);
+    }
+    words[word] |= std::uint64_t{1} << (index % 64);
+  }
+  /// Remove specified index from the set.
+  void reset(std::uint32_t index) noexcept {
+    if (const auto word{index / 64}; word < words.size()) {
+      words[word] &= ~(std::uint64_t{1} << (index % 64));
+      trim();
+    }
+  }
+  /// Remove all indices present in another set from this one.
+  void reset(const acc_bitset &other) noexcept {
+    for (auto &&[word, other_word] : std::views::zip(words, other.words)) {
+      word &= ~other_word;
+    }
+    trim();
+  }
+  /// Find the first index in the set that is not less than specified one,
+  ///    wrapping around to the lowest one if there is none. The set must not
+  ///    be empty.
+  ///
+  /// @param from
+  ///    Index to start the search from.
+  /// @return The found index.
+  std::uint32_t next(std::uint32_t from) const noexcept {
+    auto word{from / 64};
+    if (word < words.size()) {
+      if (const auto bits{words[word] & (~std::uint64_t{} << (from % 64))};
+          bits) {
+        return word * 64 + std::countr_zero(bits);
+      }
+      while (++word < words.size()) {
+        if (words[word]) {
+          return word * 64 + std::countr_zero(words[word]);
+        }
+      }
+    }
+    word = 0;
+    while (!words[word]) {
+      ++word;
+    }
+    return word * 64 + std::countr_zero(words[word]);
+  }
 };
 
 /// Steam depot entry.
 struct depot {
-  /// Pointers to accounts owning a license for the depot, which can be used to
+  /// Indices of accounts owning a license for the depot, which can be used to
   ///    provide manifest request codes.
-  std::vector<account *> accs;
-  /// Iterator pointing to the next account to get manifest request code with.
-  decltype(accs)::const_iterator next_acc;
+  acc_bitset accs;
+  /// Index of the next account to try getting manifest request code with.
+  std::uint32_t next_acc;
+  /// Bit mask of peer nodes owning the depot, by their indices in the peer
+  ///    node table. Depots owned only by peers are kept in the manifest.
+  std::uint64_t peers;
 };
 
 /// Steam application entry.
@@ -114,7 +208,31 @@ struct app {
   /// PICS access token for the application.
   std::uint64_t pics_access_token;
   /// Depots belonging to the application, by ID.
-  std::map<std::uint32_t, depot> depots;
+  flat_map<std::uint32_t, depot> depots;
+};
+
+/// Cached PICS info of a package.
+struct pics_package {
+  /// Time (seconds since Epoch) when the info has been received.
+  std::time_t timestamp;
+  /// IDs of depots included in the package.
+  std::vector<std::uint32_t> depot_ids;
+  /// IDs of applications included in the package.
+  std::vector<std::uint32_t> app_ids;
+};
+
+/// Cached PICS info of an application.
+struct pics_app {
+  /// Time (seconds since Epoch) when the info has been received.
+  std::time_t timestamp;
+  /// PICS access token for the application.
+  std::uint64_t access_token;
+  /// Name of the application.
+  std::string name;
+  /// ID of the application's workshop depot, or 0 if it has none.
+  std::uint32_t workshop_depot;
+  /// IDs of the application's depots that have manifests.
+  std::vector<std::uint32_t> depot_ids;
 };
 
 /// Manifest request code cache entry.
@@ -151,6 +269,8 @@ public:
       mtx.unlock();
     }
   }
+  /// Check whether there are active references.
+  constexpr bool locked() const noexcept { return ref_count; }
   /// Unlock the mutex if it has active references, and reset the reference
   /// counter.
   void force_unlock() {
@@ -161,30 +281,309 @@ public:
   }
 };
 
+struct enc_job;
+
+/// Types of events posted to the service thread by CM client callbacks and
+///    worker thread jobs.
+enum class event_type {
+  /// The token renewal job of @ref event::acc should be scheduled.
+  schedule_renewal,
+  /// The CM client of @ref event::acc has been disconnected, and the account
+  ///    should be removed.
+  remove_account,
+  /// @ref event::s_ctx has an outgoing message, or its connection should be
+  ///    closed.
+  signin_output,
+  /// @ref event::job has been completed.
+  enc_built
+};
+
+/// Event posted to the service thread.
+struct event {
+  /// Next event in @ref event_queue.
+  event *_Nullable next;
+  /// Type of the event.
+  event_type type;
+  /// For account events, pointer to the account.
+  account *_Nullable acc;
+  /// For @ref event_type::signin_output, pointer to the sign-in context. It may
+  ///    have been freed by the time the event is processed, so it must only be
+  ///    dereferenced if it's still present in @ref ts3_state::signin_ctxs.
+  signin_ctx *_Nullable s_ctx;
+  /// For @ref event_type::enc_built, the completed compression job.
+  std::unique_ptr<enc_job> job;
+};
+
+/// Lock-free multi-producer single-consumer queue of events. Producers push
+///    events onto an intrusive stack, and the consumer takes the whole stack
+///    at once, so that there is no ABA problem.
+class [[gnu::visibility("internal")]] event_queue {
+  /// The most recently pushed event, `nullptr` if the queue is empty.
+  std::atomic<event *> head{};
+
+public:
+  /// Push an event onto the queue.
+  ///
+  /// @param [in, out] ev
+  ///    The event to push.
+  /// @return Value indicating whether the queue was empty, in which case the
+  ///    consumer has to be woken up. Otherwise, a wakeup is already pending.
+  bool push(event *_Nonnull ev) noexcept {
+    ev->next = head.load(std::memory_order::relaxed);
+    while (!head.compare_exchange_weak(ev->next, ev, std::memory_order::release,
+                                       std::memory_order::relaxed))
+      ;
+    return !ev->next;
+  }
+  /// Take all events from the queue.
+  ///
+  /// @return Pointer to the earliest pushed event, with the rest linked via
+  ///    @ref event::next in the order of pushing, or `nullptr` if the queue
+  ///    is empty.
+  event *_Nullable take() noexcept {
+    event *reversed{};
+    for (auto ev{head.exchange(nullptr, std::memory_order::acquire)}; ev;) {
+      reversed = std::exchange(ev, std::exchange(ev->next, reversed));
+    }
+    return reversed;
+  }
+};
+
 /// Wrapper around a buffer pointer with known size.
 struct sized_buf {
-  /// Pointer to the buffer.
-  std::unique_ptr<unsigned char[]> buf;
+  /// Deleter for @ref buf.
+  struct deleter {
+    /// Size of the file mapping that the buffer is, or `0` if it's allocated
+    ///    with `std::malloc`.
+    std::size_t map_size;
+
+    void operator()(unsigned char *_Nonnull buf) const noexcept;
+  };
+
+  /// Pointer to the buffer, allocated with `std::malloc`, or a read-only
+  ///    mapping of @ref file.
+  std::unique_ptr<unsigned char[], deleter> buf;
   /// Size of the buffer pointed to by @ref buf, in bytes.
   std::size_t size{};
+  /// Sealed in-memory file with the contents of the buffer for sending it
+  ///    without copying through user space, created by @ref seal.
+  std::unique_ptr<os_handle> file;
+
+  /// Allocate a new uninitialized buffer.
+  ///
+  /// @param size
+  ///    Size of the buffer to allocate, in bytes.
+  /// @return The allocated buffer.
+  /// @throws std::bad_alloc if allocation fails.
+  static sized_buf alloc(std::size_t size);
+  /// Shrink the buffer in place, which is a no-op for most allocators, unlike
+  ///    allocating a new right-sized buffer and copying the data into it.
+  ///
+  /// @param new_size
+  ///    New size of the buffer, in bytes. Must be non-zero and not exceed
+  ///    @ref size.
+  void shrink(std::size_t new_size) noexcept;
+  /// Create a sealed in-memory file with the contents of the buffer, and
+  ///    replace the buffer with a read-only mapping of the file, so the data
+  ///    isn't kept in memory twice. The buffer is left as is if that fails or
+  ///    isn't supported by the OS. Since it copies the whole buffer, it must
+  ///    only be called on the worker thread, before the buffer is published.
+  void seal() noexcept;
+  /// Create a sealed copy of a buffer, see @ref seal.
+  ///
+  /// @param [in] src
+  ///    The buffer to copy.
+  /// @return The sealed copy, empty if it can't be created.
+  static sized_buf sealed_copy(const sized_buf &src) noexcept;
+  /// Get the sealed in-memory file with the contents of the buffer.
+  ///
+  /// @return OS handle for the file, or @ref TS3_OS_INVALID_HANDLE if the
+  ///    buffer hasn't been sealed, in which case it must be sent from memory.
+  tek_sc_os_handle get_file() const noexcept {
+    return file ? file->value : TS3_OS_INVALID_HANDLE;
+  }
+};
+
+/// Previous manifest generation retained for use as a compression dictionary.
+struct manifest_dict {
+  /// SHA-256 hash of @ref buf.
+  sha256_hash hash;
+  /// Raw manifest data.
+  std::shared_ptr<const sized_buf> buf;
 };
 
+/// HTTP response content encodings.
+enum class enc_type {
+  none,
+  deflate,
+#ifdef TEK_S3B_BROTLI
+  brotli,
+#endif // TEK_S3B_BROTLI
+#ifdef TEK_S3B_ZSTD
+  zstd,
+  /// zstd with a previous manifest generation as the dictionary.
+  dcz
+#endif // TEK_S3B_ZSTD
+};
+
+/// Encodings that HTTP buffers may be pre-compressed with.
+constexpr std::array precomp_encs{enc_type::deflate,
+#ifdef TEK_S3B_BROTLI
+                                  enc_type::brotli,
+#endif // TEK_S3B_BROTLI
+#ifdef TEK_S3B_ZSTD
+                                  enc_type::zstd
+#endif // TEK_S3B_ZSTD
+};
+
+/// Pre-compressed version of a buffer that is built on demand and evicted
+///    when it's not used for a while.
+struct enc_buf {
+  /// Compressed data, `nullptr` if it hasn't been built yet or has been
+  ///    evicted. Shared with pre-compressed manifest cache jobs that write it
+  ///    to disk.
+  std::shared_ptr<const sized_buf> data;
+  /// Compression level that @ref data has been built with.
+  int level{};
+  /// Number of responses sent in this encoding. Carried over to the next
+  ///    snapshot.
+  std::uint64_t num_uses{};
+  /// Time of the last response sent in this encoding, in libwebsockets
+  ///    microseconds. Carried over to the next snapshot.
+  lws_usec_t last_use{};
+  /// Ratio of compressed size to uncompressed size achieved on the last build,
+  ///    used to estimate the size without building. Carried over to the next
+  ///    snapshot.
+  double ratio;
+  /// Value indicating whether compression is in progress on the worker
+  ///    thread.
+  bool pending{};
+  /// Value indicating whether compression has failed for current snapshot.
+  bool failed{};
+  /// Value indicating whether @ref data has been loaded from the
+  ///    pre-compressed manifest cache rather than compressed, so it doesn't
+  ///    need to be saved there again.
+  bool restored{};
+};
+
+/// Compression of a buffer, or loading of its pre-compressed version saved by
+///    a previous run, on the worker thread.
+struct enc_job {
+  /// Uncompressed data, kept alive by the job even if its snapshot is
+  ///    replaced in the meantime.
+  std::shared_ptr<const sized_buf> src;
+  /// SHA-256 hash of @ref src, identifying snapshots that the result may be
+  ///    installed into.
+  sha256_hash hash;
+  /// Value indicating whether @ref src contains binary data rather than text.
+  bool binary;
+  /// Encoding to compress with, one of @ref precomp_encs or
+  ///    @ref enc_type::dcz, or @ref enc_type::none to make a sealed copy of
+  ///    @ref src to replace it.
+  enc_type enc;
+  /// Compression level to use.
+  int level;
+  /// Compressed data, or the sealed copy of @ref src, empty if the job has
+  ///    failed.
+  sized_buf data;
+  /// Time that compression has taken, in nanoseconds.
+  std::int64_t elapsed;
+  /// Previous manifest generation to use as the dictionary for
+  ///    @ref enc_type::dcz, empty for other encodings.
+  manifest_dict dict;
+  /// Value indicating whether @ref data is loaded from the pre-compressed
+  ///    manifest cache rather than compressed, so @ref elapsed is unknown. If
+  ///    it's empty, the encoding is compressed as usual.
+  bool restored;
+};
+
+/// Time after which unused pre-compressed buffers are evicted, in microseconds.
+constexpr lws_usec_t enc_idle_timeout{15 * 60 * LWS_US_PER_SEC};
+
 /// A buffer with pre-compressed versions for returning over HTTP.
 struct [[gnu::visibility("internal")]] http_buf {
-  /// The main buffer.
-  sized_buf buf;
-  /// @ref buf pre-compressed with deflate.
-  sized_buf deflate;
+  /// The main buffer, shared with compression jobs that read it. `nullptr` in
+  ///    default-constructed snapshots. Replaced by its sealed copy once the
+  ///    worker thread makes one and no downloads are streaming it.
+  std::shared_ptr<const sized_buf> buf;
+  /// Sealed copy of @ref buf waiting for downloads that stream it to finish.
+  std::shared_ptr<const sized_buf> sealed_buf;
+  /// Value indicating whether @ref buf contains binary data rather than text.
+  bool binary{};
+  /// SHA-256 hash of @ref buf, identifying it as a compression dictionary for
+  ///    future generations and as the key of its persisted pre-compressed
+  ///    versions.
+  sha256_hash hash{};
+  /// @ref buf compressed with deflate.
+  enc_buf deflate{.ratio = 0.25};
 #ifdef TEK_S3B_BROTLI
-  /// @ref buf pre-compressed with brotli.
-  sized_buf brotli;
+  /// @ref buf compressed with brotli.
+  enc_buf brotli{.ratio = 0.18};
 #endif // TEK_S3B_BROTLI
 #ifdef TEK_S3B_ZSTD
-  /// @ref buf pre-compressed with zstd.
-  sized_buf zstd;
+  /// @ref buf compressed with zstd.
+  enc_buf zstd{.ratio = 0.2};
+  /// @ref buf compressed with zstd using previous manifest generations as
+  ///    dictionaries (dcz encoding), by dictionary hash. Entries are created
+  ///    on first request and built on the worker thread.
+  std::map<sha256_hash, enc_buf> dcz;
 #endif // TEK_S3B_ZSTD
-  constexpr http_buf() noexcept {}
+  http_buf() = default;
   http_buf(sized_buf &&buf, bool binary);
+
+  /// Get pre-compressed buffer entry for specified encoding.
+  ///
+  /// @param enc
+  ///    Encoding to get the entry for, one of @ref precomp_encs.
+  /// @return Reference to the entry.
+  const enc_buf &get(enc_type enc) const noexcept;
+  /// @copydoc get(enc_type) const
+  enc_buf &get(enc_type enc) noexcept {
+    return const_cast<enc_buf &>(std::as_const(*this).get(enc));
+  }
+  /// Start compressing @ref buf with specified encoding on the worker thread,
+  ///    unless it's already built, in progress or has failed. The result is
+  ///    installed by @ref complete_enc_job.
+  ///
+  /// @param enc
+  ///    Encoding to compress with, one of @ref precomp_encs.
+  /// @return Value indicating whether the compressed buffer is available.
+  /// @throws std::bad_alloc if allocation fails.
+  bool build(enc_type enc);
+  /// Start making a sealed copy of @ref buf on the worker thread, inherit
+  ///    encoding usage statistics from the previous snapshot, and start
+  ///    building encodings that have been used recently. If @p prev is empty,
+  ///    all encodings are considered recently used.
+  ///
+  /// @param [in] prev
+  ///    Previous snapshot of the same buffer.
+  void prebuild(const http_buf &prev);
+  /// Free compressed buffers that haven't been used recently.
+  ///
+  /// @param idle_since
+  ///    Buffers whose last use happened before this time, in libwebsockets
+  ///    microseconds, are freed.
+  void evict(lws_usec_t idle_since) noexcept;
+  /// Replace @ref buf with @ref sealed_buf if it's ready. Must be called only
+  ///    when no downloads are streaming @ref buf.
+  void install_sealed() noexcept;
+  /// Get the total amount of memory occupied by buffers of this snapshot.
+  ///
+  /// @return Total size of all resident buffers, in bytes.
+  std::size_t mem_size() const noexcept;
+
+#ifdef TEK_S3B_ZSTD
+  /// Get @ref buf encoded with dcz against specified dictionary, or start
+  ///    compressing it on the worker thread if it's not built yet, in progress
+  ///    or has failed. The result is installed by @ref complete_enc_job.
+  ///
+  /// @param [in] dict
+  ///    Previous manifest generation to use as the dictionary.
+  /// @return Pointer to the dcz-encoded buffer, or `nullptr` if it's not
+  ///    available.
+  /// @throws std::bad_alloc if allocation fails.
+  const sized_buf *_Nullable build_dcz(const manifest_dict &dict);
+#endif // TEK_S3B_ZSTD
 };
 
 /// tek-s3 program state.
@@ -203,18 +602,86 @@ struct ts3_state {
   std::time_t timestamp;
   // Steam accounts that the server has access to, by Steam IDs.
   std::map<std::uint64_t, account> accounts;
+  /// Pointers to @ref accounts entries by their indices, `nullptr` for free
+  ///    indices.
+  std::vector<account *> acc_slots;
   /// Steam applications owned by server's accounts.
-  std::map<std::uint32_t, app> apps;
-  /// Known AES-256 depot decryption keys.
-  std::map<std::uint32_t, tek_sc_aes256_key> depot_keys;
+  flat_map<std::uint32_t, app> apps;
+  /// Known AES-256 depot decryption keys, by depot IDs.
+  flat_map<std::uint32_t, depot_key> depot_keys;
+  /// PICS info of packages owned by server's accounts, by package IDs.
+  flat_map<std::uint32_t, pics_package> pics_packages;
+  /// PICS info of applications owned by server's accounts, by app IDs.
+  flat_map<std::uint32_t, pics_app> pics_apps;
+  /// Time after which cached PICS info is requested again, in seconds.
+  std::time_t pics_cache_ttl{24 * 3600};
   /// Pre-serialized manifest JSON.
   http_buf manifest;
   /// Pre-serialized binary manifest.
   http_buf manifest_bin;
+  /// Pre-serialized binary manifest v2.
+  http_buf manifest_bin_v2;
+#ifdef TEK_S3B_ZSTD
+  /// Previous generations of @ref manifest, newest first.
+  std::deque<manifest_dict> manifest_dicts;
+  /// Previous generations of @ref manifest_bin, newest first.
+  std::deque<manifest_dict> manifest_bin_dicts;
+  /// Previous generations of @ref manifest_bin_v2, newest first.
+  std::deque<manifest_dict> manifest_bin_v2_dicts;
+#endif // TEK_S3B_ZSTD
+  /// Scheduling element for the periodic eviction of unused pre-compressed
+  ///    manifest buffers.
+  lws_sorted_usec_list_t enc_evict_sul;
+  /// CPU time budget for compressing manifests on each update, in
+  ///    microseconds, `0` for compressing them at maximum levels.
+  lws_usec_t comp_budget{};
   /// Manifest request code cache.
   std::map<std::uint64_t, mrc_cache> mrcs;
+  /// Admission control limits for manifest request code requests.
+  mrc_admission_limits mrc_limits;
+  /// Token bucket parameters for rate-limited request classes, indexed by
+  ///    @ref rl_class values.
+  std::array<rl_params, num_rl_classes> rate_limits;
+  /// Built-in TLS settings.
+  tls_settings tls;
+  /// Addresses of reverse proxies whose `X-Forwarded-For` headers are trusted.
+  std::vector<std::string> trusted_proxies;
+  /// Addresses of clients that are allowed to query `/stats`.
+  std::vector<std::string> stats_clients;
+  /// ID of this node for peer replication.
+  std::string node_id;
+  /// Secret shared by all peer nodes, peer replication is disabled if it's
+  ///    empty.
+  std::string peer_secret;
+  /// Name of the shared memory segment with the manifest request code table
+  ///    shared between processes on the host, empty if it's disabled.
+  std::string shared_mrc_cache;
+  /// Peer nodes to maintain outbound replication sessions with.
+  std::vector<peer_endpoint> peers;
+  /// IDs of peer nodes that are allowed to be hot standbys of this one, and
+  ///    thus to receive tokens of its accounts.
+  std::vector<std::string> standbys;
+  /// Time that a hot standby waits for its primary to reconnect before
+  ///    promoting itself, in microseconds.
+  lws_usec_t failover_timeout{15 * LWS_US_PER_SEC};
+  /// Primary instance that this server is a read-only replica of.
+  replica_endpoint replica_of;
+  /// Interval between polls of the primary's manifest, in microseconds.
+  lws_usec_t replica_poll_interval{30 * LWS_US_PER_SEC};
   /// Pointers to active sign-in contexts.
   std::vector<signin_ctx *> signin_ctxs;
+  /// Events posted to the service thread.
+  event_queue events;
+  /// Mutex for locking concurrent access to @ref retired_signin_ctxs.
+  std::mutex retired_signin_mtx;
+  /// Sign-in contexts released by CM client threads, to be freed by the
+  ///    service thread.
+  std::vector<signin_ctx *> retired_signin_ctxs;
+  /// Number of sign-in contexts that haven't been freed yet.
+  std::atomic_uint32_t num_signin_ctxs;
+  /// Counter that is incremented and signaled every time a context is added
+  ///    to @ref retired_signin_ctxs.
+  std::atomic_uint32_t signin_retire_seq;
   /// Pointer to the tek-steamclient library context.
   tek_sc_lib_ctx *_Nonnull tek_sc_ctx;
   /// Number of accounts ready to process manifest request code requests.
@@ -226,6 +693,22 @@ struct ts3_state {
   bool manifest_dirty;
   /// Value indicating whether the state file needs to be updated.
   bool state_dirty;
+  /// Value indicating whether the server listens on a Unix socket, in which
+  ///    case all peers are considered trusted proxies.
+  bool unix_socket;
+  /// Value indicating whether cleartext connections are expected to speak
+  ///    HTTP/2 with prior knowledge, for reverse proxies that use h2c.
+  bool h2c;
+  /// Value indicating whether accounts are partitioned between peer nodes
+  ///    that have it enabled, by rendezvous hashing of their Steam IDs.
+  bool shard_accounts;
+  /// Value indicating whether the server is a hot standby of the node at the
+  ///    front of @ref peers and hasn't been promoted yet. A standby mirrors
+  ///    the primary's accounts without connecting them to CM.
+  bool standby;
+  /// Value indicating whether the manifest is served during setup, set when a
+  ///    hot standby is promoted and its accounts are still connecting.
+  bool hot_manifest;
 };
 
 /// tek-s3 libwebsockets protocol.
@@ -241,4 +724,52 @@ inline ts3_state state;
 [[gnu::visibility("internal")]]
 void update_manifest();
 
+/// Post an event to the service thread, and wake it up unless a wakeup is
+///    already pending or the server is stopping.
+///
+/// @param [in, out] ev
+///    The event to post.
+/// @throws std::bad_alloc if allocation fails.
+[[gnu::visibility("internal")]]
+void post_event(event &&ev);
+
+/// Install the result of a compression job into the current snapshot of the
+///    buffer it has been started for, if it hasn't been replaced since with
+///    different contents. Sealed copies of main buffers are installed only
+///    when no downloads are streaming them, otherwise they're deferred to
+///    @ref evict_encs. Must be called from the libwebsockets service thread,
+///    with @ref ts3_state::manifest_mtx locked.
+///
+/// @param [in, out] job
+///    The completed job.
+[[gnu::visibility("internal")]]
+void complete_enc_job(enc_job &job);
+
+/// Assign the lowest free index to an account.
+///
+/// @param [in, out] acc
+///    Account to assign the index to.
+[[gnu::visibility("internal")]]
+void assign_acc_index(account &acc);
+
+/// Remove an account from @ref depot::accs of all depots listed in its
+///    @ref account::depots, and clear the list. Must be called with
+///    @ref ts3_state::manifest_mtx locked.
+///
+/// @param [in, out] acc
+///    The account to unlink.
+/// @param prune
+///    Value indicating whether depots that are left without owners, and apps
+///    that are left without depots, should be removed from the manifest.
+[[gnu::visibility("internal")]]
+void unlink_acc_depots(account &acc, bool prune);
+
+/// Evict pre-compressed manifest buffers that haven't been used recently,
+///    install deferred sealed copies of main buffers, and reschedule itself.
+///
+/// @param [in, out] sul
+///    Pointer to @ref ts3_state::enc_evict_sul.
+[[gnu::visibility("internal"), gnu::nonnull(1), gnu::access(read_write, 1)]]
+void evict_encs(lws_sorted_usec_list_t *_Nonnull sul);
+
 } // namespace tek::s3
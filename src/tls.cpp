@@ -0,0 +1,149 @@
+//===-- tls.cpp - Built-in TLS termination implementation -----------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Implementation of built-in TLS termination. libwebsockets loads the
+///    certificate into the listening vhost's TLS context; renewed files are
+///    detected by their modification times and loaded into the same context
+///    via @ref lws_tls_cert_updated, so established connections are not
+///    affected. HTTP/2 is offered via ALPN when libwebsockets supports it.
+///    Session tickets are left enabled, letting returning clients resume
+///    sessions with an abbreviated handshake.
+///
+//===----------------------------------------------------------------------===//
+#include "tls.hpp"
+
+#include "null_attrs.h" // IWYU pragma: keep
+#include "state.hpp"
+
+#include <filesystem>
+#include <iostream>
+#include <libwebsockets.h>
+#include <print>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private types -----------------------------------------------------===//
+
+/// Interval between checks of certificate and key files for changes, in
+///    microseconds.
+constexpr lws_usec_t check_interval{60 * LWS_US_PER_SEC};
+
+/// Certificate file watcher state.
+struct tls_watcher {
+  /// Doubly linked list element for libwebsockets check job scheduling.
+  lws_sorted_usec_list_t sul;
+  /// Modification time of the certificate file as of the last successful
+  ///    load.
+  std::filesystem::file_time_type cert_mtime;
+  /// Modification time of the key file as of the last successful load.
+  std::filesystem::file_time_type key_mtime;
+};
+
+//===-- Private variable --------------------------------------------------===//
+
+/// The watcher instance.
+static tls_watcher watcher;
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Get modification time of a file.
+///
+/// @param [in] path
+///    UTF-8 path to the file.
+/// @return Modification time of the file, or default-constructed value if it
+///    can't be obtained.
+static std::filesystem::file_time_type get_mtime(const std::string &path) {
+  std::error_code ec;
+  const auto mtime{std::filesystem::last_write_time(
+      std::filesystem::path{std::u8string_view{
+          reinterpret_cast<const char8_t *>(path.data()), path.length()}},
+      ec)};
+  return ec ? std::filesystem::file_time_type{} : mtime;
+}
+
+/// libwebsockets scheduled callback that reloads the certificate if its
+///    files have changed.
+///
+/// @param [in, out] sul
+///    Pointer to @ref tls_watcher::sul.
+[[using gnu: nonnull(1), access(read_write, 1)]]
+static void check_certs(lws_sorted_usec_list_t *_Nonnull sul) {
+  const auto &settings{state.tls};
+  const auto cert_mtime{get_mtime(settings.cert_path)};
+  const auto key_mtime{get_mtime(settings.key_path)};
+  // Files may be missing for a moment while they are being replaced, in that
+  //    case they are checked again next time
+  if (cert_mtime != std::filesystem::file_time_type{} &&
+      key_mtime != std::filesystem::file_time_type{} &&
+      (cert_mtime != watcher.cert_mtime || key_mtime != watcher.key_mtime)) {
+    // The certificate may have been written before the matching key, so a
+    //    failed load is retried on subsequent checks
+    if (lws_tls_cert_updated(state.lws_ctx, settings.cert_path.data(),
+                             settings.key_path.data(), nullptr, 0, nullptr,
+                             0)) {
+      std::println(std::cerr, "Failed to reload TLS certificate from {}",
+                   settings.cert_path);
+    } else {
+      std::println("Reloaded TLS certificate from {}", settings.cert_path);
+      watcher.cert_mtime = cert_mtime;
+      watcher.key_mtime = key_mtime;
+    }
+  }
+  sul->us = lws_now_usecs() + check_interval;
+  lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED, sul);
+}
+
+} // namespace
+
+//===-- Internal functions ------------------------------------------------===//
+
+void tls_configure(lws_context_creation_info &info) {
+  const auto &settings{state.tls};
+  if (settings.cert_path.empty()) {
+    return;
+  }
+  info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+  info.ssl_cert_filepath = settings.cert_path.data();
+  info.ssl_private_key_filepath = settings.key_path.data();
+#ifdef LWS_WITH_HTTP2
+  info.alpn = "h2,http/1.1";
+#else  // def LWS_WITH_HTTP2
+  info.alpn = "http/1.1";
+#endif // def LWS_WITH_HTTP2 else
+#ifdef SSL_OP_NO_TICKET
+  // Stateless resumption doesn't need a server-side session cache shared
+  //    between connections
+  info.ssl_options_clear |= SSL_OP_NO_TICKET;
+#endif // def SSL_OP_NO_TICKET
+}
+
+void tls_start() {
+  const auto &settings{state.tls};
+  if (settings.cert_path.empty()) {
+    return;
+  }
+  // libwebsockets has just loaded the files
+  watcher.cert_mtime = get_mtime(settings.cert_path);
+  watcher.key_mtime = get_mtime(settings.key_path);
+  watcher.sul.cb = check_certs;
+  watcher.sul.us = lws_now_usecs() + check_interval;
+  lws_sul2_schedule(state.lws_ctx, 0, LWSSULLI_MISS_IF_SUSPENDED,
+                    &watcher.sul);
+}
+
+void tls_stop() { lws_sul_cancel(&watcher.sul); }
+
+} // namespace tek::s3
@@ -0,0 +1,56 @@
+//===-- tls.hpp - Built-in TLS termination declarations -------------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Declarations of functions for serving HTTPS directly via libwebsockets'
+///    TLS support, without a reverse proxy. Certificate and private key files
+///    are checked for changes periodically and reloaded without restarting
+///    the server, so renewed certificates are picked up automatically.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include "null_attrs.h" // IWYU pragma: keep
+
+#include <libwebsockets.h>
+#include <string>
+
+namespace tek::s3 {
+
+/// Built-in TLS settings.
+struct tls_settings {
+  /// Path to the PEM file with the server certificate chain, empty if TLS is
+  ///    disabled.
+  std::string cert_path;
+  /// Path to the PEM file with the private key of the certificate.
+  std::string key_path;
+};
+
+/// Set up TLS for the listening vhost in libwebsockets context creation info,
+///    if it's enabled in @ref ts3_state::tls. The paths in the settings must
+///    stay valid for the lifetime of the context.
+///
+/// @param [out] info
+///    Context creation info to set up.
+[[gnu::visibility("internal")]]
+void tls_configure(lws_context_creation_info &info);
+
+/// Start watching the certificate and key files for changes, if TLS is
+///    enabled. Must be called after the libwebsockets context has been
+///    created.
+[[gnu::visibility("internal")]]
+void tls_start();
+
+/// Cancel scheduled certificate checks. Must be called before destroying the
+///    libwebsockets context.
+[[gnu::visibility("internal")]]
+void tls_stop();
+
+} // namespace tek::s3
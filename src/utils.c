@@ -14,7 +14,12 @@
 //===----------------------------------------------------------------------===//
 #include "utils.h"
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif // defined(__i386__) || defined(__x86_64__)
 
 //===-- Tables ------------------------------------------------------------===//
 
@@ -44,6 +49,416 @@ __extension__ static const uint8_t ts3_base64_dec_table[256] = {
 static const char ts3_base64_enc_table[64] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+/// SHA-256 round constants.
+static const uint32_t ts3_sha256_k[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1,
+    0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174, 0xE49B69C1, 0xEFBE4786,
+    0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+    0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85, 0xA2BFE8A1, 0xA81A664B,
+    0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A,
+    0x5B9CCA4F, 0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2};
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Rotate a 32-bit value right.
+///
+/// @param val
+///    The value to rotate.
+/// @param n
+///    Number of bits to rotate by.
+/// @return Rotated value.
+[[gnu::const]]
+static inline uint32_t ts3_rotr(uint32_t val, int n) {
+  return (val >> n) | (val << (32 - n));
+}
+
+/// Process a single 64-byte SHA-256 block.
+///
+/// @param [in, out] st
+///    Pointer to the hash state array.
+/// @param [in] block
+///    Pointer to the block data.
+[[gnu::nonnull(1, 2), gnu::access(read_write, 1), gnu::access(read_only, 2)]]
+static void ts3_sha256_block(uint32_t st[restrict 8],
+                             const unsigned char block[restrict 64]) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; ++i) {
+    w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+           ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; ++i) {
+    const uint32_t s0 = ts3_rotr(w[i - 15], 7) ^ ts3_rotr(w[i - 15], 18) ^
+                        (w[i - 15] >> 3);
+    const uint32_t s1 = ts3_rotr(w[i - 2], 17) ^ ts3_rotr(w[i - 2], 19) ^
+                        (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = st[0], b = st[1], c = st[2], d = st[3], e = st[4], f = st[5],
+           g = st[6], h = st[7];
+  for (int i = 0; i < 64; ++i) {
+    const uint32_t t1 = h +
+                        (ts3_rotr(e, 6) ^ ts3_rotr(e, 11) ^ ts3_rotr(e, 25)) +
+                        ((e & f) ^ (~e & g)) + ts3_sha256_k[i] + w[i];
+    const uint32_t t2 = (ts3_rotr(a, 2) ^ ts3_rotr(a, 13) ^ ts3_rotr(a, 22)) +
+                        ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  st[0] += a;
+  st[1] += b;
+  st[2] += c;
+  st[3] += d;
+  st[4] += e;
+  st[5] += f;
+  st[6] += g;
+  st[7] += h;
+}
+
+/// Encode whole 3-byte groups of a key into Base64.
+///
+/// @param [in] input
+///    Pointer to the first group to encode.
+/// @param num_groups
+///    Number of groups to encode.
+/// @param [out] output
+///    Pointer to the buffer that receives 4 characters per group.
+[[gnu::nonnull(1, 3), gnu::access(read_only, 1), gnu::access(write_only, 3)]]
+static inline void ts3_b64_enc_groups(const unsigned char *restrict input,
+                                      int num_groups, char *restrict output) {
+  for (int i = 0; i < num_groups; ++i, input += 3, output += 4) {
+    const uint32_t val =
+        ((uint32_t)input[0] << 16) | ((uint32_t)input[1] << 8) | input[2];
+    output[0] = ts3_base64_enc_table[val >> 18];
+    output[1] = ts3_base64_enc_table[(val >> 12) & 0b111'111];
+    output[2] = ts3_base64_enc_table[(val >> 6) & 0b111'111];
+    output[3] = ts3_base64_enc_table[val & 0b111'111];
+  }
+}
+
+/// Encode the last 2 bytes of a 32-byte key into Base64, with padding.
+///
+/// @param [in] input
+///    Pointer to the bytes to encode.
+/// @param [out] output
+///    Pointer to the buffer that receives 4 characters.
+[[gnu::nonnull(1, 2), gnu::access(read_only, 1), gnu::access(write_only, 2)]]
+static inline void ts3_b64_enc_key_tail(const unsigned char *restrict input,
+                                        char *restrict output) {
+  const uint32_t val = ((uint32_t)input[0] << 8) | input[1];
+  output[0] = ts3_base64_enc_table[val >> 10];
+  output[1] = ts3_base64_enc_table[(val >> 4) & 0b111'111];
+  output[2] = ts3_base64_enc_table[(val << 2) & 0b111'111];
+  output[3] = '=';
+}
+
+/// Decode whole 4-character groups of an encoded key.
+///
+/// @param [in] input
+///    Pointer to the first group to decode.
+/// @param num_groups
+///    Number of groups to decode.
+/// @param [out] output
+///    Pointer to the buffer that receives 3 bytes per group.
+/// @return Value indicating whether all characters are valid.
+[[gnu::nonnull(1, 3), gnu::access(read_only, 1), gnu::access(write_only, 3)]]
+static inline bool ts3_b64_dec_groups(const unsigned char *restrict input,
+                                      int num_groups,
+                                      unsigned char *restrict output) {
+  for (int i = 0; i < num_groups; ++i, input += 4, output += 3) {
+    const uint32_t a = ts3_base64_dec_table[input[0]];
+    const uint32_t b = ts3_base64_dec_table[input[1]];
+    const uint32_t c = ts3_base64_dec_table[input[2]];
+    const uint32_t d = ts3_base64_dec_table[input[3]];
+    // Invalid characters have index 64, which no valid one has a bit of
+    if ((a | b | c | d) & 64) {
+      return false;
+    }
+    const uint32_t val = (a << 18) | (b << 12) | (c << 6) | d;
+    output[0] = val >> 16;
+    output[1] = val >> 8;
+    output[2] = val;
+  }
+  return true;
+}
+
+/// Decode the last 4 characters of an encoded 32-byte key.
+///
+/// @param [in] input
+///    Pointer to the characters to decode.
+/// @param [out] output
+///    Pointer to the buffer that receives the last 2 bytes of the key.
+/// @return Value indicating whether the characters are valid.
+[[gnu::nonnull(1, 2), gnu::access(read_only, 1), gnu::access(write_only, 2)]]
+static inline bool ts3_b64_dec_key_tail(const unsigned char *restrict input,
+                                        unsigned char *restrict output) {
+  const uint32_t a = ts3_base64_dec_table[input[0]];
+  const uint32_t b = ts3_base64_dec_table[input[1]];
+  const uint32_t c = ts3_base64_dec_table[input[2]];
+  if (((a | b | c) & 64) || input[3] != '=') {
+    return false;
+  }
+  const uint32_t val = (a << 10) | (b << 4) | (c >> 2);
+  output[0] = val >> 8;
+  output[1] = val;
+  return true;
+}
+
+/// Scalar implementation of @ref ts3_u_base64_encode_keys.
+[[gnu::nonnull(1, 4), gnu::access(read_only, 1), gnu::access(write_only, 4)]]
+static void ts3_b64_enc_keys_scalar(const unsigned char *restrict input,
+                                    size_t stride, size_t num_keys,
+                                    char *restrict output) {
+  for (size_t i = 0; i < num_keys; ++i, input += stride, output += 44) {
+    ts3_b64_enc_groups(input, 10, output);
+    ts3_b64_enc_key_tail(&input[30], &output[40]);
+  }
+}
+
+/// Scalar implementation of @ref ts3_u_base64_decode_keys.
+[[gnu::nonnull(1, 3), gnu::access(read_only, 1), gnu::access(write_only, 3)]]
+static size_t ts3_b64_dec_keys_scalar(const char *restrict input,
+                                      size_t num_keys,
+                                      unsigned char *restrict output,
+                                      size_t stride) {
+  auto const u_input = (const unsigned char *)input;
+  for (size_t i = 0; i < num_keys; ++i) {
+    const unsigned char *const key_input = &u_input[i * 44];
+    unsigned char *const key = &output[i * stride];
+    if (!ts3_b64_dec_groups(key_input, 10, key) ||
+        !ts3_b64_dec_key_tail(&key_input[40], &key[30])) {
+      return i;
+    }
+  }
+  return num_keys;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+
+// Vectorized Base64 conversion follows the approach by Wojciech Muła and
+//    Daniel Lemire: each 12-byte group in a 16-byte lane is split into 6-bit
+//    indices with multiplications, and indices are mapped to ASCII characters
+//    and back via nibble-indexed pshufb lookups. A 32-byte key has 24 bytes
+//    (32 characters) processed this way, and the rest via scalar code.
+
+/// Shuffle mask that spreads 3-byte groups over 4-byte lanes in the order
+///    expected by the index extraction multiplications.
+#define TS3_B64_ENC_SHUF 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+/// Offsets to add to 6-bit indices to get ASCII characters, by index class
+///    computed in @ref ts3_b64_enc_ssse3.
+#define TS3_B64_ENC_SHIFT                                                      \
+  'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,        \
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+/// Validity flags of ASCII characters by their low nibbles.
+#define TS3_B64_DEC_LUT_LO                                                     \
+  0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,      \
+      0x1B, 0x1B, 0x1B, 0x1A
+/// Validity flags of ASCII characters by their high nibbles.
+#define TS3_B64_DEC_LUT_HI                                                     \
+  0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,      \
+      0x10, 0x10, 0x10, 0x10
+/// Offsets to add to ASCII characters to get 6-bit indices, by their high
+///    nibbles ('/' uses the slot of nibble 1).
+#define TS3_B64_DEC_ROLL                                                       \
+  0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+/// Shuffle mask that packs 3 decoded bytes of each 4-byte lane together.
+#define TS3_B64_DEC_SHUF 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+/// Encode 12 bytes into 16 Base64 characters.
+///
+/// @param input
+///    Lane with the bytes to encode in its first 12 bytes.
+/// @return Lane with the encoded characters.
+[[gnu::target("ssse3")]]
+static inline __m128i ts3_b64_enc_ssse3(__m128i input) {
+  input = _mm_shuffle_epi8(input, _mm_setr_epi8(TS3_B64_ENC_SHUF));
+  const __m128i hi = _mm_mulhi_epu16(
+      _mm_and_si128(input, _mm_set1_epi32(0x0FC0FC00)),
+      _mm_set1_epi32(0x04000040));
+  const __m128i lo = _mm_mullo_epi16(
+      _mm_and_si128(input, _mm_set1_epi32(0x003F03F0)),
+      _mm_set1_epi32(0x01000010));
+  const __m128i indices = _mm_or_si128(hi, lo);
+  // Classify indices: 0-25 -> 13, 26-51 -> 0, 52-61 -> 1-10, 62 -> 11,
+  //    63 -> 12
+  __m128i cls = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  cls = _mm_or_si128(cls, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26),
+                                                       indices),
+                                        _mm_set1_epi8(13)));
+  return _mm_add_epi8(
+      indices, _mm_shuffle_epi8(_mm_setr_epi8(TS3_B64_ENC_SHIFT), cls));
+}
+
+/// Decode 16 Base64 characters into 12 bytes.
+///
+/// @param input
+///    Lane with the characters to decode.
+/// @param [out] valid
+///    Variable that is set to `false` if @p input has invalid characters.
+/// @return Lane with the decoded bytes in its first 12 bytes.
+[[gnu::target("ssse3"), gnu::nonnull(2), gnu::access(write_only, 2)]]
+static inline __m128i ts3_b64_dec_ssse3(__m128i input, bool *_Nonnull valid) {
+  const __m128i hi_nibbles =
+      _mm_and_si128(_mm_srli_epi32(input, 4), _mm_set1_epi8(0x0F));
+  const __m128i lo_nibbles = _mm_and_si128(input, _mm_set1_epi8(0x0F));
+  const __m128i lo =
+      _mm_shuffle_epi8(_mm_setr_epi8(TS3_B64_DEC_LUT_LO), lo_nibbles);
+  const __m128i hi =
+      _mm_shuffle_epi8(_mm_setr_epi8(TS3_B64_DEC_LUT_HI), hi_nibbles);
+  if (_mm_movemask_epi8(
+          _mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()))) {
+    *valid = false;
+  }
+  const __m128i roll = _mm_shuffle_epi8(
+      _mm_setr_epi8(TS3_B64_DEC_ROLL),
+      _mm_add_epi8(_mm_cmpeq_epi8(input, _mm_set1_epi8('/')), hi_nibbles));
+  const __m128i indices = _mm_add_epi8(input, roll);
+  const __m128i pairs =
+      _mm_maddubs_epi16(indices, _mm_set1_epi32(0x01400140));
+  const __m128i groups = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(groups, _mm_setr_epi8(TS3_B64_DEC_SHUF));
+}
+
+/// SSSE3 implementation of @ref ts3_u_base64_encode_keys.
+[[gnu::target("ssse3"), gnu::nonnull(1, 4), gnu::access(read_only, 1),
+  gnu::access(write_only, 4)]]
+static void ts3_b64_enc_keys_ssse3(const unsigned char *restrict input,
+                                   size_t stride, size_t num_keys,
+                                   char *restrict output) {
+  for (size_t i = 0; i < num_keys; ++i, input += stride, output += 44) {
+    _mm_storeu_si128(
+        (__m128i *)output,
+        ts3_b64_enc_ssse3(_mm_loadu_si128((const __m128i *)input)));
+    _mm_storeu_si128(
+        (__m128i *)&output[16],
+        ts3_b64_enc_ssse3(_mm_loadu_si128((const __m128i *)&input[12])));
+    ts3_b64_enc_groups(&input[24], 2, &output[32]);
+    ts3_b64_enc_key_tail(&input[30], &output[40]);
+  }
+}
+
+/// SSSE3 implementation of @ref ts3_u_base64_decode_keys.
+[[gnu::target("ssse3"), gnu::nonnull(1, 3), gnu::access(read_only, 1),
+  gnu::access(write_only, 3)]]
+static size_t ts3_b64_dec_keys_ssse3(const char *restrict input,
+                                     size_t num_keys,
+                                     unsigned char *restrict output,
+                                     size_t stride) {
+  auto const u_input = (const unsigned char *)input;
+  for (size_t i = 0; i < num_keys; ++i) {
+    const unsigned char *const key_input = &u_input[i * 44];
+    unsigned char *const key = &output[i * stride];
+    bool valid = true;
+    // Each store writes 4 extra bytes, which are overwritten by the next one
+    _mm_storeu_si128(
+        (__m128i *)key,
+        ts3_b64_dec_ssse3(_mm_loadu_si128((const __m128i *)key_input),
+                          &valid));
+    _mm_storeu_si128(
+        (__m128i *)&key[12],
+        ts3_b64_dec_ssse3(_mm_loadu_si128((const __m128i *)&key_input[16]),
+                          &valid));
+    if (!valid || !ts3_b64_dec_groups(&key_input[32], 2, &key[24]) ||
+        !ts3_b64_dec_key_tail(&key_input[40], &key[30])) {
+      return i;
+    }
+  }
+  return num_keys;
+}
+
+/// AVX2 implementation of @ref ts3_u_base64_encode_keys, which processes
+///    both 12-byte groups of a key in one 32-byte register.
+[[gnu::target("avx2"), gnu::nonnull(1, 4), gnu::access(read_only, 1),
+  gnu::access(write_only, 4)]]
+static void ts3_b64_enc_keys_avx2(const unsigned char *restrict input,
+                                  size_t stride, size_t num_keys,
+                                  char *restrict output) {
+  for (size_t i = 0; i < num_keys; ++i, input += stride, output += 44) {
+    __m256i in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)input)),
+        _mm_loadu_si128((const __m128i *)&input[12]), 1);
+    in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(TS3_B64_ENC_SHUF,
+                                                  TS3_B64_ENC_SHUF));
+    const __m256i hi = _mm256_mulhi_epu16(
+        _mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00)),
+        _mm256_set1_epi32(0x04000040));
+    const __m256i lo = _mm256_mullo_epi16(
+        _mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0)),
+        _mm256_set1_epi32(0x01000010));
+    const __m256i indices = _mm256_or_si256(hi, lo);
+    __m256i cls = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    cls = _mm256_or_si256(
+        cls, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices),
+                              _mm256_set1_epi8(13)));
+    _mm256_storeu_si256(
+        (__m256i *)output,
+        _mm256_add_epi8(indices, _mm256_shuffle_epi8(
+                                     _mm256_setr_epi8(TS3_B64_ENC_SHIFT,
+                                                      TS3_B64_ENC_SHIFT),
+                                     cls)));
+    ts3_b64_enc_groups(&input[24], 2, &output[32]);
+    ts3_b64_enc_key_tail(&input[30], &output[40]);
+  }
+}
+
+/// AVX2 implementation of @ref ts3_u_base64_decode_keys, which processes the
+///    first 32 characters of a key in one register.
+[[gnu::target("avx2"), gnu::nonnull(1, 3), gnu::access(read_only, 1),
+  gnu::access(write_only, 3)]]
+static size_t ts3_b64_dec_keys_avx2(const char *restrict input,
+                                    size_t num_keys,
+                                    unsigned char *restrict output,
+                                    size_t stride) {
+  auto const u_input = (const unsigned char *)input;
+  for (size_t i = 0; i < num_keys; ++i) {
+    const unsigned char *const key_input = &u_input[i * 44];
+    unsigned char *const key = &output[i * stride];
+    const __m256i in = _mm256_loadu_si256((const __m256i *)key_input);
+    const __m256i hi_nibbles =
+        _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0F));
+    const __m256i lo_nibbles = _mm256_and_si256(in, _mm256_set1_epi8(0x0F));
+    const __m256i lo = _mm256_shuffle_epi8(
+        _mm256_setr_epi8(TS3_B64_DEC_LUT_LO, TS3_B64_DEC_LUT_LO), lo_nibbles);
+    const __m256i hi = _mm256_shuffle_epi8(
+        _mm256_setr_epi8(TS3_B64_DEC_LUT_HI, TS3_B64_DEC_LUT_HI), hi_nibbles);
+    if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi),
+                                               _mm256_setzero_si256()))) {
+      return i;
+    }
+    const __m256i roll = _mm256_shuffle_epi8(
+        _mm256_setr_epi8(TS3_B64_DEC_ROLL, TS3_B64_DEC_ROLL),
+        _mm256_add_epi8(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('/')),
+                        hi_nibbles));
+    const __m256i pairs = _mm256_maddubs_epi16(_mm256_add_epi8(in, roll),
+                                               _mm256_set1_epi32(0x01400140));
+    __m256i out = _mm256_shuffle_epi8(
+        _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000)),
+        _mm256_setr_epi8(TS3_B64_DEC_SHUF, TS3_B64_DEC_SHUF));
+    // Move 12 bytes of the second lane right after the first lane's ones, the
+    //    last 8 bytes stored are overwritten below
+    out = _mm256_permutevar8x32_epi32(
+        out, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+    _mm256_storeu_si256((__m256i *)key, out);
+    if (!ts3_b64_dec_groups(&key_input[32], 2, &key[24]) ||
+        !ts3_b64_dec_key_tail(&key_input[40], &key[30])) {
+      return i;
+    }
+  }
+  return num_keys;
+}
+
+#endif // defined(__i386__) || defined(__x86_64__)
+
 //===-- Functions ---------------------------------------------------------===//
 
 int ts3_u_base64_decode(const char *restrict input, int input_len,
@@ -275,3 +690,67 @@ int ts3_u_base64_encode(const unsigned char *restrict input, int input_size,
   } // if (rem) else
   return (char *)u_output - output;
 }
+
+void ts3_u_base64_encode_keys(const unsigned char *input, size_t stride,
+                              size_t num_keys, char *output) {
+#if defined(__i386__) || defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    ts3_b64_enc_keys_avx2(input, stride, num_keys, output);
+    return;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    ts3_b64_enc_keys_ssse3(input, stride, num_keys, output);
+    return;
+  }
+#endif // defined(__i386__) || defined(__x86_64__)
+  ts3_b64_enc_keys_scalar(input, stride, num_keys, output);
+}
+
+size_t ts3_u_base64_decode_keys(const char *input, size_t num_keys,
+                                unsigned char *output, size_t stride) {
+#if defined(__i386__) || defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    return ts3_b64_dec_keys_avx2(input, num_keys, output, stride);
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return ts3_b64_dec_keys_ssse3(input, num_keys, output, stride);
+  }
+#endif // defined(__i386__) || defined(__x86_64__)
+  return ts3_b64_dec_keys_scalar(input, num_keys, output, stride);
+}
+
+void ts3_u_sha256(const void *input, size_t input_size,
+                  unsigned char *output) {
+  uint32_t h[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                   0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+  auto const u_input = (const unsigned char *)input;
+  // Process whole blocks directly from input
+  const size_t num_blocks = input_size / 64;
+  for (size_t i = 0; i < num_blocks; ++i) {
+    ts3_sha256_block(h, &u_input[i * 64]);
+  }
+  // Pad the remainder with 0x80 byte, zeros and 64-bit message length in bits,
+  //    this may take either one or two blocks
+  unsigned char tail[128] = {};
+  const size_t rem = input_size % 64;
+  if (rem) {
+    memcpy(tail, &u_input[num_blocks * 64], rem);
+  }
+  tail[rem] = 0x80;
+  const size_t tail_size = rem < 56 ? 64 : 128;
+  const uint64_t num_bits = (uint64_t)input_size * 8;
+  for (int i = 0; i < 8; ++i) {
+    tail[tail_size - 1 - i] = (unsigned char)(num_bits >> (i * 8));
+  }
+  ts3_sha256_block(h, tail);
+  if (tail_size == 128) {
+    ts3_sha256_block(h, &tail[64]);
+  }
+  // Write the hash in big-endian byte order
+  for (int i = 0; i < 8; ++i) {
+    output[i * 4] = h[i] >> 24;
+    output[i * 4 + 1] = h[i] >> 16;
+    output[i * 4 + 2] = h[i] >> 8;
+    output[i * 4 + 3] = h[i];
+  }
+}
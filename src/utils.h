@@ -17,6 +17,8 @@
 
 #include "null_attrs.h" // IWYU pragma: keep
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif // def __cplusplus
@@ -53,6 +55,62 @@ int ts3_u_base64_decode(const char *_Nonnull input, int input_len,
 int ts3_u_base64_encode(const unsigned char *_Nonnull input, int input_size,
                         char *_Nonnull output);
 
+/// Encode 32-byte binary keys (such as AES-256 keys or SHA-256 hashes) into
+///    44-character Base64 strings, using SIMD instructions if the CPU
+///    supports them.
+///
+/// @param [in] input
+///    Pointer to the first key to encode.
+/// @param stride
+///    Distance between the beginnings of consecutive keys in @p input, in
+///    bytes. Must be at least `32`.
+/// @param num_keys
+///    Number of keys to encode.
+/// @param [out] output
+///    Pointer to the buffer that receives the encoded strings, consecutively
+///    and without null terminators. Its size must be at least 44 * @p num_keys
+///    characters.
+[[gnu::visibility("internal"), gnu::nonnull(1, 4), gnu::access(read_only, 1),
+  gnu::access(write_only, 4)]]
+void ts3_u_base64_encode_keys(const unsigned char *_Nonnull input,
+                              size_t stride, size_t num_keys,
+                              char *_Nonnull output);
+
+/// Decode 44-character Base64 strings into 32-byte binary keys, using SIMD
+///    instructions if the CPU supports them. Unlike @ref ts3_u_base64_decode,
+///    any character that is not a valid part of an encoded key makes it
+///    invalid.
+///
+/// @param [in] input
+///    Pointer to the strings to decode, placed consecutively without null
+///    terminators.
+/// @param num_keys
+///    Number of strings to decode.
+/// @param [out] output
+///    Pointer to the buffer that receives the first decoded key.
+/// @param stride
+///    Distance between the beginnings of consecutive keys in @p output, in
+///    bytes. Must be at least `32`.
+/// @return Number of keys that have been decoded before the first invalid
+///    string, equal to @p num_keys if all of them are valid.
+[[gnu::visibility("internal"), gnu::nonnull(1, 3), gnu::access(read_only, 1),
+  gnu::access(write_only, 3)]]
+size_t ts3_u_base64_decode_keys(const char *_Nonnull input, size_t num_keys,
+                                unsigned char *_Nonnull output, size_t stride);
+
+/// Compute SHA-256 hash of data.
+///
+/// @param [in] input
+///    Pointer to the data to hash.
+/// @param input_size
+///    Number of bytes to read from @p input.
+/// @param [out] output
+///    Pointer to the buffer that receives the 32-byte hash.
+[[gnu::visibility("internal"), gnu::nonnull(3), gnu::access(read_only, 1, 2),
+  gnu::access(write_only, 3)]]
+void ts3_u_sha256(const void *_Nullable input, size_t input_size,
+                  unsigned char *_Nonnull output);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif // def __cplusplus
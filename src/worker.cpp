@@ -0,0 +1,95 @@
+//===-- worker.cpp - Background worker thread implementation --------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Implementation of the background worker thread.
+///
+//===----------------------------------------------------------------------===//
+#include "worker.hpp"
+
+#include "null_attrs.h" // IWYU pragma: keep
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <utility>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private type ------------------------------------------------------===//
+
+/// Worker thread state.
+struct worker_ctx {
+  /// Mutex for locking concurrent access to @ref jobs.
+  std::mutex mtx;
+  /// Condition variable that is signaled when a job is queued.
+  std::condition_variable_any cv;
+  /// Queued jobs, in the order of submission.
+  std::deque<std::move_only_function<void()>> jobs;
+  /// The worker thread.
+  std::jthread thread;
+};
+
+//===-- Private variable --------------------------------------------------===//
+
+/// The worker instance.
+static worker_ctx worker;
+
+//===-- Private function --------------------------------------------------===//
+
+/// Run queued jobs until a stop is requested.
+///
+/// @param stop
+///    Stop token of the worker thread.
+static void worker_main(std::stop_token stop) {
+  for (;;) {
+    std::move_only_function<void()> job;
+    {
+      std::unique_lock lock{worker.mtx};
+      if (!worker.cv.wait(lock, stop,
+                          [] noexcept { return !worker.jobs.empty(); })) {
+        return;
+      }
+      job = std::move(worker.jobs.front());
+      worker.jobs.pop_front();
+    }
+    job();
+  }
+}
+
+} // namespace
+
+//===-- Internal functions ------------------------------------------------===//
+
+void worker_submit(std::move_only_function<void()> &&job) {
+  {
+    const std::scoped_lock lock{worker.mtx};
+    worker.jobs.emplace_back(std::move(job));
+  }
+  worker.cv.notify_one();
+}
+
+void worker_start() { worker.thread = std::jthread{worker_main}; }
+
+void worker_stop() {
+  if (worker.thread.joinable()) {
+    worker.thread.request_stop();
+    worker.thread.join();
+  }
+  const std::scoped_lock lock{worker.mtx};
+  worker.jobs.clear();
+}
+
+} // namespace tek::s3
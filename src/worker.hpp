@@ -0,0 +1,49 @@
+//===-- worker.hpp - Background worker thread declarations ----------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Declarations of functions for running CPU- and I/O-heavy jobs, such as
+///    compressing manifests and writing them to disk, on a background thread,
+///    so that they don't stall the libwebsockets service thread. Jobs are run
+///    one at a time in the order of submission. They must not access
+///    @ref state fields that are protected by @ref ts3_state::manifest_mtx,
+///    and should post an event to hand their results over to the service
+///    thread instead.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include "null_attrs.h" // IWYU pragma: keep
+
+#include <functional>
+
+namespace tek::s3 {
+
+/// Queue a job for running on the worker thread. Jobs may be queued before
+///    the thread is started.
+///
+/// @param [in, out] job
+///    The job to run. It must not throw exceptions.
+/// @throws std::bad_alloc if allocation fails.
+[[gnu::visibility("internal")]]
+void worker_submit(std::move_only_function<void()> &&job);
+
+/// Start the worker thread.
+///
+/// @throws std::system_error if the thread can't be created.
+[[gnu::visibility("internal")]]
+void worker_start();
+
+/// Wait for the job that is currently running to complete, stop the worker
+///    thread, and discard queued jobs.
+[[gnu::visibility("internal")]]
+void worker_stop();
+
+} // namespace tek::s3
@@ -0,0 +1,211 @@
+//===-- base64_keys.c - Base64 key codec test -----------------------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Test that cross-checks every implementation of
+///    @ref ts3_u_base64_encode_keys and @ref ts3_u_base64_decode_keys
+///    supported by the CPU against the generic scalar codec, on random keys
+///    with different strides and on keys with an invalid character at every
+///    position.
+///
+//===----------------------------------------------------------------------===//
+// Included directly to get access to the internal implementations
+#include "utils.c"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+//===-- Types -------------------------------------------------------------===//
+
+/// Pair of key encoding and decoding implementations.
+typedef struct ts3_test_impl ts3_test_impl;
+struct ts3_test_impl {
+  /// Name of the implementation to print in error messages.
+  const char *_Nonnull name;
+  /// Key encoding function.
+  void (*_Nonnull encode)(const unsigned char *restrict input, size_t stride,
+                          size_t num_keys, char *restrict output);
+  /// Key decoding function.
+  size_t (*_Nonnull decode)(const char *restrict input, size_t num_keys,
+                            unsigned char *restrict output, size_t stride);
+};
+
+//===-- Constants ---------------------------------------------------------===//
+
+/// Number of keys in each batch.
+#define TS3_TEST_NUM_KEYS 64
+
+/// Key strides to test.
+static const size_t ts3_test_strides[] = {32, 33, 36, 48, 64};
+
+//===-- Variables ---------------------------------------------------------===//
+
+/// State of the pseudo-random number generator.
+static uint64_t ts3_test_rng = 0x9E3779B97F4A7C15;
+
+/// Number of failed checks.
+static int ts3_test_failures;
+
+//===-- Functions ---------------------------------------------------------===//
+
+/// Get the next pseudo-random number (xorshift64).
+///
+/// @return The number.
+static uint64_t ts3_test_rand(void) {
+  ts3_test_rng ^= ts3_test_rng << 13;
+  ts3_test_rng ^= ts3_test_rng >> 7;
+  ts3_test_rng ^= ts3_test_rng << 17;
+  return ts3_test_rng;
+}
+
+/// Check whether a character may appear in an encoded key at a position,
+///    independently of the codec's tables.
+///
+/// @param c
+///    The character.
+/// @param pos
+///    Position in the 44-character string.
+/// @return Value indicating whether @p c is valid at @p pos.
+static bool ts3_test_valid_char(unsigned char c, int pos) {
+  if (pos == 43) {
+    return c == '=';
+  }
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+         (c >= '0' && c <= '9') || c == '+' || c == '/';
+}
+
+/// Record a failed check.
+///
+/// @param [in] impl
+///    Implementation that has failed the check.
+/// @param [in] what
+///    Description of the check.
+/// @param stride
+///    Key stride that has been used.
+/// @param index
+///    Index of the key or position that has failed the check.
+static void ts3_test_fail(const ts3_test_impl *_Nonnull impl,
+                          const char *_Nonnull what, size_t stride,
+                          size_t index) {
+  fprintf(stderr, "%s: %s (stride %zu, index %zu)\n", impl->name, what, stride,
+          index);
+  ++ts3_test_failures;
+}
+
+/// Check an implementation on random keys against the generic codec.
+///
+/// @param [in] impl
+///    The implementation to check.
+/// @param stride
+///    Distance between consecutive keys in the binary buffer, in bytes.
+static void ts3_test_roundtrip(const ts3_test_impl *_Nonnull impl,
+                               size_t stride) {
+  static unsigned char keys[TS3_TEST_NUM_KEYS * 64];
+  static unsigned char decoded[TS3_TEST_NUM_KEYS * 64];
+  static char encoded[TS3_TEST_NUM_KEYS * 44];
+  for (size_t i = 0; i < sizeof keys; ++i) {
+    keys[i] = (unsigned char)ts3_test_rand();
+  }
+  // Fill the gaps between keys with a pattern to detect stray writes
+  memset(decoded, 0xA5, sizeof decoded);
+  impl->encode(keys, stride, TS3_TEST_NUM_KEYS, encoded);
+  for (size_t i = 0; i < TS3_TEST_NUM_KEYS; ++i) {
+    char expected[45];
+    if (ts3_u_base64_encode(&keys[i * stride], 32, expected) != 44 ||
+        memcmp(&encoded[i * 44], expected, 44)) {
+      ts3_test_fail(impl, "encoded key mismatch", stride, i);
+    }
+  }
+  const size_t num_decoded =
+      impl->decode(encoded, TS3_TEST_NUM_KEYS, decoded, stride);
+  if (num_decoded != TS3_TEST_NUM_KEYS) {
+    ts3_test_fail(impl, "valid key rejected", stride, num_decoded);
+    return;
+  }
+  for (size_t i = 0; i < TS3_TEST_NUM_KEYS; ++i) {
+    unsigned char expected[33];
+    if (ts3_u_base64_decode(&encoded[i * 44], 44, expected) != 32 ||
+        memcmp(&decoded[i * stride], expected, 32) ||
+        memcmp(&decoded[i * stride], &keys[i * stride], 32)) {
+      ts3_test_fail(impl, "decoded key mismatch", stride, i);
+    }
+    for (size_t j = 32; j < stride; ++j) {
+      if (decoded[i * stride + j] != 0xA5) {
+        ts3_test_fail(impl, "write past the key", stride, i);
+        break;
+      }
+    }
+  }
+}
+
+/// Check that an implementation stops at the first invalid key, trying every
+///    character at every position of the key.
+///
+/// @param [in] impl
+///    The implementation to check.
+static void ts3_test_invalid(const ts3_test_impl *_Nonnull impl) {
+  // The invalid key is placed in the middle, so that both the keys before it
+  //    and the ones after it are exercised
+  enum { num_keys = 4, bad_key = 2 };
+  unsigned char keys[num_keys * 32];
+  unsigned char decoded[num_keys * 32];
+  char encoded[num_keys * 44];
+  for (size_t i = 0; i < sizeof keys; ++i) {
+    keys[i] = (unsigned char)ts3_test_rand();
+  }
+  ts3_b64_enc_keys_scalar(keys, 32, num_keys, encoded);
+  char *const bad = &encoded[bad_key * 44];
+  for (int pos = 0; pos < 44; ++pos) {
+    const char orig = bad[pos];
+    for (int c = 0; c < 256; ++c) {
+      if (ts3_test_valid_char(c, pos)) {
+        continue;
+      }
+      bad[pos] = (char)c;
+      const size_t num_decoded = impl->decode(encoded, num_keys, decoded, 32);
+      if (num_decoded != bad_key) {
+        ts3_test_fail(impl, "invalid character accepted", 32, pos);
+      } else if (memcmp(decoded, keys, bad_key * 32)) {
+        ts3_test_fail(impl, "key before invalid one mismatch", 32, pos);
+      }
+    }
+    bad[pos] = orig;
+  }
+}
+
+int main(void) {
+  const ts3_test_impl impls[] = {
+      {"scalar", ts3_b64_enc_keys_scalar, ts3_b64_dec_keys_scalar},
+#if defined(__i386__) || defined(__x86_64__)
+      {"ssse3", ts3_b64_enc_keys_ssse3, ts3_b64_dec_keys_ssse3},
+      {"avx2", ts3_b64_enc_keys_avx2, ts3_b64_dec_keys_avx2},
+#endif // defined(__i386__) || defined(__x86_64__)
+      {"dispatch", ts3_u_base64_encode_keys, ts3_u_base64_decode_keys}};
+  for (size_t i = 0; i < sizeof impls / sizeof *impls; ++i) {
+    const ts3_test_impl *const impl = &impls[i];
+#if defined(__i386__) || defined(__x86_64__)
+    if ((impl->encode == ts3_b64_enc_keys_ssse3 &&
+         !__builtin_cpu_supports("ssse3")) ||
+        (impl->encode == ts3_b64_enc_keys_avx2 &&
+         !__builtin_cpu_supports("avx2"))) {
+      printf("%s: not supported by the CPU, skipped\n", impl->name);
+      continue;
+    }
+#endif // defined(__i386__) || defined(__x86_64__)
+    for (size_t j = 0; j < sizeof ts3_test_strides / sizeof *ts3_test_strides;
+         ++j) {
+      ts3_test_roundtrip(impl, ts3_test_strides[j]);
+    }
+    ts3_test_invalid(impl);
+    printf("%s: checked\n", impl->name);
+  }
+  return ts3_test_failures ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+//===-- base64_keys_bench.c - Base64 key codec benchmark ------------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Benchmark that measures throughput of every implementation of
+///    @ref ts3_u_base64_encode_keys and @ref ts3_u_base64_decode_keys
+///    supported by the CPU, on a batch the size of a large depot key list.
+///
+//===----------------------------------------------------------------------===//
+// Included directly to get access to the internal implementations
+#include "utils.c"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+//===-- Types -------------------------------------------------------------===//
+
+/// Pair of key encoding and decoding implementations.
+typedef struct ts3_bench_impl ts3_bench_impl;
+struct ts3_bench_impl {
+  /// Name of the implementation to print.
+  const char *_Nonnull name;
+  /// Key encoding function.
+  void (*_Nonnull encode)(const unsigned char *restrict input, size_t stride,
+                          size_t num_keys, char *restrict output);
+  /// Key decoding function.
+  size_t (*_Nonnull decode)(const char *restrict input, size_t num_keys,
+                            unsigned char *restrict output, size_t stride);
+};
+
+//===-- Constants ---------------------------------------------------------===//
+
+/// Number of keys in the batch.
+#define TS3_BENCH_NUM_KEYS 100'000
+
+/// Number of times the batch is processed by each implementation.
+#define TS3_BENCH_ITERATIONS 50
+
+/// Distance between consecutive keys in the binary buffer, matching entries
+///    of @ref ts3_state::depot_keys.
+#define TS3_BENCH_STRIDE 36
+
+//===-- Functions ---------------------------------------------------------===//
+
+/// Get current time.
+///
+/// @return Current time, in nanoseconds.
+static int64_t ts3_bench_now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (int64_t)ts.tv_sec * 1'000'000'000 + ts.tv_nsec;
+}
+
+int main(void) {
+  const ts3_bench_impl impls[] = {
+      {"scalar", ts3_b64_enc_keys_scalar, ts3_b64_dec_keys_scalar},
+#if defined(__i386__) || defined(__x86_64__)
+      {"ssse3", ts3_b64_enc_keys_ssse3, ts3_b64_dec_keys_ssse3},
+      {"avx2", ts3_b64_enc_keys_avx2, ts3_b64_dec_keys_avx2},
+#endif // defined(__i386__) || defined(__x86_64__)
+  };
+  unsigned char *const keys = malloc(TS3_BENCH_NUM_KEYS * TS3_BENCH_STRIDE);
+  char *const encoded = malloc(TS3_BENCH_NUM_KEYS * 44);
+  if (!keys || !encoded) {
+    return 1;
+  }
+  uint32_t seed = 1;
+  for (size_t i = 0; i < TS3_BENCH_NUM_KEYS * TS3_BENCH_STRIDE; ++i) {
+    seed = seed * 1'664'525 + 1'013'904'223;
+    keys[i] = seed >> 24;
+  }
+  for (size_t i = 0; i < sizeof impls / sizeof *impls; ++i) {
+    const ts3_bench_impl *const impl = &impls[i];
+#if defined(__i386__) || defined(__x86_64__)
+    if ((impl->encode == ts3_b64_enc_keys_ssse3 &&
+         !__builtin_cpu_supports("ssse3")) ||
+        (impl->encode == ts3_b64_enc_keys_avx2 &&
+         !__builtin_cpu_supports("avx2"))) {
+      printf("%-8s not supported by the CPU\n", impl->name);
+      continue;
+    }
+#endif // defined(__i386__) || defined(__x86_64__)
+    auto start = ts3_bench_now();
+    for (int j = 0; j < TS3_BENCH_ITERATIONS; ++j) {
+      impl->encode(keys, TS3_BENCH_STRIDE, TS3_BENCH_NUM_KEYS, encoded);
+    }
+    const double enc_ns = (double)(ts3_bench_now() - start) /
+                          (TS3_BENCH_ITERATIONS * TS3_BENCH_NUM_KEYS);
+    start = ts3_bench_now();
+    for (int j = 0; j < TS3_BENCH_ITERATIONS; ++j) {
+      if (impl->decode(encoded, TS3_BENCH_NUM_KEYS, keys, TS3_BENCH_STRIDE) !=
+          TS3_BENCH_NUM_KEYS) {
+        fprintf(stderr, "%s: decoding failed\n", impl->name);
+        return 1;
+      }
+    }
+    const double dec_ns = (double)(ts3_bench_now() - start) /
+                          (TS3_BENCH_ITERATIONS * TS3_BENCH_NUM_KEYS);
+    printf("%-8s encode %6.2f ns/key, decode %6.2f ns/key\n", impl->name,
+           enc_ns, dec_ns);
+  }
+  free(keys);
+  free(encoded);
+  return 0;
+}
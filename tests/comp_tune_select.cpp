@@ -0,0 +1,186 @@
+//===-- comp_tune_select.cpp - Compression level selection test -----------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Test that checks level selection of the compression level tuner: maximum
+///    levels without a budget or when they fit in it, fastest levels when
+///    nothing fits, spending the budget on encodings that clients actually
+///    accept, and ratio-only measurements of restored data.
+///
+//===----------------------------------------------------------------------===//
+// Included directly to get access to the tuner state
+#include "comp_tune.cpp"
+
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <print>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private constants -------------------------------------------------===//
+
+/// Size of data to select levels for, in bytes. Estimated costs are whole
+///    numbers of microseconds for it, since all time priors are whole numbers
+///    of nanoseconds per byte.
+constexpr std::size_t test_size{1000};
+
+/// Number of observed requests that accept only one encoding, enough to
+///    outweigh the initial mix.
+constexpr int test_num_requests{1000};
+
+//===-- Private variable --------------------------------------------------===//
+
+/// Number of failed checks.
+static int failures;
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Record a failed check.
+///
+/// @param [in] what
+///    Description of the check.
+/// @param index
+///    Index of the encoding in @ref precomp_encs that has failed the check.
+static void fail(const char *_Nonnull what, std::size_t index) {
+  std::println(std::cerr, "{} (encoding {})", what, index);
+  ++failures;
+}
+
+/// Reset the tuner to its initial state and set the compression budget.
+///
+/// @param budget
+///    Compression budget, in microseconds.
+static void reset(lws_usec_t budget) {
+  tuner = make_tuner();
+  state.comp_budget = budget;
+}
+
+/// Get estimated compression time of a combination of levels for
+///    @ref test_size bytes.
+///
+/// @param combo
+///    Indexes of levels of encodings, in the same order as
+///    @ref precomp_encs.
+/// @return Estimated compression time, in microseconds.
+static lws_usec_t combo_cost(const std::array<std::size_t, num_encs> &combo) {
+  double cost{};
+  for (std::size_t i{}; i < num_encs; ++i) {
+    cost += tuner.codecs[i].est_time(combo[i]) * test_size;
+  }
+  return static_cast<lws_usec_t>(cost / 1000);
+}
+
+/// Check that the selected levels are the expected ones.
+///
+/// @param [in] what
+///    Description of the check.
+/// @param expected
+///    Expected indexes of selected levels, in the same order as
+///    @ref precomp_encs.
+static void check_selected(const char *_Nonnull what,
+                           const std::array<std::size_t, num_encs> &expected) {
+  for (std::size_t i{}; i < num_encs; ++i) {
+    if (tuner.codecs[i].cur != expected[i]) {
+      fail(what, i);
+    }
+  }
+}
+
+/// Get indexes of the strongest levels of all encodings.
+///
+/// @return The indexes, in the same order as @ref precomp_encs.
+static std::array<std::size_t, num_encs> strongest() {
+  std::array<std::size_t, num_encs> combo;
+  for (std::size_t i{}; i < num_encs; ++i) {
+    combo[i] = tuner.codecs[i].levels.size() - 1;
+  }
+  return combo;
+}
+
+/// Check selection without a budget and with budgets that fit everything or
+///    nothing.
+static void test_budget() {
+  reset(0);
+  comp_tune_select(test_size);
+  check_selected("no budget: maximum level not selected", strongest());
+  reset(combo_cost(strongest()));
+  comp_tune_select(test_size);
+  check_selected("budget fits: maximum level not selected", strongest());
+  // The fastest levels cost several microseconds together
+  reset(1);
+  comp_tune_select(test_size);
+  check_selected("nothing fits: fastest level not selected", {});
+  // A budget between these must be respected while spent on something
+  const auto budget{combo_cost({}) * 2};
+  reset(budget);
+  comp_tune_select(test_size);
+  std::array<std::size_t, num_encs> selected;
+  for (std::size_t i{}; i < num_encs; ++i) {
+    selected[i] = tuner.codecs[i].cur;
+  }
+  if (combo_cost(selected) > budget) {
+    fail("partial budget: exceeded", 0);
+  }
+  if (selected == std::array<std::size_t, num_encs>{}) {
+    fail("partial budget: left unused", 0);
+  }
+}
+
+/// Check that the budget goes to the encoding that clients accept, for each
+///    encoding. The budget fits exactly the strongest level of that encoding
+///    and the fastest levels of the others.
+static void test_mix() {
+  for (std::size_t i{}; i < num_encs; ++i) {
+    std::array<std::size_t, num_encs> expected{};
+    expected[i] = tuner.codecs[i].levels.size() - 1;
+    reset(combo_cost(expected));
+    for (int j{}; j < test_num_requests; ++j) {
+      comp_tune_observe(1u << i);
+    }
+    comp_tune_select(test_size);
+    check_selected("mix: budget not spent on the requested encoding", expected);
+  }
+}
+
+/// Check that ratio-only measurements update ratio estimates but not time
+///    estimates.
+static void test_ratio_only() {
+  reset(0);
+  const auto before{comp_tune_get_stats()};
+  for (std::size_t i{}; i < num_encs; ++i) {
+    comp_tune_record_ratio(precomp_encs[i], before[i].level, test_size,
+                           test_size / 10);
+  }
+  const auto after{comp_tune_get_stats()};
+  for (std::size_t i{}; i < num_encs; ++i) {
+    if (after[i].ratio != 0.1) {
+      fail("ratio-only: ratio not recorded", i);
+    }
+    if (after[i].samples || after[i].ns_per_byte != before[i].ns_per_byte) {
+      fail("ratio-only: time estimate changed", i);
+    }
+  }
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+int main() {
+  using namespace tek::s3;
+  test_budget();
+  test_mix();
+  test_ratio_only();
+  std::println("{} encodings checked", num_encs);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,194 @@
+//===-- flat_map_bench.cpp - Flat map benchmark ---------------------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Benchmark that compares @ref tek::s3::flat_map against `std::map` holding
+///    100k depot keys, on random lookups, full iteration, and bulk updates in
+///    ascending key order as done by the PICS pipeline.
+///
+//===----------------------------------------------------------------------===//
+#include "flat_map.hpp"
+#include "null_attrs.h" // IWYU pragma: keep
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <print>
+#include <utility>
+#include <vector>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private types -----------------------------------------------------===//
+
+/// Mapped value type, the same size as @ref depot_key.
+using bench_value = std::array<unsigned char, 32>;
+
+/// Checksums of benchmark passes, compared between containers to make sure
+///    they did the same work.
+struct bench_sums {
+  std::uint64_t build;
+  std::uint64_t update;
+  std::uint64_t lookup;
+  std::uint64_t iterate;
+
+  constexpr bool operator==(const bench_sums &) const noexcept = default;
+};
+
+//===-- Private constants -------------------------------------------------===//
+
+/// Number of depots in the benchmarked containers.
+constexpr std::size_t bench_num_depots{100'000};
+
+/// Number of times each operation is run.
+constexpr int bench_iterations{20};
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Generate depot IDs shaped like real ones: 1 to 4 depots following each
+///    application ID.
+///
+/// @return Depot IDs in ascending order.
+static std::vector<std::uint32_t> make_ids() {
+  std::vector<std::uint32_t> ids;
+  ids.reserve(bench_num_depots);
+  for (std::uint32_t app_id{10}; ids.size() < bench_num_depots; app_id += 10) {
+    for (std::uint32_t j{}; j <= app_id / 10 % 4; ++j) {
+      ids.emplace_back(app_id + 1 + j);
+    }
+  }
+  ids.resize(bench_num_depots);
+  return ids;
+}
+
+/// Shuffle IDs into a random lookup order.
+///
+/// @param ids
+///    IDs to shuffle.
+/// @return The shuffled IDs.
+static std::vector<std::uint32_t> shuffle(std::vector<std::uint32_t> ids) {
+  std::uint32_t seed{1};
+  for (auto i{ids.size() - 1}; i > 0; --i) {
+    seed = seed * 1'664'525 + 1'013'904'223;
+    std::swap(ids[i], ids[(seed >> 8) % (i + 1)]);
+  }
+  return ids;
+}
+
+/// Run an operation repeatedly and get its average time.
+///
+/// @param fn
+///    Function that runs the operation and returns its checksum.
+/// @param [out] sum
+///    On return, checksum of the last run.
+/// @return Average time of a run, in milliseconds.
+template <typename Fn> static double measure(Fn fn, std::uint64_t &sum) {
+  // Warm up caches and the allocator
+  sum = fn();
+  const auto start{std::chrono::steady_clock::now()};
+  for (int i{}; i < bench_iterations; ++i) {
+    sum = fn();
+  }
+  const std::chrono::duration<double, std::milli> elapsed{
+      std::chrono::steady_clock::now() - start};
+  return elapsed.count() / bench_iterations;
+}
+
+/// Benchmark a container type and print its timings.
+///
+/// @tparam Map
+///    Container type mapping `std::uint32_t` to @ref bench_value.
+/// @param [in] name
+///    Name of the container to print.
+/// @param [in] ids
+///    Depot IDs in ascending order.
+/// @param [in] lookup_ids
+///    Depot IDs in lookup order.
+/// @return Checksums of the runs.
+template <typename Map>
+static bench_sums run(const char *_Nonnull name,
+                      const std::vector<std::uint32_t> &ids,
+                      const std::vector<std::uint32_t> &lookup_ids) {
+  bench_sums sums;
+  const auto build_ms{measure(
+      [&ids] {
+        Map map;
+        for (const auto id : ids) {
+          map.try_emplace(id).first->second[0] = static_cast<unsigned char>(id);
+        }
+        return static_cast<std::uint64_t>(map.size());
+      },
+      sums.build)};
+  Map map;
+  for (const auto id : ids) {
+    map.try_emplace(id);
+  }
+  std::uint8_t gen{};
+  const auto update_ms{measure(
+      [&map, &ids, &gen] {
+        ++gen;
+        for (const auto id : ids) {
+          map[id][0] = static_cast<unsigned char>(id + gen);
+        }
+        return static_cast<std::uint64_t>(map.size());
+      },
+      sums.update)};
+  const auto lookup_ms{measure(
+      [&map, &lookup_ids] {
+        std::uint64_t sum{};
+        for (const auto id : lookup_ids) {
+          if (const auto it{map.find(id)}; it != map.end()) {
+            sum += it->first;
+          }
+        }
+        return sum;
+      },
+      sums.lookup)};
+  const auto iterate_ms{measure(
+      [&map] {
+        std::uint64_t sum{};
+        for (const auto &[id, value] : map) {
+          sum += id;
+        }
+        return sum;
+      },
+      sums.iterate)};
+  std::println("{:<10} build {:7.3f} ms, update {:7.3f} ms, lookup {:6.2f} "
+               "ns/op, iterate {:7.3f} ms",
+               name, build_ms, update_ms,
+               lookup_ms * 1'000'000 / lookup_ids.size(), iterate_ms);
+  return sums;
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+int main() {
+  using namespace tek::s3;
+  const auto ids{make_ids()};
+  const auto lookup_ids{shuffle(ids)};
+  std::println("{} depots", ids.size());
+  const auto flat_sums{
+      run<flat_map<std::uint32_t, bench_value>>("flat_map", ids, lookup_ids)};
+  const auto map_sums{
+      run<std::map<std::uint32_t, bench_value>>("std::map", ids, lookup_ids)};
+  if (flat_sums != map_sums) {
+    std::println(std::cerr, "Containers disagree on checksums");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
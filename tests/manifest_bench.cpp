@@ -0,0 +1,131 @@
+//===-- manifest_bench.cpp - Manifest serializer benchmark ----------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Benchmark that measures the time of serializing a synthetic state with
+///    100k applications into the JSON manifest, binary manifests and the state
+///    file, and of serializing manifests alone, as done by
+///    @ref tek::s3::update_manifest.
+///
+//===----------------------------------------------------------------------===//
+// Included directly to get access to the serializer
+#include "manifest.cpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <mutex>
+#include <print>
+#include <string>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private constants -------------------------------------------------===//
+
+/// Number of applications in the synthetic state.
+constexpr std::uint32_t bench_num_apps{100'000};
+
+/// Number of times each serialization is run.
+constexpr int bench_iterations{20};
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Fill the state with synthetic applications and depot decryption keys.
+///    Applications have 1 to 4 depots, with keys for most of them, and some
+///    names need escaping.
+static void make_state() {
+  std::uint32_t seed{1};
+  const auto next_rand{[&seed] {
+    seed = seed * 1'664'525 + 1'013'904'223;
+    return seed >> 8;
+  }};
+  state.apps.reserve(bench_num_apps);
+  for (std::uint32_t i{}; i < bench_num_apps; ++i) {
+    const auto app_id{(i + 1) * 10};
+    auto &app{state.apps[app_id]};
+    app.name = std::format("Synthetic application {}", app_id);
+    if (i % 50 == 0) {
+      app.name += " \"Deluxe\"\tEdition \\ \x01";
+    }
+    if (i % 3 == 0) {
+      app.pics_access_token = (std::uint64_t{next_rand()} << 32) | next_rand();
+    }
+    for (std::uint32_t j{}; j <= i % 4; ++j) {
+      const auto depot_id{app_id + 1 + j};
+      app.depots.try_emplace(depot_id);
+      if (i % 8 != 0) {
+        auto &key{state.depot_keys[depot_id]};
+        for (auto &byte : key) {
+          byte = static_cast<unsigned char>(next_rand());
+        }
+      }
+    }
+  }
+  state.timestamp =
+      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+}
+
+/// Run a serialization repeatedly and print its average time and output
+///    size.
+///
+/// @param [in] name
+///    Name of the serialization to print.
+/// @param fn
+///    Function that runs the serialization and returns total output size.
+template <typename Fn> static void run(const char *_Nonnull name, Fn fn) {
+  // Warm up caches and the allocator
+  auto size{fn()};
+  const auto start{std::chrono::steady_clock::now()};
+  for (int i{}; i < bench_iterations; ++i) {
+    size = fn();
+  }
+  const std::chrono::duration<double, std::milli> elapsed{
+      std::chrono::steady_clock::now() - start};
+  std::println("{:<16} {:8.2f} ms/pass, {} bytes", name,
+               elapsed.count() / bench_iterations, size);
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+int main() {
+  using namespace tek::s3;
+  make_state();
+  const std::scoped_lock lock{state.manifest_mtx};
+  std::println("{} apps, {} depot keys", state.apps.size(),
+               state.depot_keys.size());
+  run("manifests", [] {
+    json_fmt<manifest_schema> manifest_json;
+    bmanifest_fmt manifest_bin;
+    bmanifest2_fmt manifest_bin_v2;
+    serialize(manifest_json, manifest_bin, manifest_bin_v2);
+    return manifest_json.release().size + manifest_bin.release().size +
+           manifest_bin_v2.release().size;
+  });
+  run("manifests+state", [] {
+    json_fmt<manifest_schema> manifest_json;
+    bmanifest_fmt manifest_bin;
+    bmanifest2_fmt manifest_bin_v2;
+    json_fmt<state_schema> state_json;
+    serialize(manifest_json, manifest_bin, manifest_bin_v2, state_json);
+    return manifest_json.release().size + manifest_bin.release().size +
+           manifest_bin_v2.release().size + state_json.release().size;
+  });
+  run("state", [] {
+    json_fmt<state_schema> state_json;
+    serialize(state_json);
+    return state_json.release().size;
+  });
+  return EXIT_SUCCESS;
+}
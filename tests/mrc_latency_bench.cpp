@@ -0,0 +1,344 @@
+//===-- mrc_latency_bench.cpp - Mixed-load /mrc latency benchmark ---------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Benchmark that serves a large manifest to concurrent bulk downloaders over
+///    loopback, and measures latency percentiles of cached `/mrc` responses
+///    requested at the same time, with the bulk stream scheduler's budget and
+///    with an unlimited one that lets streams re-arm after every write.
+///    Downloaders reuse their HTTP/1.1 connections, which checks that
+///    connections survive zero-copy streams.
+///
+//===----------------------------------------------------------------------===//
+// Included directly to get access to the bulk stream scheduler
+#include "server.cpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <limits>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <print>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private constants -------------------------------------------------===//
+
+/// Size of the served manifest, in bytes.
+constexpr std::size_t bench_manifest_size{32 * 1024 * 1024};
+
+/// Number of concurrent bulk downloaders.
+constexpr int bench_num_downloaders{16};
+
+/// Number of `/mrc` requests measured per run.
+constexpr int bench_num_probes{2000};
+
+/// Interval between `/mrc` requests.
+constexpr std::chrono::milliseconds bench_probe_interval{1};
+
+/// Time given to downloads to ramp up before measuring.
+constexpr std::chrono::milliseconds bench_warmup{200};
+
+/// ID of the manifest whose request code is cached.
+constexpr std::uint64_t bench_manifest_id{7'000'000'000'000'000'001};
+
+//===-- Private variables -------------------------------------------------===//
+
+/// Value indicating whether the service thread should exit.
+static std::atomic_bool stop_service;
+
+/// Value indicating whether bulk downloaders should exit.
+static std::atomic_bool stop_downloads;
+
+/// Number of manifest downloads completed in the current run.
+static std::atomic_int num_downloads;
+
+/// Number of bulk downloaders whose connection has failed or has been closed
+///    by the server before @ref stop_downloads was set.
+static std::atomic_int num_dropped;
+
+/// Value indicating whether the service loop refills the stream budget to
+///    @ref stream_budget, rather than leaving it unlimited.
+static bool paced;
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Connect to the server over loopback.
+///
+/// @param port
+///    Port number that the server listens on.
+/// @return Socket file descriptor, or `-1` on failure.
+static int connect_server(int port) {
+  const int fd{socket(AF_INET, SOCK_STREAM, 0)};
+  if (fd < 0) {
+    return -1;
+  }
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<std::uint16_t>(port));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr)) {
+    close(fd);
+    return -1;
+  }
+  const int one{1};
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  return fd;
+}
+
+/// Send a request and read the whole response.
+///
+/// @param fd
+///    Socket file descriptor.
+/// @param [in] request
+///    The request to send.
+/// @param [in, out] buf
+///    Receive buffer.
+/// @param [in] stop
+///    Flag that aborts reading the response body once set.
+/// @return Value indicating whether the response has been read completely.
+static bool exchange(int fd, std::string_view request, std::vector<char> &buf,
+                     const std::atomic_bool &stop) {
+  if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) !=
+      static_cast<ssize_t>(request.size())) {
+    return false;
+  }
+  // Read headers
+  std::size_t received{};
+  std::size_t hdr_end;
+  for (;;) {
+    const auto res{recv(fd, &buf[received], buf.size() - received, 0)};
+    if (res <= 0) {
+      return false;
+    }
+    received += res;
+    if (const auto pos{
+            std::string_view{buf.data(), received}.find("\r\n\r\n")};
+        pos != std::string_view::npos) {
+      hdr_end = pos + 4;
+      break;
+    }
+    if (received == buf.size()) {
+      return false;
+    }
+  }
+  std::string headers{buf.data(), hdr_end};
+  std::ranges::transform(headers, headers.begin(), [](unsigned char c) {
+    return static_cast<char>(std::tolower(c));
+  });
+  constexpr std::string_view cl_name{"content-length:"};
+  auto pos{headers.find(cl_name)};
+  if (pos == std::string::npos) {
+    return false;
+  }
+  pos += cl_name.length();
+  while (headers[pos] == ' ') {
+    ++pos;
+  }
+  std::size_t body_size;
+  if (std::from_chars(&headers[pos], headers.data() + headers.size(),
+                      body_size)
+          .ec != std::errc{}) {
+    return false;
+  }
+  // Read the rest of the body
+  auto remaining{body_size - (received - hdr_end)};
+  while (remaining) {
+    if (stop.load(std::memory_order::relaxed)) {
+      return false;
+    }
+    const auto res{recv(fd, buf.data(), std::min(buf.size(), remaining), 0)};
+    if (res <= 0) {
+      return false;
+    }
+    remaining -= res;
+  }
+  return true;
+}
+
+/// Run the libwebsockets service loop like @ref ts3_run does, until
+///    @ref stop_service is set.
+static void serve() {
+  do {
+    // An unlimited budget reproduces streams re-arming after every write
+    streams.budget =
+        paced ? stream_budget : std::numeric_limits<std::size_t>::max();
+  } while (!stop_service.load(std::memory_order::relaxed) &&
+           !lws_service(state.lws_ctx, 0));
+}
+
+/// Download the manifest repeatedly over one connection until
+///    @ref stop_downloads is set. Streams of the manifest are sent with
+///    sendfile, and the connection must stay alive after each of them.
+///
+/// @param port
+///    Port number that the server listens on.
+static void download(int port) {
+  const int fd{connect_server(port)};
+  if (fd < 0) {
+    return;
+  }
+  std::vector<char> buf(256 * 1024);
+  constexpr std::string_view request{
+      "GET /manifest HTTP/1.1\r\nHost: localhost\r\n\r\n"};
+  while (!stop_downloads.load(std::memory_order::relaxed)) {
+    if (!exchange(fd, request, buf, stop_downloads)) {
+      if (!stop_downloads.load(std::memory_order::relaxed)) {
+        num_dropped.fetch_add(1, std::memory_order::relaxed);
+      }
+      break;
+    }
+    num_downloads.fetch_add(1, std::memory_order::relaxed);
+  }
+  close(fd);
+}
+
+/// Measure `/mrc` latency under bulk download load, and print its
+///    percentiles.
+///
+/// @param [in] name
+///    Name of the run to print.
+/// @param port
+///    Port number that the server listens on.
+/// @return Value indicating whether all `/mrc` requests have succeeded, and
+///    no bulk download connection has been dropped.
+static bool run(const char *_Nonnull name, int port) {
+  stop_service.store(false, std::memory_order::relaxed);
+  stop_downloads.store(false, std::memory_order::relaxed);
+  num_downloads.store(0, std::memory_order::relaxed);
+  num_dropped.store(0, std::memory_order::relaxed);
+  std::thread service{serve};
+  std::vector<std::thread> downloaders;
+  downloaders.reserve(bench_num_downloaders);
+  for (int i{}; i < bench_num_downloaders; ++i) {
+    downloaders.emplace_back(download, port);
+  }
+  std::this_thread::sleep_for(bench_warmup);
+  bool success{};
+  std::vector<double> latencies;
+  latencies.reserve(bench_num_probes);
+  if (const int fd{connect_server(port)}; fd >= 0) {
+    const auto request{std::format(
+        "GET /mrc?app_id=1&depot_id=2&manifest_id={} HTTP/1.1\r\n"
+        "Host: localhost\r\n\r\n",
+        bench_manifest_id)};
+    std::vector<char> buf(4096);
+    const std::atomic_bool never_stop;
+    success = true;
+    for (int i{}; i < bench_num_probes; ++i) {
+      const auto start{std::chrono::steady_clock::now()};
+      if (!exchange(fd, request, buf, never_stop)) {
+        success = false;
+        break;
+      }
+      latencies.emplace_back(std::chrono::duration<double, std::micro>{
+          std::chrono::steady_clock::now() - start}
+                                 .count());
+      std::this_thread::sleep_for(bench_probe_interval);
+    }
+    close(fd);
+  }
+  stop_downloads.store(true, std::memory_order::relaxed);
+  for (auto &thread : downloaders) {
+    thread.join();
+  }
+  // Let the server process closures before the next run
+  std::this_thread::sleep_for(bench_warmup);
+  stop_service.store(true, std::memory_order::relaxed);
+  lws_cancel_service(state.lws_ctx);
+  service.join();
+  if (!success) {
+    std::println(std::cerr, "{}: /mrc request failed", name);
+    return false;
+  }
+  std::ranges::sort(latencies);
+  std::println("{:<10} /mrc p50 {:8.1f} us, p99 {:8.1f} us, max {:8.1f} us, "
+               "{} manifests downloaded",
+               name, latencies[latencies.size() / 2],
+               latencies[latencies.size() * 99 / 100], latencies.back(),
+               num_downloads.load(std::memory_order::relaxed));
+  if (const auto dropped{num_dropped.load(std::memory_order::relaxed)};
+      dropped) {
+    std::println(std::cerr, "{}: {} download connections dropped", name,
+                 dropped);
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+int main() {
+  using namespace tek::s3;
+  std::signal(SIGPIPE, SIG_IGN);
+  // Incompressible manifest, sealed like published ones so that streams take
+  //    the zero-copy path
+  auto manifest{sized_buf::alloc(bench_manifest_size)};
+  std::uint32_t seed{1};
+  for (std::size_t i{}; i < manifest.size; ++i) {
+    seed = seed * 1'664'525 + 1'013'904'223;
+    manifest.buf[i] = static_cast<unsigned char>(seed >> 24);
+  }
+  manifest.seal();
+  state.manifest = http_buf{std::move(manifest), false};
+  state.timestamp =
+      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  state.cur_status.store(status::running, std::memory_order::relaxed);
+  lws_set_log_level(LLL_ERR, nullptr);
+  lws_context_creation_info info{};
+  info.iface = "127.0.0.1";
+  // Let the OS pick a free port
+  info.port = 0;
+  info.timeout_secs = 10;
+  const lws_protocols *pprotocols[]{&protocol, nullptr};
+  info.pprotocols = pprotocols;
+  state.lws_ctx = lws_create_context(&info);
+  if (!state.lws_ctx) {
+    std::println(std::cerr, "lws_create_context failed");
+    return EXIT_FAILURE;
+  }
+  const int port{lws_get_vhost_listen_port(
+      lws_get_vhost_by_name(state.lws_ctx, "default"))};
+  if (port <= 0) {
+    std::println(std::cerr, "Failed to get listening port");
+    lws_context_destroy(std::exchange(state.lws_ctx, nullptr));
+    return EXIT_FAILURE;
+  }
+  mrc_cache_put(bench_manifest_id, 1, state.timestamp + 24 * 60 * 60);
+  std::println("{} downloaders of a {} MiB manifest, {} /mrc requests",
+               bench_num_downloaders, bench_manifest_size / (1024 * 1024),
+               bench_num_probes);
+  paced = false;
+  bool success{run("unpaced", port)};
+  paced = true;
+  success = run("paced", port) && success;
+  lws_context_destroy(std::exchange(state.lws_ctx, nullptr));
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,354 @@
+//===-- peer_cluster.cpp - Two-node peer replication test -----------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Test that runs two nodes sharing a peer secret over loopback, one in this
+///    process and one in a forked child, and checks that they exchange depot
+///    keys and ownership, that `/mrc` requests for a depot owned only by the
+///    other node are forwarded to it and answered with its cached code, and
+///    that an account is handed over to the node with the higher rendezvous
+///    hash score for it while the other accounts stay put. CM clients are
+///    replaced with fakes that only record connection requests.
+///
+//===----------------------------------------------------------------------===//
+#include "peer_fixture.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <print>
+#include <string>
+#include <string_view>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private constants -------------------------------------------------===//
+
+/// Peer secret shared by the nodes.
+constexpr std::string_view test_secret{"peer-cluster-test-secret"};
+
+/// ID of the node running in this process.
+constexpr std::string_view test_local_id{"node-a"};
+
+/// ID of the node running in the child process.
+constexpr std::string_view test_remote_id{"node-b"};
+
+/// App and depot IDs owned by the local node.
+constexpr std::uint32_t test_local_app{10}, test_local_depot{11};
+
+/// App and depot IDs owned by the remote node.
+constexpr std::uint32_t test_remote_app{20}, test_remote_depot{21};
+
+/// ID of the manifest whose request code is cached by the remote node.
+constexpr std::uint64_t test_manifest_id{7'000'000'000'000'000'001};
+
+/// Manifest request code cached by the remote node.
+constexpr std::uint64_t test_mrc{1'234'567'890'123'456'789};
+
+//===-- Private variables -------------------------------------------------===//
+
+/// Number of failed checks.
+static int failures;
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Record a failed check.
+///
+/// @param [in] what
+///    Description of the check.
+/// @param [in] node
+///    ID of the node that has failed the check.
+static void fail(const char *_Nonnull what, std::string_view node) {
+  std::println(std::cerr, "{} ({})", what, node);
+  ++failures;
+}
+
+/// Make a depot key whose bytes are derived from the depot ID.
+///
+/// @param depot_id
+///    ID of the depot.
+/// @return The key.
+static depot_key make_key(std::uint32_t depot_id) {
+  depot_key key;
+  for (std::size_t i{}; i < key.size(); ++i) {
+    key[i] = static_cast<unsigned char>(depot_id * 31 + i);
+  }
+  return key;
+}
+
+/// Find a Steam ID that a node has a higher rendezvous hash score for than
+///    the other node.
+///
+/// @param [in] winner
+///    ID of the node that must have the higher score.
+/// @param [in] loser
+///    ID of the other node.
+/// @param first
+///    Steam ID to start searching from.
+/// @return The Steam ID.
+static std::uint64_t find_steam_id(std::string_view winner,
+                                   std::string_view loser,
+                                   std::uint64_t first) {
+  auto steam_id{first};
+  while (hrw_score(winner, steam_id) <= hrw_score(loser, steam_id)) {
+    ++steam_id;
+  }
+  return steam_id;
+}
+
+/// Add a local account that is ready to serve, optionally owning a depot.
+///    Must be called with @ref ts3_state::manifest_mtx locked.
+///
+/// @param steam_id
+///    Steam ID of the account.
+/// @param app_id
+///    ID of the application owning the depot.
+/// @param depot_id
+///    ID of the depot owned by the account, `0` if none.
+static void add_account(std::uint64_t steam_id, std::uint32_t app_id,
+                        std::uint32_t depot_id) {
+  const auto expires{std::chrono::system_clock::to_time_t(
+                         std::chrono::system_clock::now()) +
+                     24 * 60 * 60};
+  auto token{std::format("{}:{}", steam_id, expires)};
+  const auto token_info{fake_cm_parse_auth_token(token.data())};
+  const auto cm_client{fake_cm_client_create(nullptr, nullptr)};
+  auto &acc{state.accounts
+                .try_emplace(steam_id, lws_sorted_usec_list_t{}, cm_client,
+                             std::move(token), token_info,
+                             renew_status::not_scheduled,
+                             remove_status::none, true, 0,
+                             std::shared_ptr<cancel_token>{})
+                .first->second};
+  assign_acc_index(acc);
+  fake_cm_set_user_data(cm_client, &acc);
+  ++state.num_ready_accs;
+  if (!depot_id) {
+    return;
+  }
+  auto &app{state.apps[app_id]};
+  app.name = std::format("Test app {}", app_id);
+  app.depots[depot_id].accs.set(acc.index);
+  acc.depots.emplace_back(app_id, depot_id);
+  state.depot_keys[depot_id] = make_key(depot_id);
+}
+
+/// Handler for `SIGTERM` in the child process, stopping the node like
+///    tek-s3 does.
+static void handle_sigterm(int) { ts3_stop(); }
+
+/// Run the remote node until `SIGTERM`, then check that it has received
+///    depot keys and ownership of the local node, and that it has taken over
+///    the account handed over to it.
+///
+/// @param port_fd
+///    Write end of the pipe to send the listening port number to.
+/// @param [in] state_dir
+///    Directory to write the state file into.
+/// @param handed_id
+///    Steam ID of the account that the local node hands over.
+/// @param kept_id
+///    Steam ID of the account that this node keeps.
+/// @return Exit code for the child process.
+static int run_remote(int port_fd, const std::filesystem::path &state_dir,
+                      std::uint64_t handed_id, std::uint64_t kept_id) {
+  state.shard_accounts = true;
+  const int port{start_node(test_remote_id, test_secret, state_dir, [kept_id] {
+    add_account(kept_id, test_remote_app, test_remote_depot);
+    mrc_cache_put(test_manifest_id, test_mrc,
+                  std::chrono::system_clock::to_time_t(
+                      std::chrono::system_clock::now()) +
+                      60 * 60);
+  })};
+  const bool port_sent{write(port_fd, &port, sizeof port) == sizeof port};
+  close(port_fd);
+  if (port < 0 || !port_sent) {
+    return EXIT_FAILURE;
+  }
+  std::signal(SIGTERM, handle_sigterm);
+  ts3_run();
+  // Closed sessions have cleared ownership bits of the local node, but
+  //    nothing is pruned while stopping, so depots learned from it are still
+  //    there
+  const auto app{state.apps.find(test_local_app)};
+  if (app == state.apps.end() ||
+      !app->second.depots.contains(test_local_depot)) {
+    fail("Depot owned by the peer not received", test_remote_id);
+  }
+  if (const auto key{state.depot_keys.find(test_local_depot)};
+      key == state.depot_keys.end() ||
+      key->second != make_key(test_local_depot)) {
+    fail("Depot key of the peer not received", test_remote_id);
+  }
+  if (const auto acc{state.accounts.find(handed_id)};
+      acc == state.accounts.end()) {
+    fail("Handed over account not taken over", test_remote_id);
+  } else if (!from(acc->second.cm_client)
+                  .connected.load(std::memory_order::relaxed)) {
+    fail("Taken over account not connected", test_remote_id);
+  }
+  if (const auto acc{state.accounts.find(kept_id)};
+      acc == state.accounts.end() ||
+      acc->second.rem_status.load(std::memory_order::relaxed) !=
+          remove_status::none) {
+    fail("Account with the higher score handed over", test_remote_id);
+  }
+  std::fflush(stdout);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+int main() {
+  using namespace tek::s3;
+  std::signal(SIGPIPE, SIG_IGN);
+  // Accounts are picked so that exactly one of them should change its node
+  constexpr std::uint64_t first_steam_id{76'561'198'000'000'000};
+  const auto handed_id{
+      find_steam_id(test_remote_id, test_local_id, first_steam_id)};
+  const auto remote_kept_id{
+      find_steam_id(test_remote_id, test_local_id, handed_id + 1)};
+  const auto local_kept_id{
+      find_steam_id(test_local_id, test_remote_id, first_steam_id)};
+  std::string dir_template{
+      (std::filesystem::temp_directory_path() / "tek-s3-test-XXXXXX")
+          .string()};
+  if (!mkdtemp(dir_template.data())) {
+    std::println(std::cerr, "mkdtemp failed");
+    return EXIT_FAILURE;
+  }
+  const std::filesystem::path dir{dir_template};
+  int port_pipe[2];
+  if (pipe(port_pipe)) {
+    std::println(std::cerr, "pipe failed");
+    std::filesystem::remove_all(dir);
+    return EXIT_FAILURE;
+  }
+  std::fflush(stdout);
+  // The remote node is forked before any threads are started
+  const auto remote_pid{fork()};
+  if (!remote_pid) {
+    close(port_pipe[0]);
+    std::_Exit(
+        run_remote(port_pipe[1], dir / "remote", handed_id, remote_kept_id));
+  }
+  close(port_pipe[1]);
+  int remote_port{-1};
+  if (remote_pid < 0 ||
+      read(port_pipe[0], &remote_port, sizeof remote_port) !=
+          sizeof remote_port ||
+      remote_port <= 0) {
+    std::println(std::cerr, "Remote node failed to start");
+    close(port_pipe[0]);
+    if (remote_pid > 0) {
+      waitpid(remote_pid, nullptr, 0);
+    }
+    std::filesystem::remove_all(dir);
+    return EXIT_FAILURE;
+  }
+  close(port_pipe[0]);
+  state.peers.emplace_back("127.0.0.1", remote_port, false);
+  state.shard_accounts = true;
+  const int port{start_node(test_local_id, test_secret, dir / "local", [=] {
+    add_account(handed_id, 0, 0);
+    add_account(local_kept_id, test_local_app, test_local_depot);
+  })};
+  std::thread service;
+  if (port > 0) {
+    peer_connect();
+    service = std::thread{ts3_run};
+    // process_sync
+    if (!wait_for([] {
+          const auto app{state.apps.find(test_remote_app)};
+          if (app == state.apps.end()) {
+            return false;
+          }
+          const auto depot{app->second.depots.find(test_remote_depot)};
+          return depot != app->second.depots.end() && depot->second.peers &&
+                 depot->second.accs.empty();
+        })) {
+      fail("Depot owned by the peer not received", test_local_id);
+    }
+    if (!wait_for([] {
+          const auto key{state.depot_keys.find(test_remote_depot)};
+          return key != state.depot_keys.end() &&
+                 key->second == make_key(test_remote_depot);
+        })) {
+      fail("Depot key of the peer not received", test_local_id);
+    }
+    // process_mrc on the remote node and process_mrc_res on this one
+    const auto response{http_get(
+        port, std::format("/mrc?app_id={}&depot_id={}&manifest_id={}",
+                          test_remote_app, test_remote_depot,
+                          test_manifest_id))};
+    const auto body_pos{response.find("\r\n\r\n")};
+    if (!is_ok(response)) {
+      fail("Forwarded /mrc request failed", test_local_id);
+    } else if (body_pos == std::string::npos ||
+               std::string_view{response}.substr(body_pos + 4) !=
+                   std::to_string(test_mrc)) {
+      fail("Forwarded /mrc request returned a wrong code", test_local_id);
+    }
+    // process_account on the remote node and process_account_res on this one
+    if (!wait_for([handed_id] {
+          const auto acc{state.accounts.find(handed_id)};
+          return acc != state.accounts.end() &&
+                 acc->second.rem_status.load(std::memory_order::relaxed) ==
+                     remove_status::pending_remove &&
+                 from(acc->second.cm_client)
+                     .disconnected.load(std::memory_order::relaxed);
+        })) {
+      fail("Account not handed over", test_local_id);
+    }
+    {
+      const std::scoped_lock lock{state.manifest_mtx};
+      if (const auto acc{state.accounts.find(local_kept_id)};
+          acc == state.accounts.end() ||
+          acc->second.rem_status.load(std::memory_order::relaxed) !=
+              remove_status::none) {
+        fail("Account with the higher score handed over", test_local_id);
+      }
+    }
+  } else {
+    ++failures;
+  }
+  kill(remote_pid, SIGTERM);
+  int status;
+  if (waitpid(remote_pid, &status, 0) != remote_pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != EXIT_SUCCESS) {
+    std::println(std::cerr, "Remote node has failed");
+    ++failures;
+  }
+  if (service.joinable()) {
+    ts3_stop();
+    service.join();
+  } else if (state.lws_ctx) {
+    lws_context_destroy(std::exchange(state.lws_ctx, nullptr));
+  }
+  std::filesystem::remove_all(dir);
+  std::println("Handed over account {}, kept accounts {} and {}", handed_id,
+               local_kept_id, remote_kept_id);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
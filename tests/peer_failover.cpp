@@ -0,0 +1,450 @@
+//===-- peer_failover.cpp - Hot standby failover test ---------------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Test that runs a primary node in a forked child and its hot standby in
+///    this process over loopback, checks that the standby mirrors the
+///    primary's accounts without connecting them, then kills the primary and
+///    checks that the standby promotes itself after the failover timeout:
+///    it connects the mirrored accounts, keeps the primary's depots, and
+///    serves manifest request codes mirrored from the primary. Finally, it
+///    completes setup while a manifest download is in flight, and checks that
+///    the manifest update is deferred until the download ends. CM clients are
+///    replaced with fakes that only record connection requests.
+///
+//===----------------------------------------------------------------------===//
+#include "peer_fixture.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <print>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private constants -------------------------------------------------===//
+
+/// Peer secret shared by the nodes.
+constexpr std::string_view test_secret{"peer-failover-test-secret"};
+
+/// ID of the primary node running in the child process.
+constexpr std::string_view test_primary_id{"node-p"};
+
+/// ID of the standby node running in this process.
+constexpr std::string_view test_standby_id{"node-s"};
+
+/// App and depot IDs owned by the primary.
+constexpr std::uint32_t test_app{30}, test_depot{31};
+
+/// Steam IDs of the primary's accounts, the first one owns the depot.
+constexpr std::array<std::uint64_t, 2> test_steam_ids{76'561'198'000'000'001,
+                                                      76'561'198'000'000'002};
+
+/// ID of the manifest whose request code is cached by the primary.
+constexpr std::uint64_t test_manifest_id{7'000'000'000'000'000'001};
+
+/// Manifest request code cached by the primary.
+constexpr std::uint64_t test_mrc{1'234'567'890'123'456'789};
+
+/// Time that the standby waits for the primary to reconnect. Long enough for
+///    the initial connection over loopback to be established before it.
+constexpr lws_usec_t test_failover_timeout{2 * LWS_US_PER_SEC};
+
+/// Length of the app name that makes the manifest large enough for its
+///    download to stay in flight while the client doesn't read it.
+constexpr std::size_t test_filler_size{16 * 1024 * 1024};
+
+//===-- Private variables -------------------------------------------------===//
+
+/// Number of failed checks.
+static int failures;
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Record a failed check.
+///
+/// @param [in] what
+///    Description of the check.
+static void fail(const char *_Nonnull what) {
+  std::println(std::cerr, "{}", what);
+  ++failures;
+}
+
+/// Add a local account that is ready to serve, optionally owning the test
+///    depot. Must be called with @ref ts3_state::manifest_mtx locked.
+///
+/// @param steam_id
+///    Steam ID of the account.
+/// @param owns_depot
+///    Value indicating whether the account owns the test depot.
+static void add_account(std::uint64_t steam_id, bool owns_depot) {
+  const auto expires{std::chrono::system_clock::to_time_t(
+                         std::chrono::system_clock::now()) +
+                     24 * 60 * 60};
+  auto token{std::format("{}:{}", steam_id, expires)};
+  const auto token_info{fake_cm_parse_auth_token(token.data())};
+  const auto cm_client{fake_cm_client_create(nullptr, nullptr)};
+  auto &acc{state.accounts
+                .try_emplace(steam_id, lws_sorted_usec_list_t{}, cm_client,
+                             std::move(token), token_info,
+                             renew_status::not_scheduled,
+                             remove_status::none, true, 0,
+                             std::shared_ptr<cancel_token>{})
+                .first->second};
+  assign_acc_index(acc);
+  fake_cm_set_user_data(cm_client, &acc);
+  ++state.num_ready_accs;
+  if (!owns_depot) {
+    return;
+  }
+  auto &app{state.apps[test_app]};
+  app.name = std::format("Test app {}", test_app);
+  app.depots[test_depot].accs.set(acc.index);
+  acc.depots.emplace_back(test_app, test_depot);
+  auto &key{state.depot_keys[test_depot]};
+  for (std::size_t i{}; i < key.size(); ++i) {
+    key[i] = static_cast<unsigned char>(i);
+  }
+}
+
+/// Check whether all of the primary's accounts are present locally with
+///    their CM clients in the specified connection state. Must be called with
+///    @ref ts3_state::manifest_mtx locked.
+///
+/// @param connected
+///    Expected connection state of the CM clients.
+/// @return Value indicating whether the accounts match.
+static bool accounts_match(bool connected) {
+  for (const auto steam_id : test_steam_ids) {
+    const auto it{state.accounts.find(steam_id)};
+    if (it == state.accounts.end() ||
+        from(it->second.cm_client)
+                .connected.load(std::memory_order::relaxed) != connected) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Start a download from a node over loopback with a small receive buffer,
+///    and read only its headers, so that the rest of the response stays
+///    unsent until @ref finish_download.
+///
+/// @param port
+///    Port number that the node listens on.
+/// @param [in] path
+///    Path and query of the request.
+/// @param [out] response
+///    Variable that receives the part of the response read so far.
+/// @return Socket of the download, or `-1` on failure.
+static int start_download(int port, std::string_view path,
+                          std::string &response) {
+  const int fd{socket(AF_INET, SOCK_STREAM, 0)};
+  if (fd < 0) {
+    return -1;
+  }
+  const timeval timeout{.tv_sec = test_timeout.count(), .tv_usec = 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  // Must be set before connecting to limit the advertised window
+  const int rcvbuf{4096};
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<std::uint16_t>(port));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const auto request{
+      std::format("GET {} HTTP/1.0\r\nHost: localhost\r\n\r\n", path)};
+  if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr) ||
+      send(fd, request.data(), request.size(), MSG_NOSIGNAL) !=
+          static_cast<ssize_t>(request.size())) {
+    close(fd);
+    return -1;
+  }
+  response.clear();
+  std::array<char, 1024> buf;
+  while (!response.contains("\r\n\r\n")) {
+    const auto res{recv(fd, buf.data(), buf.size(), 0)};
+    if (res <= 0) {
+      close(fd);
+      return -1;
+    }
+    response.append(buf.data(), res);
+  }
+  return fd;
+}
+
+/// Read the rest of a download started by @ref start_download and close its
+///    socket.
+///
+/// @param fd
+///    Socket of the download.
+/// @param [in, out] response
+///    Variable that holds the part of the response read so far, and receives
+///    the whole response. Cleared on failure.
+static void finish_download(int fd, std::string &response) {
+  std::array<char, 65536> buf;
+  for (;;) {
+    const auto res{recv(fd, buf.data(), buf.size(), 0)};
+    if (res < 0) {
+      response.clear();
+      break;
+    }
+    if (!res) {
+      break;
+    }
+    response.append(buf.data(), res);
+  }
+  close(fd);
+}
+
+/// Check whether the body of an HTTP response is as long as its
+///    Content-Length header says.
+///
+/// @param [in] response
+///    The response.
+/// @return Value indicating whether the body is complete.
+static bool is_complete(std::string_view response) {
+  const auto body_pos{response.find("\r\n\r\n")};
+  if (body_pos == std::string_view::npos) {
+    return false;
+  }
+  std::string headers{response.substr(0, body_pos)};
+  std::ranges::transform(headers, headers.begin(), [](unsigned char c) {
+    return static_cast<char>(std::tolower(c));
+  });
+  constexpr std::string_view name{"\r\ncontent-length: "};
+  const auto pos{headers.find(name)};
+  std::size_t len;
+  return pos != std::string::npos &&
+         std::from_chars(&headers[pos + name.length()],
+                         headers.data() + headers.size(), len)
+                 .ec == std::errc{} &&
+         response.size() - body_pos - 4 == len;
+}
+
+/// Run the primary node until it's killed.
+///
+/// @param port_fd
+///    Write end of the pipe to send the listening port number to.
+/// @param [in] state_dir
+///    Directory to write the state file into.
+/// @return Exit code for the child process.
+static int run_primary(int port_fd, const std::filesystem::path &state_dir) {
+  state.standbys.emplace_back(test_standby_id);
+  const int port{start_node(test_primary_id, test_secret, state_dir, [] {
+    add_account(test_steam_ids[0], true);
+    add_account(test_steam_ids[1], false);
+    mrc_cache_put(test_manifest_id, test_mrc,
+                  std::chrono::system_clock::to_time_t(
+                      std::chrono::system_clock::now()) +
+                      60 * 60);
+  })};
+  const bool port_sent{write(port_fd, &port, sizeof port) == sizeof port};
+  close(port_fd);
+  if (port < 0 || !port_sent) {
+    return EXIT_FAILURE;
+  }
+  ts3_run();
+  return EXIT_SUCCESS;
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+int main() {
+  using namespace tek::s3;
+  std::signal(SIGPIPE, SIG_IGN);
+  std::string dir_template{
+      (std::filesystem::temp_directory_path() / "tek-s3-test-XXXXXX")
+          .string()};
+  if (!mkdtemp(dir_template.data())) {
+    std::println(std::cerr, "mkdtemp failed");
+    return EXIT_FAILURE;
+  }
+  const std::filesystem::path dir{dir_template};
+  int port_pipe[2];
+  if (pipe(port_pipe)) {
+    std::println(std::cerr, "pipe failed");
+    std::filesystem::remove_all(dir);
+    return EXIT_FAILURE;
+  }
+  std::fflush(stdout);
+  // The primary is forked before any threads are started
+  const auto primary_pid{fork()};
+  if (!primary_pid) {
+    close(port_pipe[0]);
+    std::_Exit(run_primary(port_pipe[1], dir / "primary"));
+  }
+  close(port_pipe[1]);
+  int primary_port{-1};
+  if (primary_pid < 0 ||
+      read(port_pipe[0], &primary_port, sizeof primary_port) !=
+          sizeof primary_port ||
+      primary_port <= 0) {
+    std::println(std::cerr, "Primary failed to start");
+    close(port_pipe[0]);
+    if (primary_pid > 0) {
+      kill(primary_pid, SIGKILL);
+      waitpid(primary_pid, nullptr, 0);
+    }
+    std::filesystem::remove_all(dir);
+    return EXIT_FAILURE;
+  }
+  close(port_pipe[0]);
+  state.peers.emplace_back("127.0.0.1", primary_port, false);
+  state.standby = true;
+  state.failover_timeout = test_failover_timeout;
+  const int port{
+      start_node(test_standby_id, test_secret, dir / "standby", [] {})};
+  std::thread service;
+  bool primary_reaped{};
+  if (port > 0) {
+    peer_connect();
+    service = std::thread{ts3_run};
+    // process_state and mirror_accounts
+    if (!wait_for([] { return accounts_match(false); })) {
+      fail("Accounts of the primary not mirrored, or connected while standby");
+    }
+    if (!wait_for([] {
+          const auto app{state.apps.find(test_app)};
+          return app != state.apps.end() &&
+                 app->second.depots.contains(test_depot);
+        })) {
+      fail("Depot owned by the primary not received");
+    }
+    kill(primary_pid, SIGKILL);
+    waitpid(primary_pid, nullptr, 0);
+    primary_reaped = true;
+    // promote and connect_next
+    if (!wait_for([] {
+          return state.hot_manifest &&
+                 state.cur_status.load(std::memory_order::relaxed) ==
+                     status::setup &&
+                 accounts_match(true);
+        })) {
+      fail("Standby not promoted, or mirrored accounts not connected");
+    }
+    {
+      const std::scoped_lock lock{state.manifest_mtx};
+      const auto app{state.apps.find(test_app)};
+      if (app == state.apps.end() ||
+          !app->second.depots.contains(test_depot)) {
+        fail("Depot owned by the primary dropped on promotion");
+      }
+    }
+    // The primary is gone, so the code may only come from the mirrored cache
+    const auto response{http_get(
+        port, std::format("/mrc?app_id={}&depot_id={}&manifest_id={}",
+                          test_app, test_depot, test_manifest_id))};
+    const auto body_pos{response.find("\r\n\r\n")};
+    if (!is_ok(response)) {
+      fail("/mrc request to the promoted standby failed");
+    } else if (body_pos == std::string::npos ||
+               std::string_view{response}.substr(body_pos + 4) !=
+                   std::to_string(test_mrc)) {
+      fail("Promoted standby returned a wrong code");
+    }
+    if (!is_ok(http_get(port, "/manifest"))) {
+      fail("Promoted standby doesn't serve its manifest while connecting "
+           "accounts");
+    }
+    // Complete setup by removing the last pending account while a download
+    //    of the manifest is in flight, the manifest must not be replaced
+    //    under it
+    {
+      const std::scoped_lock lock{state.manifest_mtx};
+      state.apps[test_app].name.assign(test_filler_size, 'x');
+      state.manifest_dirty = true;
+      update_manifest();
+    }
+    std::string download;
+    if (const int fd{start_download(port, "/manifest", download)}; fd < 0) {
+      fail("Failed to start a manifest download from the promoted standby");
+    } else {
+      tek_sc_cm_client *removed_client;
+      {
+        const std::scoped_lock lock{state.manifest_mtx};
+        auto &ready{state.accounts.at(test_steam_ids[0])};
+        ready.ready = true;
+        ++state.num_ready_accs;
+        auto &removed{state.accounts.at(test_steam_ids[1])};
+        removed_client = removed.cm_client;
+        removed.rem_status.store(remove_status::pending_remove,
+                                 std::memory_order::relaxed);
+        state.state_dirty = true;
+        post_event({.type = event_type::remove_account, .acc = &removed});
+      }
+      if (!wait_for([] {
+            return state.cur_status.load(std::memory_order::relaxed) ==
+                       status::running &&
+                   !state.accounts.contains(test_steam_ids[1]);
+          })) {
+        fail("Setup not completed after removing the last pending account");
+      }
+      fake_cm_client_destroy(removed_client);
+      {
+        const std::scoped_lock lock{state.manifest_mtx};
+        if (!state.state_dirty) {
+          fail("Manifest updated while a download was streaming it");
+        }
+      }
+      finish_download(fd, download);
+      if (!is_ok(download) || !is_complete(download) ||
+          !download.contains(std::string(test_filler_size, 'x'))) {
+        fail("Manifest download corrupted by setup completion");
+      }
+      // retry_update
+      if (!wait_for([] { return !state.state_dirty; })) {
+        fail("Deferred manifest update not retried after the download");
+      }
+    }
+  } else {
+    ++failures;
+  }
+  if (!primary_reaped) {
+    kill(primary_pid, SIGKILL);
+    waitpid(primary_pid, nullptr, 0);
+  }
+  if (service.joinable()) {
+    ts3_stop();
+    service.join();
+    if (state.standby) {
+      fail("Standby flag not cleared on promotion");
+    }
+  } else if (state.lws_ctx) {
+    lws_context_destroy(std::exchange(state.lws_ctx, nullptr));
+  }
+  std::filesystem::remove_all(dir);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,301 @@
+//===-- peer_fixture.hpp - Shared fixture of peer replication tests ------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Fixture shared by tests that run tek-s3 nodes talking over `/peer`
+///    sessions on loopback. It includes peer.cpp with CM client functions
+///    substituted by fakes that only record connection and disconnection
+///    requests, and provides functions for starting a node in the current
+///    process, waiting for state changes and sending HTTP requests to a node.
+///    Must be included by exactly one source file of a test executable.
+///
+//===----------------------------------------------------------------------===//
+#pragma once
+
+#include "cm_callbacks.hpp"
+#include "impl.h"
+#include "mrc.hpp"
+#include "peer.hpp"
+#include "state.hpp"
+#include "utils.h"
+#include "worker.hpp"
+
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <libwebsockets.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <print>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <tek-steamclient/cm.h>
+#include <thread>
+#include <unistd.h>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Fixture types -----------------------------------------------------===//
+
+/// Fake CM client that records connection requests instead of connecting.
+struct fake_client {
+  /// Pointer to the associated @ref account object.
+  void *_Nullable user_data;
+  /// Value indicating whether connection has been requested.
+  std::atomic_bool connected;
+  /// Value indicating whether disconnection has been requested.
+  std::atomic_bool disconnected;
+};
+
+//===-- Fake CM client functions ------------------------------------------===//
+
+/// Parse a fake authentication token in `<steam_id>:<expires>` format.
+///
+/// @param [in] token
+///    The token to parse.
+/// @return Parsed token information, with zero Steam ID if the token is
+///    malformed.
+static tek_sc_cm_auth_token_info
+fake_cm_parse_auth_token(const char *_Nonnull token) {
+  tek_sc_cm_auth_token_info info{};
+  const std::string_view view{token};
+  const auto sep{view.find(':')};
+  std::int64_t expires;
+  if (sep == std::string_view::npos ||
+      std::from_chars(view.data(), &view[sep], info.steam_id).ec !=
+          std::errc{} ||
+      std::from_chars(&view[sep + 1], view.data() + view.size(), expires)
+              .ec != std::errc{}) {
+    return {};
+  }
+  info.expires = static_cast<decltype(info.expires)>(expires);
+  return info;
+}
+
+/// Create a fake CM client.
+///
+/// @return Pointer to the created client.
+static tek_sc_cm_client *_Nullable fake_cm_client_create(auto, auto) {
+  return reinterpret_cast<tek_sc_cm_client *>(
+      new fake_client{.user_data = nullptr,
+                      .connected = false,
+                      .disconnected = false});
+}
+
+/// Get the fake client behind a CM client pointer.
+///
+/// @param [in] client
+///    Pointer to the CM client instance.
+/// @return The fake client.
+static fake_client &from(tek_sc_cm_client *_Nonnull client) {
+  return *reinterpret_cast<fake_client *>(client);
+}
+
+/// Destroy a fake CM client.
+///
+/// @param [in] client
+///    Pointer to the CM client instance.
+static void fake_cm_client_destroy(tek_sc_cm_client *_Nonnull client) {
+  delete &from(client);
+}
+
+/// Set user data pointer of a fake CM client.
+///
+/// @param [in, out] client
+///    Pointer to the CM client instance.
+/// @param [in] data
+///    Pointer to the associated @ref account object.
+static void fake_cm_set_user_data(tek_sc_cm_client *_Nonnull client,
+                                  void *_Nullable data) {
+  from(client).user_data = data;
+}
+
+/// Record a connection request of a fake CM client.
+///
+/// @param [in, out] client
+///    Pointer to the CM client instance.
+static void fake_cm_connect(tek_sc_cm_client *_Nonnull client, auto, auto,
+                            auto) {
+  from(client).connected.store(true, std::memory_order::relaxed);
+}
+
+/// Record a disconnection request of a fake CM client.
+///
+/// @param [in, out] client
+///    Pointer to the CM client instance.
+static void fake_cm_disconnect(tek_sc_cm_client *_Nonnull client) {
+  from(client).disconnected.store(true, std::memory_order::relaxed);
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+// Included directly with CM client functions substituted by the fakes, the
+//    headers above are already included with the real declarations
+#define tek_sc_cm_parse_auth_token fake_cm_parse_auth_token
+#define tek_sc_cm_client_create fake_cm_client_create
+#define tek_sc_cm_client_destroy fake_cm_client_destroy
+#define tek_sc_cm_set_user_data fake_cm_set_user_data
+#define tek_sc_cm_connect fake_cm_connect
+#define tek_sc_cm_disconnect fake_cm_disconnect
+#include "peer.cpp"
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Fixture constants -------------------------------------------------===//
+
+/// Time to wait for each expected change.
+constexpr std::chrono::seconds test_timeout{10};
+
+//===-- Fixture functions -------------------------------------------------===//
+
+/// Set up this process as a running node and create its libwebsockets
+///    context, like @ref ts3_init does after loading accounts.
+///
+/// @param [in] node_id
+///    ID of the node.
+/// @param [in] secret
+///    Peer secret shared by the nodes.
+/// @param [in] state_dir
+///    Directory to write the state file into.
+/// @param [in] setup
+///    Function that adds accounts and cached codes of the node, called with
+///    @ref ts3_state::manifest_mtx locked after the context is created.
+/// @return Port number that the node listens on, or `-1` on failure.
+template <typename Setup>
+static int start_node(std::string_view node_id, std::string_view secret,
+                      const std::filesystem::path &state_dir, Setup setup) {
+  std::filesystem::create_directories(state_dir);
+  setenv("XDG_STATE_HOME", state_dir.c_str(), 1);
+  state.node_id = node_id;
+  state.peer_secret = secret;
+  lws_set_log_level(LLL_ERR, nullptr);
+  lws_context_creation_info info{};
+  info.iface = "127.0.0.1";
+  // Let the OS pick a free port
+  info.port = 0;
+  info.timeout_secs = 10;
+  const lws_protocols *pprotocols[]{&protocol, nullptr};
+  info.pprotocols = pprotocols;
+  state.lws_ctx = lws_create_context(&info);
+  if (!state.lws_ctx) {
+    std::println(std::cerr, "lws_create_context failed");
+    return -1;
+  }
+  const int port{lws_get_vhost_listen_port(
+      lws_get_vhost_by_name(state.lws_ctx, "default"))};
+  if (port <= 0) {
+    std::println(std::cerr, "Failed to get listening port");
+    return -1;
+  }
+  worker_start();
+  const std::scoped_lock lock{state.manifest_mtx};
+  setup();
+  state.manifest_dirty = true;
+  update_manifest();
+  state.cur_status.store(status::running, std::memory_order::relaxed);
+  return port;
+}
+
+/// Wait until a condition over the node state becomes true.
+///
+/// @param pred
+///    Function that checks the condition, called with
+///    @ref ts3_state::manifest_mtx locked.
+/// @return Value indicating whether the condition has become true before
+///    @ref test_timeout.
+template <typename Pred> static bool wait_for(Pred pred) {
+  const auto deadline{std::chrono::steady_clock::now() + test_timeout};
+  for (;;) {
+    {
+      const std::scoped_lock lock{state.manifest_mtx};
+      if (pred()) {
+        return true;
+      }
+    }
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  }
+}
+
+/// Send an HTTP/1.0 GET request to a node over loopback and read the whole
+///    response.
+///
+/// @param port
+///    Port number that the node listens on.
+/// @param [in] path
+///    Path and query of the request.
+/// @return The response, empty on failure.
+static std::string http_get(int port, std::string_view path) {
+  const int fd{socket(AF_INET, SOCK_STREAM, 0)};
+  if (fd < 0) {
+    return {};
+  }
+  const timeval timeout{.tv_sec = test_timeout.count(), .tv_usec = 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<std::uint16_t>(port));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  std::string response;
+  if (!connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr)) {
+    const auto request{
+        std::format("GET {} HTTP/1.0\r\nHost: localhost\r\n\r\n", path)};
+    if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) ==
+        static_cast<ssize_t>(request.size())) {
+      // HTTP/1.0 connections are closed after the response
+      std::array<char, 4096> buf;
+      for (;;) {
+        const auto res{recv(fd, buf.data(), buf.size(), 0)};
+        if (res < 0) {
+          response.clear();
+          break;
+        }
+        if (!res) {
+          break;
+        }
+        response.append(buf.data(), res);
+      }
+    }
+  }
+  close(fd);
+  return response;
+}
+
+/// Check whether an HTTP response has status code 200.
+///
+/// @param [in] response
+///    The response.
+/// @return Value indicating whether the status code is 200.
+static bool is_ok(std::string_view response) {
+  return response.starts_with("HTTP/1.1 200") ||
+         response.starts_with("HTTP/1.0 200");
+}
+
+} // namespace
+
+} // namespace tek::s3
@@ -0,0 +1,239 @@
+//===-- shared_mrc_bench.cpp - Cross-process MRC cache benchmark ----------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Benchmark that forks processes sharing a manifest request code table, lets
+///    each of them publish codes for its own share of a working set, like
+///    instances that have fetched them from CM, and then has each of them
+///    look up codes published by the other processes. It reports the hit rate
+///    of these cross-process lookups and their latency percentiles, for
+///    working sets below and above the table's capacity.
+///
+//===----------------------------------------------------------------------===//
+// Included directly to get access to the table capacity
+#include "shared_mrc.cpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <new>
+#include <print>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private constants -------------------------------------------------===//
+
+/// Number of processes sharing the table.
+constexpr int bench_num_procs{4};
+
+/// Working set sizes to run with, relative to the table capacity in percent.
+constexpr std::array bench_working_sets{25, 50, 75, 100, 150};
+
+/// Number of lookups done by each process in a run.
+constexpr int bench_num_lookups{1'000'000};
+
+/// First manifest ID.
+constexpr std::uint64_t bench_first_id{7'000'000'000'000'000'001};
+
+//===-- Private types -----------------------------------------------------===//
+
+/// Results of a process, written to anonymous shared memory for the parent.
+struct proc_result {
+  /// Number of lookups of codes published by other processes.
+  std::uint64_t num_lookups;
+  /// Number of those lookups that have found the code.
+  std::uint64_t num_hits;
+  /// Number of found codes that didn't match the published ones.
+  std::uint64_t num_wrong;
+  /// Median lookup latency, in nanoseconds.
+  std::uint32_t p50;
+  /// 99th percentile lookup latency, in nanoseconds.
+  std::uint32_t p99;
+};
+
+/// Memory shared between the parent and forked processes of a run.
+struct run_shared {
+  /// Number of processes that have published their share of codes.
+  std::atomic_int num_populated;
+  /// Results of each process.
+  std::array<proc_result, bench_num_procs> results;
+};
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Get the manifest request code that a process publishes for a manifest.
+///
+/// @param manifest_id
+///    ID of the manifest.
+/// @return The manifest request code.
+static constexpr std::uint64_t make_mrc(std::uint64_t manifest_id) noexcept {
+  return manifest_id * 0x9E3779B97F4A7C15;
+}
+
+/// Publish codes for every @ref bench_num_procs-th manifest of the working
+///    set, wait until all processes have published theirs, then look up
+///    random manifests published by other processes.
+///
+/// @param index
+///    Index of the process.
+/// @param num_ids
+///    Number of manifests in the working set.
+/// @param [in, out] shared
+///    Memory shared with the parent and other processes.
+/// @return Exit code for the process.
+static int run_proc(int index, std::uint64_t num_ids, run_shared &shared) {
+  const auto expires{time_now() + 3600};
+  for (auto i{static_cast<std::uint64_t>(index)}; i < num_ids;
+       i += bench_num_procs) {
+    shared_mrc_publish(bench_first_id + i, make_mrc(bench_first_id + i),
+                       expires);
+  }
+  shared.num_populated.fetch_add(1, std::memory_order::release);
+  while (shared.num_populated.load(std::memory_order::acquire) <
+         bench_num_procs) {
+    std::this_thread::yield();
+  }
+  auto &res{shared.results[index]};
+  std::vector<std::uint32_t> latencies;
+  latencies.reserve(bench_num_lookups);
+  std::uint32_t seed{static_cast<std::uint32_t>(index) + 1};
+  while (latencies.size() < static_cast<std::size_t>(bench_num_lookups)) {
+    seed = seed * 1'664'525 + 1'013'904'223;
+    const auto i{(seed >> 4) % num_ids};
+    if (i % bench_num_procs == static_cast<std::uint64_t>(index)) {
+      // Published by this process
+      continue;
+    }
+    const auto manifest_id{bench_first_id + i};
+    std::uint64_t mrc;
+    std::int64_t code_expires;
+    const auto start{std::chrono::steady_clock::now()};
+    const bool found{shared_mrc_find(manifest_id, mrc, code_expires)};
+    latencies.emplace_back(static_cast<std::uint32_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count()));
+    ++res.num_lookups;
+    if (found) {
+      ++res.num_hits;
+      if (mrc != make_mrc(manifest_id)) {
+        ++res.num_wrong;
+      }
+    }
+  }
+  std::ranges::sort(latencies);
+  res.p50 = latencies[latencies.size() / 2];
+  res.p99 = latencies[latencies.size() * 99 / 100];
+  return EXIT_SUCCESS;
+}
+
+/// Run the benchmark with a working set in a fresh table, and print its
+///    results.
+///
+/// @param percent
+///    Size of the working set relative to the table capacity, in percent.
+/// @return Value indicating whether all processes have succeeded and found
+///    only correct codes.
+static bool run(int percent) {
+  const auto name{std::format("tek-s3-bench-{}-{}", getpid(), percent)};
+  if (!shared_mrc_open(name)) {
+    return false;
+  }
+  // The mapping is inherited by forked processes
+  shm_unlink(std::format("/{}", name).data());
+  const auto mem{mmap(nullptr, sizeof(run_shared), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0)};
+  if (mem == MAP_FAILED) {
+    std::println(std::cerr, "mmap failed");
+    shared_mrc_close();
+    return false;
+  }
+  auto &shared{*new (mem) run_shared{}};
+  const auto num_ids{static_cast<std::uint64_t>(num_slots * percent / 100)};
+  std::fflush(stdout);
+  bool success{true};
+  std::vector<pid_t> procs;
+  for (int i{}; i < bench_num_procs; ++i) {
+    const auto pid{fork()};
+    if (pid < 0) {
+      std::println(std::cerr, "fork failed");
+      success = false;
+      // Let the already forked processes finish
+      shared.num_populated.fetch_add(bench_num_procs - i,
+                                     std::memory_order::release);
+      break;
+    }
+    if (!pid) {
+      std::_Exit(run_proc(i, num_ids, shared));
+    }
+    procs.emplace_back(pid);
+  }
+  for (const auto pid : procs) {
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS) {
+      success = false;
+    }
+  }
+  if (success) {
+    proc_result total{};
+    std::uint32_t p50{}, p99{};
+    for (const auto &res : shared.results) {
+      total.num_lookups += res.num_lookups;
+      total.num_hits += res.num_hits;
+      total.num_wrong += res.num_wrong;
+      p50 = std::max(p50, res.p50);
+      p99 = std::max(p99, res.p99);
+    }
+    std::println("{:>5} manifests ({:>3}%): cross-process hit rate {:6.2f}%, "
+                 "p50 {} ns, p99 {} ns in the slowest process",
+                 num_ids, percent,
+                 static_cast<double>(total.num_hits) * 100 /
+                     static_cast<double>(total.num_lookups),
+                 p50, p99);
+    if (total.num_wrong) {
+      std::println(std::cerr, "{} wrong codes found", total.num_wrong);
+      success = false;
+    }
+  }
+  munmap(mem, sizeof(run_shared));
+  shared_mrc_close();
+  return success;
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+int main() {
+  using namespace tek::s3;
+  std::println("{} processes, {} table slots, {} lookups per process",
+               bench_num_procs, num_slots, bench_num_lookups);
+  bool success{true};
+  for (const auto percent : bench_working_sets) {
+    success = run(percent) && success;
+  }
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,181 @@
+//===-- shared_mrc_readers.cpp - Shared MRC table concurrency test --------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Test that forks reader processes looking up manifest request codes in the
+///    shared table while the parent process keeps rewriting them, checks that
+///    no reader observes a torn entry, and prints lookup latency percentiles
+///    of each reader.
+///
+//===----------------------------------------------------------------------===//
+// Included directly to get access to the table layout
+#include "shared_mrc.cpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <print>
+#include <string>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private constants -------------------------------------------------===//
+
+/// Number of forked reader processes.
+constexpr int test_num_readers{4};
+
+/// Number of lookups done by each reader.
+constexpr int test_num_lookups{2'000'000};
+
+/// Number of manifest IDs that the writer keeps rewriting.
+constexpr std::uint64_t test_num_ids{16};
+
+/// First manifest ID.
+constexpr std::uint64_t test_first_id{7'000'000'000'000'000'001};
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Get the manifest request code that the writer publishes for a manifest in
+///    a generation, so that readers can check it against the expiration time
+///    that encodes the generation.
+///
+/// @param manifest_id
+///    ID of the manifest.
+/// @param gen
+///    Generation of the code.
+/// @return The manifest request code.
+static constexpr std::uint64_t make_mrc(std::uint64_t manifest_id,
+                                        std::uint64_t gen) noexcept {
+  return (manifest_id * 0x9E3779B97F4A7C15) ^ (gen * 0xC2B2AE3D27D4EB4F);
+}
+
+/// Look up codes for random manifests, checking that each found code matches
+///    its expiration time, and print latency percentiles.
+///
+/// @param index
+///    Index of the reader.
+/// @param base
+///    Expiration time of generation `0` codes.
+/// @return Exit code for the reader process.
+static int run_reader(int index, std::int64_t base) {
+  std::vector<std::uint32_t> latencies;
+  latencies.reserve(test_num_lookups);
+  std::uint32_t seed{static_cast<std::uint32_t>(index) + 1};
+  int num_torn{};
+  int num_misses{};
+  for (int i{}; i < test_num_lookups; ++i) {
+    seed = seed * 1'664'525 + 1'013'904'223;
+    const auto manifest_id{test_first_id + (seed >> 8) % test_num_ids};
+    std::uint64_t mrc;
+    std::int64_t expires;
+    const auto start{std::chrono::steady_clock::now()};
+    const bool found{shared_mrc_find(manifest_id, mrc, expires)};
+    latencies.emplace_back(static_cast<std::uint32_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count()));
+    if (!found) {
+      // Possible only if the writer has held the slot for all read attempts
+      ++num_misses;
+      continue;
+    }
+    if (expires < base ||
+        mrc != make_mrc(manifest_id, static_cast<std::uint64_t>(expires -
+                                                                base))) {
+      ++num_torn;
+    }
+  }
+  std::ranges::sort(latencies);
+  std::println("reader {}: p50 {} ns, p99 {} ns, max {} ns, {} misses", index,
+               latencies[latencies.size() / 2],
+               latencies[latencies.size() * 99 / 100], latencies.back(),
+               num_misses);
+  if (num_torn) {
+    std::println(std::cerr, "reader {}: {} torn entries observed", index,
+                 num_torn);
+  }
+  if (num_misses == test_num_lookups) {
+    std::println(std::cerr, "reader {}: no codes found", index);
+  }
+  std::fflush(stdout);
+  return (num_torn || num_misses == test_num_lookups) ? EXIT_FAILURE
+                                                       : EXIT_SUCCESS;
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+int main() {
+  using namespace tek::s3;
+  const auto name{std::format("tek-s3-test-{}", getpid())};
+  if (!shared_mrc_open(name)) {
+    return EXIT_FAILURE;
+  }
+  // The mapping is inherited by readers, the name isn't needed anymore
+  shm_unlink(std::format("/{}", name).data());
+  const auto base{time_now() + 3600};
+  std::uint64_t gen{};
+  for (std::uint64_t i{}; i < test_num_ids; ++i) {
+    shared_mrc_publish(test_first_id + i, make_mrc(test_first_id + i, gen),
+                       base);
+  }
+  std::fflush(stdout);
+  std::vector<pid_t> readers;
+  for (int i{}; i < test_num_readers; ++i) {
+    const auto pid{fork()};
+    if (pid < 0) {
+      std::println(std::cerr, "fork failed");
+      return EXIT_FAILURE;
+    }
+    if (!pid) {
+      std::_Exit(run_reader(i, base));
+    }
+    readers.emplace_back(pid);
+  }
+  // Rewrite codes until all readers are done
+  bool success{true};
+  std::uint64_t num_writes{};
+  while (!readers.empty()) {
+    ++gen;
+    for (std::uint64_t i{}; i < test_num_ids; ++i) {
+      const auto manifest_id{test_first_id + i};
+      shared_mrc_publish(manifest_id, make_mrc(manifest_id, gen),
+                         base + static_cast<std::int64_t>(gen));
+    }
+    num_writes += test_num_ids;
+    std::erase_if(readers, [&success](pid_t pid) {
+      int status;
+      const auto res{waitpid(pid, &status, WNOHANG)};
+      if (!res) {
+        return false;
+      }
+      if (res < 0 || !WIFEXITED(status) ||
+          WEXITSTATUS(status) != EXIT_SUCCESS) {
+        success = false;
+      }
+      return true;
+    });
+  }
+  std::println("{} codes written", num_writes);
+  shared_mrc_close();
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
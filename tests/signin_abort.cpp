@@ -0,0 +1,395 @@
+//===-- signin_abort.cpp - Sign-in abort test -----------------------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Test that starts two sign-ins to the same account, aborts one of them at
+///    different stages of authentication while the other one completes, and
+///    checks that both contexts are freed exactly once, and only after their
+///    CM clients have released them. Then it aborts many concurrent sign-ins
+///    whose CM clients take a while to disconnect, and checks that closing
+///    their sessions doesn't stall the thread that does it, which is the
+///    service thread in the server. Build with `-Db_sanitize=address` to also
+///    catch accesses to freed contexts.
+///
+//===----------------------------------------------------------------------===//
+#include "cm_callbacks.hpp"
+#include "config.h"
+#include "os.h"
+#include "signin.hpp"
+#include "state.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <print>
+#include <string>
+#include <tek-steamclient/cm.h>
+#include <tek-steamclient/error.h>
+#include <thread>
+#include <utility>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private types -----------------------------------------------------===//
+
+/// CM client callback function type.
+using cm_callback = void(tek_sc_cm_client *, void *, void *);
+
+/// Fake CM client that runs callbacks on its own thread, like the real one.
+struct fake_client {
+  /// Pointer to the associated @ref signin_ctx object.
+  void *_Nonnull user_data;
+  /// The callback for connected event.
+  cm_callback *_Nullable cb_connected;
+  /// The callback for disconnected event.
+  cm_callback *_Nullable cb_disconnected;
+  /// The callback for authentication session events.
+  cm_callback *_Nullable cb_auth;
+  /// Value indicating whether the authentication session should complete.
+  std::atomic_bool complete;
+  /// Value indicating whether the client is awaiting confirmation.
+  std::atomic_bool confirming;
+  /// Value indicating whether disconnection has been requested.
+  std::atomic_bool disconnect;
+  /// Value indicating whether the disconnection callback has been entered.
+  std::atomic_bool released;
+  /// Thread running the callbacks.
+  std::thread thread;
+};
+
+//===-- Private constants -------------------------------------------------===//
+
+/// Number of rounds of concurrent sign-ins.
+constexpr int test_num_rounds{200};
+
+/// Time to wait for CM clients to release their references, in each round.
+constexpr std::chrono::seconds test_timeout{5};
+
+/// Number of concurrent sign-ins aborted at once.
+constexpr int test_num_concurrent{64};
+
+/// Time that fake CM clients of concurrent sign-ins take to disconnect, like
+///    a real one waiting for the server to close the connection.
+constexpr std::chrono::milliseconds test_disconnect_delay{50};
+
+/// Maximum time that closing a single session may take. Closing one that
+///    waits for its CM client to disconnect takes at least
+///    @ref test_disconnect_delay.
+constexpr std::chrono::milliseconds test_max_close_time{10};
+
+//===-- Private variables -------------------------------------------------===//
+
+/// Number of failed checks.
+static int failures;
+
+/// Index of the current round.
+static int cur_round;
+
+/// Number of destroyed fake CM clients.
+static int num_destroyed;
+
+/// Time that fake CM clients take to disconnect after it's requested.
+static std::chrono::milliseconds disconnect_delay;
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Record a failed check.
+///
+/// @param [in] what
+///    Description of the check.
+/// @param round
+///    Index of the round that has failed the check.
+static void fail(const char *_Nonnull what, int round) {
+  std::println(std::cerr, "{} (round {})", what, round);
+  ++failures;
+}
+
+/// Get the fake client behind a CM client pointer.
+///
+/// @param [in] client
+///    Pointer to the CM client instance.
+/// @return The fake client.
+static fake_client &from(tek_sc_cm_client *_Nonnull client) {
+  return *reinterpret_cast<fake_client *>(client);
+}
+
+/// Run CM client callbacks: connect, report that confirmation is needed, then
+///    wait for the test to complete authentication with an error or for
+///    disconnection, and report it.
+///
+/// @param [in, out] fc
+///    The fake client.
+static void run_client(fake_client &fc) {
+  const auto client{reinterpret_cast<tek_sc_cm_client *>(&fc)};
+  if (!fc.disconnect.load(std::memory_order::acquire)) {
+    tek_sc_err res{};
+    fc.cb_connected(client, &res, fc.user_data);
+    tek_sc_cm_data_auth_polling data{};
+    data.status = TEK_SC_CM_AUTH_STATUS_awaiting_confirmation;
+    data.confirmation_types = TEK_SC_CM_AUTH_CONFIRMATION_TYPE_device;
+    fc.cb_auth(client, &data, fc.user_data);
+    fc.confirming.store(true, std::memory_order::release);
+    while (!fc.disconnect.load(std::memory_order::acquire)) {
+      if (!fc.complete.load(std::memory_order::acquire)) {
+        std::this_thread::sleep_for(std::chrono::microseconds{10});
+        continue;
+      }
+      // The callback requests disconnection by itself
+      data.status = TEK_SC_CM_AUTH_STATUS_completed;
+      data.result.type = TEK_SC_ERR_TYPE_basic;
+      data.result.primary = TEK_SC_ERRC_cm_timeout;
+      fc.cb_auth(client, &data, fc.user_data);
+    }
+  }
+  std::this_thread::sleep_for(disconnect_delay);
+  fc.released.store(true, std::memory_order::release);
+  tek_sc_err res{};
+  fc.cb_disconnected(client, &res, fc.user_data);
+}
+
+//===-- Fake CM client functions ------------------------------------------===//
+
+/// Create a fake CM client.
+///
+/// @param [in] data
+///    Pointer to the associated @ref signin_ctx object.
+/// @return Pointer to the created client.
+static tek_sc_cm_client *_Nullable fake_cm_client_create(auto,
+                                                         void *_Nonnull data) {
+  return reinterpret_cast<tek_sc_cm_client *>(new fake_client{
+      .user_data = data,
+      .cb_connected = nullptr,
+      .cb_disconnected = nullptr,
+      .cb_auth = nullptr,
+      .complete = false,
+      .confirming = false,
+      .disconnect = false,
+      .released = false,
+      .thread = {}});
+}
+
+/// Destroy a fake CM client, checking that it has already released its
+///    context and that it's not destroyed from its own callback.
+///
+/// @param [in] client
+///    Pointer to the CM client instance.
+static void fake_cm_client_destroy(tek_sc_cm_client *_Nonnull client) {
+  auto &fc{from(client)};
+  if (fc.thread.get_id() == std::this_thread::get_id()) {
+    fail("CM client destroyed from its own callback", cur_round);
+    fc.thread.detach();
+    return;
+  }
+  if (!fc.released.load(std::memory_order::acquire)) {
+    fail("Context freed before its CM client released it", cur_round);
+  }
+  fc.thread.join();
+  delete &fc;
+  ++num_destroyed;
+}
+
+/// Start running callbacks of a fake CM client.
+///
+/// @param [in, out] client
+///    Pointer to the CM client instance.
+/// @param [in] cb_connected
+///    The callback for connected event.
+/// @param [in] cb_disconnected
+///    The callback for disconnected event.
+static void fake_cm_connect(tek_sc_cm_client *_Nonnull client,
+                            cm_callback *_Nonnull cb_connected, auto,
+                            cm_callback *_Nonnull cb_disconnected) {
+  auto &fc{from(client)};
+  fc.cb_connected = cb_connected;
+  fc.cb_disconnected = cb_disconnected;
+  fc.thread = std::thread{run_client, std::ref(fc)};
+}
+
+/// Request disconnection of a fake CM client.
+///
+/// @param [in, out] client
+///    Pointer to the CM client instance.
+static void fake_cm_disconnect(tek_sc_cm_client *_Nonnull client) {
+  from(client).disconnect.store(true, std::memory_order::release);
+}
+
+/// Begin authentication session of a fake CM client.
+///
+/// @param [in, out] client
+///    Pointer to the CM client instance.
+/// @param [in] cb
+///    The callback for authentication session events.
+static void fake_cm_auth_credentials(tek_sc_cm_client *_Nonnull client,
+                                     const char *_Nonnull,
+                                     const char *_Nonnull,
+                                     const char *_Nonnull,
+                                     cm_callback *_Nonnull cb, auto) {
+  from(client).cb_auth = cb;
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+// Included directly with CM client functions substituted by the fakes, the
+//    headers above are already included with the real declarations
+#define tek_sc_cm_client_create fake_cm_client_create
+#define tek_sc_cm_client_destroy fake_cm_client_destroy
+#define tek_sc_cm_connect fake_cm_connect
+#define tek_sc_cm_disconnect fake_cm_disconnect
+#define tek_sc_cm_auth_credentials fake_cm_auth_credentials
+#include "signin.cpp"
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Start a credentials-based sign-in.
+///
+/// @param [in, out] ctx
+///    Sign-in context.
+/// @param round
+///    Index of the current round.
+static void start(signin_ctx &ctx, int round) {
+  std::string msg{R"({"type":"credentials","account_name":"test",)"
+                  R"("password":"test"})"};
+  const auto size{msg.size()};
+  // signin_process_msg null-terminates the message past its end
+  msg.push_back('\0');
+  if (signin_process_msg(ctx, msg.data(), size)) {
+    fail("Sign-in not started", round);
+  }
+}
+
+/// Close a sign-in session like the server does.
+///
+/// @param [in, out] ctx
+///    Sign-in context.
+static void close_session(signin_ctx &ctx) {
+  std::erase(state.signin_ctxs, &ctx);
+  signin_close(ctx);
+}
+
+/// Wait until all sign-in contexts are freed, freeing retired ones like the
+///    service thread does, then discard posted events.
+///
+/// @param round
+///    Index of the current round.
+static void wait_released(int round) {
+  const auto deadline{std::chrono::steady_clock::now() + test_timeout};
+  while (state.num_signin_ctxs.load(std::memory_order::relaxed)) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      fail("Contexts not released by CM clients", round);
+      std::exit(EXIT_FAILURE);
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds{100});
+    signin_free_retired();
+  }
+  for (auto ev{state.events.take()}; ev;) {
+    delete std::exchange(ev, ev->next);
+  }
+}
+
+/// Run a round: start two sign-ins to the same account, abort one after
+///    a delay that depends on @p round, complete the other one with an error
+///    while its session is closing, and wait for both to be freed.
+///
+/// @param round
+///    Index of the round.
+static void run_round(int round) {
+  // Sign-in contexts never dereference their connection instances
+  char dummy_wsi;
+  const auto wsi{reinterpret_cast<lws *>(&dummy_wsi)};
+  auto &aborted{*signin_create(wsi)};
+  auto &completed{*signin_create(wsi)};
+  start(aborted, round);
+  start(completed, round);
+  std::this_thread::sleep_for(std::chrono::microseconds{round % 4 * 100});
+  close_session(aborted);
+  from(completed.cm_client.get())
+      .complete.store(true, std::memory_order::release);
+  close_session(completed);
+  wait_released(round);
+}
+
+/// Start @ref test_num_concurrent sign-ins, wait until all of them await
+///    confirmation, then close all their sessions at once while their CM
+///    clients take @ref test_disconnect_delay to disconnect. Time spent in
+///    each close is reported and checked against @ref test_max_close_time.
+static void run_concurrent() {
+  char dummy_wsi;
+  const auto wsi{reinterpret_cast<lws *>(&dummy_wsi)};
+  disconnect_delay = test_disconnect_delay;
+  std::array<signin_ctx *, test_num_concurrent> ctxs;
+  for (auto &ctx : ctxs) {
+    ctx = signin_create(wsi);
+    start(*ctx, cur_round);
+  }
+  const auto deadline{std::chrono::steady_clock::now() + test_timeout};
+  for (const auto ctx : ctxs) {
+    while (!from(ctx->cm_client.get())
+                .confirming.load(std::memory_order::acquire)) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        fail("Concurrent sign-ins not started", cur_round);
+        std::exit(EXIT_FAILURE);
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds{100});
+    }
+  }
+  std::chrono::steady_clock::duration max_close{}, total_close{};
+  for (const auto ctx : ctxs) {
+    const auto begin{std::chrono::steady_clock::now()};
+    close_session(*ctx);
+    const auto close_time{std::chrono::steady_clock::now() - begin};
+    max_close = std::max(max_close, close_time);
+    total_close += close_time;
+  }
+  const auto to_us{[](auto duration) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+        .count();
+  }};
+  std::println("Closed {} sign-in sessions in {} us, at most {} us per "
+               "session, while CM clients took {} ms to disconnect",
+               test_num_concurrent, to_us(total_close), to_us(max_close),
+               test_disconnect_delay.count());
+  if (max_close > test_max_close_time) {
+    fail("Closing a sign-in session stalled the service thread", cur_round);
+  }
+  wait_released(cur_round);
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+int main() {
+  using namespace tek::s3;
+  // Skip waking up the service thread, there is none
+  state.cur_status.store(status::stopping, std::memory_order::relaxed);
+  for (; cur_round < test_num_rounds; ++cur_round) {
+    run_round(cur_round);
+  }
+  run_concurrent();
+  if (constexpr int expected{test_num_rounds * 2 + test_num_concurrent};
+      num_destroyed != expected) {
+    std::println(std::cerr, "{} CM clients destroyed, expected {}",
+                 num_destroyed, expected);
+    ++failures;
+  }
+  std::println("{} rounds completed", test_num_rounds);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,621 @@
+//===-- tls_mrc_bench.cpp - Native TLS vs nginx /mrc benchmark ------------===//
+//
+// Copyright (c) 2025 Nuclearist <nuclearist@teknology-hub.com>
+// Part of tek-s3, under the GNU General Public License v3.0 or later
+// See https://github.com/teknology-hub/tek-s3/blob/main/COPYING for license
+//    information.
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+//===----------------------------------------------------------------------===//
+///
+/// @file
+/// Benchmark that measures latency percentiles and CPU time per request of
+///    cached `/mrc` responses over HTTPS, served with built-in TLS and through
+///    nginx terminating TLS in front of a plain HTTP listener, both on kept
+///    alive connections and on a new resumed connection per request.
+///
+/// Needs nginx and a certificate, so it is skipped unless
+///    `TS3_BENCH_TLS_CERT` and `TS3_BENCH_TLS_KEY` are set to paths of PEM
+///    certificate and private key files, and nginx is found in `PATH` or at
+///    `TS3_BENCH_NGINX`.
+///
+//===----------------------------------------------------------------------===//
+// Included directly to get access to the server protocol
+#include "server.cpp"
+
+#include "tls.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <print>
+#include <ranges>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace tek::s3 {
+
+namespace {
+
+//===-- Private types -----------------------------------------------------===//
+
+/// Ports and processes that the client measures.
+struct bench_target {
+  /// Port of the built-in TLS listener.
+  int native_port;
+  /// Port of the nginx TLS listener.
+  int nginx_port;
+  /// ID of the nginx process.
+  pid_t nginx_pid;
+};
+
+//===-- Private constants -------------------------------------------------===//
+
+/// Exit code that tells meson that the benchmark has been skipped.
+constexpr int bench_skip{77};
+
+/// Number of `/mrc` requests measured per run.
+constexpr int bench_num_requests{5000};
+
+/// Number of `/mrc` requests sent before measuring.
+constexpr int bench_num_warmup{200};
+
+/// Time given to nginx to start listening.
+constexpr std::chrono::seconds bench_nginx_timeout{5};
+
+/// ID of the manifest whose request code is cached.
+constexpr std::uint64_t bench_manifest_id{7'000'000'000'000'000'001};
+
+//===-- Private variables -------------------------------------------------===//
+
+/// ID of the client process.
+static pid_t client_pid;
+
+/// Exit status of the client process, or `-1` while it's running.
+static int client_status{-1};
+
+/// Scheduling entry for checking whether the client has exited.
+static lws_sorted_usec_list_t client_sul;
+
+//===-- Private functions -------------------------------------------------===//
+
+/// Find an executable in `PATH`.
+///
+/// @param [in] name
+///    Name of the executable.
+/// @return Path to the executable, or an empty string if it's not found.
+static std::string find_program(std::string_view name) {
+  const char *const path{std::getenv("PATH")};
+  if (!path) {
+    return {};
+  }
+  for (const auto dir : std::views::split(std::string_view{path}, ':')) {
+    const auto file{std::filesystem::path{std::string_view{dir}} / name};
+    if (!access(file.c_str(), X_OK)) {
+      return file.string();
+    }
+  }
+  return {};
+}
+
+/// Get a free loopback port number by binding to port `0`.
+///
+/// @return The port number, or `-1` on failure.
+static int get_free_port() {
+  const int fd{socket(AF_INET, SOCK_STREAM, 0)};
+  if (fd < 0) {
+    return -1;
+  }
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len{sizeof addr};
+  int port{-1};
+  if (!bind(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr) &&
+      !getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len)) {
+    port = ntohs(addr.sin_port);
+  }
+  close(fd);
+  return port;
+}
+
+/// Get CPU time consumed by a process.
+///
+/// @param pid
+///    ID of the process.
+/// @return CPU time in user and kernel mode, in microseconds.
+static double get_cpu_time(pid_t pid) {
+  std::ifstream file{std::format("/proc/{}/stat", pid)};
+  std::string line;
+  std::getline(file, line);
+  // Process name may contain spaces, fields are counted after it
+  const auto pos{line.rfind(')')};
+  if (pos == std::string::npos) {
+    return 0;
+  }
+  std::istringstream fields{line.substr(pos + 1)};
+  std::string field;
+  // Skip 11 fields preceding utime
+  for (int i{}; i < 11; ++i) {
+    fields >> field;
+  }
+  unsigned long long utime{}, stime{};
+  fields >> utime >> stime;
+  return static_cast<double>(utime + stime) * 1'000'000 /
+         static_cast<double>(sysconf(_SC_CLK_TCK));
+}
+
+/// Connect to a server over loopback.
+///
+/// @param port
+///    Port number that the server listens on.
+/// @return Socket file descriptor, or `-1` on failure.
+static int connect_server(int port) {
+  const int fd{socket(AF_INET, SOCK_STREAM, 0)};
+  if (fd < 0) {
+    return -1;
+  }
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<std::uint16_t>(port));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr)) {
+    close(fd);
+    return -1;
+  }
+  const int one{1};
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  return fd;
+}
+
+/// Establish a TLS connection to a server over loopback.
+///
+/// @param [in] ctx
+///    OpenSSL context to create the connection with.
+/// @param port
+///    Port number that the server listens on.
+/// @param [in] session
+///    Session to resume, or `nullptr` to do a full handshake.
+/// @return The connection, or `nullptr` on failure.
+static SSL *_Nullable connect_tls(SSL_CTX *_Nonnull ctx, int port,
+                                 SSL_SESSION *_Nullable session) {
+  const int fd{connect_server(port)};
+  if (fd < 0) {
+    return nullptr;
+  }
+  const auto ssl{SSL_new(ctx)};
+  if (!ssl) {
+    close(fd);
+    return nullptr;
+  }
+  SSL_set_fd(ssl, fd);
+  if (session) {
+    SSL_set_session(ssl, session);
+  }
+  if (SSL_connect(ssl) != 1) {
+    SSL_free(ssl);
+    close(fd);
+    return nullptr;
+  }
+  return ssl;
+}
+
+/// Close a TLS connection.
+///
+/// @param [in] ssl
+///    The connection to close.
+static void disconnect_tls(SSL *_Nonnull ssl) {
+  const int fd{SSL_get_fd(ssl)};
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  close(fd);
+}
+
+/// Send a request and read the whole response.
+///
+/// @param [in, out] ssl
+///    The connection to use.
+/// @param [in] request
+///    The request to send.
+/// @param [in, out] buf
+///    Receive buffer.
+/// @return Value indicating whether a successful response has been read
+///    completely.
+static bool exchange(SSL *_Nonnull ssl, std::string_view request,
+                     std::vector<char> &buf) {
+  if (SSL_write(ssl, request.data(), static_cast<int>(request.size())) !=
+      static_cast<int>(request.size())) {
+    return false;
+  }
+  // Read headers
+  std::size_t received{};
+  std::size_t hdr_end;
+  for (;;) {
+    const int res{SSL_read(ssl, &buf[received],
+                           static_cast<int>(buf.size() - received))};
+    if (res <= 0) {
+      return false;
+    }
+    received += res;
+    if (const auto pos{
+            std::string_view{buf.data(), received}.find("\r\n\r\n")};
+        pos != std::string_view::npos) {
+      hdr_end = pos + 4;
+      break;
+    }
+    if (received == buf.size()) {
+      return false;
+    }
+  }
+  std::string headers{buf.data(), hdr_end};
+  if (!headers.starts_with("HTTP/1.1 200")) {
+    return false;
+  }
+  std::ranges::transform(headers, headers.begin(), [](unsigned char c) {
+    return static_cast<char>(std::tolower(c));
+  });
+  constexpr std::string_view cl_name{"content-length:"};
+  auto pos{headers.find(cl_name)};
+  if (pos == std::string::npos) {
+    return false;
+  }
+  pos += cl_name.length();
+  while (headers[pos] == ' ') {
+    ++pos;
+  }
+  std::size_t body_size;
+  if (std::from_chars(&headers[pos], headers.data() + headers.size(),
+                      body_size)
+          .ec != std::errc{}) {
+    return false;
+  }
+  // Read the rest of the body
+  auto remaining{body_size - (received - hdr_end)};
+  while (remaining) {
+    const int res{SSL_read(
+        ssl, buf.data(), static_cast<int>(std::min(buf.size(), remaining)))};
+    if (res <= 0) {
+      return false;
+    }
+    remaining -= res;
+  }
+  return true;
+}
+
+/// Measure `/mrc` requests to a server and print latency percentiles and CPU
+///    time per request.
+///
+/// @param [in] ctx
+///    OpenSSL context to create connections with.
+/// @param [in] name
+///    Name of the run to print.
+/// @param port
+///    Port number that the server listens on.
+/// @param proxy_pid
+///    ID of the proxy process whose CPU time is counted too, or `0` if there
+///    is none.
+/// @param resume
+///    Value indicating whether each request is sent over a new connection
+///    resuming the previous session, rather than over a single kept alive
+///    connection.
+/// @return Value indicating whether all requests have succeeded.
+static bool run(SSL_CTX *_Nonnull ctx, const char *_Nonnull name, int port,
+                pid_t proxy_pid, bool resume) {
+  const auto request{
+      std::format("GET /mrc?app_id=1&depot_id=2&manifest_id={} HTTP/1.1\r\n"
+                  "Host: localhost\r\n\r\n",
+                  bench_manifest_id)};
+  std::vector<char> buf(4096);
+  std::vector<double> latencies;
+  latencies.reserve(bench_num_requests);
+  SSL *ssl{};
+  SSL_SESSION *session{};
+  int num_resumed{};
+  double server_cpu{};
+  double proxy_cpu{};
+  bool success{true};
+  for (int i{}; i < bench_num_warmup + bench_num_requests; ++i) {
+    if (i == bench_num_warmup) {
+      server_cpu = get_cpu_time(getppid());
+      proxy_cpu = proxy_pid ? get_cpu_time(proxy_pid) : 0;
+    }
+    const auto start{std::chrono::steady_clock::now()};
+    if (!ssl) {
+      ssl = connect_tls(ctx, port, session);
+      if (!ssl) {
+        success = false;
+        break;
+      }
+      if (i >= bench_num_warmup && SSL_session_reused(ssl)) {
+        ++num_resumed;
+      }
+    }
+    if (!exchange(ssl, request, buf)) {
+      success = false;
+      break;
+    }
+    if (resume) {
+      // TLS 1.3 tickets arrive after the handshake, the response is read by
+      //    now
+      if (session) {
+        SSL_SESSION_free(session);
+      }
+      session = SSL_get1_session(ssl);
+      disconnect_tls(std::exchange(ssl, nullptr));
+    }
+    if (i >= bench_num_warmup) {
+      latencies.emplace_back(std::chrono::duration<double, std::micro>{
+          std::chrono::steady_clock::now() - start}
+                                 .count());
+    }
+  }
+  server_cpu = get_cpu_time(getppid()) - server_cpu;
+  if (proxy_pid) {
+    proxy_cpu = get_cpu_time(proxy_pid) - proxy_cpu;
+  }
+  if (ssl) {
+    disconnect_tls(ssl);
+  }
+  if (session) {
+    SSL_SESSION_free(session);
+  }
+  if (!success) {
+    std::println(std::cerr, "{}: /mrc request failed", name);
+    return false;
+  }
+  std::ranges::sort(latencies);
+  std::println("{:<18} p50 {:7.1f} us, p99 {:7.1f} us, CPU {:6.1f} us/req "
+               "(tek-s3 {:6.1f}, nginx {:6.1f}), {} resumed",
+               name, latencies[latencies.size() / 2],
+               latencies[latencies.size() * 99 / 100],
+               (server_cpu + proxy_cpu) / bench_num_requests,
+               server_cpu / bench_num_requests, proxy_cpu / bench_num_requests,
+               num_resumed);
+  return true;
+}
+
+/// Run all measurements against the servers.
+///
+/// @param [in] target
+///    Ports and processes to measure.
+/// @return Exit code for the client process.
+static int run_client(const bench_target &target) {
+  const auto ctx{SSL_CTX_new(TLS_client_method())};
+  if (!ctx) {
+    std::println(std::cerr, "SSL_CTX_new failed");
+    return EXIT_FAILURE;
+  }
+  // The benchmark certificate doesn't have to be trusted
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+  static constexpr unsigned char alpn[]{8, 'h', 't', 't', 'p', '/', '1', '.',
+                                        '1'};
+  SSL_CTX_set_alpn_protos(ctx, alpn, sizeof alpn);
+  // Wait for nginx to start listening
+  const auto deadline{std::chrono::steady_clock::now() + bench_nginx_timeout};
+  for (;;) {
+    if (const int fd{connect_server(target.nginx_port)}; fd >= 0) {
+      close(fd);
+      break;
+    }
+    if (std::chrono::steady_clock::now() > deadline) {
+      std::println(std::cerr, "nginx didn't start listening, see error.log in "
+                              "its prefix directory");
+      SSL_CTX_free(ctx);
+      return EXIT_FAILURE;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  }
+  bool success{run(ctx, "native keep-alive", target.native_port, 0, false)};
+  success = run(ctx, "nginx keep-alive", target.nginx_port, target.nginx_pid,
+                false) &&
+            success;
+  success =
+      run(ctx, "native resumed", target.native_port, 0, true) && success;
+  success = run(ctx, "nginx resumed", target.nginx_port, target.nginx_pid,
+                true) &&
+            success;
+  SSL_CTX_free(ctx);
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/// Write nginx configuration proxying TLS connections to a plain HTTP
+///    listener.
+///
+/// @param [in] prefix
+///    nginx prefix directory to write the configuration into.
+/// @param listen_port
+///    Port number for nginx to listen on.
+/// @param upstream_port
+///    Port number of the plain HTTP listener.
+/// @return Value indicating whether the configuration has been written.
+static bool write_nginx_conf(const std::filesystem::path &prefix,
+                             int listen_port, int upstream_port) {
+  std::ofstream file{prefix / "nginx.conf"};
+  // A single process, so that its CPU time is all of nginx's
+  file << std::format(
+      "daemon off;\n"
+      "master_process off;\n"
+      "worker_processes 1;\n"
+      "error_log error.log;\n"
+      "pid nginx.pid;\n"
+      "events {{}}\n"
+      "http {{\n"
+      "  access_log off;\n"
+      "  client_body_temp_path tmp;\n"
+      "  proxy_temp_path tmp;\n"
+      "  fastcgi_temp_path tmp;\n"
+      "  uwsgi_temp_path tmp;\n"
+      "  scgi_temp_path tmp;\n"
+      "  upstream tek_s3 {{\n"
+      "    server 127.0.0.1:{};\n"
+      "    keepalive 16;\n"
+      "  }}\n"
+      "  server {{\n"
+      "    listen 127.0.0.1:{} ssl;\n"
+      "    ssl_certificate {};\n"
+      "    ssl_certificate_key {};\n"
+      "    location / {{\n"
+      "      proxy_pass http://tek_s3;\n"
+      "      proxy_http_version 1.1;\n"
+      "      proxy_set_header Connection \"\";\n"
+      "    }}\n"
+      "  }}\n"
+      "}}\n",
+      upstream_port, listen_port, state.tls.cert_path,
+      state.tls.key_path);
+  std::filesystem::create_directory(prefix / "tmp");
+  return static_cast<bool>(file.flush());
+}
+
+/// Check whether the client process has exited, and reschedule the check if
+///    it hasn't.
+///
+/// @param [in, out] sul
+///    Pointer to the scheduling entry.
+static void check_client(lws_sorted_usec_list_t *_Nonnull sul) {
+  int status;
+  const auto res{waitpid(client_pid, &status, WNOHANG)};
+  if (!res) {
+    lws_sul_schedule(state.lws_ctx, 0, sul, check_client,
+                     10 * LWS_US_PER_MS);
+    return;
+  }
+  client_status = (res > 0 && WIFEXITED(status)) ? WEXITSTATUS(status)
+                                                   : EXIT_FAILURE;
+  lws_cancel_service(state.lws_ctx);
+}
+
+} // namespace
+
+} // namespace tek::s3
+
+int main() {
+  using namespace tek::s3;
+  std::signal(SIGPIPE, SIG_IGN);
+  const char *const cert{std::getenv("TS3_BENCH_TLS_CERT")};
+  const char *const key{std::getenv("TS3_BENCH_TLS_KEY")};
+  if (!cert || !key) {
+    std::println("TS3_BENCH_TLS_CERT and TS3_BENCH_TLS_KEY are not set, "
+                 "skipping");
+    return bench_skip;
+  }
+  const char *const nginx_env{std::getenv("TS3_BENCH_NGINX")};
+  const auto nginx{nginx_env ? std::string{nginx_env} : find_program("nginx")};
+  if (nginx.empty() || access(nginx.data(), X_OK)) {
+    std::println("nginx not found, skipping");
+    return bench_skip;
+  }
+#ifndef LWS_WITH_TLS
+  std::println("libwebsockets is built without TLS support, skipping");
+  return bench_skip;
+#endif // ndef LWS_WITH_TLS
+  // nginx resolves relative paths against its prefix directory
+  state.tls.cert_path = std::filesystem::absolute(cert).string();
+  state.tls.key_path = std::filesystem::absolute(key).string();
+  state.timestamp =
+      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  state.cur_status.store(status::running, std::memory_order::relaxed);
+  lws_set_log_level(LLL_ERR, nullptr);
+  const lws_protocols *pprotocols[]{&protocol, nullptr};
+  // The default vhost terminates TLS like a configured server does
+  lws_context_creation_info info{};
+  info.iface = "127.0.0.1";
+  // Let the OS pick free ports
+  info.port = 0;
+  info.timeout_secs = 10;
+  info.pprotocols = pprotocols;
+  tls_configure(info);
+  state.lws_ctx = lws_create_context(&info);
+  if (!state.lws_ctx) {
+    std::println(std::cerr, "lws_create_context failed");
+    return EXIT_FAILURE;
+  }
+  // A plain HTTP vhost for nginx to proxy to
+  lws_context_creation_info plain_info{};
+  plain_info.vhost_name = "plain";
+  plain_info.iface = "127.0.0.1";
+  plain_info.port = 0;
+  plain_info.timeout_secs = 10;
+  plain_info.pprotocols = pprotocols;
+  const auto plain_vhost{lws_create_vhost(state.lws_ctx, &plain_info)};
+  bench_target target{
+      .native_port = lws_get_vhost_listen_port(
+          lws_get_vhost_by_name(state.lws_ctx, "default")),
+      .nginx_port = get_free_port(),
+      .nginx_pid = 0};
+  const int plain_port{plain_vhost ? lws_get_vhost_listen_port(plain_vhost)
+                                   : -1};
+  if (target.native_port <= 0 || plain_port <= 0 || target.nginx_port <= 0) {
+    std::println(std::cerr, "Failed to get listening ports");
+    lws_context_destroy(std::exchange(state.lws_ctx, nullptr));
+    return EXIT_FAILURE;
+  }
+  mrc_cache_put(bench_manifest_id, 1, state.timestamp + 24 * 60 * 60);
+  const auto prefix{std::filesystem::temp_directory_path() /
+                    std::format("tek-s3-bench-{}", getpid())};
+  std::filesystem::create_directory(prefix);
+  if (!write_nginx_conf(prefix, target.nginx_port, plain_port)) {
+    std::println(std::cerr, "Failed to write nginx configuration");
+    std::filesystem::remove_all(prefix);
+    lws_context_destroy(std::exchange(state.lws_ctx, nullptr));
+    return EXIT_FAILURE;
+  }
+  std::fflush(stdout);
+  // Both child processes are forked before any threads are started
+  target.nginx_pid = fork();
+  if (!target.nginx_pid) {
+    execl(nginx.data(), nginx.data(), "-p", prefix.c_str(), "-c",
+          (prefix / "nginx.conf").c_str(), nullptr);
+    std::_Exit(EXIT_FAILURE);
+  }
+  int exit_code{EXIT_FAILURE};
+  if (target.nginx_pid < 0) {
+    std::println(std::cerr, "fork failed");
+  } else {
+    client_pid = fork();
+    if (!client_pid) {
+      std::_Exit(run_client(target));
+    }
+    if (client_pid < 0) {
+      std::println(std::cerr, "fork failed");
+    } else {
+      std::println("{} /mrc requests per run", bench_num_requests);
+      std::fflush(stdout);
+      lws_sul_schedule(state.lws_ctx, 0, &client_sul, check_client,
+                       10 * LWS_US_PER_MS);
+      // Serve like ts3_run does until the client is done
+      do {
+        streams.budget = stream_budget;
+      } while (client_status < 0 && !lws_service(state.lws_ctx, 0));
+      exit_code = client_status;
+    }
+    kill(target.nginx_pid, SIGTERM);
+    waitpid(target.nginx_pid, nullptr, 0);
+  }
+  lws_sul_cancel(&client_sul);
+  lws_context_destroy(std::exchange(state.lws_ctx, nullptr));
+  std::filesystem::remove_all(prefix);
+  return exit_code == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}